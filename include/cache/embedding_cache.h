@@ -0,0 +1,81 @@
+#pragma once
+
+#include "models/llm_interface.h"
+#include "utils/pg_llm_shmem.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pg_llm {
+
+// Identifies the embedder an entry came from. model_key names the model and
+// everything else that changes its output; dimensions is the requested size
+// (zero for the provider default). Durable scopes are also persisted in
+// _pg_llm_catalog.pg_llm_embedding_cache, which only pays off for embedders
+// that are slower than a catalog lookup.
+struct EmbeddingScope {
+  std::string model_key;
+  int dimensions = 0;
+  bool durable = false;
+};
+
+struct EmbeddingCacheStats {
+  bool enabled = false;
+  uint64_t entries = 0;
+  uint64_t bytes_used = 0;
+  uint64_t max_bytes = 0;
+  uint64_t hits = 0;        // Served from shared memory
+  uint64_t table_hits = 0;  // Served from the catalog table
+  uint64_t misses = 0;      // Passed to the embedder
+  uint64_t inserts = 0;
+  uint64_t evictions = 0;
+};
+
+// Content-addressed embedding cache shared by all backends.
+//
+// Entries are keyed by the SHA-256 of the scope and the SHA-256 of the text.
+// The first tier is a dshash table in the pg_llm DSA area with the same LRU
+// scheme as ResponseCache; the second is a catalog table that survives
+// restarts. Texts repeated within one call are embedded once.
+class EmbeddingCache {
+public:
+  using Embedder = std::function<std::vector<EmbeddingResult>(const std::vector<std::string>&)>;
+
+  static EmbeddingCache& get_instance();
+
+  // Reserve the shared control struct; called from _PG_init
+  static void request_shmem();
+
+  // pg_llm.embedding_cache_enabled; the table tier works without preloading
+  bool enabled() const;
+
+  // Embeddings for texts in input order. Cached entries are served from the
+  // cheapest tier that has them, the rest go to embed in one call and are
+  // stored unless they failed.
+  std::vector<EmbeddingResult> get_or_embed(const EmbeddingScope& scope,
+                                            const std::vector<std::string>& texts,
+                                            const Embedder& embed);
+
+  EmbeddingCacheStats stats();
+
+  // Drop every entry of both tiers and zero the counters; returns the
+  // number removed
+  uint64_t reset();
+
+private:
+  EmbeddingCache() = default;
+  EmbeddingCache(const EmbeddingCache&) = delete;
+  EmbeddingCache& operator=(const EmbeddingCache&) = delete;
+
+  bool attach();
+  bool shared_lookup(const std::string& key, std::vector<float>* embedding);
+  void shared_store(const std::string& key, const std::vector<float>& embedding);
+  void evict(uint64_t target_bytes);
+
+  dshash_table* table_ = nullptr;  // Backend-local attachment
+};
+
+} // namespace pg_llm
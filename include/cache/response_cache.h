@@ -0,0 +1,66 @@
+#pragma once
+
+#include "models/llm_interface.h"
+#include "utils/pg_llm_shmem.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace pg_llm {
+
+struct ResponseCacheStats {
+  bool enabled = false;
+  uint64_t entries = 0;
+  uint64_t bytes_used = 0;
+  uint64_t max_bytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t inserts = 0;
+  uint64_t evictions = 0;
+};
+
+// Exact-match chat response cache shared by all backends.
+//
+// Entries live in a dshash table in the pg_llm DSA area, keyed by the
+// SHA-256 of database, instance, the digest of its definition, model,
+// sampling parameters and the normalized conversation. Lookups take only a shared partition lock; the LRU clock is
+// an atomic timestamp in the entry. When the configured memory cap is
+// exceeded the least recently used entries are evicted in one batch.
+class ResponseCache {
+public:
+  static ResponseCache& get_instance();
+
+  // Reserve the shared control struct; called from _PG_init
+  static void request_shmem();
+
+  // False without shared_preload_libraries, when disabled by GUC, or when
+  // the server lacks the required dshash support
+  bool enabled() const;
+
+  // Digest identifying one request
+  static std::string make_key(const std::string& instance_name,
+                              const LLMInterface& model,
+                              const std::vector<ChatMessage>& messages);
+
+  std::optional<ModelResponse> lookup(const std::string& key);
+  void store(const std::string& key, const ModelResponse& response);
+
+  ResponseCacheStats stats();
+
+  // Drop every entry and zero the counters; returns the number removed
+  uint64_t reset();
+
+private:
+  ResponseCache() = default;
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+
+  bool attach();
+  void evict(uint64_t target_bytes);
+
+  dshash_table* table_ = nullptr;  // Backend-local attachment
+};
+
+} // namespace pg_llm
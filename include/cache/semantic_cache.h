@@ -0,0 +1,49 @@
+#pragma once
+
+#include "models/llm_interface.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Result of a semantic cache probe. similarity is the cosine similarity of
+// the nearest stored prompt, or negative when nothing comparable was found.
+struct SemanticCacheLookup {
+  std::optional<ModelResponse> response;
+  double similarity = -1.0;
+};
+
+// Embedding-similarity response cache backed by
+// _pg_llm_catalog.pg_llm_semantic_cache. Paraphrases of an earlier prompt to
+// the same instance and model are answered with the stored reply when their
+// cosine similarity reaches the instance threshold. Entries are keyed by
+// the digest of the instance definition, expire with
+// pg_llm.response_cache_ttl and are capped at
+// pg_llm.semantic_cache_max_entries, oldest first.
+class SemanticCache {
+public:
+  // Effective threshold: options "semantic_cache_threshold", then the model
+  // config key of the same name. Zero (the default) disables the cache.
+  static double threshold(const LLMInterface& model, const Json::Value& options);
+
+  static SemanticCacheLookup lookup(const std::string& instance_name,
+                                    const LLMInterface& model,
+                                    const std::vector<float>& embedding,
+                                    double threshold);
+
+  static void store(const std::string& instance_name,
+                    const LLMInterface& model,
+                    const std::string& prompt,
+                    const std::vector<float>& embedding,
+                    const ModelResponse& response);
+
+  // Delete every stored answer; returns the number removed
+  static uint64_t reset();
+};
+
+} // namespace pg_llm
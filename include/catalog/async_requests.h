@@ -0,0 +1,83 @@
+#pragma once
+
+extern "C" {
+#include "postgres.h"
+}
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Runs one request of a kind and returns what the synchronous function
+// would; raises an error when the request fails
+using AsyncHandler = std::function<Json::Value(const std::string& instance_name,
+                                               const std::string& input,
+                                               const Json::Value& options)>;
+
+// Requests submitted with pg_llm_submit and run by background workers, so
+// the submitting session does not hold its connection and transaction open
+// for the model round trip.
+//
+// Requests are rows of _pg_llm_catalog.pg_llm_async_requests. When a
+// transaction that submitted some commits, background workers connected to
+// its database are started; each worker claims queued rows one at a time
+// (SKIP LOCKED), runs them as the role that submitted them and stores the
+// result or the error in the row. At most pg_llm.async_workers workers run
+// per database, each holding one advisory lock slot; a worker that finds
+// every slot taken leaves the queue to the running ones. Rows are removed
+// pg_llm.async_result_ttl after they were submitted or finished.
+class AsyncRequests {
+public:
+  static AsyncRequests& get_instance();
+
+  // Register what runs requests of a kind; called from _PG_init
+  void register_handler(const std::string& kind, AsyncHandler handler);
+
+  // Queue a request; its workers start when the transaction commits.
+  // Returns the request id.
+  std::string submit(const std::string& kind,
+                     const std::string& instance_name,
+                     const std::string& input,
+                     const Json::Value& options);
+
+  // State of a request: status ("queued", "running", "succeeded" or
+  // "failed"), result, error and timestamps. Raises an error when the
+  // request does not exist or has expired.
+  Json::Value poll(const std::string& request_id);
+
+  // Poll until the request finished or timeout_ms passed
+  Json::Value await(const std::string& request_id, long timeout_ms);
+
+  // Transaction end: start workers for the requests submitted in it
+  void end_transaction(bool committed);
+
+  // PREPARE TRANSACTION is refused after a submit: no worker would be
+  // started when the prepared transaction commits
+  void prepare_transaction();
+
+  // Body of a worker connected to the database
+  void run();
+
+private:
+  AsyncRequests() = default;
+  AsyncRequests(const AsyncRequests&) = delete;
+  AsyncRequests& operator=(const AsyncRequests&) = delete;
+
+  struct Claim;
+  int acquire_slot();
+  void release_slot(int slot);
+  bool queue_empty();
+  bool run_next();
+  Json::Value execute(const Claim& claim);
+
+  std::map<std::string, AsyncHandler> handlers_;
+  std::vector<std::string> pending_;  // Submitted by the open transaction
+  bool callback_registered_ = false;
+};
+
+} // namespace pg_llm
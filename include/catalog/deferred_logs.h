@@ -0,0 +1,100 @@
+#pragma once
+
+#include "utils/pg_llm_shmem.h"
+
+extern "C" {
+#include "access/xact.h"
+}
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pg_llm {
+
+// One pg_llm_audit_log row; metadata is JSON and already redacted
+struct AuditRecord {
+  std::string request_id;
+  std::string event_type;
+  std::string instance_name;
+  std::string session_id;
+  bool success = true;
+  double confidence_score = 0.0;
+  std::string metadata;
+};
+
+// One pg_llm_trace_log row; details is JSON and already redacted
+struct TraceRecord {
+  std::string request_id;
+  std::string stage;
+  std::string details;
+};
+
+// Audit and trace rows of calls made while the transaction is in parallel
+// mode, where INSERT is refused.
+//
+// The leader keeps its own rows in backend memory, tagged with the
+// subtransaction that made them. A parallel worker appends its rows to the
+// leader's list, an entry of a dshash table in the pg_llm DSA area keyed by
+// the leader's pid; the leader moves them to its own rows when the parallel
+// plan ends. Just before the leader's transaction commits or prepares, it
+// inserts them with one statement per log table. Rows of an aborted
+// subtransaction or transaction are dropped, so they are committed together
+// with the statement that made the calls, as rows written directly would be.
+// A transaction that started a parallel plan always drains its shared list.
+// Without pg_llm in shared_preload_libraries a worker drops its rows and
+// warns once; past kMaxPendingBytes per leader rows are dropped and the
+// leader warns at commit.
+class DeferredLogs {
+public:
+  static DeferredLogs& get_instance();
+
+  // Reserve the shared control struct; called from _PG_init
+  static void request_shmem();
+
+  // Install the transaction callback; called from _PG_init, since a leader
+  // commits its workers' rows without having to run a pg_llm function
+  void register_callbacks();
+
+  // Whether log rows must go through add() instead of an INSERT
+  static bool active();
+
+  void add(const AuditRecord& record);
+  void add(const TraceRecord& record);
+
+  // A parallel plan led by this backend starts, or has ended
+  void enter_parallel();
+  void collect_shared();
+
+  // Subtransaction end: hand the rows to the parent on commit, drop them on
+  // abort (parent_subid invalid)
+  void end_subtransaction(SubTransactionId subid, SubTransactionId parent_subid);
+
+  // Transaction end: insert the rows before commit, drop them on abort
+  void end_transaction(bool committed);
+
+private:
+  DeferredLogs() = default;
+  DeferredLogs(const DeferredLogs&) = delete;
+  DeferredLogs& operator=(const DeferredLogs&) = delete;
+
+  bool attach();
+  void add_payload(const std::string& payload);
+  void push_shared(const std::string& payload);
+  uint64_t take_shared(std::vector<std::string>* payloads);
+  void insert(const std::vector<std::string>& payloads);
+
+  struct PendingRow {
+    SubTransactionId subid;
+    std::string payload;  // Serialized row
+  };
+
+  std::vector<PendingRow> local_;  // Rows of this leader and collected ones
+  uint64_t dropped_ = 0;           // Worker rows lost past kMaxPendingBytes
+  bool shared_used_ = false;       // Led a parallel plan in this transaction
+  bool warned_ = false;            // Worker without the shared area said so
+  bool callbacks_registered_ = false;
+  dshash_table* table_ = nullptr;   // Backend-local attachment
+};
+
+} // namespace pg_llm
@@ -0,0 +1,71 @@
+#pragma once
+
+extern "C" {
+#include "postgres.h"
+}
+
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Bulk enrichment jobs of pg_llm_map: every row of a source query is
+// rendered into a prompt and answered by one instance, and the replies are
+// written to a target table keyed by the row's first column.
+//
+// A job is a row of _pg_llm_catalog.pg_llm_map_jobs run by a background
+// worker of its own, started when the submitting transaction commits and
+// acting as the submitting role. The worker reads the source once, in key
+// order, into numbered rows of pg_llm_map_rows with the rendered prompts,
+// then takes batch_size of them per transaction: the batch is sent with at
+// most max_concurrency requests in flight, its replies are inserted with
+// one statement and the position is checkpointed in the same transaction.
+// A job whose worker failed, was canceled or died (crash, terminate) goes
+// on after its checkpoint when it is resumed.
+class MapJobs {
+public:
+  static MapJobs& get_instance();
+
+  // Check the source's columns, the template and the target (creating the
+  // target table when missing) and queue the job. The source's first column
+  // must be unique; the job fails when its first pass meets a repeated key
+  // and skips rows with a NULL key. Returns the job id.
+  std::string submit(const std::string& source_query,
+                     const std::string& instance_name,
+                     const std::string& prompt_template,
+                     const std::string& target_table,
+                     const Json::Value& options);
+
+  // Stop a queued or running job after its current batch
+  bool cancel(const std::string& job_id);
+
+  // Queue a failed, canceled or interrupted job again from its checkpoint
+  bool resume(const std::string& job_id);
+
+  // Transaction end: start workers for the jobs queued in it
+  void end_transaction(bool committed);
+
+  // PREPARE TRANSACTION is refused after queuing a job
+  void prepare_transaction();
+
+  // Body of a job's worker
+  void run(const std::string& job_id);
+
+private:
+  MapJobs() = default;
+  MapJobs(const MapJobs&) = delete;
+  MapJobs& operator=(const MapJobs&) = delete;
+
+  struct Job;
+  void queue(const std::string& job_id);
+  bool run_batch(Job* job);
+  void materialize(Job* job);
+  bool process_batch(Job* job);
+
+  std::vector<std::string> pending_;  // Queued by the open transaction
+  bool callback_registered_ = false;
+};
+
+} // namespace pg_llm
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "catalog/pg_llm_models.h"
+#include "utils/pg_llm_shmem.h"
+
+#include <cstdint>
+#include <string>
+
+namespace pg_llm {
+
+struct ModelRegistryStats {
+  bool enabled = false;
+  uint64_t generation = 0;
+  uint64_t entries = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+// Parsed and decrypted pg_llm_models rows shared by all backends, so a
+// fresh backend resolves an instance without SPI or AES-GCM.
+//
+// Entries live in a dshash table in the pg_llm DSA area, keyed by the
+// SHA-256 of the database OID and instance name, and carry the catalog
+// generation of their database they were read at. A statement trigger on
+// pg_llm_models bumps that generation when the changing transaction
+// commits, which retires every entry of the database at once; the next
+// lookup of an instance reads the catalog again, under a snapshot taken
+// after the generation, and republishes it. Transactions that run on one
+// snapshot read the catalog directly and publish nothing, and a
+// transaction that changed pg_llm_models cannot be prepared.
+// Entries of encrypted rows are only served to backends whose
+// pg_llm.master_key has the fingerprint of the key that decrypted them.
+class ModelRegistry {
+public:
+  static ModelRegistry& get_instance();
+
+  // Reserve the shared control struct; called from _PG_init
+  static void request_shmem();
+
+  // False without shared_preload_libraries
+  bool enabled() const;
+
+  // Catalog generation of the current database, bumped by every committed
+  // pg_llm_models change; 0 when the registry is disabled
+  uint64_t generation() const;
+
+  // Row of the instance with api_key and config in clear text and the
+  // encrypted_* fields empty. Returns false when the instance does not
+  // exist. When the secrets cannot be decrypted the other fields are still
+  // filled in and *decrypt_error says why.
+  bool lookup(const std::string& instance_name, PgLlmModelInfo* info, std::string* decrypt_error);
+
+  // pg_llm_models changed in the current transaction: read it directly for
+  // the rest of the transaction and bump the generation at commit
+  void invalidate();
+
+  // Transaction end: publish a pending change on commit, drop it on abort
+  void end_transaction(bool committed);
+
+  // pg_llm_models was changed by the current transaction
+  bool changed_in_xact() const { return changed_in_xact_; }
+
+  ModelRegistryStats stats();
+
+private:
+  ModelRegistry() = default;
+  ModelRegistry(const ModelRegistry&) = delete;
+  ModelRegistry& operator=(const ModelRegistry&) = delete;
+
+  bool attach();
+  bool load(const std::string& instance_name,
+            PgLlmModelInfo* info,
+            bool* encrypted,
+            std::string* decrypt_error,
+            bool latest = false);
+  void publish(const std::string& key,
+               uint64_t generation,
+               const PgLlmModelInfo& info,
+               const std::string& fingerprint);
+  void forget(const std::string& key);
+
+  dshash_table* table_ = nullptr;  // Backend-local attachment
+  bool changed_in_xact_ = false;
+  bool callback_registered_ = false;
+};
+
+} // namespace pg_llm
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Per-instance breaker settings read from the model config
+struct CircuitBreakerConfig {
+  bool enabled = true;             // "circuit_breaker"
+  double error_rate = 0.5;         // "breaker_error_rate": trip at this failure ratio
+  int min_requests = 10;           // "breaker_min_requests": in the window before tripping
+  int open_ms = 30000;             // "breaker_open_ms": time before a probe is let through
+  int slow_call_ms = 0;            // "breaker_slow_call_ms": slower replies count as failures
+
+  static CircuitBreakerConfig from_config(const Json::Value& config);
+};
+
+// Outcome of CircuitBreaker::allow
+struct BreakerDecision {
+  bool allowed = true;
+  bool probe = false;  // This request decides whether a half-open breaker closes
+};
+
+// Point-in-time view of one instance for pg_llm_model_health()
+struct InstanceHealth {
+  std::string instance_name;
+  std::string state;              // "closed", "open" or "half_open"
+  uint32_t window_requests = 0;   // Outcomes in the sliding window
+  uint32_t window_failures = 0;
+  double latency_ms = 0.0;        // Moving average of completed requests
+  uint64_t total_requests = 0;
+  uint64_t total_failures = 0;
+  uint64_t rejected = 0;          // Calls short-circuited while open
+  int32_t in_flight = 0;          // Requests holding a rate-limiter permit
+  int64_t opened_at = 0;          // TimestampTz of the last trip, 0 if never
+  int64_t last_failure_at = 0;
+};
+
+// Closed / open / half-open circuit breaker per model instance, shared by
+// all backends through the pg_llm shared memory segment. An instance is
+// identified by the SHA-256 of its database and full name, since each
+// database has its own catalog of instances; slots are reused like those of
+// RateLimiter once the table is full.
+//
+// The last 32 completed requests form the window. Transport errors, HTTP
+// 429 and 5xx replies and, optionally, slow replies count as failures.
+// Once enough of the window failed the breaker opens and every backend
+// short-circuits calls to the instance; after open_ms a single probe is let
+// through and its outcome closes or reopens the breaker.
+//
+// Each slot also keeps a latency histogram of successful requests, from
+// which parallel requests take the delay before hedging.
+//
+// Each slot also holds the instance's retry budget: every chat attempt
+// deposits the retry ratio as credit and every retry spends a whole one, so
+// retries stay a bounded share of the traffic however many backends see
+// the same failures.
+class CircuitBreaker {
+public:
+  static CircuitBreaker& get_instance();
+
+  // Reserve the shared slot table; called from _PG_init
+  static void request_shmem();
+
+  bool available() const;
+
+  BreakerDecision allow(uint32_t database_id,
+                        const std::string& instance_name,
+                        const CircuitBreakerConfig& config);
+
+  void record(uint32_t database_id,
+              const std::string& instance_name,
+              const CircuitBreakerConfig& config,
+              bool success,
+              double latency_ms,
+              bool probe);
+
+  // 95th percentile latency of the instance's recent successful requests
+  // across backends, nullopt until enough were recorded. Only instances
+  // with the breaker enabled keep one.
+  std::optional<double> latency_p95(uint32_t database_id, const std::string& instance_name);
+
+  // A probe that ended without an outcome (canceled) frees its turn
+  void abandon_probe(uint32_t database_id, const std::string& instance_name);
+
+  // Credit the retry budget for one attempt sent to the instance
+  void deposit_retry_credit(uint32_t database_id, const std::string& instance_name, double ratio);
+
+  // Spend one credit for a retry; false when the budget is exhausted
+  bool withdraw_retry_credit(uint32_t database_id, const std::string& instance_name);
+
+  // Whether a finished HTTP exchange counts against the instance
+  static bool is_failure(int curl_result, long http_code);
+
+  // The given instances of the current database that have a slot
+  std::vector<InstanceHealth> snapshot(const std::vector<std::string>& instance_names);
+
+private:
+  CircuitBreaker() = default;
+  CircuitBreaker(const CircuitBreaker&) = delete;
+  CircuitBreaker& operator=(const CircuitBreaker&) = delete;
+
+  int find_slot(uint32_t database_id, const std::string& instance_name, bool create);
+
+  // Both keyed by slot key
+  std::unordered_map<std::string, int> slot_index_;
+  std::unordered_map<std::string, double> local_retry_credits_;  // Without shared memory
+};
+
+} // namespace pg_llm
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Kind of prompt context competing for the token budget
+struct ContextSection {
+  std::string name;
+  int priority = 0;                 // Lower fills first
+  std::string heading;              // Rendered before the first packed item
+  size_t max_items = SIZE_MAX;      // Per-section caps
+  size_t max_tokens = SIZE_MAX;
+  bool deduplicate = true;          // Skip items overlapping a packed one
+  bool contiguous = false;          // Stop at the first item that does not fit
+};
+
+// Chooses which candidate context items go into a prompt.
+//
+// Items are visited by section priority, then by score (highest first), and
+// packed while they fit the budget and their section's caps. An item whose
+// word trigrams are mostly contained in an already packed item is dropped
+// as a duplicate. pack() only decides items added since the last call, so
+// lower-priority candidates that depend on the outcome (sample rows of the
+// packed tables) can be added and packed afterwards.
+class ContextPacker {
+public:
+  using TokenCounter = std::function<size_t(std::string_view)>;
+
+  // budget 0 means unlimited; caps and deduplication still apply
+  ContextPacker(TokenCounter count_tokens, size_t budget);
+
+  void add_section(ContextSection section);
+
+  // Tokens of prompt parts that are always sent
+  void reserve(std::string_view text);
+  void reserve_tokens(size_t tokens);
+
+  // Add a candidate of a registered section; extra_tokens covers framing
+  // the text does not show (such as per-message overhead). Returns its index.
+  size_t add(const std::string& section,
+             std::string label,
+             std::string text,
+             double score,
+             size_t extra_tokens = 0);
+
+  void pack();
+
+  bool packed(size_t index) const { return items_[index].state == State::kPacked; }
+  size_t tokens(size_t index) const { return items_[index].tokens; }
+  const std::string& text(size_t index) const { return items_[index].text; }
+
+  // Heading and packed items of a section in the order they were added;
+  // empty when nothing was packed
+  std::string render(const std::string& section) const;
+
+  size_t used_tokens() const { return used_; }
+  bool over_budget() const { return budget_ != 0 && used_ > budget_; }
+
+  // Budget, per-section totals and the reason for every dropped item
+  Json::Value plan() const;
+
+private:
+  enum class State { kPending, kPacked, kDuplicate, kSectionCap, kOverBudget };
+
+  struct Item {
+    size_t section;
+    std::string label;
+    std::string text;
+    double score;
+    size_t tokens;
+    State state;
+    std::vector<uint64_t> shingles;  // Sorted word-trigram hashes
+  };
+
+  struct SectionState {
+    ContextSection config;
+    size_t items = 0;
+    size_t tokens = 0;
+    size_t heading_tokens = 0;
+    bool closed = false;  // A contiguous section hit an item that did not fit
+  };
+
+  bool is_duplicate(const Item& item) const;
+
+  TokenCounter count_tokens_;
+  size_t budget_;
+  size_t reserved_ = 0;
+  size_t used_ = 0;
+  std::vector<SectionState> sections_;
+  std::vector<Item> items_;
+};
+
+} // namespace pg_llm
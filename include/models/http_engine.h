@@ -0,0 +1,216 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <curl/curl.h>
+
+struct WaitEventSet;
+
+namespace pg_llm {
+
+// Easy handles of one model instance, all copies of a configured
+// prototype. A request checks one out and the transfer returns it when it
+// ends, so requests in flight at the same time never share a handle.
+// Transfers hold the pool, so replacing the instance does not pull the
+// handles (or the header list they point to) from under them.
+class HandlePool {
+public:
+  // Takes ownership of both; the prototype's CURLOPT_HTTPHEADER is headers
+  HandlePool(CURL* prototype, curl_slist* headers);
+  ~HandlePool();
+  HandlePool(const HandlePool&) = delete;
+  HandlePool& operator=(const HandlePool&) = delete;
+
+  // An idle handle or a new copy of the prototype; nullptr when curl is
+  // out of memory
+  CURL* checkout();
+
+  // Keep the handle for a later request, or clean it up when enough are
+  // idle already
+  void checkin(CURL* handle);
+
+  size_t idle_count() const;
+
+private:
+  CURL* prototype_;
+  curl_slist* headers_;
+  std::vector<CURL*> idle_;
+  mutable std::mutex mutex_;
+};
+
+// One outstanding HTTP request driven by the HttpEngine
+struct HttpTransfer {
+  HttpTransfer() = default;
+  ~HttpTransfer();
+  HttpTransfer(const HttpTransfer&) = delete;
+  HttpTransfer& operator=(const HttpTransfer&) = delete;
+
+  CURL* handle = nullptr;          // Easy handle configured by the caller
+  bool owns_handle = false;        // Handle was created for this transfer only
+  std::shared_ptr<HandlePool> pool;  // Pool the handle was checked out of
+  curl_slist* headers = nullptr;   // Request headers owned by this transfer
+  std::string url;                 // Target URL, used for endpoint bookkeeping
+  std::string request_body;        // Must outlive the transfer (CURLOPT_POSTFIELDS)
+  std::string response_body;       // Accumulated response payload
+  long timeout_ms = 0;             // Whole-transfer limit, 0 for none; capped by the deadline
+  size_t max_body_bytes = 0;       // write_body fails the transfer beyond this, 0 for no limit
+  long http_code = 0;              // HTTP status once finished
+  long retry_after_ms = -1;        // Retry-After of the final reply, -1 when absent
+  CURLcode result = CURLE_OK;      // Transfer result once finished
+  bool running = false;            // Attached to the multi handle
+  bool done = false;               // Finished (successfully or not)
+  uint32_t subxact_id = 0;         // SubTransactionId that attached it
+  long local_reply_ms = -1;        // >= 0: not sent, response_body is the reply due this long after add()
+  std::chrono::steady_clock::time_point local_due;  // Set by add() for local replies
+  bool local_timed_out = false;    // The timeout or deadline comes before the local reply
+  std::function<void(HttpTransfer&)> on_complete;  // Optional completion hook
+  std::function<void()> on_release;  // Runs once when the transfer leaves the engine or dies
+
+  // Run and clear on_release
+  void release();
+};
+
+// Connection bookkeeping for one scheme://host:port origin
+struct EndpointState {
+  std::chrono::steady_clock::time_point last_used;
+  bool connected = false;   // Last transfer to this origin reached the server
+  bool connecting = false;  // A pre-connect is in flight
+  uint64_t requests = 0;
+};
+
+// Single-threaded curl_multi engine shared by every model in the backend.
+//
+// All outstanding requests are driven from the backend's own thread, so a
+// fan-out to several models costs the slowest reply instead of one thread
+// per model. Transfers to the same host are multiplexed over HTTP/2 when
+// the server supports it. DNS results, TLS sessions and idle keep-alive
+// connections live in one CURLSH share for the lifetime of the backend, so
+// every instance pointing at the same endpoint reuses them.
+//
+// The engine uses curl's socket API and sleeps in a WaitEventSet holding
+// the curl sockets and the process latch. A query cancel or terminate
+// wakes it at once; every transfer is then aborted before the interrupt is
+// serviced, and again when the transaction aborts for any other reason.
+//
+// A transfer with local_reply_ms set is not sent at all: the engine
+// completes it with its prepared body once that time has passed. Mock
+// models answer late this way, so the code driving transfers, the
+// deadline and cancellation treat them like any other request.
+class HttpEngine {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static HttpEngine& get_instance();
+
+  // Attach a configured transfer; it starts on the next drive call
+  bool add(HttpTransfer* transfer);
+
+  // Abort and detach a transfer that has not finished yet
+  void cancel(HttpTransfer* transfer);
+
+  // Abort every attached transfer; used before an interrupt is serviced
+  // and when the transaction aborts
+  void abort_all();
+
+  // Abort the transfers attached in subtransaction subid or a deeper one;
+  // used when that subtransaction rolls back
+  void abort_all(uint32_t subxact_id);
+
+  // Drive all attached transfers, waiting at most timeout_ms for socket
+  // activity. Services pending interrupts. Returns the number of
+  // transfers still running.
+  int run_once(int timeout_ms);
+
+  // Drive until every given transfer has finished
+  void wait_all(const std::vector<HttpTransfer*>& transfers);
+
+  // Run a single transfer to completion
+  CURLcode perform(HttpTransfer* transfer);
+
+  // Apply the backend-wide transport defaults (share, keep-alive,
+  // compression) to an easy handle. Done once per handle, not per request.
+  void configure_handle(CURL* handle);
+
+  // Start warming a connection to the origin of url unless one is already
+  // known to be alive. Returns immediately; the handshake progresses on the
+  // next drive call and the resulting connection is kept in the share.
+  void preconnect(const std::string& url, long timeout_ms);
+
+  // Transfers added before the deadline passes are cut off at it;
+  // cleared at transaction end. Use ScopedDeadline rather than these.
+  void set_deadline(std::optional<Clock::time_point> deadline) { deadline_ = deadline; }
+  std::optional<Clock::time_point> deadline() const { return deadline_; }
+
+  // Milliseconds left until the deadline, -1 without one
+  long deadline_remaining_ms() const;
+
+  // Whether CHECK_FOR_INTERRUPTS() would throw right now
+  static bool interrupt_pending();
+
+  // Origin ("scheme://host:port") of a URL, empty if it cannot be parsed
+  static std::string origin_of(const std::string& url);
+
+  size_t active_count() const { return active_.size(); }
+
+  // Default write callback appending to HttpTransfer::response_body
+  static size_t write_body(void* contents, size_t size, size_t nmemb, void* userp);
+
+  // Header callback filling HttpTransfer::retry_after_ms
+  static size_t read_header(char* buffer, size_t size, size_t nitems, void* userp);
+
+  // Wait ms milliseconds while driving the attached transfers; wakes up
+  // for interrupts and services them
+  void sleep(long ms);
+
+private:
+  HttpEngine();
+  ~HttpEngine();
+  HttpEngine(const HttpEngine&) = delete;
+  HttpEngine& operator=(const HttpEngine&) = delete;
+
+  void collect_finished();
+  bool add_local(HttpTransfer* transfer, long timeout_ms);
+  void detach(HttpTransfer* transfer);
+  void abandon(HttpTransfer* transfer);
+  void touch_endpoint(const HttpTransfer& transfer);
+  void socket_action(curl_socket_t socket, int events);
+  WaitEventSet* wait_set();
+
+  static int socket_callback(CURL* easy, curl_socket_t socket, int what, void* userp, void* socketp);
+  static int timer_callback(CURLM* multi, long timeout_ms, void* userp);
+
+  CURLM* multi_;
+  CURLSH* share_;
+  std::unordered_map<curl_socket_t, int> sockets_;  // CURL_POLL_* interest per socket
+  bool sockets_changed_ = true;                     // wait_set_ needs rebuilding
+  WaitEventSet* wait_set_ = nullptr;
+  std::optional<Clock::time_point> timer_;          // When curl wants a timeout action
+  std::optional<Clock::time_point> deadline_;
+  int running_ = 0;
+  std::vector<HttpTransfer*> active_;
+  std::unordered_map<std::string, EndpointState> endpoints_;
+  std::vector<std::unique_ptr<HttpTransfer>> background_;  // Engine-owned pre-connects
+};
+
+// Limits transfers started in its scope to finish within deadline_ms
+// (no-op when not positive); nested scopes keep the earlier deadline.
+class ScopedDeadline {
+public:
+  explicit ScopedDeadline(long deadline_ms);
+  ~ScopedDeadline();
+  ScopedDeadline(const ScopedDeadline&) = delete;
+  ScopedDeadline& operator=(const ScopedDeadline&) = delete;
+
+private:
+  std::optional<HttpEngine::Clock::time_point> previous_;
+};
+
+} // namespace pg_llm
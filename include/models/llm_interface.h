@@ -9,6 +9,7 @@
 #include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <curl/curl.h>
@@ -21,6 +22,12 @@
 #include <openssl/sha.h>
 #include <openssl/types.h>
 
+#include "models/circuit_breaker.h"
+#include "models/http_engine.h"
+#include "models/rate_limiter.h"
+#include "models/request_writer.h"
+#include "models/response_parser.h"
+#include "models/retry_policy.h"
 #include "utils/pg_llm_log.h"
 
 namespace pg_llm {
@@ -36,6 +43,7 @@ struct ModelResponse {
   std::string response;
   double confidence_score;
   std::string model_name;
+  std::string error = {};  // Why the request failed; response is empty and the score 0
 };
 
 struct StreamChunk {
@@ -49,6 +57,25 @@ struct StreamResponse {
   std::string response;
   double confidence_score;
   std::string model_name;
+  std::string error = {};
+};
+
+// Embedding settings read from the model config
+struct EmbeddingConfig {
+  std::string provider;     // "embedding_provider": "local_onnxless" runs a mapped model in-process
+  std::string model_path;   // "embedding_model_path": model file under the data directory
+  std::string endpoint;     // "embedding_endpoint"; empty: local hashed vectors
+  std::string model;        // "embedding_model", defaults to model_name
+  int dimensions = 0;       // "embedding_dimensions": requested and checked when set
+  int batch_size = 64;      // "embedding_batch_size": inputs per request
+  int max_concurrency = 4;  // "embedding_max_concurrency": requests in flight
+  bool normalize = false;   // "embedding_normalize": scale vectors to unit length
+};
+
+// One input of LLMInterface::embed
+struct EmbeddingResult {
+  std::vector<float> embedding;  // Empty when error is set
+  std::string error;
 };
 
 // Response data accumulation structure
@@ -59,30 +86,65 @@ struct ResponseData {
 
 // Custom structure to store streaming results and buffer
 struct StreamContext {
-  std::string buffer;      // Unprocessed data buffer
+  LineBuffer lines;        // Received bytes not yet split into events
+  size_t received = 0;     // Body bytes received so far
+  size_t max_bytes = 0;    // Abort the transfer beyond this size, 0 for no limit
   std::string fullReply;   // Final concatenated response
-  std::vector<std::string> chunks;
+  std::vector<std::string> chunks;  // Deltas not yet handed to the caller
+  std::string raw;         // Non-SSE payload (e.g. an error document)
+  double confidence = 0.0; // Derived from the usage event, if any
+};
+
+class LLMInterface;
+
+// Incremental chat completion over server-sent events. Each next() call
+// drives the shared HttpEngine only until at least one new delta arrived,
+// so the first token reaches the caller as soon as the provider sends it.
+class ChatStream {
+public:
+  ~ChatStream() = default;
+  ChatStream(const ChatStream&) = delete;
+  ChatStream& operator=(const ChatStream&) = delete;
+
+  // Produce the next chunk; the last one has is_final set and no text.
+  // Returns false once the final chunk has been produced.
+  bool next(StreamChunk* chunk);
+
+  // Text received so far (the complete reply once finished)
+  const std::string& response() const { return context_.fullReply; }
+  double confidence_score() const { return context_.confidence; }
+  const std::string& model_name() const { return model_name_; }
+
+  // Why the request failed, empty on success; set once the final chunk
+  // has been produced
+  const std::string& error() const { return error_; }
+
+private:
+  friend class LLMInterface;
+  ChatStream() = default;
+
+  void finish_transfer();
+
+  LLMInterface* model_ = nullptr;           // Owner keeps the model alive
+  std::unique_ptr<HttpTransfer> transfer_;  // Null for locally produced streams
+  StreamContext context_;
+  std::string model_name_;
+  std::string error_;
+  size_t next_chunk_ = 0;
+  int seq_no_ = 0;
+  bool final_sent_ = false;
 };
 
 // Abstract base class for LLM models
 class LLMInterface {
 public:
   LLMInterface(const std::string& model_type) :
-               curl_(nullptr),
                is_initialized_(false),
                is_streaming_(false) {
-    curl_ = curl_easy_init();
-    if (!curl_) {
-      PG_LLM_LOG_ERROR("Failed to initialize curl");
-    }
     model_type_ = model_type;
   }
 
-  virtual ~LLMInterface() {
-      if (curl_) {
-          curl_easy_cleanup(curl_);
-      }
-  }
+  virtual ~LLMInterface() = default;
 
   // Initialize the model with API key and other configurations
   bool initialize(bool local_model,
@@ -92,16 +154,57 @@ public:
   // Single round chat completion
   ModelResponse chat_completion(const std::string& prompt);
 
-  // Multi-turn chat completion
+  // Multi-turn chat completion; transient failures are retried as the
+  // instance's retry policy allows. Runs on a pg_llm background worker
+  // when pg_llm.workers is set.
   ModelResponse chat_completion(const std::vector<ChatMessage>& messages);
 
-  // Streaming chat completion
+  // Prepare a chat request for the shared HttpEngine. Returns nullptr when the
+  // reply is produced without a network round trip and stores it in *immediate.
+  // A mock model with "mock_delay_ms" returns a local transfer instead.
+  std::unique_ptr<HttpTransfer> begin_chat_completion(const std::vector<ChatMessage>& messages,
+                                                      ModelResponse* immediate);
+
+  // Parse the reply of a finished transfer created by begin_chat_completion
+  ModelResponse finish_chat_completion(HttpTransfer& transfer);
+
+  // Milliseconds to wait before sending a failed chat transfer again, whose
+  // attempt number (1-based) is given; -1 when the failure is final: not
+  // retryable, attempts or retry budget used up, or the wait would not end
+  // before the deadline
+  long retry_delay_ms(const HttpTransfer& transfer, int attempt);
+
+  // Streaming chat completion, collected into a single response
   StreamResponse stream_chat_completion(const std::string& prompt);
   StreamResponse stream_chat_completion(const std::vector<ChatMessage>& messages);
 
+  // Start a "stream": true request and hand back chunks as they arrive
+  std::unique_ptr<ChatStream> open_chat_stream(const std::vector<ChatMessage>& messages);
+
+  // Warm DNS/TCP/TLS to the API endpoint when the config sets "preconnect"
+  void preconnect();
+
   // Get model name
   std::string get_model_name() const;
 
+  // Catalog instance this model serves and the database whose catalog
+  // defines it; together they key the shared rate limits and circuit breaker
+  void set_instance_name(const std::string& instance_name, uint32_t database_id);
+  const std::string& get_instance_name() const;
+  uint32_t get_database_id() const { return database_id_; }
+
+  // Whether requests wait for rate-limit capacity (the default). The pg_llm
+  // workers turn it off and reschedule turned-away requests themselves,
+  // instead of blocking the event loop that drives all their transfers.
+  void set_rate_limit_wait(bool wait) { rate_limit_wait_ = wait; }
+
+  // Whether the last request was turned away by the rate limiter only
+  // because waiting was turned off; the instance does not fail fast
+  bool rate_limit_deferred() const { return rate_limit_deferred_; }
+
+  // Sampling parameters sent with every request, in a stable textual form
+  std::string sampling_signature() const;
+
   // Get model capabilities and parameters
   std::string get_model_info() const;
 
@@ -116,10 +219,30 @@ public:
                             const std::string& request_body,
                             ResponseData &response_data);
 
-  // Get text embedding
+  // Embed every text through the instance's embedding endpoint, several
+  // inputs per request and several requests in flight. The local_onnxless
+  // provider runs a memory-mapped model instead; without either (and for
+  // mock models) the local hashed embedding is used.
+  // Unless use_cache is false, texts embedded before are served from the
+  // embedding cache.
+  std::vector<EmbeddingResult> embed(const std::vector<std::string>& texts, bool use_cache = true);
+
+  // Local 64-dimension hashed embedding, through the shared embedding
+  // cache; the catalog tables are sized for it
   std::vector<float> get_embedding(const std::string& text);
   std::string get_embedding_str(const std::string& text);
 
+  // Tokens the text takes up in a prompt: exact with the BPE merges named
+  // by "tokenizer_path", estimated otherwise. Raises an error when the
+  // configured file cannot be loaded.
+  size_t count_tokens(std::string_view text) const;
+
+  // Tokens of a whole conversation, including per-message framing
+  size_t count_tokens(const std::vector<ChatMessage>& messages) const;
+
+  // "max_input_tokens": prompt budget of chat requests, 0 for none
+  int max_input_tokens() const { return max_input_tokens_; }
+
   inline bool is_streaming() { return is_streaming_; }
 
 protected:
@@ -131,23 +254,47 @@ protected:
     return realsize;
   }
 
-  size_t stream_write_callback(void* contents, size_t size, size_t nmemb, void* userp);
+  static size_t stream_write_callback(void* contents, size_t size, size_t nmemb, void* userp);
+  static void process_stream_line(StreamContext* ctx, std::string_view line);
   
   std::string generate_signature(const std::string& request_body);
 
+  // Configure an engine transfer for a POST to the given endpoint. Fails
+  // fast while the instance's circuit breaker is open and waits for
+  // rate-limit capacity; returns nullptr with transfer_error_ set when the
+  // request may not be sent.
+  std::unique_ptr<HttpTransfer> prepare_transfer(const std::string& endpoint,
+                                                 std::string request_body);
+
 private:
+  friend class ChatStream;
+
+  std::string build_chat_request_body(const std::vector<ChatMessage>& messages, bool stream) const;
   ModelResponse build_mock_response(const std::vector<ChatMessage>& messages);
-  StreamResponse build_mock_stream_response(const std::vector<ChatMessage>& messages);
-  std::vector<float> build_deterministic_embedding(const std::string& text, int dimensions) const;
+  std::unique_ptr<ChatStream> build_mock_stream(const std::vector<ChatMessage>& messages);
+  std::vector<EmbeddingResult> embed_uncached(const std::vector<std::string>& texts);
 
-  CURL* curl_;
+  std::shared_ptr<HandlePool> handles_;  // Built once per instance in initialize()
   std::string model_type_;
   std::string api_key_;
+  std::string model_config_;     // As given to initialize(); sent to workers
   std::string access_key_id_;
   std::string access_key_secret_;
   std::string model_name_;
   std::string api_endpoint_;
+  std::string instance_name_;
+  uint32_t database_id_ = 0;
+  std::string transfer_error_;   // Why the last prepare_transfer failed
   Json::Value config_json_;
+  RateLimits rate_limits_;
+  CircuitBreakerConfig breaker_config_;
+  RetryPolicy retry_policy_;
+  ChatRequestWriter request_writer_;  // Configured in initialize()
+  EmbeddingConfig embedding_config_;
+  std::string tokenizer_path_;
+  int max_input_tokens_ = 0;
+  bool rate_limit_wait_ = true;
+  bool rate_limit_deferred_ = false;
   bool local_model_;
   bool is_initialized_;
   bool is_streaming_;
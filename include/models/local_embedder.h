@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace pg_llm {
+
+// Embedding cache scope of the local embedder; change it whenever the
+// embedder's output changes so stale cached vectors are not served
+constexpr const char* kLocalEmbedderKey = "pg_llm:ngram-v1";
+
+// Built-in lexical embedder used when an instance has no embedding endpoint.
+//
+// One pass over the text emits hashed features for character trigrams
+// (ASCII case folded, whitespace collapsed), words and word bigrams. Each
+// feature adds a signed weight to one of the dimensions (the hashing trick),
+// and the result is scaled to unit length, so cosine similarity tracks
+// shared vocabulary. The reductions run on simd_kernels().
+void local_embed(std::string_view text, int dimensions, float* out);
+
+std::vector<float> local_embedding(std::string_view text, int dimensions);
+
+// One hashed feature mapped onto a fixed number of buckets
+struct LocalFeature {
+  uint32_t index;
+  float weight;  // Signed
+};
+
+// The features local_embed scatters, mapped onto buckets (for example the
+// rows of a hashed token embedding table); never empty
+void local_features(std::string_view text, uint32_t buckets, std::vector<LocalFeature>* features);
+
+} // namespace pg_llm
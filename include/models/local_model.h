@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace pg_llm {
+
+// "embedding_provider" value selecting the in-process model
+constexpr const char* kLocalModelProvider = "local_onnxless";
+
+// In-process int8 embedding model, memory-mapped from a file under the data
+// directory.
+//
+// File layout (little endian, each section starts on a 64-byte boundary):
+//   header       LocalModelHeader (magic "PGLLMEMB", version 1, sizes)
+//   row_scales   float[vocab_size]
+//   table        int8[vocab_size][hidden_size]   hashed feature embeddings
+//   proj_scales  float[output_size]
+//   bias         float[output_size]
+//   projection   int8[output_size][hidden_size]
+// hidden_size must be a multiple of 32 and weights lie in [-127, 127].
+//
+// Text is mapped to table rows by local_features(), pooled as the weighted
+// mean of the dequantized rows, quantized to int8 and projected with int8
+// dot products. The mapping is read-only and MAP_SHARED, so all backends
+// share one page-cache copy of the weights.
+class LocalEmbeddingModel {
+public:
+  // Map path (relative to the data directory, which it may not leave), or
+  // reuse this backend's mapping while the file is unchanged. Returns
+  // nullptr with *error set on failure.
+  static std::shared_ptr<const LocalEmbeddingModel> open(const std::string& path, std::string* error);
+
+  ~LocalEmbeddingModel();
+
+  int dimensions() const { return static_cast<int>(output_size_); }
+
+  // Path, size and modification time; part of embedding cache keys
+  const std::string& identity() const { return identity_; }
+
+  // Write dimensions() floats to out
+  void embed(std::string_view text, float* out) const;
+
+private:
+  LocalEmbeddingModel() = default;
+  LocalEmbeddingModel(const LocalEmbeddingModel&) = delete;
+  LocalEmbeddingModel& operator=(const LocalEmbeddingModel&) = delete;
+
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  std::string identity_;
+  uint32_t vocab_size_ = 0;
+  uint32_t hidden_size_ = 0;
+  uint32_t output_size_ = 0;
+  const float* row_scales_ = nullptr;
+  const int8_t* table_ = nullptr;
+  const float* proj_scales_ = nullptr;
+  const float* bias_ = nullptr;
+  const int8_t* projection_ = nullptr;
+};
+
+} // namespace pg_llm
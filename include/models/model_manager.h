@@ -2,11 +2,44 @@
 
 #include "models/llm_interface.h"
 
+#include <cstdint>
+#include <functional>
 #include <map>
-#include <mutex>
+#include <optional>
+#include <shared_mutex>
 
 namespace pg_llm {
 
+// Outcome of one request in a batch; error is empty on success
+struct BatchResult {
+  ModelResponse response;
+  std::string error;
+};
+
+// Decides whether a finished candidate is good enough to stop waiting
+using CandidateAcceptor = std::function<bool(const std::string& instance_name,
+                                             const ModelResponse& response)>;
+
+// Tuning for parallel_inference; the defaults wait for every candidate
+struct ParallelOptions {
+  // Stop at the first candidate accepted here and cancel the rest; empty
+  // waits for all candidates
+  CandidateAcceptor accept;
+  // Duplicate a slow request to the instance's "hedge_instance" once it has
+  // been outstanding longer than the instance's p95 latency across backends
+  bool hedge = false;
+};
+
+// One candidate of a parallel request
+struct ParallelCandidate {
+  std::string instance_name;   // Instance the request was addressed to
+  std::string answered_by;     // Instance that produced response
+  ModelResponse response;
+  double latency_ms = 0.0;
+  bool finished = false;       // False when canceled before answering
+  bool hedged = false;         // A duplicate was sent to the hedge instance
+};
+
 class ModelManager {
 public:
   static ModelManager& get_instance();
@@ -14,7 +47,8 @@ public:
   // Register a new model type
   void register_model(const std::string& model_type, ModelCreator creator);
 
-  // Create and initialize a new model instance
+  // Create and initialize a model instance, replacing any instance of the
+  // same name in one step; requests already holding the old one finish on it
   bool create_model_instance(bool local_model,
                              const std::string& model_type, 
                              const std::string& instance_name,
@@ -24,9 +58,14 @@ public:
   // Remove a model instance
   bool remove_model_instance(const std::string& instance_name);
 
-  // Get a model instance
+  // Get a model instance, building it from pg_llm_models on first use and
+  // again when the row changed since (see ModelRegistry)
   std::shared_ptr<LLMInterface> get_model(const std::string& instance_name);
 
+  // Digest of the pg_llm_models row the current instance was built from;
+  // empty when it is not loaded
+  std::string instance_digest(const std::string& instance_name);
+
   // Parallel inference with multiple models
   std::vector<ModelResponse> parallel_inference(const std::string& prompt,
                                               const std::vector<std::string>& model_names);
@@ -35,6 +74,20 @@ public:
   std::vector<ModelResponse> parallel_inference(const std::vector<ChatMessage>& messages,
                                               const std::vector<std::string>& model_names);
 
+  // Parallel inference with early acceptance and hedging. Unknown instances
+  // are skipped; the rest are returned in request order.
+  std::vector<ParallelCandidate> parallel_inference(const std::vector<ChatMessage>& messages,
+                                                    const std::vector<std::string>& model_names,
+                                                    const ParallelOptions& options);
+
+  // Run one model over many conversations with at most max_concurrency
+  // requests in flight. Results follow input order; a failed request only
+  // sets its own error. Transient failures are retried per the instance's
+  // retry policy, leaving their slot to other requests while they wait.
+  std::vector<BatchResult> batch_inference(const std::string& instance_name,
+                                           const std::vector<std::vector<ChatMessage>>& requests,
+                                           size_t max_concurrency);
+
   // Get best response based on confidence score
   ModelResponse get_best_response(const std::vector<ModelResponse>& responses);
 
@@ -44,9 +97,26 @@ private:
   ModelManager(const ModelManager&) = delete;
   ModelManager& operator=(const ModelManager&) = delete;
 
+  bool create_model_instance(bool local_model,
+                             const std::string& model_type,
+                             const std::string& instance_name,
+                             const std::string& api_key,
+                             const std::string& model_config,
+                             uint64_t generation);
+
   std::map<std::string, ModelCreator> model_creators_;
   std::map<std::string, std::shared_ptr<LLMInterface>> model_instances_;
-  std::mutex mutex_;
+
+  // Catalog generation an instance was last checked at and a digest of the
+  // row it was built from
+  struct InstanceSource {
+    uint64_t generation = 0;
+    std::string digest;
+  };
+  std::map<std::string, InstanceSource> sources_;
+
+  // Lookups take it shared; registration, replacement and removal exclusive
+  std::shared_mutex mutex_;
 };
 
 } // namespace pg_llm
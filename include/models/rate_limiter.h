@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Per-instance limits read from the model config; zero means unlimited
+struct RateLimits {
+  double requests_per_second = 0.0;  // "rate_limit_rps"
+  double tokens_per_minute = 0.0;    // "rate_limit_tpm"
+  int max_concurrency = 0;           // "max_concurrency"
+  bool fail_fast = false;            // "rate_limit_fail_fast"
+
+  static RateLimits from_config(const Json::Value& config);
+  bool enabled() const {
+    return requests_per_second > 0.0 || tokens_per_minute > 0.0 || max_concurrency > 0;
+  }
+};
+
+// Identifies one granted request; zero means no permit
+using RatePermit = uint64_t;
+
+// Token buckets and a concurrency semaphore per model instance, kept in
+// shared memory so that every backend draws from the same budget. An
+// instance is identified by the SHA-256 of its database and full name,
+// since each database has its own catalog of instances. Once all slots are
+// taken, the one idle for longest (nothing in flight or queued, untouched
+// for ten minutes) is handed to a new instance; backends check that a slot
+// they remember still belongs to their instance before using it.
+//
+// Waiters are served in arrival order. A waiter sleeps on the instance's
+// condition variable (or drives the backend's own in-flight transfers) and
+// gives up after pg_llm.rate_limit_max_wait. Permits and queue positions
+// left behind by an aborted transaction are returned at abort time.
+class RateLimiter {
+public:
+  static RateLimiter& get_instance();
+
+  // Reserve the shared slot table; called from _PG_init
+  static void request_shmem();
+
+  // Whether limits can be enforced (pg_llm is preloaded)
+  bool available() const;
+
+  // Wait for capacity and take one request plus estimated_tokens from the
+  // instance budget. Returns 0 when the wait timed out or fail-fast applies.
+  RatePermit acquire(uint32_t database_id,
+                     const std::string& instance_name,
+                     const RateLimits& limits,
+                     int64_t estimated_tokens);
+
+  // Give back the concurrency slot of a finished request
+  void release(RatePermit permit);
+
+  // Correct the token budget once the provider reported actual usage
+  void settle(uint32_t database_id,
+              const std::string& instance_name,
+              int64_t estimated_tokens,
+              int64_t actual_tokens);
+
+  // Requests of the instance currently holding a permit, across backends
+  int32_t in_flight(uint32_t database_id, const std::string& instance_name);
+
+  // Rough token count of a request body, used until usage is known
+  static int64_t estimate_tokens(const std::string& request_body, int64_t max_output_tokens);
+
+  // Return what this backend acquired in the given subtransaction or its
+  // children (zero: everything); runs on abort and exit
+  void release_held(uint32_t subxact_id);
+
+private:
+  RateLimiter() = default;
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  int find_slot(uint32_t database_id, const std::string& instance_name, bool create);
+  void register_callbacks();
+
+  struct HeldPermit {
+    RatePermit id;
+    int slot;
+    uint32_t subxact_id;  // Subtransaction that acquired the permit
+  };
+
+  std::vector<HeldPermit> held_;  // Permits this backend has not released
+  std::unordered_map<std::string, int> slot_index_;  // By slot key
+  int waiting_slot_ = -1;         // Slot whose queue holds waiting_ticket_
+  uint64_t waiting_ticket_ = 0;
+  RatePermit next_permit_ = 0;
+  bool callbacks_registered_ = false;
+};
+
+} // namespace pg_llm
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pg_llm {
+
+struct ChatMessage;
+
+// Shape of the chat completion request an endpoint expects
+enum class RequestDialect {
+  kDashScope,  // Sampling parameters nested under "parameters" (default)
+  kOpenAI,     // Sampling parameters at the top level, no logprobs
+};
+
+// Append value to out as a quoted JSON string. Runs that need no escaping
+// are copied in one piece.
+void append_json_string(std::string* out, std::string_view value);
+
+// Body of an OpenAI-style /embeddings request for inputs[begin, end);
+// dimensions is only sent when positive
+std::string build_embedding_request(const std::string& model,
+                                    const std::vector<std::string>& inputs,
+                                    size_t begin,
+                                    size_t end,
+                                    int dimensions);
+
+// Serializes chat completion requests straight into a string, without a
+// JSON DOM. Everything except the messages is rendered once by configure(),
+// so a request costs one escaped copy of each message.
+class ChatRequestWriter {
+public:
+  // "request_format" config value; unknown names map to the default
+  static RequestDialect dialect_from_name(const std::string& name);
+
+  void configure(const std::string& model_name,
+                 RequestDialect dialect,
+                 double temperature,
+                 double top_p,
+                 int logprobs);
+
+  // Request body, reserved up front from the message sizes
+  std::string write(const std::vector<ChatMessage>& messages, bool stream) const;
+
+private:
+  std::string prefix_;         // Up to and including "messages":[
+  std::string suffix_;         // After the messages, non-streaming
+  std::string stream_suffix_;  // After the messages, streaming
+};
+
+} // namespace pg_llm
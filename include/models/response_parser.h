@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pg_llm {
+
+// Byte buffer that hands out complete lines without moving the remaining
+// data for every line. Consumed bytes are dropped in bulk once they make up
+// most of the buffer, so splitting a response is linear in its size.
+class LineBuffer {
+public:
+  void append(const char* data, size_t size);
+
+  // Next complete line without its terminator ("\n" or "\r\n"). The view
+  // stays valid until the next append() or clear().
+  bool next_line(std::string_view* line);
+
+  // Bytes after the last complete line
+  std::string_view remainder() const;
+
+  void clear();
+
+private:
+  std::string data_;
+  size_t start_ = 0;    // First byte not handed out yet
+  size_t scanned_ = 0;  // Bytes already searched for a newline
+};
+
+// The few fields pg_llm reads from an OpenAI-style chat completion body
+// or stream event
+struct ChatPayload {
+  bool has_choices = false;            // "choices" is a non-empty array
+  std::optional<std::string> content;  // choices[0].message.content or .delta.content
+  bool has_usage = false;              // "usage" is an object
+  double total_tokens = 0.0;
+  double output_tokens = 0.0;          // usage.output_tokens
+  double completion_tokens = 0.0;      // usage.completion_tokens
+  bool has_output_tokens = false;
+};
+
+// Single-pass pull parser over a JSON document that materializes only the
+// ChatPayload fields and skips everything else without building a DOM.
+// Returns false with a message in error when the document is malformed.
+bool parse_chat_payload(std::string_view json, ChatPayload* payload, std::string* error);
+
+// Vectors of an OpenAI-style embeddings response ("data": [{"index": i,
+// "embedding": [...]}]), ordered by index. Other members are skipped.
+bool parse_embedding_payload(std::string_view json,
+                             std::vector<std::vector<float>>* embeddings,
+                             std::string* error);
+
+} // namespace pg_llm
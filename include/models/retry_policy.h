@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+#include <curl/curl.h>
+#include <json/json.h>
+
+namespace pg_llm {
+
+// Why an HTTP exchange failed, as far as sending it again is concerned
+enum class FailureClass {
+  kNone,         // Succeeded
+  kConnect,      // Resolve, connect or TLS failure, or the connection dropped
+  kTimeout,      // Transfer timeout or HTTP 408
+  kRateLimited,  // HTTP 429
+  kServer,       // HTTP 500, 502, 503 or 504
+  kPermanent,    // Repeating it will not help (other 4xx/5xx, oversized reply)
+};
+
+// Per-instance retry settings read from the model config.
+//
+// Retry n (1-based) waits a uniformly random time between zero and
+// min(max_delay_ms, base_delay_ms * 2^(n-1)) ("full jitter"), so clients
+// failing together do not come back together. A Retry-After header asking
+// for longer wins; one asking for more than max_delay_ms ends the retries.
+struct RetryPolicy {
+  int max_attempts = 3;       // "retry_max_attempts": first attempt included, 1 disables retries
+  int base_delay_ms = 200;    // "retry_base_delay_ms"
+  int max_delay_ms = 10000;   // "retry_max_delay_ms": longest wait, Retry-After included
+  double budget_ratio = 0.1;  // "retry_budget_ratio": share of attempts that may be retries
+  uint32_t retry_on = 0;      // "retry_on": bit per FailureClass; defaults to every transient class
+
+  static RetryPolicy from_config(const Json::Value& config);
+
+  static FailureClass classify(CURLcode result, long http_code);
+  static const char* class_name(FailureClass failure);
+
+  // Whether a failure of the given attempt may be sent again
+  bool retryable(FailureClass failure, int attempt) const;
+
+  // Milliseconds to wait before retry number `retry`, -1 when the server's
+  // Retry-After (retry_after_ms, -1 when absent) exceeds max_delay_ms
+  long backoff_ms(int retry, long retry_after_ms) const;
+};
+
+} // namespace pg_llm
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pg_llm {
+
+// Vector kernels shared by the local embedders. The implementation is
+// picked once per process: AVX2+FMA when the CPU reports it, NEON on
+// aarch64, portable C++ otherwise.
+struct SimdKernels {
+  const char* name;
+
+  // Sum of values[i]^2
+  float (*sum_squares)(const float* values, size_t count);
+
+  // values[i] *= factor
+  void (*scale)(float* values, size_t count, float factor);
+
+  // out[i] += factor * row[i], widening int8 to float
+  void (*axpy_i8)(float* out, const int8_t* row, size_t count, float factor);
+
+  // Sum of a[i] * b[i] in int32; count must be a multiple of 32, and
+  // neither input may contain -128
+  int32_t (*dot_i8)(const int8_t* a, const int8_t* b, size_t count);
+};
+
+const SimdKernels& simd_kernels();
+
+} // namespace pg_llm
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace pg_llm {
+
+// Byte-level BPE tokenizer used to size prompts before they are sent.
+//
+// The merges come from a file under the data directory, either a GPT-2
+// style merges.txt ("left right" per line, optional "#version" header) or a
+// Hugging Face tokenizer.json ("model.merges"). Text is split the way the
+// GPT-2 pre-tokenizer splits it (contractions, letter runs, digit runs,
+// punctuation runs and whitespace, non-ASCII bytes counted as letters) and
+// each piece is merged by rank. Only counts are produced, so no vocabulary
+// ids are needed.
+class Tokenizer {
+public:
+  // Load path (relative to the data directory, which it may not leave), or
+  // reuse this backend's copy while the file is unchanged. Returns nullptr
+  // with *error set on failure.
+  static std::shared_ptr<const Tokenizer> open(const std::string& path, std::string* error);
+
+  size_t count(std::string_view text) const;
+
+  // Path, size and modification time
+  const std::string& identity() const { return identity_; }
+
+private:
+  struct Merge {
+    uint32_t rank;
+    uint32_t token;  // Symbol the pair merges into
+  };
+
+  Tokenizer() = default;
+
+  bool add_merge(const std::string& left, const std::string& right);
+  uint32_t symbol(const std::string& bytes);
+  size_t count_piece(std::string_view piece) const;
+
+  std::string identity_;
+  std::unordered_map<std::string, uint32_t> symbols_;
+  std::unordered_map<uint64_t, Merge> merges_;  // Keyed by (left << 32) | right
+};
+
+// Token count without a tokenizer file: the pre-tokenizer's pieces, with
+// long pieces charged one token per four bytes
+size_t estimate_token_count(std::string_view text);
+
+} // namespace pg_llm
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "models/llm_interface.h"
+
+namespace pg_llm {
+
+// What LLMInterface::initialize was given; a worker builds its own
+// instance from it, so workers need neither a database nor the master key
+struct ModelDefinition {
+  std::string instance_name;
+  uint32_t database_id = 0;  // Of the catalog defining the instance
+  std::string model_type;
+  bool local_model = false;
+  std::string api_key;
+  std::string config;
+};
+
+struct WorkerPoolStats {
+  bool enabled = false;
+  int workers = 0;          // Workers currently attached
+  uint64_t queued = 0;      // Requests waiting for a worker
+  uint64_t in_flight = 0;   // Requests a worker is running
+  uint64_t submitted = 0;
+  uint64_t completed = 0;
+  uint64_t abandoned = 0;   // Requester went away before the reply
+  uint64_t rejected = 0;    // Queue full; run by the requesting backend
+};
+
+// Optional pool of background workers that perform chat completions for
+// every backend (pg_llm.workers, needs shared_preload_libraries).
+//
+// A backend writes the request into a DSM segment holding two shm_mq
+// queues, pushes the segment handle onto a shared queue and wakes the
+// least busy worker; it then sleeps on its latch until the reply arrives
+// or its deadline passes. Each worker drives many requests at once on its own HttpEngine,
+// so upstream connections stay warm and multiplexed however many backends
+// come and go, and the shared rate limits and circuit breakers are applied
+// by a handful of processes; a worker never waits for rate-limit capacity
+// but tries a turned-away request again later. When the requesting backend goes away (cancel,
+// error, exit) its segment is detached and the worker aborts the transfer.
+class WorkerPool {
+public:
+  static WorkerPool& get_instance();
+
+  // Reserve the shared queue and register the workers; called from _PG_init
+  static void request_shmem();
+  static void register_workers();
+
+  // Whether chat requests of this backend go to the workers
+  bool enabled() const;
+
+  // Run a chat completion on a worker. Returns false when no worker can
+  // take it, or every worker exited before taking it; the caller then runs
+  // it itself. Past deadline_ms (when not negative) the response is a
+  // timeout error.
+  bool chat(const ModelDefinition& model,
+            const std::vector<ChatMessage>& messages,
+            long deadline_ms,
+            ModelResponse* response);
+
+  WorkerPoolStats stats();
+
+  // Body of a worker process
+  void run(int index);
+
+private:
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  struct Job;
+  void start_job(uint32_t handle, std::vector<std::unique_ptr<Job>>* jobs);
+  void begin_job(Job* job, const std::string& payload);
+  bool send_transfer(Job* job);
+  void reply(Job* job, const ModelResponse& response);
+  void flush_reply(Job* job);
+  std::shared_ptr<LLMInterface> model_for(const ModelDefinition& definition);
+
+  bool is_worker_ = false;
+  int index_ = -1;
+  // Worker-side instances keyed by a digest of their definition
+  std::map<std::string, std::shared_ptr<LLMInterface>> models_;
+};
+
+} // namespace pg_llm
@@ -23,3 +23,6 @@ extern "C" {
 Oid get_vector_type_oid();
 
 Datum std_vector_to_vector(const std::vector<float>& vec);
+
+// Copy of a vector datum's elements; detoasts as needed
+std::vector<float> vector_to_std_vector(Datum datum);
@@ -114,6 +114,9 @@ public:
 
   std::string validate_and_optimize_sql(const std::string& sql);
 
+  // What the last generated prompt kept and dropped (ContextPacker::plan)
+  const Json::Value& context_plan() const { return context_plan_; }
+
 private:
   // Build prompt
   std::string build_prompt(const std::string& query,
@@ -143,6 +146,7 @@ private:
 
   std::shared_ptr<LLMInterface> model_;
   Text2SQLConfig config_;
+  Json::Value context_plan_;
   
   // Cache storage
   std::unordered_map<std::string, CacheEntry<std::vector<TableInfo>>> schema_cache_;
@@ -0,0 +1,169 @@
+#pragma once
+
+extern "C" {
+#include "postgres.h"
+#include "lib/dshash.h"
+#include "storage/spin.h"
+#include "utils/dsa.h"
+#include "utils/timestamp.h"
+}
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Shared memory coordination for pg_llm.
+ *
+ * Modules reserve fixed-size structs from _PG_init; variable-size state lives
+ * in one extension-wide DSA area that is created on first use. Everything
+ * here is only available when pg_llm is listed in shared_preload_libraries;
+ * callers must check pg_llm_shmem_available() and degrade gracefully.
+ */
+
+// dshash sequential scans (needed for eviction and reset) exist since PG15
+#define PG_LLM_HAVE_SHARED_HASH_SCAN (PG_VERSION_NUM >= 150000)
+
+using PgLlmShmemInitCallback = void (*)(void* ptr, bool found);
+
+// Install the shared memory hooks; called from _PG_init before any module
+// registers its structs
+void pg_llm_shmem_init(void);
+
+// Reserve a named fixed-size struct. Only honored while preloading; init runs
+// in the postmaster (found == false) and, on EXEC_BACKEND, in every backend.
+void pg_llm_shmem_register(const char* name, Size size, PgLlmShmemInitCallback init);
+
+// Whether shared memory was set up for this server
+bool pg_llm_shmem_available(void);
+
+// Backend-local attachment to the extension-wide DSA area, or nullptr
+dsa_area* pg_llm_shared_area(void);
+
+// Create or attach a hash table in the shared area. *handle lives in a
+// registered struct and must be initialized to InvalidDsaPointer.
+dshash_table* pg_llm_shared_hash(const dshash_parameters* params, dshash_table_handle* handle);
+
+// Size of a slot key: the SHA-256 of a database OID and full instance name
+#define PG_LLM_SLOT_KEY_SIZE 32
+
+// Key of an instance in a PgLlmSlotTable; each database has its own catalog
+// of instances, so the same name may denote different endpoints
+std::string pg_llm_slot_key(uint32 database_id, const std::string& instance_name);
+
+/*
+ * Fixed table of per-instance slots in a registered struct, shared by the
+ * rate limiter and the circuit breaker. Slot must have the fields
+ *
+ *   slock_t mutex; bool used; Oid database_id;
+ *   uint8 key[PG_LLM_SLOT_KEY_SIZE]; TimestampTz last_used;
+ *
+ * used and key only change under both the table mutex and the slot's own
+ * mutex, so lookups read them under either. Once the table is full, the slot
+ * idle for the longest time goes to a new instance if the owner agrees it
+ * can be reclaimed; backends cache indexes and revalidate them on each use.
+ */
+template <typename Slot, int kSlots>
+struct PgLlmSlotTable {
+  slock_t mutex;  // Guards slot allocation
+  Slot slots[kSlots];
+
+  // Reset the common fields; called from the registered init callback
+  void init() {
+    SpinLockInit(&mutex);
+    for (auto& slot : slots) {
+      SpinLockInit(&slot.mutex);
+      slot.used = false;
+      slot.database_id = InvalidOid;
+      memset(slot.key, 0, sizeof(slot.key));
+      slot.last_used = 0;
+    }
+  }
+
+  // Callers hold mutex or the slot's mutex
+  static bool holds_key(const Slot& slot, const std::string& key) {
+    return slot.used && memcmp(slot.key, key.data(), PG_LLM_SLOT_KEY_SIZE) == 0;
+  }
+
+  // Slot of the key or -1; callers hold mutex
+  int search(const std::string& key) const {
+    for (int i = 0; i < kSlots; ++i) {
+      if (holds_key(slots[i], key)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Slot of the instance, claiming one when create is set, or -1 when none
+  // is free. reclaimable(const Slot&, now) tells whether an idle slot may go
+  // to another instance and reset(Slot&, now) prepares a claimed one; both
+  // run under the slot's mutex and must not throw. cache is backend-local
+  // and keyed by slot key.
+  template <typename Reclaimable, typename Reset>
+  int find(std::unordered_map<std::string, int>* cache,
+           uint32 database_id,
+           const std::string& instance_name,
+           bool create,
+           Reclaimable reclaimable,
+           Reset reset) {
+    std::string key = pg_llm_slot_key(database_id, instance_name);
+    TimestampTz now = GetCurrentTimestamp();
+
+    // A cached slot may have been handed to another instance while idle
+    auto cached = cache->find(key);
+    if (cached != cache->end()) {
+      Slot& slot = slots[cached->second];
+      SpinLockAcquire(&slot.mutex);
+      bool current = holds_key(slot, key);
+      if (current) {
+        slot.last_used = now;
+      }
+      SpinLockRelease(&slot.mutex);
+      if (current) {
+        return cached->second;
+      }
+      cache->erase(cached);
+    }
+
+    SpinLockAcquire(&mutex);
+    int index = search(key);
+    if (index < 0 && create) {
+      // A free slot, else the one idle for the longest time
+      int victim = -1;
+      for (int i = 0; i < kSlots; ++i) {
+        if (!slots[i].used) {
+          victim = i;
+          break;
+        }
+        if (victim < 0 || slots[i].last_used < slots[victim].last_used) {
+          victim = i;
+        }
+      }
+      Slot& slot = slots[victim];
+      SpinLockAcquire(&slot.mutex);
+      // Checked again under the slot's mutex: a backend that still uses it
+      // has just refreshed last_used
+      if (!slot.used || reclaimable(static_cast<const Slot&>(slot), now)) {
+        slot.database_id = database_id;
+        memcpy(slot.key, key.data(), PG_LLM_SLOT_KEY_SIZE);
+        reset(slot, now);
+        slot.used = true;
+        index = victim;
+      }
+      SpinLockRelease(&slot.mutex);
+    }
+    if (index >= 0) {
+      Slot& slot = slots[index];
+      SpinLockAcquire(&slot.mutex);
+      slot.last_used = now;
+      SpinLockRelease(&slot.mutex);
+    }
+    SpinLockRelease(&mutex);
+
+    if (index >= 0) {
+      (*cache)[key] = index;
+    }
+    return index;
+  }
+};
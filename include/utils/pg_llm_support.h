@@ -17,6 +17,18 @@ extern bool pg_llm_redact_sensitive;
 extern double pg_llm_audit_sample_rate;
 extern double pg_llm_default_confidence_threshold;
 extern char* pg_llm_default_local_fallback;
+extern bool pg_llm_response_cache_enabled;
+extern int pg_llm_response_cache_ttl;
+extern int pg_llm_response_cache_max_memory;
+extern int pg_llm_semantic_cache_max_entries;
+extern bool pg_llm_embedding_cache_enabled;
+extern int pg_llm_embedding_cache_max_memory;
+extern int pg_llm_rate_limit_max_wait;
+extern int pg_llm_request_timeout;
+extern int pg_llm_max_response_size;
+extern int pg_llm_workers;
+extern int pg_llm_async_workers;
+extern int pg_llm_async_result_ttl;
 
 void pg_llm_define_core_gucs(void);
 
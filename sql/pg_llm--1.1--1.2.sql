@@ -0,0 +1,267 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_llm UPDATE TO '1.2'" to load this file. \quit
+
+CREATE TABLE _pg_llm_catalog.pg_llm_semantic_cache (
+  id bigserial PRIMARY KEY,
+  instance_name text NOT NULL,
+  instance_digest bytea NOT NULL,
+  model_name text NOT NULL,
+  sampling text NOT NULL,
+  prompt text NOT NULL,
+  prompt_embedding vector(64) NOT NULL,
+  response text NOT NULL,
+  confidence_score double precision NOT NULL DEFAULT 0,
+  hit_count bigint NOT NULL DEFAULT 0,
+  created_at timestamptz NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  last_hit_at timestamptz
+);
+
+-- Lookups walk the nearest prompts; the planner ranks an instance with few
+-- entries exactly through the btree instead
+CREATE INDEX pg_llm_semantic_cache_embedding_idx
+  ON _pg_llm_catalog.pg_llm_semantic_cache
+  USING hnsw (prompt_embedding vector_cosine_ops);
+
+CREATE INDEX pg_llm_semantic_cache_instance_idx
+  ON _pg_llm_catalog.pg_llm_semantic_cache (instance_name, instance_digest, model_name, sampling);
+
+-- Expired entries are swept when new ones are stored
+CREATE INDEX pg_llm_semantic_cache_created_idx
+  ON _pg_llm_catalog.pg_llm_semantic_cache (created_at);
+
+CREATE FUNCTION pg_llm_cache_stats()
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_llm_cache_stats'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_llm_cache_reset()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_llm_cache_reset'
+LANGUAGE C VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION pg_llm_cache_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_llm_chat_batch(
+  instance_name text,
+  prompts text[],
+  options jsonb DEFAULT '{}'::jsonb
+) RETURNS TABLE (
+  idx integer,
+  response text,
+  confidence_score float8,
+  cache_hit boolean,
+  error text,
+  request_id uuid
+)
+AS 'MODULE_PATHNAME', 'pg_llm_chat_batch'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_llm_model_health()
+RETURNS TABLE (
+  instance_name text,
+  state text,
+  window_requests integer,
+  window_failures integer,
+  error_rate float8,
+  avg_latency_ms float8,
+  in_flight integer,
+  total_requests bigint,
+  total_failures bigint,
+  rejected bigint,
+  opened_at timestamptz,
+  last_failure_at timestamptz
+)
+AS 'MODULE_PATHNAME', 'pg_llm_model_health'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_llm_embed_batch(
+  instance_name text,
+  texts text[],
+  options jsonb DEFAULT '{}'::jsonb
+) RETURNS TABLE (
+  idx integer,
+  embedding vector,
+  error text
+)
+AS 'MODULE_PATHNAME', 'pg_llm_embed_batch'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+CREATE TABLE _pg_llm_catalog.pg_llm_embedding_cache (
+  model_key text NOT NULL,
+  dimensions integer NOT NULL,
+  content_hash bytea NOT NULL,
+  embedding vector NOT NULL,
+  created_at timestamptz NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (model_key, dimensions, content_hash)
+);
+
+CREATE FUNCTION pg_llm_count_tokens(
+  instance_name text,
+  input text
+) RETURNS integer
+AS 'MODULE_PATHNAME', 'pg_llm_count_tokens'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION _pg_llm_catalog.pg_llm_models_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_llm_models_changed'
+LANGUAGE C;
+
+-- Retires the shared model registry when a change commits
+CREATE TRIGGER pg_llm_models_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON _pg_llm_catalog.pg_llm_models
+FOR EACH STATEMENT EXECUTE FUNCTION _pg_llm_catalog.pg_llm_models_changed();
+
+CREATE FUNCTION pg_llm_worker_stats()
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_llm_worker_stats'
+LANGUAGE C VOLATILE;
+
+CREATE TABLE _pg_llm_catalog.pg_llm_async_requests (
+  request_id uuid PRIMARY KEY,
+  kind text NOT NULL,
+  instance_name text NOT NULL,
+  input text NOT NULL,
+  options jsonb NOT NULL DEFAULT '{}'::jsonb,
+  submitted_by oid NOT NULL,
+  status text NOT NULL DEFAULT 'queued'
+    CHECK (status IN ('queued', 'running', 'succeeded', 'failed')),
+  result jsonb,
+  error text,
+  worker_pid integer,
+  submitted_at timestamptz NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  started_at timestamptz,
+  finished_at timestamptz,
+  expires_at timestamptz NOT NULL
+);
+
+CREATE INDEX pg_llm_async_requests_queue_idx
+  ON _pg_llm_catalog.pg_llm_async_requests (submitted_at)
+  WHERE status = 'queued';
+
+CREATE INDEX pg_llm_async_requests_expires_idx
+  ON _pg_llm_catalog.pg_llm_async_requests (expires_at);
+
+CREATE FUNCTION pg_llm_submit(
+  kind text,
+  instance_name text,
+  input text,
+  options jsonb DEFAULT '{}'::jsonb
+) RETURNS uuid
+AS 'MODULE_PATHNAME', 'pg_llm_submit'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_llm_poll(request_id uuid)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_llm_poll'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_llm_await(
+  request_id uuid,
+  timeout_ms integer DEFAULT 30000
+) RETURNS jsonb
+AS 'MODULE_PATHNAME', 'pg_llm_await'
+LANGUAGE C VOLATILE;
+
+CREATE TABLE _pg_llm_catalog.pg_llm_map_jobs (
+  job_id uuid PRIMARY KEY,
+  instance_name text NOT NULL,
+  source_query text NOT NULL,
+  prompt_template text NOT NULL,
+  target_table text NOT NULL,
+  key_column text NOT NULL,
+  key_type text NOT NULL,
+  options jsonb NOT NULL DEFAULT '{}'::jsonb,
+  submitted_by oid NOT NULL,
+  status text NOT NULL DEFAULT 'queued'
+    CHECK (status IN ('queued', 'running', 'succeeded', 'failed', 'canceled')),
+  last_key text,
+  rows_total bigint,                       -- Set once the source has been read
+  rows_done bigint NOT NULL DEFAULT 0,
+  rows_failed bigint NOT NULL DEFAULT 0,
+  rows_skipped bigint NOT NULL DEFAULT 0,  -- Source rows with a NULL key
+  batches bigint NOT NULL DEFAULT 0,
+  error text,
+  worker_pid integer,
+  created_at timestamptz NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  started_at timestamptz,
+  updated_at timestamptz,
+  finished_at timestamptz
+);
+
+-- Source rows of a map job in key order with their rendered prompts, read
+-- once when the job first runs; removed when it succeeds
+CREATE TABLE _pg_llm_catalog.pg_llm_map_rows (
+  job_id uuid NOT NULL REFERENCES _pg_llm_catalog.pg_llm_map_jobs ON DELETE CASCADE,
+  seq bigint NOT NULL,
+  source_key text NOT NULL,
+  prompt text NOT NULL,
+  PRIMARY KEY (job_id, seq)
+);
+
+-- A running job whose worker is gone shows as interrupted until resumed
+CREATE VIEW pg_llm_jobs AS
+SELECT
+  j.job_id,
+  j.instance_name,
+  j.target_table,
+  CASE
+    WHEN j.status = 'running'
+      AND NOT EXISTS (SELECT 1 FROM pg_stat_activity a WHERE a.pid = j.worker_pid)
+    THEN 'interrupted'
+    ELSE j.status
+  END AS status,
+  j.rows_total,
+  j.rows_done,
+  j.rows_failed,
+  j.rows_skipped,
+  j.batches,
+  j.last_key,
+  j.error,
+  pg_get_userbyid(j.submitted_by) AS submitted_by,
+  j.created_at,
+  j.started_at,
+  j.updated_at,
+  j.finished_at
+FROM _pg_llm_catalog.pg_llm_map_jobs j;
+
+CREATE FUNCTION pg_llm_map(
+  source_query text,
+  instance_name text,
+  prompt_template text,
+  target_table text,
+  options jsonb DEFAULT '{}'::jsonb
+) RETURNS uuid
+AS 'MODULE_PATHNAME', 'pg_llm_map'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_llm_cancel_job(job_id uuid)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_llm_cancel_job'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_llm_resume_job(job_id uuid)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_llm_resume_job'
+LANGUAGE C STRICT VOLATILE;
+
+-- Parallel restricted: calls run in the leader, which can log them in a
+-- parallel query
+ALTER FUNCTION pg_llm_get_embedding(text, text) PARALLEL RESTRICTED;
+ALTER FUNCTION pg_llm_chat(text, text) PARALLEL RESTRICTED;
+
+-- Parallel safe variants for large scans: parallel workers only read the
+-- catalog, and their audit and trace rows are inserted by the leader at
+-- commit. The costs reflect a model round trip, so the planner spreads
+-- large scans over workers.
+CREATE FUNCTION pg_llm_get_embedding_parallel_safe(
+  instance_name text,
+  text_var text
+) RETURNS vector
+AS 'MODULE_PATHNAME', 'pg_llm_get_embedding'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE COST 1000;
+
+CREATE FUNCTION pg_llm_chat_parallel_safe(instance_name text, prompt text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'pg_llm_chat'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE COST 10000;
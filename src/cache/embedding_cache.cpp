@@ -0,0 +1,512 @@
+#include "cache/embedding_cache.h"
+
+extern "C" {
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "port/atomics.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+}
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "text2sql/pg_vector.h"
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm embedding cache";
+
+// Eviction frees space down to this fraction of the cap, as in ResponseCache
+constexpr double kEvictionLowWatermark = 0.9;
+
+struct EmbeddingCacheEntry {
+  uint8 key[SHA256_DIGEST_LENGTH];
+  dsa_pointer payload;           // dimensions floats
+  uint32 dimensions;
+  pg_atomic_uint64 last_access;  // LRU clock, bumped under a shared lock
+};
+
+struct EmbeddingCacheShared {
+  dshash_table_handle table_handle;
+  pg_atomic_flag evicting;
+  pg_atomic_uint64 entries;
+  pg_atomic_uint64 bytes_used;
+  pg_atomic_uint64 hits;
+  pg_atomic_uint64 table_hits;
+  pg_atomic_uint64 misses;
+  pg_atomic_uint64 inserts;
+  pg_atomic_uint64 evictions;
+};
+
+EmbeddingCacheShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<EmbeddingCacheShared*>(ptr);
+  if (found) {
+    return;
+  }
+  shared->table_handle = InvalidDsaPointer;
+  pg_atomic_init_flag(&shared->evicting);
+  pg_atomic_init_u64(&shared->entries, 0);
+  pg_atomic_init_u64(&shared->bytes_used, 0);
+  pg_atomic_init_u64(&shared->hits, 0);
+  pg_atomic_init_u64(&shared->table_hits, 0);
+  pg_atomic_init_u64(&shared->misses, 0);
+  pg_atomic_init_u64(&shared->inserts, 0);
+  pg_atomic_init_u64(&shared->evictions, 0);
+}
+
+dshash_parameters table_params() {
+  dshash_parameters params;
+  params.key_size = SHA256_DIGEST_LENGTH;
+  params.entry_size = sizeof(EmbeddingCacheEntry);
+  params.compare_function = dshash_memcmp;
+  params.hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+  params.copy_function = dshash_memcpy;
+#endif
+  params.tranche_id = 0;  // Assigned by pg_llm_shared_hash
+  return params;
+}
+
+uint64_t max_bytes() {
+  return static_cast<uint64_t>(pg_llm_embedding_cache_max_memory) * 1024;
+}
+
+uint64_t entry_footprint(uint32 dimensions) {
+  return sizeof(EmbeddingCacheEntry) + static_cast<uint64_t>(dimensions) * sizeof(float);
+}
+
+std::string sha256(std::string_view data) {
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(data.data()),
+         data.size(),
+         reinterpret_cast<unsigned char*>(&digest[0]));
+  return digest;
+}
+
+// Shared tier key: the scope and the content hash, length-prefixed
+std::string shared_key(const EmbeddingScope& scope, const std::string& content_hash) {
+  std::string material = std::to_string(scope.model_key.size());
+  material.push_back(':');
+  material += scope.model_key;
+  material += std::to_string(scope.dimensions);
+  material.push_back(':');
+  material += content_hash;
+  return sha256(material);
+}
+
+void ensure_spi_ok(int code, int expected, const char* message) {
+  if (code != expected) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("%s: %s", message, SPI_result_code_string(code))));
+  }
+}
+
+Datum bytea_datum(const std::string& value) {
+  bytea* result = static_cast<bytea*>(palloc(VARHDRSZ + value.size()));
+  SET_VARSIZE(result, VARHDRSZ + value.size());
+  memcpy(VARDATA(result), value.data(), value.size());
+  return PointerGetDatum(result);
+}
+
+Datum datum_array(const std::vector<Datum>& elements, Oid element_type) {
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+  get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+  ArrayType* array = construct_array(const_cast<Datum*>(elements.data()),
+                                     static_cast<int>(elements.size()),
+                                     element_type,
+                                     typlen,
+                                     typbyval,
+                                     typalign);
+  return PointerGetDatum(array);
+}
+
+// Stored embeddings for content_hashes, keyed by content hash
+std::unordered_map<std::string, std::vector<float>> table_lookup(const EmbeddingScope& scope,
+                                                                 const std::vector<std::string>& content_hashes) {
+  std::unordered_map<std::string, std::vector<float>> found;
+  std::vector<Datum> hashes;
+  hashes.reserve(content_hashes.size());
+  for (const auto& hash : content_hashes) {
+    hashes.push_back(bytea_datum(hash));
+  }
+
+  SPI_connect();
+  const char* sql =
+    "SELECT content_hash, embedding FROM _pg_llm_catalog.pg_llm_embedding_cache "
+    "WHERE model_key = $1 AND dimensions = $2 AND content_hash = ANY($3)";
+  Oid argtypes[3] = {TEXTOID, INT4OID, BYTEAARRAYOID};
+  Datum values[3] = {CStringGetTextDatum(scope.model_key.c_str()),
+                     Int32GetDatum(scope.dimensions),
+                     datum_array(hashes, BYTEAOID)};
+  char nulls[3] = {' ', ' ', ' '};
+  int ret = SPI_execute_with_args(sql, 3, argtypes, values, nulls, true, 0);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to read embedding cache");
+
+  for (uint64 i = 0; i < SPI_processed; ++i) {
+    HeapTuple tuple = SPI_tuptable->vals[i];
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    bool isnull = false;
+    bytea* hash = DatumGetByteaPP(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+    Datum embedding = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+    found.emplace(std::string(VARDATA_ANY(hash), VARSIZE_ANY_EXHDR(hash)), vector_to_std_vector(embedding));
+  }
+
+  SPI_finish();
+  return found;
+}
+
+void table_store(const EmbeddingScope& scope,
+                 const std::vector<std::string>& content_hashes,
+                 const std::vector<const std::vector<float>*>& embeddings) {
+  // Persisting is best effort; skip it where writes are impossible
+  if (XactReadOnly || IsInParallelMode() || content_hashes.empty()) {
+    return;
+  }
+
+  std::vector<Datum> hashes;
+  std::vector<Datum> vectors;
+  hashes.reserve(content_hashes.size());
+  vectors.reserve(embeddings.size());
+  for (size_t i = 0; i < content_hashes.size(); ++i) {
+    hashes.push_back(bytea_datum(content_hashes[i]));
+    vectors.push_back(std_vector_to_vector(*embeddings[i]));
+  }
+
+  SPI_connect();
+  Oid vector_type = get_vector_type_oid();
+  const char* sql =
+    "INSERT INTO _pg_llm_catalog.pg_llm_embedding_cache "
+    "(model_key, dimensions, content_hash, embedding) "
+    "SELECT $1, $2, h, e FROM unnest($3, $4) AS u(h, e) "
+    "ON CONFLICT DO NOTHING";
+  Oid argtypes[4] = {TEXTOID, INT4OID, BYTEAARRAYOID, get_array_type(vector_type)};
+  Datum values[4] = {CStringGetTextDatum(scope.model_key.c_str()),
+                     Int32GetDatum(scope.dimensions),
+                     datum_array(hashes, BYTEAOID),
+                     datum_array(vectors, vector_type)};
+  char nulls[4] = {' ', ' ', ' ', ' '};
+  int ret = SPI_execute_with_args(sql, 4, argtypes, values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_INSERT, "failed to store embedding cache entries");
+  SPI_finish();
+}
+
+}  // namespace
+
+EmbeddingCache& EmbeddingCache::get_instance() {
+  static EmbeddingCache instance;
+  return instance;
+}
+
+void EmbeddingCache::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(EmbeddingCacheShared), init_shared);
+}
+
+bool EmbeddingCache::enabled() const {
+  return pg_llm_embedding_cache_enabled;
+}
+
+bool EmbeddingCache::attach() {
+  if (table_ != nullptr) {
+    return true;
+  }
+#if PG_LLM_HAVE_SHARED_HASH_SCAN
+  if (shared == nullptr || !enabled() || pg_llm_embedding_cache_max_memory <= 0) {
+    return false;
+  }
+  dshash_parameters params = table_params();
+  table_ = pg_llm_shared_hash(&params, &shared->table_handle);
+  return table_ != nullptr;
+#else
+  return false;
+#endif
+}
+
+bool EmbeddingCache::shared_lookup(const std::string& key, std::vector<float>* embedding) {
+  if (!attach()) {
+    return false;
+  }
+
+  auto* entry = static_cast<EmbeddingCacheEntry*>(dshash_find(table_, key.data(), false));
+  if (entry == nullptr) {
+    return false;
+  }
+  const float* data = static_cast<const float*>(dsa_get_address(pg_llm_shared_area(), entry->payload));
+  embedding->assign(data, data + entry->dimensions);
+  pg_atomic_write_u64(&entry->last_access, static_cast<uint64>(GetCurrentTimestamp()));
+  dshash_release_lock(table_, entry);
+  return true;
+}
+
+void EmbeddingCache::shared_store(const std::string& key, const std::vector<float>& embedding) {
+  if (!attach()) {
+    return;
+  }
+
+  uint32 dimensions = static_cast<uint32>(embedding.size());
+  if (entry_footprint(dimensions) > max_bytes()) {
+    return;
+  }
+
+  dsa_area* area = pg_llm_shared_area();
+  dsa_pointer payload = dsa_allocate_extended(area, dimensions * sizeof(float), DSA_ALLOC_NO_OOM);
+  if (!DsaPointerIsValid(payload)) {
+    PG_LLM_LOG_WARNING("pg_llm embedding cache: out of shared memory");
+    return;
+  }
+  memcpy(dsa_get_address(area, payload), embedding.data(), dimensions * sizeof(float));
+
+  TimestampTz now = GetCurrentTimestamp();
+  bool found = false;
+  auto* entry = static_cast<EmbeddingCacheEntry*>(dshash_find_or_insert(table_, key.data(), &found));
+  if (found) {
+    // A concurrent backend embedded the same text; keep its copy
+    dshash_release_lock(table_, entry);
+    dsa_free(area, payload);
+    return;
+  }
+  entry->payload = payload;
+  entry->dimensions = dimensions;
+  pg_atomic_init_u64(&entry->last_access, static_cast<uint64>(now));
+  dshash_release_lock(table_, entry);
+
+  pg_atomic_fetch_add_u64(&shared->entries, 1);
+  uint64_t used = pg_atomic_add_fetch_u64(&shared->bytes_used, entry_footprint(dimensions));
+  pg_atomic_fetch_add_u64(&shared->inserts, 1);
+
+  if (used > max_bytes() && pg_atomic_test_set_flag(&shared->evicting)) {
+    // An error must not leave the flag set, or no backend evicts again
+    PG_TRY();
+    {
+      evict(static_cast<uint64_t>(max_bytes() * kEvictionLowWatermark));
+    }
+    PG_CATCH();
+    {
+      pg_atomic_clear_flag(&shared->evicting);
+      PG_RE_THROW();
+    }
+    PG_END_TRY();
+    pg_atomic_clear_flag(&shared->evicting);
+  }
+}
+
+void EmbeddingCache::evict(uint64_t target_bytes) {
+#if PG_LLM_HAVE_SHARED_HASH_SCAN
+  struct Candidate {
+    uint64 last_access;
+    std::string key;
+  };
+
+  // Same two-phase scheme as ResponseCache::evict
+  std::vector<Candidate> candidates;
+  dshash_seq_status status;
+  dshash_seq_init(&status, table_, false);
+  EmbeddingCacheEntry* entry = nullptr;
+  while ((entry = static_cast<EmbeddingCacheEntry*>(dshash_seq_next(&status))) != nullptr) {
+    candidates.push_back(Candidate{pg_atomic_read_u64(&entry->last_access),
+                                   std::string(reinterpret_cast<const char*>(entry->key),
+                                               SHA256_DIGEST_LENGTH)});
+  }
+  dshash_seq_term(&status);
+
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+    return a.last_access < b.last_access;
+  });
+
+  dsa_area* area = pg_llm_shared_area();
+  for (const auto& candidate : candidates) {
+    if (pg_atomic_read_u64(&shared->bytes_used) <= target_bytes) {
+      break;
+    }
+    entry = static_cast<EmbeddingCacheEntry*>(dshash_find(table_, candidate.key.data(), true));
+    if (entry == nullptr) {
+      continue;
+    }
+    uint64_t footprint = entry_footprint(entry->dimensions);
+    dsa_free(area, entry->payload);
+    dshash_delete_entry(table_, entry);
+    pg_atomic_fetch_sub_u64(&shared->bytes_used, footprint);
+    pg_atomic_fetch_sub_u64(&shared->entries, 1);
+    pg_atomic_fetch_add_u64(&shared->evictions, 1);
+  }
+#endif
+}
+
+std::vector<EmbeddingResult> EmbeddingCache::get_or_embed(const EmbeddingScope& scope,
+                                                          const std::vector<std::string>& texts,
+                                                          const Embedder& embed) {
+  if (!enabled() || texts.empty()) {
+    return embed(texts);
+  }
+
+  // Collapse repeated texts so each distinct one is looked up and embedded once
+  struct Distinct {
+    std::string content_hash;
+    std::string key;
+    size_t text_index;
+    EmbeddingResult result;
+    bool resolved = false;
+  };
+  std::vector<Distinct> distinct;
+  std::vector<size_t> slot_of(texts.size());
+  std::unordered_map<std::string, size_t> slot_by_hash;
+  for (size_t i = 0; i < texts.size(); ++i) {
+    std::string content_hash = sha256(texts[i]);
+    auto [it, inserted] = slot_by_hash.emplace(content_hash, distinct.size());
+    if (inserted) {
+      Distinct item;
+      item.key = shared_key(scope, content_hash);
+      item.content_hash = std::move(content_hash);
+      item.text_index = i;
+      distinct.push_back(std::move(item));
+    }
+    slot_of[i] = it->second;
+  }
+
+  uint64_t shared_hits = 0;
+  for (auto& item : distinct) {
+    item.resolved = shared_lookup(item.key, &item.result.embedding);
+    shared_hits += item.resolved ? 1 : 0;
+  }
+
+  uint64_t table_hits = 0;
+  if (scope.durable) {
+    std::vector<std::string> missing;
+    for (const auto& item : distinct) {
+      if (!item.resolved) {
+        missing.push_back(item.content_hash);
+      }
+    }
+    if (!missing.empty()) {
+      auto stored = table_lookup(scope, missing);
+      for (auto& item : distinct) {
+        auto it = item.resolved ? stored.end() : stored.find(item.content_hash);
+        if (it == stored.end()) {
+          continue;
+        }
+        item.result.embedding = std::move(it->second);
+        item.resolved = true;
+        shared_store(item.key, item.result.embedding);
+        table_hits++;
+      }
+    }
+  }
+
+  std::vector<std::string> pending_texts;
+  std::vector<size_t> pending_slots;
+  for (size_t slot = 0; slot < distinct.size(); ++slot) {
+    if (!distinct[slot].resolved) {
+      pending_texts.push_back(texts[distinct[slot].text_index]);
+      pending_slots.push_back(slot);
+    }
+  }
+
+  if (!pending_texts.empty()) {
+    auto computed = embed(pending_texts);
+    std::vector<std::string> stored_hashes;
+    std::vector<const std::vector<float>*> stored_embeddings;
+    for (size_t i = 0; i < pending_slots.size(); ++i) {
+      Distinct& item = distinct[pending_slots[i]];
+      item.result = std::move(computed[i]);
+      if (!item.result.error.empty() || item.result.embedding.empty()) {
+        continue;
+      }
+      shared_store(item.key, item.result.embedding);
+      stored_hashes.push_back(item.content_hash);
+      stored_embeddings.push_back(&item.result.embedding);
+    }
+    if (scope.durable) {
+      table_store(scope, stored_hashes, stored_embeddings);
+    }
+  }
+
+  if (shared != nullptr) {
+    pg_atomic_fetch_add_u64(&shared->hits, shared_hits);
+    pg_atomic_fetch_add_u64(&shared->table_hits, table_hits);
+    pg_atomic_fetch_add_u64(&shared->misses, pending_texts.size());
+  }
+
+  std::vector<EmbeddingResult> results(texts.size());
+  for (size_t i = 0; i < texts.size(); ++i) {
+    results[i] = distinct[slot_of[i]].result;
+  }
+  return results;
+}
+
+EmbeddingCacheStats EmbeddingCache::stats() {
+  EmbeddingCacheStats stats;
+  stats.enabled = enabled();
+  stats.max_bytes = max_bytes();
+  if (shared == nullptr) {
+    return stats;
+  }
+  stats.entries = pg_atomic_read_u64(&shared->entries);
+  stats.bytes_used = pg_atomic_read_u64(&shared->bytes_used);
+  stats.hits = pg_atomic_read_u64(&shared->hits);
+  stats.table_hits = pg_atomic_read_u64(&shared->table_hits);
+  stats.misses = pg_atomic_read_u64(&shared->misses);
+  stats.inserts = pg_atomic_read_u64(&shared->inserts);
+  stats.evictions = pg_atomic_read_u64(&shared->evictions);
+  return stats;
+}
+
+uint64_t EmbeddingCache::reset() {
+  SPI_connect();
+  int ret = SPI_execute("DELETE FROM _pg_llm_catalog.pg_llm_embedding_cache", false, 0);
+  ensure_spi_ok(ret, SPI_OK_DELETE, "failed to reset embedding cache");
+  uint64_t removed = SPI_processed;
+  SPI_finish();
+
+  if (shared == nullptr) {
+    return removed;
+  }
+
+#if PG_LLM_HAVE_SHARED_HASH_SCAN
+  // Works even while the cache is disabled, so memory can be reclaimed
+  if (table_ == nullptr && DsaPointerIsValid(shared->table_handle)) {
+    dshash_parameters params = table_params();
+    table_ = pg_llm_shared_hash(&params, &shared->table_handle);
+  }
+  if (table_ != nullptr) {
+    dsa_area* area = pg_llm_shared_area();
+    uint64_t freed_bytes = 0;
+    uint64_t freed_entries = 0;
+    dshash_seq_status status;
+    dshash_seq_init(&status, table_, true);
+    EmbeddingCacheEntry* entry = nullptr;
+    while ((entry = static_cast<EmbeddingCacheEntry*>(dshash_seq_next(&status))) != nullptr) {
+      freed_bytes += entry_footprint(entry->dimensions);
+      dsa_free(area, entry->payload);
+      dshash_delete_current(&status);
+      freed_entries++;
+    }
+    dshash_seq_term(&status);
+    pg_atomic_fetch_sub_u64(&shared->bytes_used, freed_bytes);
+    pg_atomic_fetch_sub_u64(&shared->entries, freed_entries);
+    removed += freed_entries;
+  }
+#endif
+
+  pg_atomic_write_u64(&shared->hits, 0);
+  pg_atomic_write_u64(&shared->table_hits, 0);
+  pg_atomic_write_u64(&shared->misses, 0);
+  pg_atomic_write_u64(&shared->inserts, 0);
+  pg_atomic_write_u64(&shared->evictions, 0);
+  return removed;
+}
+
+} // namespace pg_llm
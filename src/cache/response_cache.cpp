@@ -0,0 +1,366 @@
+#include "cache/response_cache.h"
+
+extern "C" {
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "utils/timestamp.h"
+}
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cctype>
+
+#include "models/model_manager.h"
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm response cache";
+
+// Eviction frees space down to this fraction of the cap so that it runs in
+// batches instead of on every insert once the cache is full
+constexpr double kEvictionLowWatermark = 0.9;
+
+struct ResponseCacheEntry {
+  uint8 key[SHA256_DIGEST_LENGTH];
+  dsa_pointer payload;           // model name, '\0', response text
+  uint32 payload_size;
+  double confidence_score;
+  TimestampTz created_at;
+  pg_atomic_uint64 last_access;  // LRU clock, bumped under a shared lock
+};
+
+struct ResponseCacheShared {
+  dshash_table_handle table_handle;
+  pg_atomic_flag evicting;
+  pg_atomic_uint64 entries;
+  pg_atomic_uint64 bytes_used;
+  pg_atomic_uint64 hits;
+  pg_atomic_uint64 misses;
+  pg_atomic_uint64 inserts;
+  pg_atomic_uint64 evictions;
+};
+
+ResponseCacheShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<ResponseCacheShared*>(ptr);
+  if (found) {
+    return;
+  }
+  shared->table_handle = InvalidDsaPointer;
+  pg_atomic_init_flag(&shared->evicting);
+  pg_atomic_init_u64(&shared->entries, 0);
+  pg_atomic_init_u64(&shared->bytes_used, 0);
+  pg_atomic_init_u64(&shared->hits, 0);
+  pg_atomic_init_u64(&shared->misses, 0);
+  pg_atomic_init_u64(&shared->inserts, 0);
+  pg_atomic_init_u64(&shared->evictions, 0);
+}
+
+dshash_parameters table_params() {
+  dshash_parameters params;
+  params.key_size = SHA256_DIGEST_LENGTH;
+  params.entry_size = sizeof(ResponseCacheEntry);
+  params.compare_function = dshash_memcmp;
+  params.hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+  params.copy_function = dshash_memcpy;
+#endif
+  params.tranche_id = 0;  // Assigned by pg_llm_shared_hash
+  return params;
+}
+
+uint64_t max_bytes() {
+  return static_cast<uint64_t>(pg_llm_response_cache_max_memory) * 1024;
+}
+
+uint64_t entry_footprint(uint32 payload_size) {
+  return sizeof(ResponseCacheEntry) + payload_size;
+}
+
+// Collapse runs of whitespace and trim, so prompts that differ only in
+// formatting share an entry
+std::string normalize_content(const std::string& content) {
+  std::string normalized;
+  normalized.reserve(content.size());
+  bool pending_space = false;
+  for (unsigned char c : content) {
+    if (std::isspace(c)) {
+      pending_space = !normalized.empty();
+      continue;
+    }
+    if (pending_space) {
+      normalized.push_back(' ');
+      pending_space = false;
+    }
+    normalized.push_back(static_cast<char>(c));
+  }
+  return normalized;
+}
+
+void append_field(std::string* material, const std::string& field) {
+  // Length prefixes keep ("ab", "c") and ("a", "bc") apart
+  *material += std::to_string(field.size());
+  material->push_back(':');
+  *material += field;
+}
+
+}  // namespace
+
+ResponseCache& ResponseCache::get_instance() {
+  static ResponseCache instance;
+  return instance;
+}
+
+void ResponseCache::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(ResponseCacheShared), init_shared);
+}
+
+bool ResponseCache::enabled() const {
+#if PG_LLM_HAVE_SHARED_HASH_SCAN
+  return shared != nullptr && pg_llm_response_cache_enabled && pg_llm_response_cache_max_memory > 0;
+#else
+  return false;
+#endif
+}
+
+std::string ResponseCache::make_key(const std::string& instance_name,
+                                    const LLMInterface& model,
+                                    const std::vector<ChatMessage>& messages) {
+  // Same-named instances of other databases, and earlier definitions of
+  // this one (other endpoint, key or system prompt), get other keys
+  std::string material;
+  append_field(&material, std::to_string(MyDatabaseId));
+  append_field(&material, instance_name);
+  append_field(&material, ModelManager::get_instance().instance_digest(instance_name));
+  append_field(&material, model.get_model_name());
+  append_field(&material, model.sampling_signature());
+  for (const auto& message : messages) {
+    std::string role = message.role;
+    std::transform(role.begin(), role.end(), role.begin(), [](unsigned char c) {
+      return static_cast<char>(std::tolower(c));
+    });
+    append_field(&material, role);
+    append_field(&material, normalize_content(message.content));
+  }
+
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(material.data()),
+         material.size(),
+         reinterpret_cast<unsigned char*>(&digest[0]));
+  return digest;
+}
+
+bool ResponseCache::attach() {
+  if (table_ != nullptr) {
+    return true;
+  }
+  if (!enabled()) {
+    return false;
+  }
+  dshash_parameters params = table_params();
+  table_ = pg_llm_shared_hash(&params, &shared->table_handle);
+  return table_ != nullptr;
+}
+
+std::optional<ModelResponse> ResponseCache::lookup(const std::string& key) {
+  if (!attach()) {
+    return std::nullopt;
+  }
+
+  auto* entry = static_cast<ResponseCacheEntry*>(dshash_find(table_, key.data(), false));
+  if (entry == nullptr) {
+    pg_atomic_fetch_add_u64(&shared->misses, 1);
+    return std::nullopt;
+  }
+
+  TimestampTz now = GetCurrentTimestamp();
+  if (pg_llm_response_cache_ttl > 0 &&
+      now - entry->created_at > static_cast<int64>(pg_llm_response_cache_ttl) * USECS_PER_SEC) {
+    // Expired entries are replaced by the next store or dropped by eviction
+    dshash_release_lock(table_, entry);
+    pg_atomic_fetch_add_u64(&shared->misses, 1);
+    return std::nullopt;
+  }
+
+  const char* payload = static_cast<const char*>(dsa_get_address(pg_llm_shared_area(), entry->payload));
+  ModelResponse response;
+  response.model_name = payload;
+  size_t name_length = response.model_name.size() + 1;
+  response.response.assign(payload + name_length, entry->payload_size - name_length);
+  response.confidence_score = entry->confidence_score;
+  pg_atomic_write_u64(&entry->last_access, static_cast<uint64>(now));
+  dshash_release_lock(table_, entry);
+
+  pg_atomic_fetch_add_u64(&shared->hits, 1);
+  return response;
+}
+
+void ResponseCache::store(const std::string& key, const ModelResponse& response) {
+  if (!attach()) {
+    return;
+  }
+
+  uint32 payload_size = static_cast<uint32>(response.model_name.size() + 1 + response.response.size());
+  if (entry_footprint(payload_size) > max_bytes()) {
+    return;
+  }
+
+  dsa_area* area = pg_llm_shared_area();
+  dsa_pointer payload = dsa_allocate_extended(area, payload_size, DSA_ALLOC_NO_OOM);
+  if (!DsaPointerIsValid(payload)) {
+    PG_LLM_LOG_WARNING("pg_llm response cache: out of shared memory");
+    return;
+  }
+  char* data = static_cast<char*>(dsa_get_address(area, payload));
+  memcpy(data, response.model_name.c_str(), response.model_name.size() + 1);
+  memcpy(data + response.model_name.size() + 1, response.response.data(), response.response.size());
+
+  TimestampTz now = GetCurrentTimestamp();
+  bool found = false;
+  auto* entry = static_cast<ResponseCacheEntry*>(dshash_find_or_insert(table_, key.data(), &found));
+  if (found) {
+    // Expired, or a concurrent backend stored the same request; keep the newer reply
+    dsa_free(area, entry->payload);
+    pg_atomic_fetch_sub_u64(&shared->bytes_used, entry_footprint(entry->payload_size));
+    pg_atomic_write_u64(&entry->last_access, static_cast<uint64>(now));
+  } else {
+    pg_atomic_init_u64(&entry->last_access, static_cast<uint64>(now));
+    pg_atomic_fetch_add_u64(&shared->entries, 1);
+  }
+  entry->payload = payload;
+  entry->payload_size = payload_size;
+  entry->confidence_score = response.confidence_score;
+  entry->created_at = now;
+  dshash_release_lock(table_, entry);
+
+  uint64_t used = pg_atomic_add_fetch_u64(&shared->bytes_used, entry_footprint(payload_size));
+  pg_atomic_fetch_add_u64(&shared->inserts, 1);
+
+  if (used > max_bytes() && pg_atomic_test_set_flag(&shared->evicting)) {
+    // An error must not leave the flag set, or no backend evicts again
+    PG_TRY();
+    {
+      evict(static_cast<uint64_t>(max_bytes() * kEvictionLowWatermark));
+    }
+    PG_CATCH();
+    {
+      pg_atomic_clear_flag(&shared->evicting);
+      PG_RE_THROW();
+    }
+    PG_END_TRY();
+    pg_atomic_clear_flag(&shared->evicting);
+  }
+}
+
+void ResponseCache::evict(uint64_t target_bytes) {
+#if PG_LLM_HAVE_SHARED_HASH_SCAN
+  struct Candidate {
+    uint64 last_access;
+    bool expired;
+    std::string key;
+  };
+
+  // Snapshot the LRU clocks under shared locks, then delete oldest first.
+  // Entries touched after the snapshot may be evicted slightly early, which
+  // is harmless for a cache.
+  std::vector<Candidate> candidates;
+  TimestampTz now = GetCurrentTimestamp();
+  int64 ttl_usecs = static_cast<int64>(pg_llm_response_cache_ttl) * USECS_PER_SEC;
+  dshash_seq_status status;
+  dshash_seq_init(&status, table_, false);
+  ResponseCacheEntry* entry = nullptr;
+  while ((entry = static_cast<ResponseCacheEntry*>(dshash_seq_next(&status))) != nullptr) {
+    bool expired = ttl_usecs > 0 && now - entry->created_at > ttl_usecs;
+    candidates.push_back(Candidate{pg_atomic_read_u64(&entry->last_access),
+                                   expired,
+                                   std::string(reinterpret_cast<const char*>(entry->key),
+                                               SHA256_DIGEST_LENGTH)});
+  }
+  dshash_seq_term(&status);
+
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+    if (a.expired != b.expired) {
+      return a.expired;
+    }
+    return a.last_access < b.last_access;
+  });
+
+  dsa_area* area = pg_llm_shared_area();
+  for (const auto& candidate : candidates) {
+    if (!candidate.expired && pg_atomic_read_u64(&shared->bytes_used) <= target_bytes) {
+      break;
+    }
+    entry = static_cast<ResponseCacheEntry*>(dshash_find(table_, candidate.key.data(), true));
+    if (entry == nullptr) {
+      continue;
+    }
+    uint64_t footprint = entry_footprint(entry->payload_size);
+    dsa_free(area, entry->payload);
+    dshash_delete_entry(table_, entry);
+    pg_atomic_fetch_sub_u64(&shared->bytes_used, footprint);
+    pg_atomic_fetch_sub_u64(&shared->entries, 1);
+    pg_atomic_fetch_add_u64(&shared->evictions, 1);
+  }
+#endif
+}
+
+ResponseCacheStats ResponseCache::stats() {
+  ResponseCacheStats stats;
+  stats.enabled = enabled();
+  stats.max_bytes = max_bytes();
+  if (shared == nullptr) {
+    return stats;
+  }
+  stats.entries = pg_atomic_read_u64(&shared->entries);
+  stats.bytes_used = pg_atomic_read_u64(&shared->bytes_used);
+  stats.hits = pg_atomic_read_u64(&shared->hits);
+  stats.misses = pg_atomic_read_u64(&shared->misses);
+  stats.inserts = pg_atomic_read_u64(&shared->inserts);
+  stats.evictions = pg_atomic_read_u64(&shared->evictions);
+  return stats;
+}
+
+uint64_t ResponseCache::reset() {
+  uint64_t removed = 0;
+  if (shared == nullptr) {
+    return removed;
+  }
+
+#if PG_LLM_HAVE_SHARED_HASH_SCAN
+  // Works even while the cache is disabled, so memory can be reclaimed
+  if (table_ == nullptr && DsaPointerIsValid(shared->table_handle)) {
+    dshash_parameters params = table_params();
+    table_ = pg_llm_shared_hash(&params, &shared->table_handle);
+  }
+  if (table_ != nullptr) {
+    dsa_area* area = pg_llm_shared_area();
+    uint64_t freed_bytes = 0;
+    dshash_seq_status status;
+    dshash_seq_init(&status, table_, true);
+    ResponseCacheEntry* entry = nullptr;
+    while ((entry = static_cast<ResponseCacheEntry*>(dshash_seq_next(&status))) != nullptr) {
+      freed_bytes += entry_footprint(entry->payload_size);
+      dsa_free(area, entry->payload);
+      dshash_delete_current(&status);
+      removed++;
+    }
+    dshash_seq_term(&status);
+    pg_atomic_fetch_sub_u64(&shared->bytes_used, freed_bytes);
+    pg_atomic_fetch_sub_u64(&shared->entries, removed);
+  }
+#endif
+
+  pg_atomic_write_u64(&shared->hits, 0);
+  pg_atomic_write_u64(&shared->misses, 0);
+  pg_atomic_write_u64(&shared->inserts, 0);
+  pg_atomic_write_u64(&shared->evictions, 0);
+  return removed;
+}
+
+} // namespace pg_llm
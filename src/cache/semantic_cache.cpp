@@ -0,0 +1,176 @@
+#include "cache/semantic_cache.h"
+
+extern "C" {
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+}
+
+#include "models/model_manager.h"
+#include "text2sql/pg_vector.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+void ensure_spi_ok(int code, int expected, const char* message) {
+  if (code != expected) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("%s: %s", message, SPI_result_code_string(code))));
+  }
+}
+
+Datum text_datum(const std::string& value) {
+  return CStringGetTextDatum(value.c_str());
+}
+
+Datum bytea_datum(const std::string& value) {
+  bytea* result = static_cast<bytea*>(palloc(VARHDRSZ + value.size()));
+  SET_VARSIZE(result, VARHDRSZ + value.size());
+  memcpy(VARDATA(result), value.data(), value.size());
+  return PointerGetDatum(result);
+}
+
+// Entries of earlier definitions of an instance (other endpoint, key or
+// system prompt) are never served
+Datum instance_digest_datum(const std::string& instance_name) {
+  return bytea_datum(ModelManager::get_instance().instance_digest(instance_name));
+}
+
+}  // namespace
+
+double SemanticCache::threshold(const LLMInterface& model, const Json::Value& options) {
+  if (options.isObject() && options.isMember("semantic_cache_threshold")) {
+    return options["semantic_cache_threshold"].asDouble();
+  }
+  return model.get_config().get("semantic_cache_threshold", 0.0).asDouble();
+}
+
+SemanticCacheLookup SemanticCache::lookup(const std::string& instance_name,
+                                          const LLMInterface& model,
+                                          const std::vector<float>& embedding,
+                                          double threshold) {
+  SemanticCacheLookup result;
+  SPI_connect();
+
+  // Nearest stored prompt through the HNSW index. The instance filter is
+  // applied to the approximate order, so a probe can miss an entry that
+  // exists; that only costs an upstream call.
+  const char* sql =
+    "SELECT id, model_name, response, confidence_score, 1 - (prompt_embedding <=> $1) AS similarity "
+    "FROM _pg_llm_catalog.pg_llm_semantic_cache "
+    "WHERE instance_name = $2 AND instance_digest = $3 AND model_name = $4 AND sampling = $5 "
+    "AND ($6 <= 0 OR created_at > CURRENT_TIMESTAMP - make_interval(secs => $6)) "
+    "ORDER BY prompt_embedding <=> $1 LIMIT 1";
+  Oid argtypes[6] = {get_vector_type_oid(), TEXTOID, BYTEAOID, TEXTOID, TEXTOID, INT4OID};
+  Datum values[6] = {std_vector_to_vector(embedding),
+                     text_datum(instance_name),
+                     instance_digest_datum(instance_name),
+                     text_datum(model.get_model_name()),
+                     text_datum(model.sampling_signature()),
+                     Int32GetDatum(pg_llm_response_cache_ttl)};
+  char nulls[6] = {' ', ' ', ' ', ' ', ' ', ' '};
+  int ret = SPI_execute_with_args(sql, 6, argtypes, values, nulls, true, 1);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to probe semantic cache");
+
+  int64 id = 0;
+  if (SPI_processed > 0) {
+    HeapTuple tuple = SPI_tuptable->vals[0];
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    bool isnull = false;
+    result.similarity = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+    if (!isnull && result.similarity >= threshold) {
+      id = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+      ModelResponse response;
+      response.model_name = SPI_getvalue(tuple, tupdesc, 2);
+      response.response = SPI_getvalue(tuple, tupdesc, 3);
+      response.confidence_score = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+      result.response = response;
+    }
+  }
+
+  // Hit statistics are best effort; skip them where writes are impossible
+  if (result.response.has_value() && !XactReadOnly && !IsInParallelMode()) {
+    const char* update_sql =
+      "UPDATE _pg_llm_catalog.pg_llm_semantic_cache "
+      "SET hit_count = hit_count + 1, last_hit_at = CURRENT_TIMESTAMP WHERE id = $1";
+    Oid update_argtypes[1] = {INT8OID};
+    Datum update_values[1] = {Int64GetDatum(id)};
+    char update_nulls[1] = {' '};
+    ret = SPI_execute_with_args(update_sql, 1, update_argtypes, update_values, update_nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to update semantic cache hit");
+  }
+
+  SPI_finish();
+  return result;
+}
+
+void SemanticCache::store(const std::string& instance_name,
+                          const LLMInterface& model,
+                          const std::string& prompt,
+                          const std::vector<float>& embedding,
+                          const ModelResponse& response) {
+  if (XactReadOnly || IsInParallelMode()) {
+    return;
+  }
+
+  SPI_connect();
+  const char* sql =
+    "INSERT INTO _pg_llm_catalog.pg_llm_semantic_cache "
+    "(instance_name, instance_digest, model_name, sampling, prompt, prompt_embedding, response, "
+    "confidence_score) "
+    "VALUES ($1, $2, $3, $4, $5, $6, $7, $8) RETURNING id";
+  Oid argtypes[8] = {
+    TEXTOID, BYTEAOID, TEXTOID, TEXTOID, TEXTOID, get_vector_type_oid(), TEXTOID, FLOAT8OID};
+  Datum values[8] = {text_datum(instance_name),
+                     instance_digest_datum(instance_name),
+                     text_datum(model.get_model_name()),
+                     text_datum(model.sampling_signature()),
+                     text_datum(prompt),
+                     std_vector_to_vector(embedding),
+                     text_datum(response.response),
+                     Float8GetDatum(response.confidence_score)};
+  char nulls[8] = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+  int ret = SPI_execute_with_args(sql, 8, argtypes, values, nulls, false, 1);
+  ensure_spi_ok(ret, SPI_OK_INSERT_RETURNING, "failed to store semantic cache entry");
+  bool isnull = false;
+  int64 id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+  // Expired entries are no longer served, drop them
+  if (pg_llm_response_cache_ttl > 0) {
+    const char* expire_sql =
+      "DELETE FROM _pg_llm_catalog.pg_llm_semantic_cache "
+      "WHERE created_at <= CURRENT_TIMESTAMP - make_interval(secs => $1)";
+    Oid expire_argtypes[1] = {INT4OID};
+    Datum expire_values[1] = {Int32GetDatum(pg_llm_response_cache_ttl)};
+    char expire_nulls[1] = {' '};
+    ret = SPI_execute_with_args(expire_sql, 1, expire_argtypes, expire_values, expire_nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_DELETE, "failed to expire semantic cache entries");
+  }
+
+  // Ids grow with every entry, so everything older than the newest
+  // max_entries ids goes first; gaps only make the table smaller
+  if (pg_llm_semantic_cache_max_entries > 0 && id > pg_llm_semantic_cache_max_entries) {
+    const char* evict_sql = "DELETE FROM _pg_llm_catalog.pg_llm_semantic_cache WHERE id <= $1";
+    Oid evict_argtypes[1] = {INT8OID};
+    Datum evict_values[1] = {Int64GetDatum(id - pg_llm_semantic_cache_max_entries)};
+    char evict_nulls[1] = {' '};
+    ret = SPI_execute_with_args(evict_sql, 1, evict_argtypes, evict_values, evict_nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_DELETE, "failed to evict semantic cache entries");
+  }
+  SPI_finish();
+}
+
+uint64_t SemanticCache::reset() {
+  SPI_connect();
+  int ret = SPI_execute("DELETE FROM _pg_llm_catalog.pg_llm_semantic_cache", false, 0);
+  ensure_spi_ok(ret, SPI_OK_DELETE, "failed to reset semantic cache");
+  uint64_t removed = SPI_processed;
+  SPI_finish();
+  return removed;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,489 @@
+#include "catalog/async_requests.h"
+
+extern "C" {
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/latch.h"
+#include "storage/procarray.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+PGDLLEXPORT void pg_llm_async_main(Datum main_arg);
+}
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <optional>
+
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+// First key of the advisory locks held by running workers; the slot
+// number is the second
+constexpr int32 kSlotLockSpace = 0x706c6c6d;  // "pllm"
+
+// Await reads the row this often at first, backing off to the maximum
+constexpr long kMinAwaitPollMs = 10;
+constexpr long kMaxAwaitPollMs = 500;
+
+constexpr const char* kLostWorkerError = "pg_llm async worker exited before the request finished";
+
+using Clock = std::chrono::steady_clock;
+
+void ensure_spi_ok(int code, int expected, const char* message) {
+  if (code != expected) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("%s: %s", message, SPI_result_code_string(code))));
+  }
+}
+
+Datum text_datum(const std::string& value) {
+  return CStringGetTextDatum(value.c_str());
+}
+
+// Column of the first SPI result row as text, empty when null
+std::string column_text(int column) {
+  char* value = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, column);
+  return value != nullptr ? value : "";
+}
+
+Json::Value column_json(int column, bool parse) {
+  char* value = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, column);
+  if (value == nullptr) {
+    return Json::Value(Json::nullValue);
+  }
+  return parse ? pg_llm_parse_json(value) : Json::Value(value);
+}
+
+void xact_callback(XactEvent event, void* arg) {
+  switch (event) {
+    case XACT_EVENT_COMMIT:
+      AsyncRequests::get_instance().end_transaction(true);
+      break;
+    case XACT_EVENT_ABORT:
+      AsyncRequests::get_instance().end_transaction(false);
+      break;
+    case XACT_EVENT_PRE_PREPARE:
+      AsyncRequests::get_instance().prepare_transaction();
+      break;
+    default:
+      break;
+  }
+}
+
+// Worker side: run fn in a transaction of its own with SPI connected
+template <typename Fn>
+void in_transaction(Fn&& fn) {
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  SPI_connect();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  fn();
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+}
+
+// Record how a claimed request ended; the row lives on for the result TTL
+void finish_request(const std::string& request_id, const Json::Value* result, const std::string& error) {
+  const char* sql =
+    "UPDATE _pg_llm_catalog.pg_llm_async_requests "
+    "SET status = $2, result = $3::jsonb, error = $4, finished_at = clock_timestamp(), "
+    "expires_at = clock_timestamp() + make_interval(secs => $5) "
+    "WHERE request_id = $1::uuid";
+  Oid argtypes[5] = {TEXTOID, TEXTOID, TEXTOID, TEXTOID, FLOAT8OID};
+  Datum values[5] = {
+    text_datum(request_id),
+    text_datum(result != nullptr ? "succeeded" : "failed"),
+    result != nullptr ? text_datum(pg_llm_write_json(*result)) : 0,
+    result == nullptr ? text_datum(error) : 0,
+    Float8GetDatum(pg_llm_async_result_ttl)};
+  char nulls[5] = {' ', ' ', result != nullptr ? ' ' : 'n', result == nullptr ? ' ' : 'n', ' '};
+  int ret = SPI_execute_with_args(sql, 5, argtypes, values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to record pg_llm request result");
+}
+
+void start_workers(int count) {
+  for (int i = 0; i < count; ++i) {
+    BackgroundWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_llm");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_llm_async_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_llm async worker for database %u", MyDatabaseId);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_llm async worker");
+    worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+    worker.bgw_notify_pid = 0;
+    if (!RegisterDynamicBackgroundWorker(&worker, nullptr)) {
+      PG_LLM_LOG_WARNING("could not start a pg_llm async worker; submitted requests wait for a "
+                         "running one (consider raising max_worker_processes)");
+      return;
+    }
+  }
+}
+
+}  // namespace
+
+struct AsyncRequests::Claim {
+  std::string request_id;
+  std::string kind;
+  std::string instance_name;
+  std::string input;
+  Json::Value options;
+  Oid role = InvalidOid;  // Submitter; the request runs with its privileges
+};
+
+AsyncRequests& AsyncRequests::get_instance() {
+  static AsyncRequests instance;
+  return instance;
+}
+
+void AsyncRequests::register_handler(const std::string& kind, AsyncHandler handler) {
+  handlers_[kind] = std::move(handler);
+}
+
+std::string AsyncRequests::submit(const std::string& kind,
+                                  const std::string& instance_name,
+                                  const std::string& input,
+                                  const Json::Value& options) {
+  if (handlers_.find(kind) == handlers_.end()) {
+    std::string kinds;
+    for (const auto& [name, handler] : handlers_) {
+      kinds += kinds.empty() ? name : ", " + name;
+    }
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("unknown pg_llm request kind \"%s\"", kind.c_str()),
+             errhint("Supported kinds: %s.", kinds.c_str())));
+  }
+
+  std::string request_id = pg_llm_generate_uuid();
+  SPI_connect();
+  const char* sql =
+    "INSERT INTO _pg_llm_catalog.pg_llm_async_requests "
+    "(request_id, kind, instance_name, input, options, submitted_by, expires_at) "
+    "VALUES ($1::uuid, $2, $3, $4, $5::jsonb, $6, "
+    "CURRENT_TIMESTAMP + make_interval(secs => $7))";
+  Oid argtypes[7] = {TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, OIDOID, FLOAT8OID};
+  Datum values[7] = {
+    text_datum(request_id),
+    text_datum(kind),
+    text_datum(instance_name),
+    text_datum(input),
+    text_datum(pg_llm_write_json(options)),
+    ObjectIdGetDatum(GetUserId()),
+    Float8GetDatum(pg_llm_async_result_ttl)};
+  char nulls[7] = {' ', ' ', ' ', ' ', ' ', ' ', ' '};
+  int ret = SPI_execute_with_args(sql, 7, argtypes, values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_INSERT, "failed to queue pg_llm request");
+  SPI_finish();
+
+  if (!callback_registered_) {
+    RegisterXactCallback(xact_callback, nullptr);
+    callback_registered_ = true;
+  }
+  pending_.push_back(request_id);
+  return request_id;
+}
+
+Json::Value AsyncRequests::poll(const std::string& request_id) {
+  const char* select_sql =
+    "SELECT kind, instance_name, status, result::text, error, submitted_at::text, "
+    "started_at::text, finished_at::text, expires_at::text, worker_pid "
+    "FROM _pg_llm_catalog.pg_llm_async_requests "
+    "WHERE request_id = $1::uuid AND expires_at > CURRENT_TIMESTAMP";
+  Oid argtypes[3] = {TEXTOID, INT4OID, TEXTOID};
+  Datum values[3] = {text_datum(request_id), 0, 0};
+  char nulls[3] = {' ', ' ', ' '};
+
+  SPI_connect();
+  int ret = SPI_execute_with_args(select_sql, 1, argtypes, values, nulls, false, 1);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to read pg_llm request");
+  if (SPI_processed == 0) {
+    SPI_finish();
+    ereport(ERROR,
+            (errcode(ERRCODE_UNDEFINED_OBJECT),
+             errmsg("pg_llm request \"%s\" does not exist or has expired", request_id.c_str())));
+  }
+
+  Json::Value state(Json::objectValue);
+  state["request_id"] = request_id;
+  state["kind"] = column_text(1);
+  state["instance_name"] = column_text(2);
+  state["status"] = column_text(3);
+  state["result"] = column_json(4, true);
+  state["error"] = column_json(5, false);
+  state["submitted_at"] = column_json(6, false);
+  state["started_at"] = column_json(7, false);
+  state["finished_at"] = column_json(8, false);
+  state["expires_at"] = column_json(9, false);
+
+  // A worker that died mid-request (crash, terminate) leaves its row running.
+  // Where the row cannot be written (read-only transaction, standby) the
+  // failure is only reported.
+  bool isnull = true;
+  Datum pid = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 10, &isnull);
+  bool lost = state["status"].asString() == "running" && !isnull &&
+    BackendPidGetProc(DatumGetInt32(pid)) == nullptr;
+  if (lost && (XactReadOnly || RecoveryInProgress() || IsInParallelMode())) {
+    state["status"] = "failed";
+    state["error"] = kLostWorkerError;
+  } else if (lost) {
+    const char* reap_sql =
+      "UPDATE _pg_llm_catalog.pg_llm_async_requests "
+      "SET status = 'failed', error = $3, finished_at = clock_timestamp() "
+      "WHERE request_id = $1::uuid AND status = 'running' AND worker_pid = $2";
+    values[1] = pid;
+    values[2] = text_datum(kLostWorkerError);
+    ret = SPI_execute_with_args(reap_sql, 3, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to record pg_llm request result");
+    if (SPI_processed > 0) {
+      state["status"] = "failed";
+      state["error"] = kLostWorkerError;
+    }
+  }
+  SPI_finish();
+  return state;
+}
+
+Json::Value AsyncRequests::await(const std::string& request_id, long timeout_ms) {
+  if (std::find(pending_.begin(), pending_.end(), request_id) != pending_.end()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("pg_llm request \"%s\" was submitted in the current transaction",
+                    request_id.c_str()),
+             errhint("Its worker starts when the transaction commits.")));
+  }
+  if (IsolationUsesXactSnapshot()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pg_llm_await requires READ COMMITTED isolation"),
+             errdetail("The transaction snapshot would never show the request finishing.")));
+  }
+
+  auto deadline = Clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0L));
+  long wait_ms = kMinAwaitPollMs;
+  while (true) {
+    Json::Value state = poll(request_id);
+    const std::string status = state["status"].asString();
+    if (status == "succeeded" || status == "failed") {
+      return state;
+    }
+    long remaining_ms = static_cast<long>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count());
+    if (remaining_ms <= 0) {
+      return state;
+    }
+
+    int rc = WaitLatch(MyLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                       std::min(wait_ms, remaining_ms),
+                       PG_WAIT_EXTENSION);
+    if (rc & WL_LATCH_SET) {
+      ResetLatch(MyLatch);
+    }
+    CHECK_FOR_INTERRUPTS();
+    wait_ms = std::min(wait_ms * 2, kMaxAwaitPollMs);
+  }
+}
+
+void AsyncRequests::end_transaction(bool committed) {
+  if (pending_.empty()) {
+    return;
+  }
+  size_t submitted = pending_.size();
+  pending_.clear();
+  if (committed) {
+    start_workers(static_cast<int>(std::min<size_t>(submitted, pg_llm_async_workers)));
+  }
+}
+
+void AsyncRequests::prepare_transaction() {
+  if (!pending_.empty()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("cannot PREPARE a transaction that submitted pg_llm requests")));
+  }
+}
+
+int AsyncRequests::acquire_slot() {
+  int slot = -1;
+  in_transaction([&] {
+    const char* sql = "SELECT pg_try_advisory_lock($1, $2)";
+    Oid argtypes[2] = {INT4OID, INT4OID};
+    char nulls[2] = {' ', ' '};
+    for (int i = 0; i < pg_llm_async_workers && slot < 0; ++i) {
+      Datum values[2] = {Int32GetDatum(kSlotLockSpace), Int32GetDatum(i)};
+      int ret = SPI_execute_with_args(sql, 2, argtypes, values, nulls, false, 1);
+      ensure_spi_ok(ret, SPI_OK_SELECT, "failed to take a pg_llm worker slot");
+      bool isnull = true;
+      Datum locked = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+      if (!isnull && DatumGetBool(locked)) {
+        slot = i;
+      }
+    }
+  });
+  return slot;
+}
+
+void AsyncRequests::release_slot(int slot) {
+  in_transaction([&] {
+    const char* sql = "SELECT pg_advisory_unlock($1, $2)";
+    Oid argtypes[2] = {INT4OID, INT4OID};
+    Datum values[2] = {Int32GetDatum(kSlotLockSpace), Int32GetDatum(slot)};
+    char nulls[2] = {' ', ' '};
+    int ret = SPI_execute_with_args(sql, 2, argtypes, values, nulls, false, 1);
+    ensure_spi_ok(ret, SPI_OK_SELECT, "failed to release a pg_llm worker slot");
+  });
+}
+
+bool AsyncRequests::queue_empty() {
+  bool empty = true;
+  in_transaction([&] {
+    const char* sql =
+      "SELECT 1 FROM _pg_llm_catalog.pg_llm_async_requests "
+      "WHERE status = 'queued' AND expires_at > clock_timestamp() LIMIT 1";
+    int ret = SPI_execute(sql, true, 1);
+    ensure_spi_ok(ret, SPI_OK_SELECT, "failed to read pg_llm request queue");
+    empty = SPI_processed == 0;
+  });
+  return empty;
+}
+
+bool AsyncRequests::run_next() {
+  std::optional<Claim> claim;
+  in_transaction([&] {
+    int ret = SPI_execute(
+      "DELETE FROM _pg_llm_catalog.pg_llm_async_requests WHERE expires_at <= clock_timestamp()",
+      false, 0);
+    ensure_spi_ok(ret, SPI_OK_DELETE, "failed to remove expired pg_llm requests");
+
+    const char* sql =
+      "UPDATE _pg_llm_catalog.pg_llm_async_requests "
+      "SET status = 'running', started_at = clock_timestamp(), worker_pid = $1 "
+      "WHERE request_id = ("
+      "  SELECT request_id FROM _pg_llm_catalog.pg_llm_async_requests "
+      "  WHERE status = 'queued' AND expires_at > clock_timestamp() "
+      "  ORDER BY submitted_at LIMIT 1 FOR UPDATE SKIP LOCKED) "
+      "RETURNING request_id::text, kind, instance_name, input, options::text, submitted_by";
+    Oid argtypes[1] = {INT4OID};
+    Datum values[1] = {Int32GetDatum(MyProcPid)};
+    char nulls[1] = {' '};
+    ret = SPI_execute_with_args(sql, 1, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_UPDATE_RETURNING, "failed to claim pg_llm request");
+    if (SPI_processed == 0) {
+      return;
+    }
+    claim.emplace();
+    claim->request_id = column_text(1);
+    claim->kind = column_text(2);
+    claim->instance_name = column_text(3);
+    claim->input = column_text(4);
+    claim->options = column_json(5, true);
+    bool isnull = true;
+    claim->role = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 6, &isnull));
+  });
+  if (!claim) {
+    return false;
+  }
+
+  // The request and its result commit together; on error both roll back
+  // and the error is recorded in a transaction of its own
+  std::string error;
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  MemoryContext xact_context = CurrentMemoryContext;
+  PushActiveSnapshot(GetTransactionSnapshot());
+  pgstat_report_activity(STATE_RUNNING, "pg_llm async request");
+  PG_TRY();
+  {
+    Oid saved_user = InvalidOid;
+    int saved_context = 0;
+    GetUserIdAndSecContext(&saved_user, &saved_context);
+    SetUserIdAndSecContext(claim->role, saved_context | SECURITY_LOCAL_USERID_CHANGE);
+    Json::Value result = execute(*claim);
+    SetUserIdAndSecContext(saved_user, saved_context);
+
+    SPI_connect();
+    finish_request(claim->request_id, &result, "");
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(xact_context);
+    ErrorData* edata = CopyErrorData();
+    FlushErrorState();
+    error = edata->message != nullptr ? edata->message : "unknown error";
+    FreeErrorData(edata);
+    AbortCurrentTransaction();
+  }
+  PG_END_TRY();
+
+  if (!error.empty()) {
+    in_transaction([&] { finish_request(claim->request_id, nullptr, error); });
+  }
+  pgstat_report_activity(STATE_IDLE, nullptr);
+  return true;
+}
+
+Json::Value AsyncRequests::execute(const Claim& claim) {
+  auto handler = handlers_.find(claim.kind);
+  if (handler == handlers_.end()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("unknown pg_llm request kind \"%s\"", claim.kind.c_str())));
+  }
+
+  // Errors must not unwind through the worker loop as C++ exceptions
+  std::string message;
+  try {
+    return handler->second(claim.instance_name, claim.input, claim.options);
+  } catch (const std::exception& e) {
+    message = e.what();
+  }
+  ereport(ERROR,
+          (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+           errmsg("%s", message.c_str())));
+  return Json::Value();
+}
+
+void AsyncRequests::run() {
+  int slot = acquire_slot();
+  while (slot >= 0) {
+    CHECK_FOR_INTERRUPTS();
+    if (run_next()) {
+      continue;
+    }
+    release_slot(slot);
+    // A request committed after the queue was seen empty may have had its
+    // own worker turned away while this one held the slot
+    slot = queue_empty() ? -1 : acquire_slot();
+  }
+}
+
+} // namespace pg_llm
+
+void pg_llm_async_main(Datum main_arg) {
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+  // As the bootstrap superuser; every request switches to its submitter
+  BackgroundWorkerInitializeConnectionByOid(DatumGetObjectId(main_arg), InvalidOid, 0);
+  pg_llm::AsyncRequests::get_instance().run();
+}
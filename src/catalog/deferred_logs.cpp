@@ -0,0 +1,418 @@
+#include "catalog/deferred_logs.h"
+
+extern "C" {
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+}
+
+#include <algorithm>
+
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm deferred logs";
+
+// Rows a leader's workers may leave in the shared area before later ones
+// are dropped; they are only freed when the leader's transaction ends
+constexpr uint64 kMaxPendingBytes = 64 * 1024 * 1024;
+
+struct LeaderEntry {
+  int32 leader_pid;  // Key
+  dsa_pointer head;  // DeferredRecord list in arrival order
+  dsa_pointer tail;
+  uint64 bytes;
+  uint64 dropped;
+};
+
+struct DeferredRecord {
+  dsa_pointer next;
+  uint32 length;
+  char data[FLEXIBLE_ARRAY_MEMBER];  // Serialized row
+};
+
+struct DeferredLogsShared {
+  dshash_table_handle table_handle;
+};
+
+DeferredLogsShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<DeferredLogsShared*>(ptr);
+  if (found) {
+    return;
+  }
+  shared->table_handle = InvalidDsaPointer;
+}
+
+dshash_parameters table_params() {
+  dshash_parameters params;
+  params.key_size = sizeof(int32);
+  params.entry_size = sizeof(LeaderEntry);
+  params.compare_function = dshash_memcmp;
+  params.hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+  params.copy_function = dshash_memcpy;
+#endif
+  params.tranche_id = 0;  // Assigned by pg_llm_shared_hash
+  return params;
+}
+
+void ensure_spi_ok(int code, int expected, const char* message) {
+  if (code != expected) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("%s: %s", message, SPI_result_code_string(code))));
+  }
+}
+
+Datum text_array_datum(const std::vector<std::string>& values) {
+  std::vector<Datum> elements;
+  elements.reserve(values.size());
+  for (const auto& value : values) {
+    elements.push_back(CStringGetTextDatum(value.c_str()));
+  }
+  return PointerGetDatum(
+    construct_array(elements.data(), static_cast<int>(elements.size()), TEXTOID, -1, false, 'i'));
+}
+
+ExecutorStart_hook_type prev_executor_start = nullptr;
+ExecutorEnd_hook_type prev_executor_end = nullptr;
+
+// A plan this backend runs as the leader of parallel workers
+bool leads_workers(QueryDesc* query_desc) {
+  return !IsParallelWorker() && query_desc->plannedstmt != nullptr &&
+         query_desc->plannedstmt->parallelModeNeeded;
+}
+
+#if PG_VERSION_NUM >= 180000
+bool executor_start(QueryDesc* query_desc, int eflags) {
+  if (leads_workers(query_desc)) {
+    DeferredLogs::get_instance().enter_parallel();
+  }
+  return prev_executor_start ? prev_executor_start(query_desc, eflags)
+                             : standard_ExecutorStart(query_desc, eflags);
+}
+#else
+void executor_start(QueryDesc* query_desc, int eflags) {
+  if (leads_workers(query_desc)) {
+    DeferredLogs::get_instance().enter_parallel();
+  }
+  if (prev_executor_start) {
+    prev_executor_start(query_desc, eflags);
+  } else {
+    standard_ExecutorStart(query_desc, eflags);
+  }
+}
+#endif
+
+void executor_end(QueryDesc* query_desc) {
+  bool parallel = leads_workers(query_desc);
+  if (prev_executor_end) {
+    prev_executor_end(query_desc);
+  } else {
+    standard_ExecutorEnd(query_desc);
+  }
+  // The workers have exited; their rows belong to the current subtransaction
+  if (parallel) {
+    DeferredLogs::get_instance().collect_shared();
+  }
+}
+
+void subxact_callback(SubXactEvent event, SubTransactionId my_subid, SubTransactionId parent_subid, void* arg) {
+  if (event == SUBXACT_EVENT_ABORT_SUB) {
+    DeferredLogs::get_instance().end_subtransaction(my_subid, InvalidSubTransactionId);
+  } else if (event == SUBXACT_EVENT_COMMIT_SUB) {
+    DeferredLogs::get_instance().end_subtransaction(my_subid, parent_subid);
+  }
+}
+
+void xact_callback(XactEvent event, void* arg) {
+  switch (event) {
+    case XACT_EVENT_PRE_COMMIT:
+    case XACT_EVENT_PRE_PREPARE:
+      DeferredLogs::get_instance().end_transaction(true);
+      break;
+    case XACT_EVENT_ABORT:
+      DeferredLogs::get_instance().end_transaction(false);
+      break;
+    default:
+      break;
+  }
+}
+
+}  // namespace
+
+DeferredLogs& DeferredLogs::get_instance() {
+  static DeferredLogs instance;
+  return instance;
+}
+
+void DeferredLogs::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(DeferredLogsShared), init_shared);
+}
+
+void DeferredLogs::register_callbacks() {
+  if (callbacks_registered_) {
+    return;
+  }
+  RegisterXactCallback(xact_callback, nullptr);
+  RegisterSubXactCallback(subxact_callback, nullptr);
+  prev_executor_start = ExecutorStart_hook;
+  ExecutorStart_hook = executor_start;
+  prev_executor_end = ExecutorEnd_hook;
+  ExecutorEnd_hook = executor_end;
+  callbacks_registered_ = true;
+}
+
+bool DeferredLogs::active() {
+  return IsInParallelMode();
+}
+
+bool DeferredLogs::attach() {
+  if (table_ != nullptr) {
+    return true;
+  }
+  if (shared == nullptr) {
+    return false;
+  }
+  dshash_parameters params = table_params();
+  table_ = pg_llm_shared_hash(&params, &shared->table_handle);
+  return table_ != nullptr;
+}
+
+void DeferredLogs::add(const AuditRecord& record) {
+  Json::Value row(Json::objectValue);
+  row["log"] = "audit";
+  row["request_id"] = record.request_id;
+  row["event_type"] = record.event_type;
+  row["instance_name"] = record.instance_name;
+  row["session_id"] = record.session_id;
+  row["success"] = record.success;
+  row["confidence_score"] = record.confidence_score;
+  row["metadata"] = record.metadata;
+  add_payload(pg_llm_write_json(row));
+}
+
+void DeferredLogs::add(const TraceRecord& record) {
+  Json::Value row(Json::objectValue);
+  row["log"] = "trace";
+  row["request_id"] = record.request_id;
+  row["stage"] = record.stage;
+  row["details"] = record.details;
+  add_payload(pg_llm_write_json(row));
+}
+
+void DeferredLogs::add_payload(const std::string& payload) {
+  if (!IsParallelWorker()) {
+    local_.push_back(PendingRow{GetCurrentSubTransactionId(), payload});
+    return;
+  }
+  // The call itself succeeds; only its rows have nowhere to go
+  if (!attach()) {
+    if (!warned_) {
+      warned_ = true;
+      ereport(WARNING,
+              (errmsg("audit and trace rows of pg_llm calls in parallel workers are not written"),
+               errhint("Add pg_llm to shared_preload_libraries to log them.")));
+    }
+    return;
+  }
+  push_shared(payload);
+}
+
+void DeferredLogs::enter_parallel() {
+  shared_used_ = true;
+}
+
+void DeferredLogs::collect_shared() {
+  std::vector<std::string> payloads;
+  dropped_ += take_shared(&payloads);
+  SubTransactionId subid = GetCurrentSubTransactionId();
+  for (auto& payload : payloads) {
+    local_.push_back(PendingRow{subid, std::move(payload)});
+  }
+}
+
+void DeferredLogs::end_subtransaction(SubTransactionId subid, SubTransactionId parent_subid) {
+  if (parent_subid != InvalidSubTransactionId) {
+    for (auto& row : local_) {
+      if (row.subid >= subid) {
+        row.subid = parent_subid;
+      }
+    }
+    return;
+  }
+  // Rows of the aborted subtransaction and of the ones nested in it, which
+  // have higher ids; worker rows still shared come from a parallel query
+  // that failed inside it
+  local_.erase(std::remove_if(local_.begin(), local_.end(),
+                              [subid](const PendingRow& row) { return row.subid >= subid; }),
+               local_.end());
+  if (shared_used_) {
+    take_shared(nullptr);
+  }
+}
+
+void DeferredLogs::push_shared(const std::string& payload) {
+  dsa_area* area = pg_llm_shared_area();
+  int32 leader_pid = ParallelLeaderPid;
+  Size size = offsetof(DeferredRecord, data) + payload.size();
+
+  bool found = false;
+  auto* entry = static_cast<LeaderEntry*>(dshash_find_or_insert(table_, &leader_pid, &found));
+  if (!found) {
+    entry->head = InvalidDsaPointer;
+    entry->tail = InvalidDsaPointer;
+    entry->bytes = 0;
+    entry->dropped = 0;
+  }
+
+  dsa_pointer pointer = InvalidDsaPointer;
+  if (entry->bytes + size <= kMaxPendingBytes) {
+    pointer = dsa_allocate_extended(area, size, DSA_ALLOC_NO_OOM);
+  }
+  if (!DsaPointerIsValid(pointer)) {
+    entry->dropped++;
+    dshash_release_lock(table_, entry);
+    return;
+  }
+
+  auto* record = static_cast<DeferredRecord*>(dsa_get_address(area, pointer));
+  record->next = InvalidDsaPointer;
+  record->length = static_cast<uint32>(payload.size());
+  memcpy(record->data, payload.data(), payload.size());
+  if (DsaPointerIsValid(entry->tail)) {
+    static_cast<DeferredRecord*>(dsa_get_address(area, entry->tail))->next = pointer;
+  } else {
+    entry->head = pointer;
+  }
+  entry->tail = pointer;
+  entry->bytes += size;
+  dshash_release_lock(table_, entry);
+}
+
+uint64_t DeferredLogs::take_shared(std::vector<std::string>* payloads) {
+  if (!attach()) {
+    return 0;
+  }
+
+  int32 leader_pid = MyProcPid;
+  auto* entry = static_cast<LeaderEntry*>(dshash_find(table_, &leader_pid, true));
+  if (entry == nullptr) {
+    return 0;
+  }
+  dsa_pointer pointer = entry->head;
+  uint64_t dropped = entry->dropped;
+  dshash_delete_entry(table_, entry);
+
+  dsa_area* area = pg_llm_shared_area();
+  while (DsaPointerIsValid(pointer)) {
+    auto* record = static_cast<DeferredRecord*>(dsa_get_address(area, pointer));
+    dsa_pointer next = record->next;
+    if (payloads != nullptr) {
+      payloads->emplace_back(record->data, record->length);
+    }
+    dsa_free(area, pointer);
+    pointer = next;
+  }
+  return dropped;
+}
+
+void DeferredLogs::end_transaction(bool committed) {
+  std::vector<PendingRow> rows;
+  rows.swap(local_);
+  uint64_t dropped = dropped_;
+  dropped_ = 0;
+  std::vector<std::string> payloads;
+  if (committed) {
+    payloads.reserve(rows.size());
+    for (auto& row : rows) {
+      payloads.push_back(std::move(row.payload));
+    }
+  }
+  // Drained whenever this transaction led workers, even if no row reached
+  // the leader, so nothing stays behind in shared memory
+  if (shared_used_) {
+    dropped += take_shared(committed ? &payloads : nullptr);
+    shared_used_ = false;
+  }
+  if (!committed) {
+    return;
+  }
+  if (dropped > 0) {
+    PG_LLM_LOG_WARNING("%llu audit and trace rows of pg_llm calls in parallel workers were dropped",
+                       static_cast<unsigned long long>(dropped));
+  }
+  if (!payloads.empty()) {
+    insert(payloads);
+  }
+}
+
+void DeferredLogs::insert(const std::vector<std::string>& payloads) {
+  std::vector<std::string> audit_ids, event_types, instance_names, session_ids, metadata;
+  std::vector<Datum> successes, scores;
+  std::vector<std::string> trace_ids, stages, details;
+  for (const auto& payload : payloads) {
+    Json::Value row = pg_llm_parse_json(payload);
+    if (row["log"].asString() == "audit") {
+      audit_ids.push_back(row["request_id"].asString());
+      event_types.push_back(row["event_type"].asString());
+      instance_names.push_back(row["instance_name"].asString());
+      session_ids.push_back(row["session_id"].asString());
+      successes.push_back(BoolGetDatum(row["success"].asBool()));
+      scores.push_back(Float8GetDatum(row["confidence_score"].asDouble()));
+      metadata.push_back(row["metadata"].asString());
+    } else {
+      trace_ids.push_back(row["request_id"].asString());
+      stages.push_back(row["stage"].asString());
+      details.push_back(row["details"].asString());
+    }
+  }
+
+  SPI_connect();
+  if (!audit_ids.empty()) {
+    int count = static_cast<int>(audit_ids.size());
+    const char* sql =
+      "INSERT INTO _pg_llm_catalog.pg_llm_audit_log "
+      "(request_id, event_type, instance_name, session_id, success, confidence_score, metadata) "
+      "SELECT r::uuid, e, i, s, ok, c, m::jsonb "
+      "FROM unnest($1::text[], $2::text[], $3::text[], $4::text[], $5::boolean[], $6::float8[], $7::text[]) "
+      "AS t(r, e, i, s, ok, c, m)";
+    Oid argtypes[7] = {TEXTARRAYOID, TEXTARRAYOID, TEXTARRAYOID, TEXTARRAYOID,
+                       BOOLARRAYOID, FLOAT8ARRAYOID, TEXTARRAYOID};
+    Datum values[7] = {
+      text_array_datum(audit_ids),
+      text_array_datum(event_types),
+      text_array_datum(instance_names),
+      text_array_datum(session_ids),
+      PointerGetDatum(construct_array(successes.data(), count, BOOLOID, 1, true, 'c')),
+      PointerGetDatum(construct_array(scores.data(), count, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd')),
+      text_array_datum(metadata)};
+    char nulls[7] = {' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    int ret = SPI_execute_with_args(sql, 7, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_INSERT, "failed to persist deferred audit log");
+  }
+  if (!trace_ids.empty()) {
+    const char* sql =
+      "INSERT INTO _pg_llm_catalog.pg_llm_trace_log (request_id, stage, details) "
+      "SELECT r::uuid, s, d::jsonb FROM unnest($1::text[], $2::text[], $3::text[]) AS t(r, s, d)";
+    Oid argtypes[3] = {TEXTARRAYOID, TEXTARRAYOID, TEXTARRAYOID};
+    Datum values[3] = {text_array_datum(trace_ids), text_array_datum(stages), text_array_datum(details)};
+    char nulls[3] = {' ', ' ', ' '};
+    int ret = SPI_execute_with_args(sql, 3, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_INSERT, "failed to persist deferred trace log");
+  }
+  SPI_finish();
+}
+
+} // namespace pg_llm
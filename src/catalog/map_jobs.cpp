@@ -0,0 +1,671 @@
+#include "catalog/map_jobs.h"
+
+extern "C" {
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/procarray.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+PGDLLEXPORT void pg_llm_map_main(Datum main_arg);
+}
+
+#include <algorithm>
+#include <exception>
+#include <optional>
+
+#include "models/model_manager.h"
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+// Rows per transaction and checkpoint
+constexpr int kDefaultBatchSize = 100;
+constexpr int kMaxBatchSize = 10000;
+
+// Source rows read and stored per round trip when a job first runs
+constexpr int kMaterializeChunk = 1000;
+
+// Requests in flight at once, as for pg_llm_chat_batch
+constexpr int kDefaultMapConcurrency = 8;
+constexpr int kMaxMapConcurrency = 64;
+
+// Literal text of a prompt template, or one of its {{column}} placeholders
+struct TemplatePart {
+  std::string text;
+  int column = -1;  // Placeholder column number, -1 for literal text
+};
+
+void ensure_spi_ok(int code, int expected, const char* message) {
+  if (code != expected) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("%s: %s", message, SPI_result_code_string(code))));
+  }
+}
+
+Datum text_datum(const std::string& value) {
+  return CStringGetTextDatum(value.c_str());
+}
+
+Datum text_array_datum(const std::vector<std::string>& values) {
+  std::vector<Datum> elements;
+  elements.reserve(values.size());
+  for (const auto& value : values) {
+    elements.push_back(text_datum(value));
+  }
+  return PointerGetDatum(
+    construct_array(elements.data(), static_cast<int>(elements.size()), TEXTOID, -1, false, 'i'));
+}
+
+Datum float8_array_datum(const std::vector<double>& values) {
+  std::vector<Datum> elements;
+  elements.reserve(values.size());
+  for (double value : values) {
+    elements.push_back(Float8GetDatum(value));
+  }
+  return PointerGetDatum(construct_array(elements.data(),
+                                         static_cast<int>(elements.size()),
+                                         FLOAT8OID,
+                                         sizeof(float8),
+                                         FLOAT8PASSBYVAL,
+                                         'd'));
+}
+
+std::string trim(const std::string& value) {
+  size_t begin = value.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  size_t end = value.find_last_not_of(" \t");
+  return value.substr(begin, end - begin + 1);
+}
+
+// Split a template into literal text and {{column}} placeholders, which
+// must name columns of the source
+std::vector<TemplatePart> parse_template(const std::string& prompt_template, TupleDesc tupdesc) {
+  std::vector<TemplatePart> parts;
+  size_t pos = 0;
+  while (pos < prompt_template.size()) {
+    size_t open = prompt_template.find("{{", pos);
+    size_t close = open == std::string::npos ? open : prompt_template.find("}}", open + 2);
+    if (close == std::string::npos) {
+      parts.push_back(TemplatePart{prompt_template.substr(pos), -1});
+      break;
+    }
+    if (open > pos) {
+      parts.push_back(TemplatePart{prompt_template.substr(pos, open - pos), -1});
+    }
+    std::string name = trim(prompt_template.substr(open + 2, close - open - 2));
+    int column = SPI_fnumber(tupdesc, name.c_str());
+    if (column <= 0) {
+      ereport(ERROR,
+              (errcode(ERRCODE_UNDEFINED_COLUMN),
+               errmsg("prompt template refers to unknown column \"%s\"", name.c_str()),
+               errhint("Placeholders name columns of the source query, as in {{%s}}.",
+                       NameStr(TupleDescAttr(tupdesc, 0)->attname))));
+    }
+    parts.push_back(TemplatePart{name, column});
+    pos = close + 2;
+  }
+  return parts;
+}
+
+std::string render_prompt(const std::vector<TemplatePart>& parts, HeapTuple tuple, TupleDesc tupdesc) {
+  std::string prompt;
+  for (const auto& part : parts) {
+    if (part.column < 0) {
+      prompt += part.text;
+      continue;
+    }
+    char* value = SPI_getvalue(tuple, tupdesc, part.column);
+    if (value != nullptr) {
+      prompt += value;
+    }
+  }
+  return prompt;
+}
+
+// Upsert of one batch of replies; the arrays are keys, responses, scores
+// and errors, an empty response or error standing for NULL
+std::string insert_sql(const std::string& target_table) {
+  return "INSERT INTO " + target_table +
+         " (source_key, response, confidence_score, error, job_id) "
+         "SELECT k, NULLIF(r, ''), c, NULLIF(e, ''), $5::uuid "
+         "FROM unnest($1::text[], $2::text[], $3::float8[], $4::text[]) AS u(k, r, c, e) "
+         "ON CONFLICT (source_key) DO UPDATE SET "
+         "response = EXCLUDED.response, confidence_score = EXCLUDED.confidence_score, "
+         "error = EXCLUDED.error, job_id = EXCLUDED.job_id";
+}
+
+void xact_callback(XactEvent event, void* arg) {
+  switch (event) {
+    case XACT_EVENT_COMMIT:
+      MapJobs::get_instance().end_transaction(true);
+      break;
+    case XACT_EVENT_ABORT:
+      MapJobs::get_instance().end_transaction(false);
+      break;
+    case XACT_EVENT_PRE_PREPARE:
+      MapJobs::get_instance().prepare_transaction();
+      break;
+    default:
+      break;
+  }
+}
+
+// Worker side: run fn in a transaction of its own with SPI connected
+template <typename Fn>
+void in_transaction(Fn&& fn) {
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  SPI_connect();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  fn();
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+}
+
+bool start_worker(const std::string& job_id) {
+  BackgroundWorker worker;
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+  worker.bgw_restart_time = BGW_NEVER_RESTART;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_llm");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_llm_map_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "pg_llm map job %s", job_id.c_str());
+  snprintf(worker.bgw_type, BGW_MAXLEN, "pg_llm map job");
+  snprintf(worker.bgw_extra, BGW_EXTRALEN, "%s", job_id.c_str());
+  worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+  worker.bgw_notify_pid = 0;
+  return RegisterDynamicBackgroundWorker(&worker, nullptr);
+}
+
+}  // namespace
+
+struct MapJobs::Job {
+  std::string job_id;
+  std::string instance_name;
+  std::string source_query;
+  std::string prompt_template;
+  std::string target_table;  // Quoted, possibly schema-qualified
+  std::string key_column;    // Quoted name of the source's first column
+  bool materialized = false; // Source rows stored in pg_llm_map_rows
+  int64 rows_done = 0;       // Checkpoint; the next batch starts after this row
+  int batch_size = kDefaultBatchSize;
+  int max_concurrency = kDefaultMapConcurrency;
+  Oid role = InvalidOid;     // Submitter; the job runs with its privileges
+};
+
+MapJobs& MapJobs::get_instance() {
+  static MapJobs instance;
+  return instance;
+}
+
+std::string MapJobs::submit(const std::string& source_query,
+                            const std::string& instance_name,
+                            const std::string& prompt_template,
+                            const std::string& target_table,
+                            const Json::Value& options) {
+  int batch_size = options.get("batch_size", kDefaultBatchSize).asInt();
+  if (batch_size < 1 || batch_size > kMaxBatchSize) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("batch_size must be between 1 and %d", kMaxBatchSize)));
+  }
+
+  SPI_connect();
+  Oid argtypes[1] = {TEXTOID};
+  char nulls[9] = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+
+  Datum target_arg[1] = {text_datum(target_table)};
+  int ret = SPI_execute_with_args(
+    "SELECT string_agg(quote_ident(part), '.' ORDER BY n) "
+    "FROM unnest(parse_ident($1)) WITH ORDINALITY AS t(part, n)",
+    1, argtypes, target_arg, nulls, true, 1);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to parse target table name");
+  std::string target = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+  // The first column keys the rows: the job reads them ordered by it and
+  // the target is upserted on it. Its keys are checked when the job first
+  // reads the source, which is the only time the source is run in full.
+  std::string probe = "SELECT * FROM (" + source_query + ") AS pg_llm_source LIMIT 0";
+  ret = SPI_execute(probe.c_str(), true, 0);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to run source query");
+  TupleDesc tupdesc = SPI_tuptable->tupdesc;
+  if (tupdesc->natts == 0) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("source query must return at least one column")));
+  }
+  parse_template(prompt_template, tupdesc);
+  Form_pg_attribute key = TupleDescAttr(tupdesc, 0);
+  std::string key_column = quote_identifier(NameStr(key->attname));
+  std::string key_type = format_type_be(key->atttypid);
+
+  std::string create =
+    "CREATE TABLE IF NOT EXISTS " + target +
+    " (source_key text PRIMARY KEY, response text, confidence_score float8, error text, "
+    "job_id uuid NOT NULL, created_at timestamptz NOT NULL DEFAULT CURRENT_TIMESTAMP)";
+  ret = SPI_execute(create.c_str(), false, 0);
+  ensure_spi_ok(ret, SPI_OK_UTILITY, "failed to create target table");
+
+  // An empty upsert checks the target's columns, key and privileges now
+  // rather than in the worker
+  std::string job_id = pg_llm_generate_uuid();
+  Oid insert_types[5] = {TEXTARRAYOID, TEXTARRAYOID, FLOAT8ARRAYOID, TEXTARRAYOID, TEXTOID};
+  Datum insert_values[5] = {
+    text_array_datum({}), text_array_datum({}), float8_array_datum({}), text_array_datum({}),
+    text_datum(job_id)};
+  ret = SPI_execute_with_args(insert_sql(target).c_str(), 5, insert_types, insert_values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_INSERT, "failed to write to target table");
+
+  const char* sql =
+    "INSERT INTO _pg_llm_catalog.pg_llm_map_jobs "
+    "(job_id, instance_name, source_query, prompt_template, target_table, key_column, "
+    "key_type, options, submitted_by) "
+    "VALUES ($1::uuid, $2, $3, $4, $5, $6, $7, $8::jsonb, $9)";
+  Oid job_types[9] = {TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, OIDOID};
+  Datum job_values[9] = {
+    text_datum(job_id),
+    text_datum(instance_name),
+    text_datum(source_query),
+    text_datum(prompt_template),
+    text_datum(target),
+    text_datum(key_column),
+    text_datum(key_type),
+    text_datum(pg_llm_write_json(options)),
+    ObjectIdGetDatum(GetUserId())};
+  ret = SPI_execute_with_args(sql, 9, job_types, job_values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_INSERT, "failed to queue pg_llm map job");
+  SPI_finish();
+
+  queue(job_id);
+  return job_id;
+}
+
+bool MapJobs::cancel(const std::string& job_id) {
+  SPI_connect();
+  const char* sql =
+    "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+    "SET status = 'canceled', finished_at = CURRENT_TIMESTAMP, updated_at = CURRENT_TIMESTAMP "
+    "WHERE job_id = $1::uuid AND status IN ('queued', 'running')";
+  Oid argtypes[1] = {TEXTOID};
+  Datum values[1] = {text_datum(job_id)};
+  char nulls[1] = {' '};
+  int ret = SPI_execute_with_args(sql, 1, argtypes, values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to cancel pg_llm map job");
+  bool canceled = SPI_processed > 0;
+  SPI_finish();
+  return canceled;
+}
+
+bool MapJobs::resume(const std::string& job_id) {
+  SPI_connect();
+  Oid argtypes[1] = {TEXTOID};
+  Datum values[1] = {text_datum(job_id)};
+  char nulls[1] = {' '};
+  int ret = SPI_execute_with_args(
+    "SELECT status, worker_pid FROM _pg_llm_catalog.pg_llm_map_jobs "
+    "WHERE job_id = $1::uuid FOR UPDATE",
+    1, argtypes, values, nulls, false, 1);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to read pg_llm map job");
+  if (SPI_processed == 0) {
+    SPI_finish();
+    ereport(ERROR,
+            (errcode(ERRCODE_UNDEFINED_OBJECT),
+             errmsg("pg_llm map job \"%s\" does not exist", job_id.c_str())));
+  }
+
+  std::string status = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+  bool isnull = true;
+  Datum pid = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull);
+  // A queued job may have had no worker start for it; two claiming it is harmless
+  bool resumable = status == "failed" || status == "canceled" || status == "queued" ||
+                   (status == "running" && (isnull || BackendPidGetProc(DatumGetInt32(pid)) == nullptr));
+  if (resumable) {
+    ret = SPI_execute_with_args(
+      "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+      "SET status = 'queued', error = NULL, worker_pid = NULL, finished_at = NULL, "
+      "updated_at = CURRENT_TIMESTAMP WHERE job_id = $1::uuid",
+      1, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to resume pg_llm map job");
+  }
+  SPI_finish();
+
+  if (resumable) {
+    queue(job_id);
+  }
+  return resumable;
+}
+
+void MapJobs::queue(const std::string& job_id) {
+  if (!callback_registered_) {
+    RegisterXactCallback(xact_callback, nullptr);
+    callback_registered_ = true;
+  }
+  pending_.push_back(job_id);
+}
+
+void MapJobs::end_transaction(bool committed) {
+  if (pending_.empty()) {
+    return;
+  }
+  std::vector<std::string> jobs;
+  jobs.swap(pending_);
+  if (!committed) {
+    return;
+  }
+  for (const auto& job_id : jobs) {
+    if (!start_worker(job_id)) {
+      PG_LLM_LOG_WARNING("could not start a worker for pg_llm map job %s; resume it with "
+                         "pg_llm_resume_job (consider raising max_worker_processes)",
+                         job_id.c_str());
+    }
+  }
+}
+
+void MapJobs::prepare_transaction() {
+  if (!pending_.empty()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("cannot PREPARE a transaction that queued pg_llm map jobs")));
+  }
+}
+
+void MapJobs::materialize(Job* job) {
+  Oid saved_user = InvalidOid;
+  int saved_context = 0;
+  GetUserIdAndSecContext(&saved_user, &saved_context);
+  char nulls[4] = {' ', ' ', ' ', ' '};
+
+  // One sorted pass over the source: repeated keys end up next to each
+  // other and NULL keys last
+  std::string sql = "SELECT * FROM (" + job->source_query + ") AS pg_llm_source ORDER BY " + job->key_column;
+  SetUserIdAndSecContext(job->role, saved_context | SECURITY_LOCAL_USERID_CHANGE);
+  Portal portal = SPI_cursor_open_with_args(nullptr, sql.c_str(), 0, nullptr, nullptr, nullptr, true, 0);
+  std::vector<TemplatePart> parts;
+  bool parsed = false;
+  std::optional<std::string> previous;
+  int64 rows = 0;
+  int64 skipped = 0;
+  while (true) {
+    CHECK_FOR_INTERRUPTS();
+    // The source and its functions run as the submitting role
+    SetUserIdAndSecContext(job->role, saved_context | SECURITY_LOCAL_USERID_CHANGE);
+    SPI_cursor_fetch(portal, true, kMaterializeChunk);
+    if (SPI_processed == 0) {
+      SetUserIdAndSecContext(saved_user, saved_context);
+      break;
+    }
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    if (!parsed) {
+      parts = parse_template(job->prompt_template, tupdesc);
+      parsed = true;
+    }
+    std::vector<std::string> keys;
+    std::vector<std::string> prompts;
+    for (uint64 i = 0; i < SPI_processed; ++i) {
+      HeapTuple tuple = SPI_tuptable->vals[i];
+      char* key = SPI_getvalue(tuple, tupdesc, 1);
+      if (key == nullptr) {
+        skipped++;
+        continue;
+      }
+      if (previous && *previous == key) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNIQUE_VIOLATION),
+                 errmsg("first column %s of the source query is not unique: %s appears more than once",
+                        job->key_column.c_str(),
+                        key)));
+      }
+      previous = key;
+      keys.push_back(key);
+      prompts.push_back(render_prompt(parts, tuple, tupdesc));
+    }
+    SPI_freetuptable(SPI_tuptable);
+    SetUserIdAndSecContext(saved_user, saved_context);
+
+    if (!keys.empty()) {
+      Oid row_types[4] = {TEXTOID, INT8OID, TEXTARRAYOID, TEXTARRAYOID};
+      Datum row_values[4] = {
+        text_datum(job->job_id), Int64GetDatum(rows), text_array_datum(keys), text_array_datum(prompts)};
+      int ret = SPI_execute_with_args(
+        "INSERT INTO _pg_llm_catalog.pg_llm_map_rows (job_id, seq, source_key, prompt) "
+        "SELECT $1::uuid, $2 + n, k, p FROM unnest($3::text[], $4::text[]) WITH ORDINALITY AS u(k, p, n)",
+        4, row_types, row_values, nulls, false, 0);
+      ensure_spi_ok(ret, SPI_OK_INSERT, "failed to store pg_llm map rows");
+      rows += static_cast<int64>(keys.size());
+    }
+  }
+  SPI_cursor_close(portal);
+
+  Oid job_types[3] = {TEXTOID, INT8OID, INT8OID};
+  Datum job_values[3] = {text_datum(job->job_id), Int64GetDatum(rows), Int64GetDatum(skipped)};
+  int ret = SPI_execute_with_args(
+    "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+    "SET rows_total = $2, rows_skipped = $3, updated_at = clock_timestamp() WHERE job_id = $1::uuid",
+    3, job_types, job_values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to record pg_llm map rows");
+  job->materialized = true;
+}
+
+bool MapJobs::process_batch(Job* job) {
+  Oid argtypes[4] = {TEXTOID, INT8OID, INT8OID, INT8OID};
+  Datum values[4] = {text_datum(job->job_id), Int64GetDatum(job->rows_done), Int64GetDatum(job->batch_size), 0};
+  char nulls[5] = {' ', ' ', ' ', ' ', ' '};
+
+  // Rows are numbered from 1 in key order, so the rows done so far are
+  // also the position of the checkpoint
+  int ret = SPI_execute_with_args(
+    "SELECT source_key, prompt FROM _pg_llm_catalog.pg_llm_map_rows "
+    "WHERE job_id = $1::uuid AND seq > $2 ORDER BY seq LIMIT $3",
+    3, argtypes, values, nulls, true, 0);
+  ensure_spi_ok(ret, SPI_OK_SELECT, "failed to read pg_llm map rows");
+  std::vector<std::string> keys;
+  std::vector<std::vector<ChatMessage>> requests;
+  for (uint64 i = 0; i < SPI_processed; ++i) {
+    HeapTuple tuple = SPI_tuptable->vals[i];
+    keys.push_back(SPI_getvalue(tuple, SPI_tuptable->tupdesc, 1));
+    requests.push_back({{"user", SPI_getvalue(tuple, SPI_tuptable->tupdesc, 2)}});
+  }
+
+  if (keys.empty()) {
+    ret = SPI_execute_with_args(
+      "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+      "SET status = 'succeeded', finished_at = clock_timestamp(), updated_at = clock_timestamp() "
+      "WHERE job_id = $1::uuid AND status = 'running'",
+      1, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to finish pg_llm map job");
+    ret = SPI_execute_with_args(
+      "DELETE FROM _pg_llm_catalog.pg_llm_map_rows WHERE job_id = $1::uuid",
+      1, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_DELETE, "failed to remove pg_llm map rows");
+    return false;
+  }
+
+  std::vector<BatchResult> results;
+  std::string failure;
+  try {
+    results = ModelManager::get_instance().batch_inference(
+      job->instance_name, requests, static_cast<size_t>(job->max_concurrency));
+  } catch (const std::exception& e) {
+    failure = e.what();
+  }
+  if (!failure.empty()) {
+    ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION), errmsg("%s", failure.c_str())));
+  }
+
+  std::vector<std::string> responses;
+  std::vector<double> scores;
+  std::vector<std::string> errors;
+  int64 failed = 0;
+  for (const auto& result : results) {
+    responses.push_back(result.error.empty() ? result.response.response : "");
+    scores.push_back(result.response.confidence_score);
+    errors.push_back(result.error);
+    failed += result.error.empty() ? 0 : 1;
+  }
+  Oid saved_user = InvalidOid;
+  int saved_context = 0;
+  GetUserIdAndSecContext(&saved_user, &saved_context);
+  SetUserIdAndSecContext(job->role, saved_context | SECURITY_LOCAL_USERID_CHANGE);
+  Oid insert_types[5] = {TEXTARRAYOID, TEXTARRAYOID, FLOAT8ARRAYOID, TEXTARRAYOID, TEXTOID};
+  Datum insert_values[5] = {
+    text_array_datum(keys), text_array_datum(responses), float8_array_datum(scores),
+    text_array_datum(errors), text_datum(job->job_id)};
+  ret = SPI_execute_with_args(
+    insert_sql(job->target_table).c_str(), 5, insert_types, insert_values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_INSERT, "failed to write pg_llm map results");
+  SetUserIdAndSecContext(saved_user, saved_context);
+
+  // Checkpoint in the transaction that wrote the batch
+  Oid checkpoint_types[4] = {TEXTOID, TEXTOID, INT8OID, INT8OID};
+  Datum checkpoint_values[4] = {
+    values[0], text_datum(keys.back()), Int64GetDatum(static_cast<int64>(keys.size())), Int64GetDatum(failed)};
+  ret = SPI_execute_with_args(
+    "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+    "SET last_key = $2, rows_done = rows_done + $3, rows_failed = rows_failed + $4, "
+    "batches = batches + 1, updated_at = clock_timestamp() WHERE job_id = $1::uuid",
+    4, checkpoint_types, checkpoint_values, nulls, false, 0);
+  ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to checkpoint pg_llm map job");
+  job->rows_done += static_cast<int64>(keys.size());
+  return true;
+}
+
+bool MapJobs::run_batch(Job* job) {
+  volatile bool more = false;
+  std::string error;
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  MemoryContext xact_context = CurrentMemoryContext;
+  PushActiveSnapshot(GetTransactionSnapshot());
+  pgstat_report_activity(STATE_RUNNING, "pg_llm map batch");
+  PG_TRY();
+  {
+    SPI_connect();
+    Oid argtypes[1] = {TEXTOID};
+    Datum values[1] = {text_datum(job->job_id)};
+    char nulls[1] = {' '};
+
+    // Canceled meanwhile: stop without touching the row
+    int ret = SPI_execute_with_args(
+      "SELECT status FROM _pg_llm_catalog.pg_llm_map_jobs WHERE job_id = $1::uuid",
+      1, argtypes, values, nulls, true, 1);
+    ensure_spi_ok(ret, SPI_OK_SELECT, "failed to read pg_llm map job");
+    bool running = SPI_processed > 0 &&
+      std::string(SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1)) == "running";
+
+    if (running) {
+      if (!job->materialized) {
+        // A transaction of its own; batches start with the next call
+        materialize(job);
+        more = true;
+      } else {
+        more = process_batch(job);
+      }
+    }
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(xact_context);
+    ErrorData* edata = CopyErrorData();
+    FlushErrorState();
+    error = edata->message != nullptr ? edata->message : "unknown error";
+    FreeErrorData(edata);
+    AbortCurrentTransaction();
+  }
+  PG_END_TRY();
+  pgstat_report_activity(STATE_IDLE, nullptr);
+
+  if (!error.empty()) {
+    // The checkpoint stays at the last committed batch
+    in_transaction([&] {
+      Oid argtypes[2] = {TEXTOID, TEXTOID};
+      Datum values[2] = {text_datum(job->job_id), text_datum(error)};
+      char nulls[2] = {' ', ' '};
+      int ret = SPI_execute_with_args(
+        "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+        "SET status = 'failed', error = $2, finished_at = clock_timestamp(), "
+        "updated_at = clock_timestamp() WHERE job_id = $1::uuid AND status = 'running'",
+        2, argtypes, values, nulls, false, 0);
+      ensure_spi_ok(ret, SPI_OK_UPDATE, "failed to record pg_llm map job error");
+    });
+    return false;
+  }
+  return more;
+}
+
+void MapJobs::run(const std::string& job_id) {
+  Job job;
+  bool claimed = false;
+  in_transaction([&] {
+    const char* sql =
+      "UPDATE _pg_llm_catalog.pg_llm_map_jobs "
+      "SET status = 'running', worker_pid = $2, "
+      "started_at = COALESCE(started_at, clock_timestamp()), updated_at = clock_timestamp() "
+      "WHERE job_id = $1::uuid AND status = 'queued' "
+      "RETURNING instance_name, source_query, prompt_template, target_table, key_column, "
+      "rows_total IS NOT NULL, rows_done, options::text, submitted_by";
+    Oid argtypes[2] = {TEXTOID, INT4OID};
+    Datum values[2] = {text_datum(job_id), Int32GetDatum(MyProcPid)};
+    char nulls[2] = {' ', ' '};
+    int ret = SPI_execute_with_args(sql, 2, argtypes, values, nulls, false, 0);
+    ensure_spi_ok(ret, SPI_OK_UPDATE_RETURNING, "failed to claim pg_llm map job");
+    if (SPI_processed == 0) {
+      return;
+    }
+    HeapTuple tuple = SPI_tuptable->vals[0];
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    job.job_id = job_id;
+    job.instance_name = SPI_getvalue(tuple, tupdesc, 1);
+    job.source_query = SPI_getvalue(tuple, tupdesc, 2);
+    job.prompt_template = SPI_getvalue(tuple, tupdesc, 3);
+    job.target_table = SPI_getvalue(tuple, tupdesc, 4);
+    job.key_column = SPI_getvalue(tuple, tupdesc, 5);
+    bool isnull = true;
+    job.materialized = DatumGetBool(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+    job.rows_done = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 7, &isnull));
+    Json::Value options = pg_llm_parse_json(SPI_getvalue(tuple, tupdesc, 8));
+    job.batch_size = std::clamp(options.get("batch_size", kDefaultBatchSize).asInt(), 1, kMaxBatchSize);
+    job.max_concurrency =
+      std::clamp(options.get("max_concurrency", kDefaultMapConcurrency).asInt(), 1, kMaxMapConcurrency);
+    job.role = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 9, &isnull));
+    claimed = true;
+  });
+  if (!claimed) {
+    return;
+  }
+
+  PG_LLM_LOG_INFO("pg_llm map job %s started", job_id.c_str());
+  while (run_batch(&job)) {
+    CHECK_FOR_INTERRUPTS();
+  }
+  PG_LLM_LOG_INFO("pg_llm map job %s stopped", job_id.c_str());
+}
+
+} // namespace pg_llm
+
+void pg_llm_map_main(Datum main_arg) {
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+  // As the bootstrap superuser; batches switch to the submitting role
+  BackgroundWorkerInitializeConnectionByOid(DatumGetObjectId(main_arg), InvalidOid, 0);
+  pg_llm::MapJobs::get_instance().run(MyBgworkerEntry->bgw_extra);
+}
@@ -0,0 +1,397 @@
+#include "catalog/model_registry.h"
+
+extern "C" {
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "utils/snapmgr.h"
+}
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm model registry";
+
+// Instances published at once; lookups beyond it read the catalog
+constexpr uint64 kMaxEntries = 4096;
+
+// Bytes of the master key fingerprint kept with encrypted entries
+constexpr size_t kFingerprintSize = 16;
+
+// Catalog generations are kept per database, hashed into this many
+// counters; a change only retires entries of databases sharing its counter
+constexpr int kGenerationBuckets = 64;
+
+struct RegistryEntry {
+  uint8 key[SHA256_DIGEST_LENGTH];  // Of the database OID and instance name
+  uint64 generation;                // Catalog generation the row was read at
+  uint8 fingerprint[kFingerprintSize];  // Master key that decrypted it
+  bool encrypted;                   // Only served to holders of that key
+  dsa_pointer payload;              // Serialized PgLlmModelInfo
+  uint32 payload_size;
+};
+
+struct RegistryShared {
+  dshash_table_handle table_handle;
+  pg_atomic_uint64 generations[kGenerationBuckets];
+  pg_atomic_uint64 entries;
+  pg_atomic_uint64 hits;
+  pg_atomic_uint64 misses;
+};
+
+RegistryShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<RegistryShared*>(ptr);
+  if (found) {
+    return;
+  }
+  shared->table_handle = InvalidDsaPointer;
+  // 0 is reserved for "registry disabled"
+  for (int i = 0; i < kGenerationBuckets; ++i) {
+    pg_atomic_init_u64(&shared->generations[i], 1);
+  }
+  pg_atomic_init_u64(&shared->entries, 0);
+  pg_atomic_init_u64(&shared->hits, 0);
+  pg_atomic_init_u64(&shared->misses, 0);
+}
+
+// Generation counter of the current database
+pg_atomic_uint64* database_generation() {
+  return &shared->generations[MyDatabaseId % kGenerationBuckets];
+}
+
+dshash_parameters table_params() {
+  dshash_parameters params;
+  params.key_size = SHA256_DIGEST_LENGTH;
+  params.entry_size = sizeof(RegistryEntry);
+  params.compare_function = dshash_memcmp;
+  params.hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+  params.copy_function = dshash_memcpy;
+#endif
+  params.tranche_id = 0;  // Assigned by pg_llm_shared_hash
+  return params;
+}
+
+void xact_callback(XactEvent event, void* arg) {
+  switch (event) {
+    case XACT_EVENT_PRE_PREPARE:
+      // The bump would have to wait for COMMIT PREPARED, which runs in
+      // another session without this backend's state
+      if (ModelRegistry::get_instance().changed_in_xact()) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot PREPARE a transaction that has modified pg_llm model instances")));
+      }
+      break;
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+      ModelRegistry::get_instance().end_transaction(true);
+      break;
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+      ModelRegistry::get_instance().end_transaction(false);
+      break;
+    default:
+      break;
+  }
+}
+
+std::string sha256(const std::string& input) {
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(input.data()),
+         input.size(),
+         reinterpret_cast<unsigned char*>(&digest[0]));
+  return digest;
+}
+
+// Same-named instances of different databases are different rows
+std::string entry_key(const std::string& instance_name) {
+  return sha256(std::to_string(MyDatabaseId) + "\n" + instance_name);
+}
+
+// Identifies the session's master key without revealing it; empty when
+// no key is set
+std::string master_key_fingerprint() {
+  if (pg_llm_master_key == nullptr || pg_llm_master_key[0] == '\0') {
+    return std::string();
+  }
+  return sha256(std::string("pg_llm model registry\n") + pg_llm_master_key).substr(0, kFingerprintSize);
+}
+
+void append_field(std::string* payload, const std::string& field) {
+  uint32 length = static_cast<uint32>(field.size());
+  payload->append(reinterpret_cast<const char*>(&length), sizeof(length));
+  payload->append(field);
+}
+
+bool read_field(const char** cursor, const char* end, std::string* field) {
+  uint32 length = 0;
+  if (end - *cursor < static_cast<ptrdiff_t>(sizeof(length))) {
+    return false;
+  }
+  memcpy(&length, *cursor, sizeof(length));
+  *cursor += sizeof(length);
+  if (end - *cursor < static_cast<ptrdiff_t>(length)) {
+    return false;
+  }
+  field->assign(*cursor, length);
+  *cursor += length;
+  return true;
+}
+
+std::string serialize(const PgLlmModelInfo& info) {
+  std::string payload;
+  payload.push_back(info.local_model ? 1 : 0);
+  payload.push_back(info.is_local_fallback ? 1 : 0);
+  payload.append(reinterpret_cast<const char*>(&info.confidence_threshold), sizeof(info.confidence_threshold));
+  append_field(&payload, info.model_type);
+  append_field(&payload, info.instance_name);
+  append_field(&payload, info.api_key);
+  append_field(&payload, info.config);
+  append_field(&payload, info.fallback_instance);
+  append_field(&payload, info.capabilities_json);
+  return payload;
+}
+
+bool deserialize(const char* data, size_t size, PgLlmModelInfo* info) {
+  const char* end = data + size;
+  if (size < 2 + sizeof(info->confidence_threshold)) {
+    return false;
+  }
+  info->local_model = data[0] != 0;
+  info->is_local_fallback = data[1] != 0;
+  memcpy(&info->confidence_threshold, data + 2, sizeof(info->confidence_threshold));
+  const char* cursor = data + 2 + sizeof(info->confidence_threshold);
+  info->encrypted_api_key.clear();
+  info->encrypted_config.clear();
+  return read_field(&cursor, end, &info->model_type) &&
+         read_field(&cursor, end, &info->instance_name) &&
+         read_field(&cursor, end, &info->api_key) &&
+         read_field(&cursor, end, &info->config) &&
+         read_field(&cursor, end, &info->fallback_instance) &&
+         read_field(&cursor, end, &info->capabilities_json);
+}
+
+}  // namespace
+
+ModelRegistry& ModelRegistry::get_instance() {
+  static ModelRegistry instance;
+  return instance;
+}
+
+void ModelRegistry::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(RegistryShared), init_shared);
+}
+
+bool ModelRegistry::enabled() const {
+  return shared != nullptr;
+}
+
+uint64_t ModelRegistry::generation() const {
+  return enabled() ? pg_atomic_read_u64(database_generation()) : 0;
+}
+
+bool ModelRegistry::attach() {
+  if (table_ != nullptr) {
+    return true;
+  }
+  if (!enabled()) {
+    return false;
+  }
+  dshash_parameters params = table_params();
+  table_ = pg_llm_shared_hash(&params, &shared->table_handle);
+  return table_ != nullptr;
+}
+
+bool ModelRegistry::load(const std::string& instance_name,
+                         PgLlmModelInfo* info,
+                         bool* encrypted,
+                         std::string* decrypt_error,
+                         bool latest) {
+  bool found = false;
+  if (latest) {
+    // Newer than the generation read by the caller, whatever snapshot the
+    // statement runs under
+    PushActiveSnapshot(GetLatestSnapshot());
+    PG_TRY();
+    {
+      found = pg_llm_model_get_info(instance_name, info);
+    }
+    PG_CATCH();
+    {
+      PopActiveSnapshot();
+      PG_RE_THROW();
+    }
+    PG_END_TRY();
+    PopActiveSnapshot();
+  } else {
+    found = pg_llm_model_get_info(instance_name, info);
+  }
+  if (!found) {
+    return false;
+  }
+  *encrypted = !info->encrypted_api_key.empty() || !info->encrypted_config.empty();
+  try {
+    if (!info->encrypted_api_key.empty()) {
+      info->api_key = pg_llm_decrypt_text(info->encrypted_api_key);
+    }
+    if (!info->encrypted_config.empty()) {
+      info->config = pg_llm_decrypt_text(info->encrypted_config);
+    }
+  } catch (const std::exception& e) {
+    *decrypt_error = e.what();
+  }
+  info->encrypted_api_key.clear();
+  info->encrypted_config.clear();
+  return true;
+}
+
+bool ModelRegistry::lookup(const std::string& instance_name,
+                           PgLlmModelInfo* info,
+                           std::string* decrypt_error) {
+  decrypt_error->clear();
+  bool encrypted = false;
+  // Inside a transaction that changed the catalog only SPI sees its rows
+  if (changed_in_xact_ || !attach()) {
+    return load(instance_name, info, &encrypted, decrypt_error);
+  }
+
+  std::string key = entry_key(instance_name);
+  std::string fingerprint = master_key_fingerprint();
+  // Read before the catalog, so a change committed meanwhile retires what
+  // is published below
+  uint64 generation = pg_atomic_read_u64(database_generation());
+  auto* entry = static_cast<RegistryEntry*>(dshash_find(table_, key.data(), false));
+  if (entry != nullptr) {
+    bool usable = entry->generation == generation &&
+                  (!entry->encrypted ||
+                   (fingerprint.size() == kFingerprintSize &&
+                    memcmp(entry->fingerprint, fingerprint.data(), kFingerprintSize) == 0));
+    if (usable) {
+      const char* payload = static_cast<const char*>(dsa_get_address(pg_llm_shared_area(), entry->payload));
+      usable = deserialize(payload, entry->payload_size, info) && info->instance_name == instance_name;
+    }
+    dshash_release_lock(table_, entry);
+    if (usable) {
+      pg_atomic_fetch_add_u64(&shared->hits, 1);
+      return true;
+    }
+  }
+  pg_atomic_fetch_add_u64(&shared->misses, 1);
+
+  // A transaction snapshot may predate the generation read above, and a
+  // parallel operation cannot take a newer one: read the row the way the
+  // statement sees it and leave the registry alone
+  if (IsolationUsesXactSnapshot() || IsInParallelMode()) {
+    return load(instance_name, info, &encrypted, decrypt_error);
+  }
+  if (!load(instance_name, info, &encrypted, decrypt_error, true)) {
+    if (entry != nullptr) {
+      forget(key);
+    }
+    return false;
+  }
+  if (decrypt_error->empty()) {
+    publish(key, generation, *info, encrypted ? fingerprint : std::string());
+  }
+  return true;
+}
+
+void ModelRegistry::publish(const std::string& key,
+                            uint64_t generation,
+                            const PgLlmModelInfo& info,
+                            const std::string& fingerprint) {
+  std::string serialized = serialize(info);
+  dsa_area* area = pg_llm_shared_area();
+  dsa_pointer payload = dsa_allocate_extended(area, serialized.size(), DSA_ALLOC_NO_OOM);
+  if (!DsaPointerIsValid(payload)) {
+    PG_LLM_LOG_WARNING("pg_llm model registry: out of shared memory");
+    return;
+  }
+  memcpy(dsa_get_address(area, payload), serialized.data(), serialized.size());
+
+  bool found = false;
+  auto* entry = static_cast<RegistryEntry*>(dshash_find(table_, key.data(), true));
+  if (entry == nullptr) {
+    if (pg_atomic_read_u64(&shared->entries) >= kMaxEntries) {
+      dsa_free(area, payload);
+      return;
+    }
+    entry = static_cast<RegistryEntry*>(dshash_find_or_insert(table_, key.data(), &found));
+  } else {
+    found = true;
+  }
+  if (found) {
+    // Another backend may have published a newer read in the meantime
+    if (entry->generation > generation) {
+      dshash_release_lock(table_, entry);
+      dsa_free(area, payload);
+      return;
+    }
+    dsa_free(area, entry->payload);
+  } else {
+    pg_atomic_fetch_add_u64(&shared->entries, 1);
+  }
+  entry->generation = generation;
+  entry->encrypted = !fingerprint.empty();
+  memset(entry->fingerprint, 0, kFingerprintSize);
+  memcpy(entry->fingerprint, fingerprint.data(), std::min(fingerprint.size(), kFingerprintSize));
+  entry->payload = payload;
+  entry->payload_size = static_cast<uint32>(serialized.size());
+  dshash_release_lock(table_, entry);
+}
+
+void ModelRegistry::forget(const std::string& key) {
+  auto* entry = static_cast<RegistryEntry*>(dshash_find(table_, key.data(), true));
+  if (entry == nullptr) {
+    return;
+  }
+  dsa_free(pg_llm_shared_area(), entry->payload);
+  dshash_delete_entry(table_, entry);
+  pg_atomic_fetch_sub_u64(&shared->entries, 1);
+}
+
+void ModelRegistry::invalidate() {
+  if (!callback_registered_) {
+    RegisterXactCallback(xact_callback, nullptr);
+    callback_registered_ = true;
+  }
+  changed_in_xact_ = true;
+}
+
+void ModelRegistry::end_transaction(bool committed) {
+  if (!changed_in_xact_) {
+    return;
+  }
+  changed_in_xact_ = false;
+  if (committed && enabled()) {
+    pg_atomic_fetch_add_u64(database_generation(), 1);
+  }
+}
+
+ModelRegistryStats ModelRegistry::stats() {
+  ModelRegistryStats stats;
+  stats.enabled = enabled();
+  if (shared == nullptr) {
+    return stats;
+  }
+  stats.generation = pg_atomic_read_u64(database_generation());
+  stats.entries = pg_atomic_read_u64(&shared->entries);
+  stats.hits = pg_atomic_read_u64(&shared->hits);
+  stats.misses = pg_atomic_read_u64(&shared->misses);
+  return stats;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,406 @@
+#include "models/circuit_breaker.h"
+
+extern "C" {
+#include "postgres.h"
+#include "miscadmin.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+}
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "models/rate_limiter.h"
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_shmem.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm circuit breaker";
+
+// Instances tracked at once; the window is one bit per outcome
+constexpr int kMaxSlots = 128;
+constexpr uint32 kWindowSize = 32;
+
+// A slot without a probe in flight that was not touched for this long goes
+// to another instance once the table is full
+constexpr int64 kIdleSlotUsecs = 10 * 60 * USECS_PER_SEC;
+
+// Weight of the newest sample in the latency moving average
+constexpr double kLatencyAlpha = 0.2;
+
+// Latency histogram of successful requests: bucket i holds latencies below
+// 2^(i / 4) ms, the last one everything slower. Counts are halved once the
+// histogram holds kLatencyDecaySamples, so it follows recent traffic.
+constexpr int kLatencyBuckets = 80;
+constexpr int kLatencyBucketsPerDoubling = 4;
+constexpr uint32 kLatencyDecaySamples = 1024;
+constexpr uint32 kMinLatencySamples = 20;
+
+// Retry credits an instance starts with and can save up; lets a quiet
+// instance retry a burst of failures right away
+constexpr double kMaxRetryCredits = 10.0;
+
+enum class BreakerState : int32 { kClosed, kOpen, kHalfOpen };
+
+struct BreakerSlot {
+  slock_t mutex;
+  bool used;
+  Oid database_id;
+  uint8 key[PG_LLM_SLOT_KEY_SIZE];  // pg_llm_slot_key()
+  TimestampTz last_used;
+  BreakerState state;
+  uint32 window;                    // Failure bits, newest in bit 0
+  uint32 window_requests;
+  uint32 window_failures;
+  bool probe_in_flight;
+  TimestampTz probe_started_at;
+  TimestampTz opened_at;
+  TimestampTz last_failure_at;
+  double latency_ms;
+  uint64 total_requests;
+  uint64 total_failures;
+  uint64 rejected;
+  double retry_credits;
+  uint32 latency_samples;
+  uint32 latency_buckets[kLatencyBuckets];
+};
+
+using BreakerShared = PgLlmSlotTable<BreakerSlot, kMaxSlots>;
+
+BreakerShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<BreakerShared*>(ptr);
+  if (!found) {
+    shared->init();
+  }
+}
+
+bool elapsed_at_least(TimestampTz since, TimestampTz now, int ms) {
+  return now - since >= static_cast<int64>(ms) * 1000;
+}
+
+// Callers hold slot->mutex
+void reset_window(BreakerSlot* slot) {
+  slot->window = 0;
+  slot->window_requests = 0;
+  slot->window_failures = 0;
+}
+
+int latency_bucket(double latency_ms) {
+  if (latency_ms < 1.0) {
+    return 0;
+  }
+  int bucket = static_cast<int>(std::log2(latency_ms) * kLatencyBucketsPerDoubling) + 1;
+  return std::min(bucket, kLatencyBuckets - 1);
+}
+
+// Upper bound of a bucket
+double latency_bucket_ms(int bucket) {
+  return std::exp2(static_cast<double>(bucket) / kLatencyBucketsPerDoubling);
+}
+
+// Callers hold slot->mutex
+void record_latency(BreakerSlot* slot, double latency_ms) {
+  if (slot->latency_samples >= kLatencyDecaySamples) {
+    slot->latency_samples = 0;
+    for (auto& count : slot->latency_buckets) {
+      count /= 2;
+      slot->latency_samples += count;
+    }
+  }
+  slot->latency_buckets[latency_bucket(latency_ms)]++;
+  slot->latency_samples++;
+}
+
+const char* state_name(BreakerState state) {
+  switch (state) {
+    case BreakerState::kOpen:
+      return "open";
+    case BreakerState::kHalfOpen:
+      return "half_open";
+    case BreakerState::kClosed:
+    default:
+      return "closed";
+  }
+}
+
+}  // namespace
+
+CircuitBreakerConfig CircuitBreakerConfig::from_config(const Json::Value& config) {
+  CircuitBreakerConfig result;
+  if (!config.isObject()) {
+    return result;
+  }
+  result.enabled = config.get("circuit_breaker", true).asBool();
+  result.error_rate = config.get("breaker_error_rate", result.error_rate).asDouble();
+  result.min_requests = config.get("breaker_min_requests", result.min_requests).asInt();
+  result.open_ms = config.get("breaker_open_ms", result.open_ms).asInt();
+  result.slow_call_ms = config.get("breaker_slow_call_ms", result.slow_call_ms).asInt();
+  return result;
+}
+
+CircuitBreaker& CircuitBreaker::get_instance() {
+  static CircuitBreaker instance;
+  return instance;
+}
+
+void CircuitBreaker::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(BreakerShared), init_shared);
+}
+
+bool CircuitBreaker::available() const {
+  return shared != nullptr;
+}
+
+bool CircuitBreaker::is_failure(int curl_result, long http_code) {
+  return curl_result != CURLE_OK || http_code == 429 || http_code >= 500;
+}
+
+int CircuitBreaker::find_slot(uint32_t database_id, const std::string& instance_name, bool create) {
+  auto reclaimable = [](const BreakerSlot& slot, TimestampTz now) {
+    return !slot.probe_in_flight && now - slot.last_used >= kIdleSlotUsecs;
+  };
+  auto reset = [](BreakerSlot& slot, TimestampTz) {
+    slot.state = BreakerState::kClosed;
+    reset_window(&slot);
+    slot.probe_in_flight = false;
+    slot.probe_started_at = 0;
+    slot.opened_at = 0;
+    slot.last_failure_at = 0;
+    slot.latency_ms = 0.0;
+    slot.total_requests = 0;
+    slot.total_failures = 0;
+    slot.rejected = 0;
+    slot.retry_credits = kMaxRetryCredits;
+    slot.latency_samples = 0;
+    memset(slot.latency_buckets, 0, sizeof(slot.latency_buckets));
+  };
+  return shared->find(&slot_index_, database_id, instance_name, create, reclaimable, reset);
+}
+
+BreakerDecision CircuitBreaker::allow(uint32_t database_id,
+                                      const std::string& instance_name,
+                                      const CircuitBreakerConfig& config) {
+  BreakerDecision decision;
+  if (!available() || !config.enabled) {
+    return decision;
+  }
+  int index = find_slot(database_id, instance_name, true);
+  if (index < 0) {
+    return decision;
+  }
+
+  BreakerSlot* slot = &shared->slots[index];
+  TimestampTz now = GetCurrentTimestamp();
+  SpinLockAcquire(&slot->mutex);
+  if (slot->state == BreakerState::kOpen && elapsed_at_least(slot->opened_at, now, config.open_ms)) {
+    slot->state = BreakerState::kHalfOpen;
+    slot->probe_in_flight = false;
+  }
+  if (slot->state == BreakerState::kHalfOpen) {
+    // One probe at a time; a probe lost to an aborted query expires
+    if (!slot->probe_in_flight || elapsed_at_least(slot->probe_started_at, now, config.open_ms)) {
+      slot->probe_in_flight = true;
+      slot->probe_started_at = now;
+      decision.probe = true;
+    } else {
+      decision.allowed = false;
+    }
+  } else if (slot->state == BreakerState::kOpen) {
+    decision.allowed = false;
+  }
+  if (!decision.allowed) {
+    slot->rejected++;
+  }
+  SpinLockRelease(&slot->mutex);
+  return decision;
+}
+
+void CircuitBreaker::record(uint32_t database_id,
+                            const std::string& instance_name,
+                            const CircuitBreakerConfig& config,
+                            bool success,
+                            double latency_ms,
+                            bool probe) {
+  if (!available() || !config.enabled) {
+    return;
+  }
+  int index = find_slot(database_id, instance_name, true);
+  if (index < 0) {
+    return;
+  }
+
+  bool failed = !success || (config.slow_call_ms > 0 && latency_ms > config.slow_call_ms);
+  BreakerSlot* slot = &shared->slots[index];
+  TimestampTz now = GetCurrentTimestamp();
+  bool tripped = false;
+
+  SpinLockAcquire(&slot->mutex);
+  slot->total_requests++;
+  slot->latency_ms = slot->total_requests == 1
+    ? latency_ms
+    : slot->latency_ms + kLatencyAlpha * (latency_ms - slot->latency_ms);
+  if (failed) {
+    slot->total_failures++;
+    slot->last_failure_at = now;
+  }
+  // Slow replies are still replies; they belong in the latency histogram
+  if (success) {
+    record_latency(slot, latency_ms);
+  }
+
+  // Slide the window: drop the oldest outcome once it is full
+  if (slot->window_requests == kWindowSize) {
+    slot->window_failures -= (slot->window >> (kWindowSize - 1)) & 1;
+  } else {
+    slot->window_requests++;
+  }
+  slot->window = (slot->window << 1) | (failed ? 1 : 0);
+  slot->window_failures += failed ? 1 : 0;
+
+  if (slot->state == BreakerState::kHalfOpen && probe) {
+    slot->probe_in_flight = false;
+    if (failed) {
+      slot->state = BreakerState::kOpen;
+      slot->opened_at = now;
+      tripped = true;
+    } else {
+      slot->state = BreakerState::kClosed;
+      reset_window(slot);
+    }
+  } else if (slot->state == BreakerState::kClosed && slot->window_failures > 0 &&
+             slot->window_requests >= static_cast<uint32>(std::max(config.min_requests, 1)) &&
+             slot->window_failures >= config.error_rate * slot->window_requests) {
+    slot->state = BreakerState::kOpen;
+    slot->opened_at = now;
+    tripped = true;
+  }
+  SpinLockRelease(&slot->mutex);
+
+  if (tripped) {
+    PG_LLM_LOG_WARNING("circuit breaker for instance %s opened", instance_name.c_str());
+  }
+}
+
+std::optional<double> CircuitBreaker::latency_p95(uint32_t database_id, const std::string& instance_name) {
+  if (!available()) {
+    return std::nullopt;
+  }
+  int index = find_slot(database_id, instance_name, false);
+  if (index < 0) {
+    return std::nullopt;
+  }
+  BreakerSlot* slot = &shared->slots[index];
+  std::optional<double> result;
+  SpinLockAcquire(&slot->mutex);
+  if (slot->latency_samples >= kMinLatencySamples) {
+    uint32 rank = slot->latency_samples - slot->latency_samples / 20;
+    uint32 seen = 0;
+    for (int bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+      seen += slot->latency_buckets[bucket];
+      if (seen >= rank) {
+        result = latency_bucket_ms(bucket);
+        break;
+      }
+    }
+  }
+  SpinLockRelease(&slot->mutex);
+  return result;
+}
+
+void CircuitBreaker::abandon_probe(uint32_t database_id, const std::string& instance_name) {
+  if (!available()) {
+    return;
+  }
+  int index = find_slot(database_id, instance_name, false);
+  if (index < 0) {
+    return;
+  }
+  BreakerSlot* slot = &shared->slots[index];
+  SpinLockAcquire(&slot->mutex);
+  if (slot->state == BreakerState::kHalfOpen) {
+    slot->probe_in_flight = false;
+  }
+  SpinLockRelease(&slot->mutex);
+}
+
+void CircuitBreaker::deposit_retry_credit(uint32_t database_id, const std::string& instance_name, double ratio) {
+  int index = available() ? find_slot(database_id, instance_name, true) : -1;
+  if (index < 0) {
+    auto inserted = local_retry_credits_.emplace(pg_llm_slot_key(database_id, instance_name), kMaxRetryCredits).first;
+    inserted->second = std::min(kMaxRetryCredits, inserted->second + ratio);
+    return;
+  }
+  BreakerSlot* slot = &shared->slots[index];
+  SpinLockAcquire(&slot->mutex);
+  slot->retry_credits = std::min(kMaxRetryCredits, slot->retry_credits + ratio);
+  SpinLockRelease(&slot->mutex);
+}
+
+bool CircuitBreaker::withdraw_retry_credit(uint32_t database_id, const std::string& instance_name) {
+  int index = available() ? find_slot(database_id, instance_name, true) : -1;
+  if (index < 0) {
+    auto inserted = local_retry_credits_.emplace(pg_llm_slot_key(database_id, instance_name), kMaxRetryCredits).first;
+    if (inserted->second < 1.0) {
+      return false;
+    }
+    inserted->second -= 1.0;
+    return true;
+  }
+  BreakerSlot* slot = &shared->slots[index];
+  bool granted = false;
+  SpinLockAcquire(&slot->mutex);
+  if (slot->retry_credits >= 1.0) {
+    slot->retry_credits -= 1.0;
+    granted = true;
+  }
+  SpinLockRelease(&slot->mutex);
+  return granted;
+}
+
+std::vector<InstanceHealth> CircuitBreaker::snapshot(const std::vector<std::string>& instance_names) {
+  std::vector<InstanceHealth> result;
+  if (!available()) {
+    return result;
+  }
+
+  for (const auto& instance_name : instance_names) {
+    std::string key = pg_llm_slot_key(MyDatabaseId, instance_name);
+    // Copy under the spinlocks, allocate after releasing them
+    BreakerSlot copy;
+    SpinLockAcquire(&shared->mutex);
+    int index = shared->search(key);
+    if (index >= 0) {
+      SpinLockAcquire(&shared->slots[index].mutex);
+      copy = shared->slots[index];
+      SpinLockRelease(&shared->slots[index].mutex);
+    }
+    SpinLockRelease(&shared->mutex);
+    if (index < 0) {
+      continue;
+    }
+
+    InstanceHealth health;
+    health.instance_name = instance_name;
+    health.state = state_name(copy.state);
+    health.window_requests = copy.window_requests;
+    health.window_failures = copy.window_failures;
+    health.latency_ms = copy.latency_ms;
+    health.total_requests = copy.total_requests;
+    health.total_failures = copy.total_failures;
+    health.rejected = copy.rejected;
+    health.opened_at = copy.opened_at;
+    health.last_failure_at = copy.last_failure_at;
+    health.in_flight = RateLimiter::get_instance().in_flight(copy.database_id, health.instance_name);
+    result.push_back(std::move(health));
+  }
+  return result;
+}
+
+} // namespace pg_llm
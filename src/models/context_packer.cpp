@@ -0,0 +1,259 @@
+#include "models/context_packer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace pg_llm {
+
+namespace {
+
+// Share of an item's word trigrams found in one packed item that makes it
+// a duplicate
+constexpr double kDuplicateContainment = 0.8;
+
+uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Hashes of the word trigrams of text (ASCII case folded); texts of fewer
+// than three words get one hash of all their words
+std::vector<uint64_t> word_shingles(std::string_view text) {
+  std::vector<uint64_t> words;
+  uint64_t hash = 0;
+  bool in_word = false;
+  for (char ch : text) {
+    auto c = static_cast<unsigned char>(ch);
+    bool word_byte = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+    if (word_byte) {
+      if (!in_word) {
+        hash = 0xcbf29ce484222325ULL;
+        in_word = true;
+      }
+      if (c >= 'A' && c <= 'Z') {
+        c = static_cast<unsigned char>(c - 'A' + 'a');
+      }
+      hash = (hash ^ c) * 0x100000001b3ULL;
+    } else if (in_word) {
+      words.push_back(hash);
+      in_word = false;
+    }
+  }
+  if (in_word) {
+    words.push_back(hash);
+  }
+
+  std::vector<uint64_t> shingles;
+  if (words.size() < 3) {
+    if (!words.empty()) {
+      uint64_t combined = 0;
+      for (uint64_t word : words) {
+        combined = mix(combined ^ word);
+      }
+      shingles.push_back(combined);
+    }
+    return shingles;
+  }
+  shingles.reserve(words.size() - 2);
+  for (size_t i = 0; i + 2 < words.size(); ++i) {
+    shingles.push_back(mix(mix(mix(words[i]) ^ words[i + 1]) ^ words[i + 2]));
+  }
+  std::sort(shingles.begin(), shingles.end());
+  shingles.erase(std::unique(shingles.begin(), shingles.end()), shingles.end());
+  return shingles;
+}
+
+size_t shared_count(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b) {
+  size_t shared = 0;
+  auto i = a.begin();
+  auto j = b.begin();
+  while (i != a.end() && j != b.end()) {
+    if (*i < *j) {
+      ++i;
+    } else if (*j < *i) {
+      ++j;
+    } else {
+      ++shared;
+      ++i;
+      ++j;
+    }
+  }
+  return shared;
+}
+
+}  // namespace
+
+ContextPacker::ContextPacker(TokenCounter count_tokens, size_t budget)
+    : count_tokens_(std::move(count_tokens)), budget_(budget) {}
+
+void ContextPacker::add_section(ContextSection section) {
+  SectionState state;
+  state.heading_tokens = section.heading.empty() ? 0 : count_tokens_(section.heading);
+  state.config = std::move(section);
+  sections_.push_back(std::move(state));
+}
+
+void ContextPacker::reserve(std::string_view text) {
+  reserve_tokens(count_tokens_(text));
+}
+
+void ContextPacker::reserve_tokens(size_t tokens) {
+  reserved_ += tokens;
+  used_ += tokens;
+}
+
+size_t ContextPacker::add(const std::string& section,
+                          std::string label,
+                          std::string text,
+                          double score,
+                          size_t extra_tokens) {
+  auto found = std::find_if(sections_.begin(), sections_.end(), [&](const SectionState& state) {
+    return state.config.name == section;
+  });
+  if (found == sections_.end()) {
+    throw std::invalid_argument("unknown context section \"" + section + "\"");
+  }
+  Item item;
+  item.section = static_cast<size_t>(found - sections_.begin());
+  item.tokens = count_tokens_(text) + extra_tokens;
+  if (found->config.deduplicate) {
+    item.shingles = word_shingles(text);
+  }
+  item.label = std::move(label);
+  item.text = std::move(text);
+  item.score = score;
+  item.state = State::kPending;
+  items_.push_back(std::move(item));
+  return items_.size() - 1;
+}
+
+bool ContextPacker::is_duplicate(const Item& item) const {
+  if (item.shingles.empty()) {
+    return false;
+  }
+  size_t needed = static_cast<size_t>(kDuplicateContainment * static_cast<double>(item.shingles.size()) + 0.5);
+  needed = std::max<size_t>(needed, 1);
+  for (const auto& other : items_) {
+    if (other.state == State::kPacked && !other.shingles.empty() &&
+        shared_count(item.shingles, other.shingles) >= needed) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ContextPacker::pack() {
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < items_.size(); ++i) {
+    if (items_[i].state == State::kPending) {
+      pending.push_back(i);
+    }
+  }
+  std::stable_sort(pending.begin(), pending.end(), [&](size_t a, size_t b) {
+    int priority_a = sections_[items_[a].section].config.priority;
+    int priority_b = sections_[items_[b].section].config.priority;
+    if (priority_a != priority_b) {
+      return priority_a < priority_b;
+    }
+    return items_[a].score > items_[b].score;
+  });
+
+  for (size_t index : pending) {
+    Item& item = items_[index];
+    SectionState& section = sections_[item.section];
+    const ContextSection& config = section.config;
+    if (section.closed) {
+      item.state = State::kOverBudget;
+      continue;
+    }
+    if (section.items >= config.max_items) {
+      item.state = State::kSectionCap;
+      continue;
+    }
+    if (config.deduplicate && is_duplicate(item)) {
+      item.state = State::kDuplicate;
+      continue;
+    }
+    size_t cost = item.tokens + (section.items == 0 ? section.heading_tokens : 0);
+    if (section.tokens + cost > config.max_tokens) {
+      item.state = State::kSectionCap;
+      section.closed = config.contiguous;
+      continue;
+    }
+    if (budget_ != 0 && used_ + cost > budget_) {
+      item.state = State::kOverBudget;
+      section.closed = config.contiguous;
+      continue;
+    }
+    item.state = State::kPacked;
+    used_ += cost;
+    section.tokens += cost;
+    section.items += 1;
+  }
+}
+
+std::string ContextPacker::render(const std::string& section) const {
+  std::string rendered;
+  for (const auto& item : items_) {
+    const ContextSection& config = sections_[item.section].config;
+    if (item.state != State::kPacked || config.name != section) {
+      continue;
+    }
+    if (rendered.empty()) {
+      rendered = config.heading;
+    }
+    rendered += item.text;
+  }
+  return rendered;
+}
+
+Json::Value ContextPacker::plan() const {
+  Json::Value plan(Json::objectValue);
+  plan["budget"] = budget_ == 0 ? Json::Value() : Json::Value(Json::UInt64(budget_));
+  plan["reserved_tokens"] = Json::UInt64(reserved_);
+  plan["used_tokens"] = Json::UInt64(used_);
+
+  Json::Value sections(Json::objectValue);
+  for (const auto& section : sections_) {
+    Json::Value entry(Json::objectValue);
+    entry["packed"] = Json::UInt64(section.items);
+    entry["tokens"] = Json::UInt64(section.tokens);
+    entry["dropped"] = 0;
+    sections[section.config.name] = entry;
+  }
+
+  Json::Value dropped(Json::arrayValue);
+  for (const auto& item : items_) {
+    const char* reason = nullptr;
+    switch (item.state) {
+      case State::kDuplicate:
+        reason = "duplicate";
+        break;
+      case State::kSectionCap:
+        reason = "section_cap";
+        break;
+      case State::kOverBudget:
+        reason = "over_budget";
+        break;
+      default:
+        continue;
+    }
+    const std::string& name = sections_[item.section].config.name;
+    sections[name]["dropped"] = Json::UInt64(sections[name]["dropped"].asUInt64() + 1);
+    Json::Value entry(Json::objectValue);
+    entry["section"] = name;
+    entry["label"] = item.label;
+    entry["reason"] = reason;
+    entry["tokens"] = Json::UInt64(item.tokens);
+    dropped.append(entry);
+  }
+  plan["sections"] = sections;
+  plan["dropped"] = dropped;
+  return plan;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,709 @@
+#include "models/http_engine.h"
+
+extern "C" {
+#include "postgres.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "utils/memutils.h"
+}
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <string_view>
+
+#include "utils/pg_llm_log.h"
+
+namespace pg_llm {
+
+namespace {
+
+// Upper bound for one poll round; keeps the drive loop responsive
+constexpr int kPollIntervalMs = 100;
+
+// Idle connections older than this are assumed closed by the server
+constexpr auto kKeepAliveWindow = std::chrono::seconds(60);
+
+// Keep resolved addresses well beyond curl's 60 second default
+constexpr long kDnsCacheTimeoutSeconds = 300;
+
+// Idle connections kept open across requests
+constexpr long kMaxCachedConnections = 32;
+
+// Ready events handled per wait
+constexpr int kMaxWaitEvents = 64;
+
+// Longest Retry-After taken literally; anything beyond is as good as never
+constexpr long kMaxRetryAfterSeconds = 86400;
+
+// Idle handles a model instance keeps for its next requests
+constexpr size_t kMaxIdleHandles = 8;
+
+// Transfers cannot outlive the transaction that started them: whatever is
+// still attached on abort belongs to a frame the error unwound.
+void engine_xact_callback(XactEvent event, void* arg) {
+  auto* engine = static_cast<HttpEngine*>(arg);
+  switch (event) {
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+      engine->abort_all();
+      engine->set_deadline(std::nullopt);
+      break;
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+    case XACT_EVENT_PREPARE:
+      engine->set_deadline(std::nullopt);
+      break;
+    default:
+      break;
+  }
+}
+
+// A rolled back savepoint unwinds the frames of the transfers it started
+// just like a transaction abort does, while its parent's keep running.
+void engine_subxact_callback(SubXactEvent event, SubTransactionId subid,
+                             SubTransactionId parent, void* arg) {
+  if (event == SUBXACT_EVENT_ABORT_SUB) {
+    static_cast<HttpEngine*>(arg)->abort_all(subid);
+  }
+}
+
+}  // namespace
+
+HandlePool::HandlePool(CURL* prototype, curl_slist* headers) : prototype_(prototype), headers_(headers) {}
+
+HandlePool::~HandlePool() {
+  for (CURL* handle : idle_) {
+    curl_easy_cleanup(handle);
+  }
+  if (prototype_) {
+    curl_easy_cleanup(prototype_);
+  }
+  if (headers_) {
+    curl_slist_free_all(headers_);
+  }
+}
+
+CURL* HandlePool::checkout() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_.empty()) {
+      CURL* handle = idle_.back();
+      idle_.pop_back();
+      return handle;
+    }
+  }
+  // Per-request options are set again on every checkout, so a copy of the
+  // prototype is as good as a used handle; the share keeps the connections
+  return prototype_ ? curl_easy_duphandle(prototype_) : nullptr;
+}
+
+void HandlePool::checkin(CURL* handle) {
+  if (!handle) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_.size() < kMaxIdleHandles) {
+      idle_.push_back(handle);
+      return;
+    }
+  }
+  curl_easy_cleanup(handle);
+}
+
+size_t HandlePool::idle_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_.size();
+}
+
+HttpTransfer::~HttpTransfer() {
+  if (running) {
+    HttpEngine::get_instance().cancel(this);
+  }
+  release();
+  if (headers) {
+    curl_slist_free_all(headers);
+  }
+  if (handle && owns_handle) {
+    curl_easy_cleanup(handle);
+  } else if (handle && pool) {
+    pool->checkin(handle);
+  }
+}
+
+void HttpTransfer::release() {
+  if (on_release) {
+    auto hook = std::move(on_release);
+    on_release = nullptr;
+    hook();
+  }
+}
+
+HttpEngine& HttpEngine::get_instance() {
+  static HttpEngine instance;
+  return instance;
+}
+
+HttpEngine::HttpEngine() : multi_(nullptr), share_(nullptr) {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  // The backend is single threaded, so the share needs no lock callbacks
+  share_ = curl_share_init();
+  if (share_) {
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  } else {
+    PG_LLM_LOG_WARNING("Failed to initialize curl share handle");
+  }
+
+  multi_ = curl_multi_init();
+  if (!multi_) {
+    PG_LLM_LOG_ERROR("Failed to initialize curl multi handle");
+    return;
+  }
+  curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS, kMaxCachedConnections);
+  curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, HttpEngine::socket_callback);
+  curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, HttpEngine::timer_callback);
+  curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+  RegisterXactCallback(engine_xact_callback, this);
+  RegisterSubXactCallback(engine_subxact_callback, this);
+}
+
+HttpEngine::~HttpEngine() {
+  if (multi_) {
+    for (auto* transfer : active_) {
+      curl_multi_remove_handle(multi_, transfer->handle);
+      transfer->running = false;
+    }
+    active_.clear();
+    background_.clear();
+    curl_multi_cleanup(multi_);
+  }
+  if (share_) {
+    curl_share_cleanup(share_);
+  }
+  if (wait_set_) {
+    FreeWaitEventSet(wait_set_);
+  }
+}
+
+int HttpEngine::socket_callback(CURL* easy, curl_socket_t socket, int what, void* userp, void* socketp) {
+  auto* engine = static_cast<HttpEngine*>(userp);
+  if (what == CURL_POLL_REMOVE) {
+    engine->sockets_.erase(socket);
+  } else {
+    engine->sockets_[socket] = what;
+  }
+  engine->sockets_changed_ = true;
+  return 0;
+}
+
+int HttpEngine::timer_callback(CURLM* multi, long timeout_ms, void* userp) {
+  auto* engine = static_cast<HttpEngine*>(userp);
+  if (timeout_ms < 0) {
+    engine->timer_.reset();
+  } else {
+    engine->timer_ = Clock::now() + std::chrono::milliseconds(timeout_ms);
+  }
+  return 0;
+}
+
+bool HttpEngine::interrupt_pending() {
+  if (!InterruptPending || InterruptHoldoffCount != 0 || CritSectionCount != 0) {
+    return false;
+  }
+  return ProcDiePending || (QueryCancelPending && QueryCancelHoldoffCount == 0);
+}
+
+long HttpEngine::deadline_remaining_ms() const {
+  if (!deadline_) {
+    return -1;
+  }
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*deadline_ - Clock::now());
+  return std::max<long>(left.count(), 0);
+}
+
+void HttpEngine::configure_handle(CURL* handle) {
+  if (!handle) {
+    return;
+  }
+  if (share_) {
+    curl_easy_setopt(handle, CURLOPT_SHARE, share_);
+  }
+  curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, kDnsCacheTimeoutSeconds);
+  curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(handle, CURLOPT_TCP_NODELAY, 1L);
+  curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, kMaxCachedConnections);
+  curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  // Empty string: offer every encoding this libcurl can decode
+  curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, HttpEngine::write_body);
+  curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
+}
+
+std::string HttpEngine::origin_of(const std::string& url) {
+  std::string origin;
+  CURLU* parsed = curl_url();
+  if (!parsed) {
+    return origin;
+  }
+
+  char* scheme = nullptr;
+  char* host = nullptr;
+  char* port = nullptr;
+  if (curl_url_set(parsed, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+      curl_url_get(parsed, CURLUPART_SCHEME, &scheme, 0) == CURLUE_OK &&
+      curl_url_get(parsed, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+      curl_url_get(parsed, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK) {
+    origin = std::string(scheme) + "://" + host + ":" + port;
+  }
+  curl_free(scheme);
+  curl_free(host);
+  curl_free(port);
+  curl_url_cleanup(parsed);
+  return origin;
+}
+
+void HttpEngine::touch_endpoint(const HttpTransfer& transfer) {
+  if (transfer.url.empty()) {
+    return;
+  }
+  std::string origin = origin_of(transfer.url);
+  if (origin.empty()) {
+    return;
+  }
+
+  auto& state = endpoints_[origin];
+  state.last_used = std::chrono::steady_clock::now();
+  state.connected = transfer.http_code > 0;
+  state.connecting = false;
+  state.requests++;
+}
+
+void HttpEngine::preconnect(const std::string& url, long timeout_ms) {
+  std::string origin = origin_of(url);
+  if (!multi_ || origin.empty()) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto it = endpoints_.find(origin);
+  if (it != endpoints_.end() &&
+      (it->second.connecting ||
+       (it->second.connected && now - it->second.last_used < kKeepAliveWindow))) {
+    return;
+  }
+
+  auto transfer = std::make_unique<HttpTransfer>();
+  transfer->handle = curl_easy_init();
+  transfer->owns_handle = true;
+  if (!transfer->handle) {
+    return;
+  }
+  transfer->url = url;
+  configure_handle(transfer->handle);
+  // A HEAD request completes DNS, TCP and TLS and leaves a keep-alive
+  // connection in the share; the response itself is irrelevant.
+  curl_easy_setopt(transfer->handle, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(transfer->handle, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, transfer.get());
+  transfer->timeout_ms = timeout_ms;
+
+  if (!add(transfer.get())) {
+    return;
+  }
+  endpoints_[origin].connecting = true;
+  background_.push_back(std::move(transfer));
+
+  // Kick off name resolution and the TCP handshake right away
+  socket_action(CURL_SOCKET_TIMEOUT, 0);
+  collect_finished();
+}
+
+size_t HttpEngine::write_body(void* contents, size_t size, size_t nmemb, void* userp) {
+  size_t realsize = size * nmemb;
+  HttpTransfer* transfer = static_cast<HttpTransfer*>(userp);
+  if (transfer->max_body_bytes > 0 &&
+      transfer->response_body.size() + realsize > transfer->max_body_bytes) {
+    PG_LLM_LOG_WARNING("response from %s exceeds %zu bytes, aborting transfer",
+                       transfer->url.c_str(),
+                       transfer->max_body_bytes);
+    return 0;  // Fails the transfer with CURLE_WRITE_ERROR
+  }
+  transfer->response_body.append(static_cast<char*>(contents), realsize);
+  return realsize;
+}
+
+size_t HttpEngine::read_header(char* buffer, size_t size, size_t nitems, void* userp) {
+  constexpr std::string_view kRetryAfter = "retry-after:";
+  size_t length = size * nitems;
+  HttpTransfer* transfer = static_cast<HttpTransfer*>(userp);
+  std::string_view line(buffer, length);
+
+  // Interim replies and redirects have headers of their own; only the
+  // final reply's count
+  if (line.substr(0, 5) == "HTTP/") {
+    transfer->retry_after_ms = -1;
+    return length;
+  }
+  if (line.size() <= kRetryAfter.size() ||
+      pg_strncasecmp(line.data(), kRetryAfter.data(), kRetryAfter.size()) != 0) {
+    return length;
+  }
+
+  std::string value(line.substr(kRetryAfter.size()));
+  value.erase(0, value.find_first_not_of(" \t"));
+  value.erase(value.find_last_not_of(" \t\r\n") + 1);
+  if (value.empty()) {
+    return length;
+  }
+  // Either delay-seconds or an HTTP date
+  if (value.find_first_not_of("0123456789") == std::string::npos) {
+    long seconds = std::min(std::strtol(value.c_str(), nullptr, 10), kMaxRetryAfterSeconds);
+    transfer->retry_after_ms = seconds * 1000;
+  } else {
+    time_t at = curl_getdate(value.c_str(), nullptr);
+    if (at >= 0) {
+      long seconds = std::clamp<long>(static_cast<long>(at - time(nullptr)), 0, kMaxRetryAfterSeconds);
+      transfer->retry_after_ms = seconds * 1000;
+    }
+  }
+  return length;
+}
+
+void HttpEngine::sleep(long ms) {
+  auto until = Clock::now() + std::chrono::milliseconds(std::max(ms, 0L));
+  while (true) {
+    if (interrupt_pending()) {
+      abort_all();
+      CHECK_FOR_INTERRUPTS();
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - Clock::now()).count();
+    if (left <= 0) {
+      return;
+    }
+    long wait_ms = std::min<long>(left, kPollIntervalMs);
+    if (!active_.empty()) {
+      run_once(static_cast<int>(wait_ms));
+      continue;
+    }
+    int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, wait_ms, PG_WAIT_EXTENSION);
+    if (rc & WL_LATCH_SET) {
+      ResetLatch(MyLatch);
+    }
+  }
+}
+
+bool HttpEngine::add(HttpTransfer* transfer) {
+  if (!transfer) {
+    return false;
+  }
+  bool local = transfer->local_reply_ms >= 0;
+  if (!multi_ || (!local && !transfer->handle)) {
+    transfer->result = CURLE_FAILED_INIT;
+    transfer->done = true;
+    return false;
+  }
+  if (transfer->running) {
+    return true;
+  }
+
+  transfer->done = false;
+  transfer->http_code = 0;
+  transfer->retry_after_ms = -1;
+  transfer->result = CURLE_OK;
+
+  // The transfer's own limit applies unless the deadline comes sooner
+  long timeout_ms = transfer->timeout_ms;
+  long remaining_ms = deadline_remaining_ms();
+  if (remaining_ms == 0) {
+    transfer->result = CURLE_OPERATION_TIMEDOUT;
+    transfer->done = true;
+    return false;
+  }
+  if (remaining_ms > 0 && (timeout_ms <= 0 || remaining_ms < timeout_ms)) {
+    timeout_ms = remaining_ms;
+  }
+  if (local) {
+    return add_local(transfer, timeout_ms);
+  }
+  curl_easy_setopt(transfer->handle, CURLOPT_TIMEOUT_MS, std::max(timeout_ms, 0L));
+  curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, transfer);
+  // Wait for an existing connection to the host instead of opening a new one
+  // so concurrent requests share a single multiplexed HTTP/2 connection.
+  curl_easy_setopt(transfer->handle, CURLOPT_PIPEWAIT, 1L);
+
+  CURLMcode code = curl_multi_add_handle(multi_, transfer->handle);
+  if (code != CURLM_OK) {
+    PG_LLM_LOG_ERROR("curl_multi_add_handle failed: %s", curl_multi_strerror(code));
+    transfer->result = CURLE_FAILED_INIT;
+    transfer->done = true;
+    return false;
+  }
+
+  transfer->running = true;
+  transfer->subxact_id = GetCurrentSubTransactionId();
+  active_.push_back(transfer);
+  return true;
+}
+
+bool HttpEngine::add_local(HttpTransfer* transfer, long timeout_ms) {
+  // Cut off like a request that does not answer in time
+  long delay_ms = transfer->local_reply_ms;
+  transfer->local_timed_out = timeout_ms > 0 && timeout_ms < delay_ms;
+  if (transfer->local_timed_out) {
+    delay_ms = timeout_ms;
+  }
+  transfer->local_due = Clock::now() + std::chrono::milliseconds(delay_ms);
+  transfer->running = true;
+  transfer->subxact_id = GetCurrentSubTransactionId();
+  active_.push_back(transfer);
+  return true;
+}
+
+void HttpEngine::detach(HttpTransfer* transfer) {
+  if (transfer->local_reply_ms < 0) {
+    curl_multi_remove_handle(multi_, transfer->handle);
+  }
+  transfer->running = false;
+  active_.erase(std::remove(active_.begin(), active_.end(), transfer), active_.end());
+  transfer->release();
+}
+
+void HttpEngine::cancel(HttpTransfer* transfer) {
+  if (!transfer || !transfer->running) {
+    return;
+  }
+  detach(transfer);
+  transfer->result = CURLE_ABORTED_BY_CALLBACK;
+  transfer->done = true;
+}
+
+void HttpEngine::abort_all() {
+  while (!active_.empty()) {
+    abandon(active_.back());
+  }
+  background_.clear();
+  for (auto& [origin, state] : endpoints_) {
+    state.connecting = false;
+  }
+  timer_.reset();
+  running_ = 0;
+}
+
+void HttpEngine::abort_all(uint32_t subxact_id) {
+  std::vector<HttpTransfer*> owned;
+  for (HttpTransfer* transfer : active_) {
+    // Pre-connects belong to the engine, not to the frame that queued them
+    bool background = std::any_of(background_.begin(), background_.end(),
+                                  [transfer](const auto& bg) { return bg.get() == transfer; });
+    if (!background && transfer->subxact_id >= subxact_id) {
+      owned.push_back(transfer);
+    }
+  }
+  for (HttpTransfer* transfer : owned) {
+    abandon(transfer);
+  }
+}
+
+void HttpEngine::abandon(HttpTransfer* transfer) {
+  cancel(transfer);
+  // Whoever checked the handle out may never return it if its frame is
+  // gone; take it back now so the pool is not held forever either
+  if (transfer->pool) {
+    transfer->pool->checkin(transfer->handle);
+    transfer->handle = nullptr;
+    transfer->pool.reset();
+  }
+}
+
+void HttpEngine::collect_finished() {
+  CURLMsg* message = nullptr;
+  int queued = 0;
+  while ((message = curl_multi_info_read(multi_, &queued)) != nullptr) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    HttpTransfer* transfer = nullptr;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&transfer));
+    if (!transfer) {
+      curl_multi_remove_handle(multi_, message->easy_handle);
+      continue;
+    }
+
+    transfer->result = message->data.result;
+    curl_easy_getinfo(transfer->handle, CURLINFO_RESPONSE_CODE, &transfer->http_code);
+    transfer->done = true;
+    touch_endpoint(*transfer);
+    // The completion hook sees the outcome before detach() runs on_release
+    if (transfer->on_complete) {
+      transfer->on_complete(*transfer);
+    }
+    detach(transfer);
+  }
+
+  auto now = Clock::now();
+  std::vector<HttpTransfer*> replied;
+  for (HttpTransfer* transfer : active_) {
+    if (transfer->local_reply_ms >= 0 && transfer->local_due <= now) {
+      replied.push_back(transfer);
+    }
+  }
+  for (HttpTransfer* transfer : replied) {
+    transfer->result = transfer->local_timed_out ? CURLE_OPERATION_TIMEDOUT : CURLE_OK;
+    transfer->http_code = transfer->local_timed_out ? 0 : 200;
+    transfer->done = true;
+    if (transfer->on_complete) {
+      transfer->on_complete(*transfer);
+    }
+    detach(transfer);
+  }
+
+  background_.erase(std::remove_if(background_.begin(),
+                                   background_.end(),
+                                   [](const std::unique_ptr<HttpTransfer>& transfer) {
+                                     return transfer->done;
+                                   }),
+                    background_.end());
+}
+
+void HttpEngine::socket_action(curl_socket_t socket, int events) {
+  CURLMcode code = curl_multi_socket_action(multi_, socket, events, &running_);
+  if (code != CURLM_OK) {
+    PG_LLM_LOG_WARNING("curl_multi_socket_action failed: %s", curl_multi_strerror(code));
+  }
+}
+
+WaitEventSet* HttpEngine::wait_set() {
+  if (wait_set_ && !sockets_changed_) {
+    return wait_set_;
+  }
+  if (wait_set_) {
+    FreeWaitEventSet(wait_set_);
+    wait_set_ = nullptr;
+  }
+
+  // The set outlives any one query; curl sockets change rarely
+  int size = static_cast<int>(sockets_.size()) + 2;
+#if PG_VERSION_NUM >= 170000
+  wait_set_ = CreateWaitEventSet(nullptr, size);
+#else
+  wait_set_ = CreateWaitEventSet(TopMemoryContext, size);
+#endif
+  AddWaitEventToSet(wait_set_, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, nullptr);
+  AddWaitEventToSet(wait_set_, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, nullptr, nullptr);
+  for (const auto& [socket, what] : sockets_) {
+    uint32 events = 0;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) {
+      events |= WL_SOCKET_READABLE;
+    }
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) {
+      events |= WL_SOCKET_WRITEABLE;
+    }
+    if (events != 0) {
+      AddWaitEventToSet(wait_set_, events, socket, nullptr, nullptr);
+    }
+  }
+  sockets_changed_ = false;
+  return wait_set_;
+}
+
+int HttpEngine::run_once(int timeout_ms) {
+  if (!multi_ || active_.empty()) {
+    return 0;
+  }
+  if (interrupt_pending()) {
+    abort_all();
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  long wait_ms = timeout_ms;
+  if (timer_) {
+    auto due = std::chrono::duration_cast<std::chrono::milliseconds>(*timer_ - Clock::now());
+    wait_ms = std::clamp<long>(due.count(), 0, wait_ms);
+  }
+  for (const HttpTransfer* transfer : active_) {
+    if (transfer->local_reply_ms >= 0) {
+      auto due = std::chrono::duration_cast<std::chrono::milliseconds>(transfer->local_due - Clock::now());
+      wait_ms = std::clamp<long>(due.count(), 0, wait_ms);
+    }
+  }
+
+  WaitEvent events[kMaxWaitEvents];
+  int ready = WaitEventSetWait(wait_set(), wait_ms, events, kMaxWaitEvents, PG_WAIT_EXTENSION);
+  for (int i = 0; i < ready; ++i) {
+    if (events[i].events & WL_LATCH_SET) {
+      ResetLatch(MyLatch);
+      continue;
+    }
+    int mask = 0;
+    if (events[i].events & WL_SOCKET_READABLE) {
+      mask |= CURL_CSELECT_IN;
+    }
+    if (events[i].events & WL_SOCKET_WRITEABLE) {
+      mask |= CURL_CSELECT_OUT;
+    }
+    if (mask != 0) {
+      socket_action(events[i].fd, mask);
+    }
+  }
+  if (timer_ && *timer_ <= Clock::now()) {
+    timer_.reset();
+    socket_action(CURL_SOCKET_TIMEOUT, 0);
+  }
+  collect_finished();
+
+  if (interrupt_pending()) {
+    abort_all();
+    CHECK_FOR_INTERRUPTS();
+  }
+  return static_cast<int>(active_.size());
+}
+
+void HttpEngine::wait_all(const std::vector<HttpTransfer*>& transfers) {
+  for (auto* transfer : transfers) {
+    if (!transfer->done && !transfer->running) {
+      add(transfer);
+    }
+  }
+
+  auto pending = [&transfers]() {
+    return std::any_of(transfers.begin(), transfers.end(), [](const HttpTransfer* transfer) {
+      return !transfer->done;
+    });
+  };
+  while (pending()) {
+    run_once(kPollIntervalMs);
+  }
+}
+
+CURLcode HttpEngine::perform(HttpTransfer* transfer) {
+  wait_all({transfer});
+  return transfer->result;
+}
+
+ScopedDeadline::ScopedDeadline(long deadline_ms) {
+  auto& engine = HttpEngine::get_instance();
+  previous_ = engine.deadline();
+  if (deadline_ms <= 0) {
+    return;
+  }
+  auto deadline = HttpEngine::Clock::now() + std::chrono::milliseconds(deadline_ms);
+  if (!previous_ || deadline < *previous_) {
+    engine.set_deadline(deadline);
+  }
+}
+
+ScopedDeadline::~ScopedDeadline() {
+  HttpEngine::get_instance().set_deadline(previous_);
+}
+
+} // namespace pg_llm
@@ -1,19 +1,71 @@
 #include "models/llm_interface.h"
 
+extern "C" {
+#include "miscadmin.h"
+}
+
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <functional>
 
+#include "cache/embedding_cache.h"
+#include "models/local_embedder.h"
+#include "models/local_model.h"
+#include "models/tokenizer.h"
+#include "models/worker_pool.h"
+#include "utils/pg_llm_support.h"
+
 namespace pg_llm {
+
+namespace {
+
+// Sampling parameters applied to every chat request
+constexpr double kTemperature = 0.6;
+constexpr double kTopP = 0.9;
+constexpr int kLogprobs = 1;
+
+// Time allowed for DNS, TCP and TLS unless the config says otherwise
+constexpr int kConnectTimeoutMs = 10000;
+
+// Dimensions of the local hashed embedding
+constexpr int kLocalEmbeddingDimensions = 64;
+
+// Chat framing (role and separators) each message adds to a prompt
+constexpr size_t kTokensPerMessage = 4;
+
+// Longest provider error body kept in an error message
+constexpr size_t kMaxErrorDetail = 200;
+
+// Upper bounds for the embedding request fan-out settings
+constexpr int kMaxEmbeddingBatchSize = 2048;
+constexpr int kMaxEmbeddingConcurrency = 32;
+
+// Upper bound for one wait on the sockets between bookkeeping passes
+constexpr int kEmbeddingPollIntervalMs = 100;
+
+void normalize_embedding(std::vector<float>* embedding) {
+  double norm = 0.0;
+  for (float value : *embedding) {
+    norm += static_cast<double>(value) * value;
+  }
+  if (norm <= 0.0) {
+    return;
+  }
+  float scale = static_cast<float>(1.0 / std::sqrt(norm));
+  for (float& value : *embedding) {
+    value *= scale;
+  }
+}
+
+}  // namespace
+
 bool LLMInterface::initialize(bool local_model,
   const std::string& api_key,
   const std::string& model_config) {
-  if (!curl_) {
-    PG_LLM_LOG_ERROR("model:%s init failed, both apikey and access_key is invalid.", model_type_.c_str());
-    return false;
-  }
-
   local_model_ = local_model;
   api_key_ = api_key;
+  model_config_ = model_config;
 
   // Parse model configuration
   Json::Value config;
@@ -28,6 +80,28 @@ bool LLMInterface::initialize(bool local_model,
   api_endpoint_ = config.get("api_endpoint", "").asString();
   access_key_id_ = config.get("access_key_id", "").asString();
   access_key_secret_ = config.get("access_key_secret", "").asString();
+  rate_limits_ = RateLimits::from_config(config);
+  breaker_config_ = CircuitBreakerConfig::from_config(config);
+  retry_policy_ = RetryPolicy::from_config(config);
+  embedding_config_.provider = config.get("embedding_provider", "").asString();
+  embedding_config_.model_path = config.get("embedding_model_path", "").asString();
+  embedding_config_.endpoint = config.get("embedding_endpoint", "").asString();
+  embedding_config_.model = config.get("embedding_model", model_name_).asString();
+  embedding_config_.dimensions = std::max(config.get("embedding_dimensions", 0).asInt(), 0);
+  embedding_config_.batch_size =
+    std::clamp(config.get("embedding_batch_size", embedding_config_.batch_size).asInt(), 1, kMaxEmbeddingBatchSize);
+  embedding_config_.max_concurrency =
+    std::clamp(config.get("embedding_max_concurrency", embedding_config_.max_concurrency).asInt(),
+               1,
+               kMaxEmbeddingConcurrency);
+  embedding_config_.normalize = config.get("embedding_normalize", false).asBool();
+  tokenizer_path_ = config.get("tokenizer_path", "").asString();
+  max_input_tokens_ = std::max(config.get("max_input_tokens", 0).asInt(), 0);
+  request_writer_.configure(model_name_,
+                            ChatRequestWriter::dialect_from_name(config.get("request_format", "").asString()),
+                            kTemperature,
+                            kTopP,
+                            kLogprobs);
 
   if (!is_mock_model() &&
       !local_model &&
@@ -37,10 +111,40 @@ bool LLMInterface::initialize(bool local_model,
     return false;
   }
 
+  // Transport options and headers do not change between requests, so set
+  // them once on the prototype of the instance's handles; per request only
+  // the URL, body and sink are updated.
+  CURL* prototype = curl_easy_init();
+  if (!prototype) {
+    PG_LLM_LOG_ERROR("Failed to initialize curl");
+    return false;
+  }
+  curl_slist* headers = curl_slist_append(nullptr, "Content-Type: application/json");
+  if (unlikely(local_model_)) {
+    headers = curl_slist_append(headers, "Authorization: Bearer ollama");
+  } else {
+    headers = curl_slist_append(headers, ("Authorization: Bearer " + api_key_).c_str());
+  }
+  HttpEngine::get_instance().configure_handle(prototype);
+  curl_easy_setopt(prototype, CURLOPT_POST, 1L);
+  curl_easy_setopt(prototype, CURLOPT_HTTPHEADER, headers);
+  long connect_timeout_ms = config.get("connect_timeout_ms", kConnectTimeoutMs).asInt();
+  curl_easy_setopt(prototype, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+  handles_ = std::make_shared<HandlePool>(prototype, headers);
+
   is_initialized_ = true;
   return true;
 }
 
+void LLMInterface::preconnect() {
+  if (!is_initialized_ || is_mock_model() || api_endpoint_.empty() ||
+      !config_json_.get("preconnect", false).asBool()) {
+    return;
+  }
+  long timeout_ms = config_json_.get("preconnect_timeout_ms", 5000).asInt();
+  HttpEngine::get_instance().preconnect(api_endpoint_, timeout_ms);
+}
+
 Json::Value LLMInterface::get_config() const {
   return config_json_;
 }
@@ -59,96 +163,169 @@ ModelResponse LLMInterface::chat_completion(const std::string& prompt) {
 }
 
 ModelResponse LLMInterface::chat_completion(const std::vector<ChatMessage>& messages) {
+  auto& engine = HttpEngine::get_instance();
+  // With pg_llm.workers set the request runs on a background worker,
+  // unless the queue is full
+  auto& workers = WorkerPool::get_instance();
+  if (!is_mock_model() && is_initialized_ && workers.enabled()) {
+    ModelDefinition definition;
+    definition.instance_name = instance_name_;
+    definition.database_id = database_id_;
+    definition.model_type = model_type_;
+    definition.local_model = local_model_;
+    definition.api_key = api_key_;
+    definition.config = model_config_;
+    ModelResponse response;
+    if (workers.chat(definition, messages, engine.deadline_remaining_ms(), &response)) {
+      return response;
+    }
+  }
+
+  for (int attempt = 1;; ++attempt) {
+    ModelResponse immediate;
+    auto transfer = begin_chat_completion(messages, &immediate);
+    if (!transfer) {
+      return immediate;
+    }
+
+    engine.perform(transfer.get());
+    long delay_ms = retry_delay_ms(*transfer, attempt);
+    if (delay_ms < 0) {
+      return finish_chat_completion(*transfer);
+    }
+    // Give back the rate-limit permit and the handle while waiting
+    transfer.reset();
+    engine.sleep(delay_ms);
+  }
+}
+
+std::string LLMInterface::build_chat_request_body(const std::vector<ChatMessage>& messages,
+                                                  bool stream) const {
+  return request_writer_.write(messages, stream);
+}
+
+std::unique_ptr<HttpTransfer> LLMInterface::begin_chat_completion(
+  const std::vector<ChatMessage>& messages,
+  ModelResponse* immediate) {
   if (is_mock_model()) {
-    return build_mock_response(messages);
+    *immediate = build_mock_response(messages);
+    // "mock_delay_ms" answers late through the engine, like a slow endpoint
+    long delay_ms = config_json_.get("mock_delay_ms", 0).asInt64();
+    if (delay_ms <= 0) {
+      return nullptr;
+    }
+    auto transfer = std::make_unique<HttpTransfer>();
+    transfer->local_reply_ms = delay_ms;
+    transfer->response_body = immediate->response;
+    return transfer;
   }
 
   if (!is_ready()) {
     PG_LLM_LOG_ERROR("model:%s not initialized.", model_type_.c_str());
-    return ModelResponse{"Model not initialized", 0.0f, get_model_name()};
+    *immediate = ModelResponse{"", 0.0, get_model_name(), "Model not initialized"};
+    return nullptr;
+  }
+
+  auto transfer = prepare_transfer(api_endpoint_, build_chat_request_body(messages, false));
+  if (!transfer) {
+    if (!rate_limit_deferred_) {
+      PG_LLM_LOG_ERROR("%s", transfer_error_.c_str());
+    }
+    *immediate = ModelResponse{"", 0.0, get_model_name(), transfer_error_};
+    return nullptr;
   }
+  CircuitBreaker::get_instance().deposit_retry_credit(database_id_, instance_name_, retry_policy_.budget_ratio);
+  return transfer;
+}
 
-  // Prepare request body
-  Json::Value request_body;
-  request_body["model"] = model_name_;
-  Json::Value message_arr(Json::arrayValue);
+ModelResponse LLMInterface::finish_chat_completion(HttpTransfer& transfer) {
+  ResponseData response_data;
+  response_data.content.swap(transfer.response_body);
+  auto failed = [this](std::string error) {
+    return ModelResponse{"", 0.0, get_model_name(), std::move(error)};
+  };
+
+  if (transfer.result != CURLE_OK) {
+    PG_LLM_LOG_ERROR("Failed to make API request: %s", curl_easy_strerror(transfer.result));
+    return failed(curl_easy_strerror(transfer.result));
+  }
 
-  // Process all messages in the conversation
-  for (const auto& msg : messages) {
-    Json::Value message;
-    message["role"] = msg.role;
-    message["content"] = msg.content;
-    message_arr.append(message);
+  long http_code = transfer.http_code;
+  if (http_code != 200) {
+    PG_LLM_LOG_ERROR("HTTP error: %ld, Error response: %s",
+      http_code, response_data.content.c_str());
+    return failed("HTTP " + std::to_string(http_code) + ": " + response_data.content.substr(0, kMaxErrorDetail));
   }
 
-  request_body["messages"] = message_arr;
-  request_body["stream"] = false;
-  request_body["parameters"]["temperature"] = 0.6;
-  request_body["parameters"]["top_p"] = 0.9;
-  request_body["parameters"]["logprobs"] = 1;
+  if (is_mock_model()) {
+    return ModelResponse{response_data.content, get_default_confidence(), get_model_name()};
+  }
 
-  // Serializing the request body
-  Json::StreamWriterBuilder writer_builder;
-  std::string request_body_str = Json::writeString(writer_builder, request_body);
+  ChatPayload payload;
+  std::string parse_errors;
+  if (!parse_chat_payload(response_data.content, &payload, &parse_errors)) {
+    PG_LLM_LOG_ERROR("JSON parsing failed: %s, Raw response: %s",
+      parse_errors.c_str(), response_data.content.c_str());
+    return failed("could not parse the reply: " + parse_errors);
+  }
 
-  ResponseData response_data;
-  // Make API request with signature
-  CURLcode res = make_api_request(api_endpoint_, request_body_str, response_data);
-  if (res != CURLE_OK) {
-    PG_LLM_LOG_ERROR("Failed to make API request");
-    return ModelResponse{"Failed to make API request", 0.0f, get_model_name()};
-  } else {
-    long http_code = 0;
-    curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &http_code);
-    if (http_code == 200) {
-      Json::CharReaderBuilder reader_builder;
-      std::unique_ptr<Json::CharReader> reader(reader_builder.newCharReader());
-      Json::Value response_json;
-      std::string parse_errors;
+  // get confidence score
+  double confidence = 0;
+  if (payload.has_usage && payload.has_choices) {
+    confidence = (payload.total_tokens > 0) ? (payload.output_tokens / payload.total_tokens) : 0.0;
+    PG_LLM_LOG_INFO("confidence: %lf", confidence);
+  }
 
-      const char* contents_tart = response_data.content.c_str();
-      if (reader->parse(contents_tart,
-                        contents_tart + response_data.content.size(),
-                        &response_json, &parse_errors)) {
-        // get confidence score
-        double confidence = 0;
-        if (response_json.isMember("usage") &&
-            response_json["choices"].isArray() &&
-            !response_json["choices"].empty()) {
-            double total = response_json["usage"]["total_tokens"].asDouble();
-            double output = response_json["usage"]["output_tokens"].asDouble();
-            confidence = (total > 0) ? (output / total) : 0.0;
-            PG_LLM_LOG_INFO("confidence: %lf", confidence);
-        }
+  // Replace the token estimate charged against the instance budget
+  if (rate_limits_.tokens_per_minute > 0.0 && payload.has_usage) {
+    int64_t max_tokens = config_json_.get("max_tokens", 0).asInt64();
+    RateLimiter::get_instance().settle(database_id_,
+                                       instance_name_,
+                                       RateLimiter::estimate_tokens(transfer.request_body, max_tokens),
+                                       static_cast<int64_t>(payload.total_tokens));
+  }
 
-        // get question answer
-        if (response_json.isMember("choices") &&
-            response_json["choices"].isArray() &&
-            !response_json["choices"].empty()) {
-          Json::Value& first_choice = response_json["choices"][0u];
-          if (first_choice.isMember("message") &&
-              first_choice["message"].isMember("content") &&
-              first_choice["message"]["content"].isString()) {
-            response_data.fullReply = first_choice["message"]["content"].asString();
-            PG_LLM_LOG_INFO("Complete reply: %s", response_data.fullReply.c_str());
-            // Only return the content field, not the entire JSON response
-            return ModelResponse{response_data.fullReply, confidence, get_model_name()};
-          }
-        } else {
-          PG_LLM_LOG_ERROR("Response format exception: missing choices field");
-        }
-      } else {
-        PG_LLM_LOG_ERROR("JSON parsing failed: %s, Raw response: %s",
-          parse_errors.c_str(), response_data.content.c_str());
-      }
-    } else {
-      PG_LLM_LOG_ERROR("HTTP error: %ld, Error response: %s",
-        http_code, response_data.content.c_str());
-    }
+  // get question answer
+  if (!payload.has_choices) {
+    PG_LLM_LOG_ERROR("Response format exception: missing choices field");
+    return failed("reply has no choices");
   }
+  if (!payload.content.has_value()) {
+    return failed("reply has no message content");
+  }
+  response_data.fullReply = std::move(*payload.content);
+  PG_LLM_LOG_INFO("Complete reply: %s", response_data.fullReply.c_str());
+  // Only return the content field, not the entire JSON response
+  return ModelResponse{response_data.fullReply, confidence, get_model_name()};
+}
 
-  // If extraction fails, return the entire original response
-  return ModelResponse{response_data.content, 0.9, get_model_name()};
+long LLMInterface::retry_delay_ms(const HttpTransfer& transfer, int attempt) {
+  FailureClass failure = RetryPolicy::classify(transfer.result, transfer.http_code);
+  if (!retry_policy_.retryable(failure, attempt)) {
+    return -1;
+  }
+  long delay_ms = retry_policy_.backoff_ms(attempt, transfer.retry_after_ms);
+  if (delay_ms < 0) {
+    PG_LLM_LOG_WARNING("instance %s asked to retry after %ld ms, beyond retry_max_delay_ms",
+                       instance_name_.c_str(),
+                       transfer.retry_after_ms);
+    return -1;
+  }
+  long remaining_ms = HttpEngine::get_instance().deadline_remaining_ms();
+  if (remaining_ms >= 0 && delay_ms >= remaining_ms) {
+    return -1;
+  }
+  if (!CircuitBreaker::get_instance().withdraw_retry_credit(database_id_, instance_name_)) {
+    PG_LLM_LOG_WARNING("retry budget of instance %s exhausted, not retrying", instance_name_.c_str());
+    return -1;
+  }
+  PG_LLM_LOG_INFO("retrying %s failure of instance %s in %ld ms (attempt %d of %d)",
+                  RetryPolicy::class_name(failure),
+                  instance_name_.c_str(),
+                  delay_ms,
+                  attempt + 1,
+                  retry_policy_.max_attempts);
+  return delay_ms;
 }
 
 StreamResponse LLMInterface::stream_chat_completion(const std::string& prompt) {
@@ -157,36 +334,130 @@ StreamResponse LLMInterface::stream_chat_completion(const std::string& prompt) {
 }
 
 StreamResponse LLMInterface::stream_chat_completion(const std::vector<ChatMessage>& messages) {
+  StreamResponse stream_response;
+  auto stream = open_chat_stream(messages);
+  StreamChunk chunk;
+  while (stream->next(&chunk)) {
+    stream_response.chunks.push_back(std::move(chunk));
+  }
+  stream_response.response = stream->response();
+  stream_response.confidence_score = stream->confidence_score();
+  stream_response.model_name = stream->model_name();
+  stream_response.error = stream->error();
+  return stream_response;
+}
+
+std::unique_ptr<ChatStream> LLMInterface::open_chat_stream(const std::vector<ChatMessage>& messages) {
   if (is_mock_model()) {
-    return build_mock_stream_response(messages);
+    return build_mock_stream(messages);
   }
 
-  auto response = chat_completion(messages);
-  StreamResponse stream_response;
-  stream_response.response = response.response;
-  stream_response.confidence_score = response.confidence_score;
-  stream_response.model_name = response.model_name;
-
-  const int chunk_size = 24;
-  int seq_no = 0;
-  for (size_t offset = 0; offset < response.response.size(); offset += chunk_size) {
-    StreamChunk chunk;
-    chunk.seq_no = ++seq_no;
-    chunk.chunk = response.response.substr(offset, chunk_size);
-    chunk.is_final = false;
-    stream_response.chunks.push_back(chunk);
-  }
-  if (stream_response.chunks.empty()) {
-    stream_response.chunks.push_back(StreamChunk{1, "", false});
-  }
-  stream_response.chunks.push_back(StreamChunk{seq_no + 1, response.response, true});
-  return stream_response;
+  std::unique_ptr<ChatStream> stream(new ChatStream());
+  stream->model_ = this;
+  stream->model_name_ = get_model_name();
+
+  if (!is_ready()) {
+    PG_LLM_LOG_ERROR("model:%s not initialized.", model_type_.c_str());
+    stream->error_ = "Model not initialized";
+    return stream;
+  }
+
+  auto transfer = prepare_transfer(api_endpoint_, build_chat_request_body(messages, true));
+  if (!transfer) {
+    PG_LLM_LOG_ERROR("%s", transfer_error_.c_str());
+    stream->error_ = transfer_error_;
+    return stream;
+  }
+
+  // Deltas are parsed as they arrive instead of accumulating the body
+  curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, LLMInterface::stream_write_callback);
+  curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, &stream->context_);
+  stream->context_.max_bytes = transfer->max_body_bytes;
+  HttpEngine::get_instance().add(transfer.get());
+  stream->transfer_ = std::move(transfer);
+  return stream;
+}
+
+bool ChatStream::next(StreamChunk* chunk) {
+  // Upper bound for one wait on the socket between checks for new deltas
+  constexpr int kStreamPollIntervalMs = 100;
+
+  while (true) {
+    if (next_chunk_ < context_.chunks.size()) {
+      *chunk = StreamChunk{++seq_no_, std::move(context_.chunks[next_chunk_++]), false};
+      if (next_chunk_ == context_.chunks.size()) {
+        context_.chunks.clear();
+        next_chunk_ = 0;
+      }
+      return true;
+    }
+
+    if (transfer_ && !transfer_->done) {
+      HttpEngine::get_instance().run_once(kStreamPollIntervalMs);
+      if (transfer_->done) {
+        finish_transfer();
+      }
+      continue;
+    }
+
+    if (!final_sent_) {
+      // The reply has already been delivered piecewise; the closing chunk
+      // only marks the end of the stream.
+      final_sent_ = true;
+      *chunk = StreamChunk{++seq_no_, "", true};
+      return true;
+    }
+    return false;
+  }
+}
+
+void ChatStream::finish_transfer() {
+  // An event without a trailing newline is still complete at end of body
+  std::string_view rest = context_.lines.remainder();
+  if (!rest.empty()) {
+    if (rest.back() == '\r') {
+      rest.remove_suffix(1);
+    }
+    LLMInterface::process_stream_line(&context_, rest);
+  }
+  context_.lines.clear();
+
+  // Providers that ignore "stream": true (or fail the request) answer with a
+  // regular JSON document; parse it the same way as a blocking completion.
+  if (context_.fullReply.empty() && context_.chunks.empty()) {
+    transfer_->response_body.swap(context_.raw);
+    ModelResponse response = model_->finish_chat_completion(*transfer_);
+    context_.fullReply = response.response;
+    context_.confidence = response.confidence_score;
+    error_ = response.error;
+    if (!response.response.empty()) {
+      context_.chunks.push_back(response.response);
+    }
+  } else if (transfer_->result != CURLE_OK) {
+    PG_LLM_LOG_ERROR("Stream interrupted: %s", curl_easy_strerror(transfer_->result));
+    error_ = std::string("stream interrupted: ") + curl_easy_strerror(transfer_->result);
+  }
+  transfer_.reset();
 }
 
 std::string LLMInterface::get_model_name() const {
   return model_name_;
 }
 
+void LLMInterface::set_instance_name(const std::string& instance_name, uint32_t database_id) {
+  instance_name_ = instance_name;
+  database_id_ = database_id;
+}
+
+const std::string& LLMInterface::get_instance_name() const {
+  return instance_name_;
+}
+
+std::string LLMInterface::sampling_signature() const {
+  return "temperature=" + std::to_string(kTemperature) + ";top_p=" + std::to_string(kTopP) +
+         ";logprobs=" + std::to_string(kLogprobs);
+}
+
 std::string LLMInterface::get_model_info() const {
   return "LLM Model - " + model_name_;
 }
@@ -198,39 +469,106 @@ bool LLMInterface::is_ready() const {
 
   bool is_ready = true;
   if (unlikely(local_model_)) {
-    is_ready = (is_initialized_ && curl_ && !api_endpoint_.empty());
+    is_ready = (is_initialized_ && handles_ && !api_endpoint_.empty());
   } else {
-    is_ready = is_initialized_ && curl_ && (!access_key_id_.empty() && !access_key_secret_.empty());
+    is_ready = is_initialized_ && handles_ && (!access_key_id_.empty() && !access_key_secret_.empty());
   }
   return is_ready;
 }
 
+std::unique_ptr<HttpTransfer> LLMInterface::prepare_transfer(const std::string& endpoint,
+                                                             std::string request_body) {
+  transfer_error_ = "Failed to make API request";
+  if (!handles_) {
+    return nullptr;
+  }
+
+  auto& breaker = CircuitBreaker::get_instance();
+  BreakerDecision decision = breaker.allow(database_id_, instance_name_, breaker_config_);
+  if (!decision.allowed) {
+    transfer_error_ = "Circuit breaker open for instance " + instance_name_;
+    return nullptr;
+  }
+
+  RatePermit permit = 0;
+  rate_limit_deferred_ = false;
+  if (rate_limits_.enabled()) {
+    int64_t max_tokens = config_json_.get("max_tokens", 0).asInt64();
+    RateLimits limits = rate_limits_;
+    limits.fail_fast = limits.fail_fast || !rate_limit_wait_;
+    permit = RateLimiter::get_instance().acquire(database_id_,
+                                                 instance_name_,
+                                                 limits,
+                                                 RateLimiter::estimate_tokens(request_body, max_tokens));
+    if (permit == 0) {
+      if (decision.probe) {
+        breaker.abandon_probe(database_id_, instance_name_);
+      }
+      rate_limit_deferred_ = !rate_limits_.fail_fast && !rate_limit_wait_;
+      transfer_error_ = "Rate limit exceeded for instance " + instance_name_;
+      return nullptr;
+    }
+  }
+
+  auto transfer = std::make_unique<HttpTransfer>();
+  auto started = std::chrono::steady_clock::now();
+  auto recorded = std::make_shared<bool>(false);
+  transfer->on_complete = [this, decision, started, recorded](HttpTransfer& done) {
+    double latency_ms =
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    CircuitBreaker::get_instance().record(database_id_,
+                                          instance_name_,
+                                          breaker_config_,
+                                          !CircuitBreaker::is_failure(done.result, done.http_code),
+                                          latency_ms,
+                                          decision.probe);
+    *recorded = true;
+  };
+  // Runs when the engine detaches the transfer or it is destroyed unsent
+  transfer->on_release = [this, permit, decision, recorded]() {
+    if (permit != 0) {
+      RateLimiter::get_instance().release(permit);
+    }
+    if (decision.probe && !*recorded) {
+      CircuitBreaker::get_instance().abandon_probe(database_id_, instance_name_);
+    }
+  };
+  transfer->handle = handles_->checkout();
+  if (!transfer->handle) {
+    return nullptr;
+  }
+  transfer->pool = handles_;
+
+  // Headers and transport options were applied to the prototype in
+  // initialize() and are inherited by every pooled handle
+  transfer->url = endpoint;
+  transfer->request_body = std::move(request_body);
+  transfer->timeout_ms = config_json_.get("timeout_ms", pg_llm_request_timeout).asInt();
+  transfer->max_body_bytes = static_cast<size_t>(pg_llm_max_response_size) * 1024;
+
+  CURL* handle = transfer->handle;
+  curl_easy_setopt(handle, CURLOPT_URL, endpoint.c_str());
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, HttpEngine::write_body);
+  curl_easy_setopt(handle, CURLOPT_POSTFIELDS, transfer->request_body.c_str());
+  curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, transfer->request_body.length());
+  curl_easy_setopt(handle, CURLOPT_WRITEDATA, transfer.get());
+  curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, HttpEngine::read_header);
+  curl_easy_setopt(handle, CURLOPT_HEADERDATA, transfer.get());
+  // Rejects oversized replies up front when the server sends Content-Length
+  curl_easy_setopt(handle, CURLOPT_MAXFILESIZE_LARGE, static_cast<curl_off_t>(transfer->max_body_bytes));
+  return transfer;
+}
+
 CURLcode LLMInterface::make_api_request(const std::string& endpoint,
                                         const std::string& request_body,
                                         ResponseData &response_data) {
-  if (!curl_) {
+  auto transfer = prepare_transfer(endpoint, request_body);
+  if (!transfer) {
     return CURLE_FAILED_INIT;
   }
 
-  struct curl_slist* headers = NULL;
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-  if (unlikely(local_model_)) {
-    headers = curl_slist_append(headers, "Authorization: Bearer ollama");
-  } else {
-    headers = curl_slist_append(headers, ("Authorization: Bearer " + api_key_).c_str());
-  }
-
-  curl_easy_setopt(curl_, CURLOPT_URL, endpoint.c_str());
-  curl_easy_setopt(curl_, CURLOPT_POST, 1L);
-  curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, request_body.c_str());
-  curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, request_body.length());
-  curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &response_data);
-  curl_easy_setopt(curl_, CURLOPT_VERBOSE, 0L);
-
-  CURLcode res = curl_easy_perform(curl_);
-  curl_slist_free_all(headers);
+  CURLcode res = HttpEngine::get_instance().perform(transfer.get());
+  response_data.content.swap(transfer->response_body);
 
   if (res != CURLE_OK) {
     PG_LLM_LOG_ERROR("curl get response field");
@@ -241,7 +579,7 @@ CURLcode LLMInterface::make_api_request(const std::string& endpoint,
 }
 
 std::string LLMInterface::get_embedding_str(const std::string& text) {
-  auto embedding = build_deterministic_embedding(text, 64);
+  auto embedding = local_embedding(text, kLocalEmbeddingDimensions);
   Json::Value root(Json::arrayValue);
   for (float value : embedding) {
     root.append(value);
@@ -252,58 +590,266 @@ std::string LLMInterface::get_embedding_str(const std::string& text) {
 }
 
 std::vector<float> LLMInterface::get_embedding(const std::string& text) {
-  return build_deterministic_embedding(text, 64);
+  EmbeddingScope scope{kLocalEmbedderKey, kLocalEmbeddingDimensions, false};
+  auto results = EmbeddingCache::get_instance().get_or_embed(
+    scope, {text}, [](const std::vector<std::string>& texts) {
+      std::vector<EmbeddingResult> computed(texts.size());
+      for (size_t i = 0; i < texts.size(); ++i) {
+        computed[i].embedding = local_embedding(texts[i], kLocalEmbeddingDimensions);
+      }
+      return computed;
+    });
+  return std::move(results[0].embedding);
+}
+
+size_t LLMInterface::count_tokens(std::string_view text) const {
+  if (tokenizer_path_.empty()) {
+    return estimate_token_count(text);
+  }
+  std::string error;
+  auto tokenizer = Tokenizer::open(tokenizer_path_, &error);
+  if (!tokenizer) {
+    ereport(ERROR,
+            (errcode(ERRCODE_CONFIG_FILE_ERROR),
+             errmsg("could not load the tokenizer of instance \"%s\": %s",
+                    instance_name_.c_str(),
+                    error.c_str())));
+  }
+  return tokenizer->count(text);
+}
+
+size_t LLMInterface::count_tokens(const std::vector<ChatMessage>& messages) const {
+  size_t total = 0;
+  for (const auto& message : messages) {
+    total += kTokensPerMessage + count_tokens(message.content);
+  }
+  return total;
+}
+
+std::vector<EmbeddingResult> LLMInterface::embed(const std::vector<std::string>& texts, bool use_cache) {
+  if (!use_cache) {
+    return embed_uncached(texts);
+  }
+
+  // Local vectors are cheaper to recompute than to read back from the
+  // catalog, so only endpoint embeddings are persisted
+  const EmbeddingConfig& config = embedding_config_;
+  EmbeddingScope scope;
+  if (config.provider == kLocalModelProvider) {
+    std::string error;
+    auto model = LocalEmbeddingModel::open(config.model_path, &error);
+    scope.model_key = std::string(kLocalModelProvider) + "\n" + (model ? model->identity() : config.model_path);
+    scope.dimensions = model ? model->dimensions() : config.dimensions;
+  } else if (config.endpoint.empty() || is_mock_model()) {
+    scope.model_key = kLocalEmbedderKey;
+    scope.dimensions = config.dimensions > 0 ? config.dimensions : kLocalEmbeddingDimensions;
+  } else {
+    scope.model_key = config.endpoint + "\n" + config.model;
+    scope.dimensions = config.dimensions;
+    scope.durable = true;
+  }
+  if (config.normalize) {
+    scope.model_key += "\nnormalized";
+  }
+  return EmbeddingCache::get_instance().get_or_embed(
+    scope, texts, [this](const std::vector<std::string>& pending) {
+      return embed_uncached(pending);
+    });
+}
+
+std::vector<EmbeddingResult> LLMInterface::embed_uncached(const std::vector<std::string>& texts) {
+  const EmbeddingConfig& config = embedding_config_;
+  std::vector<EmbeddingResult> results(texts.size());
+  if (config.provider == kLocalModelProvider) {
+    std::string error;
+    auto model = LocalEmbeddingModel::open(config.model_path, &error);
+    if (model && config.dimensions > 0 && config.dimensions != model->dimensions()) {
+      error = "expected " + std::to_string(config.dimensions) + " dimensions, model produces " +
+              std::to_string(model->dimensions());
+      model.reset();
+    }
+    for (size_t i = 0; i < texts.size(); ++i) {
+      if (!model) {
+        results[i].error = error;
+        continue;
+      }
+      CHECK_FOR_INTERRUPTS();
+      // The model writes straight into the result buffer
+      results[i].embedding.resize(static_cast<size_t>(model->dimensions()));
+      model->embed(texts[i], results[i].embedding.data());
+      if (config.normalize) {
+        normalize_embedding(&results[i].embedding);
+      }
+    }
+    return results;
+  }
+  if (config.endpoint.empty() || is_mock_model()) {
+    int dimensions = config.dimensions > 0 ? config.dimensions : kLocalEmbeddingDimensions;
+    for (size_t i = 0; i < texts.size(); ++i) {
+      results[i].embedding = local_embedding(texts[i], dimensions);
+      if (config.normalize) {
+        normalize_embedding(&results[i].embedding);
+      }
+    }
+    return results;
+  }
+
+  auto fail_range = [&results](size_t begin, size_t end, const std::string& error) {
+    for (size_t i = begin; i < end; ++i) {
+      results[i].error = error;
+    }
+  };
+
+  struct InFlight {
+    size_t begin;
+    size_t end;
+    std::unique_ptr<HttpTransfer> transfer;
+  };
+
+  auto& engine = HttpEngine::get_instance();
+  std::vector<InFlight> in_flight;
+  size_t batch_size = static_cast<size_t>(config.batch_size);
+  size_t max_concurrency = static_cast<size_t>(config.max_concurrency);
+  size_t next = 0;
+
+  while (next < texts.size() || !in_flight.empty()) {
+    // Keep the window full
+    while (next < texts.size() && in_flight.size() < max_concurrency) {
+      size_t begin = next;
+      size_t end = std::min(texts.size(), begin + batch_size);
+      next = end;
+      auto transfer = prepare_transfer(config.endpoint,
+                                       build_embedding_request(config.model, texts, begin, end, config.dimensions));
+      if (!transfer) {
+        fail_range(begin, end, transfer_error_);
+        continue;
+      }
+      engine.add(transfer.get());
+      in_flight.push_back(InFlight{begin, end, std::move(transfer)});
+    }
+
+    if (in_flight.empty()) {
+      continue;
+    }
+
+    if (HttpEngine::interrupt_pending()) {
+      // Abort the outstanding transfers before the error unwinds this frame
+      in_flight.clear();
+    }
+    CHECK_FOR_INTERRUPTS();
+
+    engine.run_once(kEmbeddingPollIntervalMs);
+
+    auto finished = std::stable_partition(in_flight.begin(), in_flight.end(),
+                                          [](const InFlight& call) {
+                                            return !call.transfer->done;
+                                          });
+    for (auto it = finished; it != in_flight.end(); ++it) {
+      const HttpTransfer& transfer = *it->transfer;
+      size_t count = it->end - it->begin;
+      if (transfer.result != CURLE_OK) {
+        fail_range(it->begin, it->end, curl_easy_strerror(transfer.result));
+        continue;
+      }
+      if (transfer.http_code != 200) {
+        fail_range(it->begin,
+                   it->end,
+                   "HTTP " + std::to_string(transfer.http_code) + ": " +
+                     transfer.response_body.substr(0, kMaxErrorDetail));
+        continue;
+      }
+
+      std::vector<std::vector<float>> embeddings;
+      std::string parse_errors;
+      if (!parse_embedding_payload(transfer.response_body, &embeddings, &parse_errors)) {
+        fail_range(it->begin, it->end, "invalid embeddings response: " + parse_errors);
+        continue;
+      }
+      if (embeddings.size() != count) {
+        fail_range(it->begin,
+                   it->end,
+                   "expected " + std::to_string(count) + " embeddings, got " +
+                     std::to_string(embeddings.size()));
+        continue;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        EmbeddingResult& result = results[it->begin + i];
+        if (embeddings[i].empty()) {
+          result.error = "empty embedding in response";
+          continue;
+        }
+        if (config.dimensions > 0 && embeddings[i].size() != static_cast<size_t>(config.dimensions)) {
+          result.error = "expected " + std::to_string(config.dimensions) + " dimensions, got " +
+                         std::to_string(embeddings[i].size());
+          continue;
+        }
+        result.embedding = std::move(embeddings[i]);
+        if (config.normalize) {
+          normalize_embedding(&result.embedding);
+        }
+      }
+    }
+    in_flight.erase(finished, in_flight.end());
+  }
+
+  return results;
 }
 
 // Streaming callback function (processes data chunk by chunk)
 size_t LLMInterface::stream_write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
   size_t realsize = size * nmemb;
   StreamContext* ctx = static_cast<StreamContext*>(userp);
-  ctx->buffer.append(static_cast<char*>(contents), realsize);
+  ctx->received += realsize;
+  if (ctx->max_bytes > 0 && ctx->received > ctx->max_bytes) {
+    PG_LLM_LOG_WARNING("streamed response exceeds %zu bytes, aborting transfer", ctx->max_bytes);
+    return 0;  // Fails the transfer with CURLE_WRITE_ERROR
+  }
+  ctx->lines.append(static_cast<char*>(contents), realsize);
 
   // Process data line by line
-  size_t pos = 0;
-  while ((pos = ctx->buffer.find("\n")) != std::string::npos) {
-    std::string line = ctx->buffer.substr(0, pos);
-    ctx->buffer.erase(0, pos + 1);
-
-    // Skip empty lines and "[DONE]"
-    if (line.empty() || line == "data: [DONE]") continue;
-
-    // Extract valid JSON data
-    if (line.find("data: ") == 0) { // Check prefix
-      line = line.substr(6); // Remove "data: " prefix
-
-      // Parse JSON using jsoncpp
-      Json::Value chunk;
-      Json::CharReaderBuilder readerBuilder;
-      std::unique_ptr<Json::CharReader> reader(readerBuilder.newCharReader());
-      const char* lineStart = line.c_str();
-      std::string parseErrors;
-
-      if (reader->parse(lineStart, lineStart + line.size(), &chunk, &parseErrors)) {
-        // Check if choices array exists and is not empty
-        if (chunk.isMember("choices") && chunk["choices"].isArray() && !chunk["choices"].empty()) {
-          Json::Value& delta = chunk["choices"][0u]["delta"]; // Use unsigned index
-
-          // Check if delta contains content field
-          if (delta.isMember("content") && delta["content"].isString()) {
-            std::string content = delta["content"].asString();
-            if (!content.empty()) {
-              ctx->fullReply += content;
-              ctx->chunks.push_back(content);
-            }
-          }
-        }
-      } else {
-        PG_LLM_LOG_ERROR("JSON parsing error: %s", parseErrors.c_str());
-      }
-    }
+  std::string_view line;
+  while (ctx->lines.next_line(&line)) {
+    process_stream_line(ctx, line);
   }
 
   return realsize;
 }
 
+void LLMInterface::process_stream_line(StreamContext* ctx, std::string_view line) {
+  // Skip empty lines and "[DONE]"
+  if (line.empty() || line == "data: [DONE]") return;
+
+  // Anything outside the event framing is kept for the non-streaming fallback
+  if (line.substr(0, 5) != "data:") {
+    if (line[0] != ':' && line.substr(0, 6) != "event:" && line.substr(0, 3) != "id:" &&
+        line.substr(0, 6) != "retry:") {
+      ctx->raw += line;
+      ctx->raw += '\n';
+    }
+    return;
+  }
+
+  // Extract valid JSON data
+  line.remove_prefix(line.substr(0, 6) == "data: " ? 6 : 5);
+
+  ChatPayload chunk;
+  std::string parse_errors;
+  if (parse_chat_payload(line, &chunk, &parse_errors)) {
+    if (chunk.content.has_value() && !chunk.content->empty()) {
+      ctx->fullReply += *chunk.content;
+      ctx->chunks.push_back(std::move(*chunk.content));
+    }
+
+    // The usage event (if requested) closes the stream
+    if (chunk.has_usage) {
+      double output = chunk.has_output_tokens ? chunk.output_tokens : chunk.completion_tokens;
+      ctx->confidence = (chunk.total_tokens > 0) ? (output / chunk.total_tokens) : 0.0;
+    }
+  } else {
+    PG_LLM_LOG_ERROR("JSON parsing error: %s", parse_errors.c_str());
+  }
+}
+
 ModelResponse LLMInterface::build_mock_response(const std::vector<ChatMessage>& messages) {
   std::string response = config_json_.get("mock_response", "").asString();
   if (response.empty()) {
@@ -315,40 +861,28 @@ ModelResponse LLMInterface::build_mock_response(const std::vector<ChatMessage>&
   return ModelResponse{response, get_default_confidence(), get_model_name()};
 }
 
-StreamResponse LLMInterface::build_mock_stream_response(const std::vector<ChatMessage>& messages) {
-  StreamResponse response;
+std::unique_ptr<ChatStream> LLMInterface::build_mock_stream(
+  const std::vector<ChatMessage>& messages) {
+  std::unique_ptr<ChatStream> stream(new ChatStream());
   auto final_response = build_mock_response(messages);
-  response.response = final_response.response;
-  response.confidence_score = final_response.confidence_score;
-  response.model_name = final_response.model_name;
+  stream->model_ = this;
+  stream->model_name_ = final_response.model_name;
+  stream->context_.fullReply = final_response.response;
+  stream->context_.confidence = final_response.confidence_score;
 
-  int seq_no = 0;
   Json::Value chunks = config_json_["mock_chunks"];
   if (chunks.isArray() && !chunks.empty()) {
     for (const auto& chunk : chunks) {
-      response.chunks.push_back(StreamChunk{++seq_no, chunk.asString(), false});
+      stream->context_.chunks.push_back(chunk.asString());
     }
   } else {
     const int chunk_size = 16;
-    for (size_t offset = 0; offset < response.response.size(); offset += chunk_size) {
-      response.chunks.push_back(
-        StreamChunk{++seq_no, response.response.substr(offset, chunk_size), false});
+    const std::string& text = final_response.response;
+    for (size_t offset = 0; offset < text.size(); offset += chunk_size) {
+      stream->context_.chunks.push_back(text.substr(offset, chunk_size));
     }
   }
-
-  response.chunks.push_back(StreamChunk{seq_no + 1, response.response, true});
-  return response;
-}
-
-std::vector<float> LLMInterface::build_deterministic_embedding(const std::string& text,
-                                                               int dimensions) const {
-  std::vector<float> embedding(dimensions, 0.0f);
-  std::hash<std::string> hasher;
-  for (int i = 0; i < dimensions; ++i) {
-    size_t hashed = hasher(text + "#" + std::to_string(i));
-    embedding[i] = static_cast<float>((hashed % 2000) - 1000) / 1000.0f;
-  }
-  return embedding;
+  return stream;
 }
 
 std::string LLMInterface::generate_signature(const std::string& request_body) {
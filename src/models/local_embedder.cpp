@@ -0,0 +1,180 @@
+#include "models/local_embedder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "models/simd_kernels.h"
+
+namespace pg_llm {
+
+namespace {
+
+// Relative weight of each feature kind
+constexpr float kTrigramWeight = 0.5f;
+constexpr float kWordWeight = 1.0f;
+constexpr float kBigramWeight = 0.5f;
+
+// Mixed into every feature hash so equal bytes of different kinds land apart
+constexpr uint64_t kTrigramSeed = 0x9e3779b97f4a7c15ULL;
+constexpr uint64_t kWordSeed = 0xc2b2ae3d27d4eb4fULL;
+constexpr uint64_t kBigramSeed = 0x165667b19e3779f9ULL;
+constexpr uint64_t kEmptySeed = 0x27d4eb2f165667c5ULL;
+
+constexpr uint64_t kFnvOffset = 0xcbf29ce484222325ULL;
+constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+
+// SplitMix64 finalizer: every input bit affects every output bit
+inline uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+inline bool is_space(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// Letters, digits, '_' and any byte of a multibyte UTF-8 sequence
+inline bool is_word_byte(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+inline unsigned char fold_case(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+}
+
+LocalFeature feature_slot(uint64_t hash, float weight, uint32_t buckets) {
+  uint64_t h = mix(hash);
+  // Low half picks the bucket (multiply-shift range reduction), top bit the sign
+  LocalFeature feature;
+  feature.index = static_cast<uint32_t>(((h & 0xffffffffULL) * buckets) >> 32);
+  feature.weight = (h >> 63) != 0 ? -weight : weight;
+  return feature;
+}
+
+// Scatters signed feature weights into the output vector
+class ScatterSink {
+public:
+  ScatterSink(float* out, uint32_t dimensions) : out_(out), dimensions_(dimensions) {}
+
+  void add(uint64_t hash, float weight) {
+    LocalFeature feature = feature_slot(hash, weight, dimensions_);
+    out_[feature.index] += feature.weight;
+  }
+
+private:
+  float* out_;
+  uint32_t dimensions_;
+};
+
+class CollectSink {
+public:
+  CollectSink(std::vector<LocalFeature>* features, uint32_t buckets) : features_(features), buckets_(buckets) {}
+
+  void add(uint64_t hash, float weight) { features_->push_back(feature_slot(hash, weight, buckets_)); }
+
+private:
+  std::vector<LocalFeature>* features_;
+  uint32_t buckets_;
+};
+
+// The text is read as " " + collapsed text + " ", so words get boundary
+// trigrams; window holds the last three bytes
+template <typename Sink>
+void extract_features(std::string_view text, Sink* sink) {
+  uint32_t window = ' ';
+  int window_length = 1;
+  bool last_space = true;
+  bool in_word = false;
+  bool have_previous = false;
+  uint64_t word_hash = kFnvOffset;
+  uint64_t previous_word = 0;
+
+  auto push_byte = [&](unsigned char c) {
+    window = ((window << 8) | c) & 0xffffffu;
+    if (++window_length >= 3) {
+      sink->add(kTrigramSeed ^ window, kTrigramWeight);
+    }
+  };
+  auto end_word = [&]() {
+    if (!in_word) {
+      return;
+    }
+    sink->add(kWordSeed ^ word_hash, kWordWeight);
+    if (have_previous) {
+      sink->add(kBigramSeed ^ (mix(previous_word) + word_hash), kBigramWeight);
+    }
+    previous_word = word_hash;
+    have_previous = true;
+    word_hash = kFnvOffset;
+    in_word = false;
+  };
+
+  for (unsigned char c : text) {
+    if (is_space(c)) {
+      end_word();
+      if (!last_space) {
+        push_byte(' ');
+        last_space = true;
+      }
+      continue;
+    }
+    c = fold_case(c);
+    push_byte(c);
+    last_space = false;
+    if (is_word_byte(c)) {
+      word_hash = (word_hash ^ c) * kFnvPrime;
+      in_word = true;
+    } else {
+      end_word();
+    }
+  }
+  end_word();
+  if (!last_space) {
+    push_byte(' ');
+  }
+}
+
+}  // namespace
+
+void local_features(std::string_view text, uint32_t buckets, std::vector<LocalFeature>* features) {
+  features->clear();
+  CollectSink sink(features, buckets);
+  extract_features(text, &sink);
+  if (features->empty()) {
+    features->push_back(feature_slot(kEmptySeed, 1.0f, buckets));
+  }
+}
+
+void local_embed(std::string_view text, int dimensions, float* out) {
+  if (dimensions <= 0) {
+    return;
+  }
+  size_t count = static_cast<size_t>(dimensions);
+  std::fill(out, out + count, 0.0f);
+  ScatterSink sink(out, static_cast<uint32_t>(dimensions));
+  extract_features(text, &sink);
+
+  const SimdKernels& k = simd_kernels();
+  float norm = std::sqrt(k.sum_squares(out, count));
+  if (norm == 0.0f) {
+    // Blank text (or features that cancelled out) still gets a unit vector,
+    // which cosine distance needs
+    sink.add(kEmptySeed, 1.0f);
+    norm = std::sqrt(k.sum_squares(out, count));
+  }
+  k.scale(out, count, 1.0f / norm);
+}
+
+std::vector<float> local_embedding(std::string_view text, int dimensions) {
+  std::vector<float> embedding(static_cast<size_t>(std::max(dimensions, 0)));
+  local_embed(text, dimensions, embedding.data());
+  return embedding;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,204 @@
+#include "models/local_model.h"
+
+extern "C" {
+#include "postgres.h"
+#include "storage/fd.h"
+}
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "models/local_embedder.h"
+#include "models/simd_kernels.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr char kMagic[8] = {'P', 'G', 'L', 'L', 'M', 'E', 'M', 'B'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kSectionAlignment = 64;
+
+// Sanity bounds; pgvector caps vectors at 16000 dimensions
+constexpr uint32_t kMaxVocabSize = 1u << 24;
+constexpr uint32_t kMaxHiddenSize = 8192;
+constexpr uint32_t kMaxOutputSize = 16000;
+
+struct LocalModelHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t vocab_size;
+  uint32_t hidden_size;
+  uint32_t output_size;
+  uint32_t reserved[4];
+};
+
+size_t align_section(size_t offset) {
+  return (offset + kSectionAlignment - 1) & ~(kSectionAlignment - 1);
+}
+
+// Models mapped by this backend, by resolved path
+std::unordered_map<std::string, std::shared_ptr<const LocalEmbeddingModel>>& mapped_models() {
+  static std::unordered_map<std::string, std::shared_ptr<const LocalEmbeddingModel>> models;
+  return models;
+}
+
+std::string file_identity(const std::string& path, const struct stat& st) {
+  return path + ":" + std::to_string(static_cast<long long>(st.st_size)) + ":" +
+         std::to_string(static_cast<long long>(st.st_mtime));
+}
+
+}  // namespace
+
+std::shared_ptr<const LocalEmbeddingModel> LocalEmbeddingModel::open(const std::string& path,
+                                                                      std::string* error) {
+  if (path.empty()) {
+    *error = "embedding_model_path is not set";
+    return nullptr;
+  }
+  // Backends run in the data directory, so relative paths resolve there
+  std::vector<char> resolved(path.begin(), path.end());
+  resolved.push_back('\0');
+  canonicalize_path(resolved.data());
+  if (!path_is_relative_and_below_cwd(resolved.data())) {
+    *error = "embedding_model_path must be a relative path inside the data directory";
+    return nullptr;
+  }
+  std::string relative(resolved.data());
+
+  int fd = OpenTransientFile(relative.c_str(), O_RDONLY | PG_BINARY);
+  if (fd < 0) {
+    *error = "could not open \"" + relative + "\": " + strerror(errno);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = "could not stat \"" + relative + "\": " + strerror(errno);
+    CloseTransientFile(fd);
+    return nullptr;
+  }
+
+  auto& models = mapped_models();
+  std::string identity = file_identity(relative, st);
+  auto cached = models.find(relative);
+  if (cached != models.end() && cached->second->identity() == identity) {
+    CloseTransientFile(fd);
+    return cached->second;
+  }
+
+  size_t file_size = static_cast<size_t>(st.st_size);
+  if (file_size < sizeof(LocalModelHeader)) {
+    *error = "\"" + relative + "\" is too small to be a model file";
+    CloseTransientFile(fd);
+    return nullptr;
+  }
+  void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  int mmap_errno = errno;
+  CloseTransientFile(fd);
+  if (mapping == MAP_FAILED) {
+    *error = "could not map \"" + relative + "\": " + strerror(mmap_errno);
+    return nullptr;
+  }
+
+  // From here on the destructor unmaps on every failure path
+  std::shared_ptr<LocalEmbeddingModel> model(new LocalEmbeddingModel());
+  model->mapping_ = mapping;
+  model->mapping_size_ = file_size;
+  model->identity_ = identity;
+
+  LocalModelHeader header;
+  memcpy(&header, mapping, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    *error = "\"" + relative + "\" is not a version 1 pg_llm embedding model";
+    return nullptr;
+  }
+  if (header.vocab_size == 0 || header.vocab_size > kMaxVocabSize ||
+      header.hidden_size == 0 || header.hidden_size > kMaxHiddenSize || header.hidden_size % 32 != 0 ||
+      header.output_size == 0 || header.output_size > kMaxOutputSize) {
+    *error = "\"" + relative + "\" has unsupported model dimensions";
+    return nullptr;
+  }
+
+  const char* base = static_cast<const char*>(mapping);
+  size_t vocab = header.vocab_size;
+  size_t hidden = header.hidden_size;
+  size_t output = header.output_size;
+  size_t row_scales = align_section(sizeof(LocalModelHeader));
+  size_t table = align_section(row_scales + vocab * sizeof(float));
+  size_t proj_scales = align_section(table + vocab * hidden);
+  size_t bias = align_section(proj_scales + output * sizeof(float));
+  size_t projection = align_section(bias + output * sizeof(float));
+  size_t expected_size = projection + output * hidden;
+  if (file_size < expected_size) {
+    *error = "\"" + relative + "\" is truncated: expected " + std::to_string(expected_size) + " bytes";
+    return nullptr;
+  }
+
+  model->vocab_size_ = header.vocab_size;
+  model->hidden_size_ = header.hidden_size;
+  model->output_size_ = header.output_size;
+  model->row_scales_ = reinterpret_cast<const float*>(base + row_scales);
+  model->table_ = reinterpret_cast<const int8_t*>(base + table);
+  model->proj_scales_ = reinterpret_cast<const float*>(base + proj_scales);
+  model->bias_ = reinterpret_cast<const float*>(base + bias);
+  model->projection_ = reinterpret_cast<const int8_t*>(base + projection);
+  // Feature lookups touch rows at random
+  madvise(mapping, file_size, MADV_RANDOM);
+
+  models[relative] = model;
+  return model;
+}
+
+LocalEmbeddingModel::~LocalEmbeddingModel() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+}
+
+void LocalEmbeddingModel::embed(std::string_view text, float* out) const {
+  const SimdKernels& k = simd_kernels();
+  size_t hidden = hidden_size_;
+
+  // Pool: weighted mean of the dequantized rows of every feature
+  std::vector<LocalFeature> features;
+  local_features(text, vocab_size_, &features);
+  std::vector<float> pooled(hidden, 0.0f);
+  float total_weight = 0.0f;
+  for (const auto& feature : features) {
+    k.axpy_i8(pooled.data(),
+              table_ + static_cast<size_t>(feature.index) * hidden,
+              hidden,
+              feature.weight * row_scales_[feature.index]);
+    total_weight += std::fabs(feature.weight);
+  }
+
+  // Quantize the pooled vector symmetrically to [-127, 127]
+  float max_abs = 0.0f;
+  for (float value : pooled) {
+    max_abs = std::max(max_abs, std::fabs(value));
+  }
+  std::vector<int8_t> quantized(hidden, 0);
+  float input_scale = 0.0f;
+  if (max_abs > 0.0f && total_weight > 0.0f) {
+    float inverse = 127.0f / max_abs;
+    for (size_t i = 0; i < hidden; ++i) {
+      quantized[i] = static_cast<int8_t>(std::lrint(pooled[i] * inverse));
+    }
+    input_scale = max_abs / 127.0f / total_weight;
+  }
+
+  // Project: one int8 dot product per output dimension
+  for (uint32_t o = 0; o < output_size_; ++o) {
+    int32_t dot = k.dot_i8(projection_ + static_cast<size_t>(o) * hidden, quantized.data(), hidden);
+    out[o] = proj_scales_[o] * input_scale * static_cast<float>(dot) + bias_[o];
+  }
+}
+
+} // namespace pg_llm
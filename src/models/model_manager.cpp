@@ -1,21 +1,53 @@
 #include "models/model_manager.h"
 
-#include <future>
-#include <thread>
+extern "C" {
+#include "miscadmin.h"
+}
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <chrono>
 
+#include "catalog/model_registry.h"
 #include "catalog/pg_llm_models.h"
+#include "models/circuit_breaker.h"
+#include "models/http_engine.h"
 #include "models/llm_interface.h"
 #include "utils/pg_llm_support.h"
 
 namespace pg_llm {
 
+namespace {
+
+// Identifies the catalog row an instance was built from without keeping a
+// second copy of its secrets
+std::string source_digest(bool local_model,
+                          const std::string& model_type,
+                          const std::string& api_key,
+                          const std::string& config) {
+  std::string source(1, local_model ? '1' : '0');
+  for (const std::string* field : {&model_type, &api_key, &config}) {
+    source += std::to_string(field->size());
+    source += ':';
+    source += *field;
+  }
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(source.data()),
+         source.size(),
+         reinterpret_cast<unsigned char*>(&digest[0]));
+  return digest;
+}
+
+}  // namespace
+
 ModelManager& ModelManager::get_instance() {
   static ModelManager instance;
   return instance;
 }
 
 void ModelManager::register_model(const std::string& model_type, ModelCreator creator) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_lock<std::shared_mutex> lock(mutex_);
   model_creators_[model_type] = creator;
 }
 
@@ -24,70 +56,117 @@ bool ModelManager::create_model_instance(bool local_model,
     const std::string& instance_name,
     const std::string& api_key,
     const std::string& model_config) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  return create_model_instance(local_model,
+                               model_type,
+                               instance_name,
+                               api_key,
+                               model_config,
+                               ModelRegistry::get_instance().generation());
+}
 
-  auto creator_it = model_creators_.find(model_type);
-  if (creator_it == model_creators_.end()) {
-    return false;
+bool ModelManager::create_model_instance(bool local_model,
+    const std::string& model_type,
+    const std::string& instance_name,
+    const std::string& api_key,
+    const std::string& model_config,
+    uint64_t generation) {
+  ModelCreator creator;
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto creator_it = model_creators_.find(model_type);
+    if (creator_it == model_creators_.end()) {
+      return false;
+    }
+    creator = creator_it->second;
   }
 
-  auto model = creator_it->second();
+  // Built outside the lock; lookups keep getting the current instance
+  std::shared_ptr<LLMInterface> model = creator();
+  model->set_instance_name(instance_name, MyDatabaseId);
   if (!model->initialize(local_model, api_key, model_config)) {
     PG_LLM_LOG_FATAL("model:%s init failed.", model_type.c_str());
     return false;
   }
 
+  // Optional warm-up so the first request skips DNS and the TLS handshake
+  model->preconnect();
+
+  // Swap it in whole; requests holding the previous instance finish on it
+  std::unique_lock<std::shared_mutex> lock(mutex_);
   model_instances_[instance_name] = std::move(model);
+  sources_[instance_name] = InstanceSource{generation, source_digest(local_model, model_type, api_key, model_config)};
   return true;
 }
 
 bool ModelManager::remove_model_instance(const std::string& instance_name) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  sources_.erase(instance_name);
   return model_instances_.erase(instance_name) > 0;
 }
 
+std::string ModelManager::instance_digest(const std::string& instance_name) {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto source = sources_.find(instance_name);
+  return source == sources_.end() ? std::string() : source->second.digest;
+}
+
 std::shared_ptr<LLMInterface> ModelManager::get_model(const std::string& instance_name) {
+  auto& registry = ModelRegistry::get_instance();
+  uint64_t generation = registry.generation();
+  std::shared_ptr<LLMInterface> current;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_lock<std::shared_mutex> lock(mutex_);
     auto it = model_instances_.find(instance_name);
     if (it != model_instances_.end()) {
-      return it->second;
+      auto source = sources_.find(instance_name);
+      if (source == sources_.end() || source->second.generation == generation) {
+        return it->second;
+      }
+      current = it->second;
     }
   }
 
+  // Not built yet, or pg_llm_models changed since it was
   PgLlmModelInfo info;
-  bool result = pg_llm_model_get_info(instance_name, &info);
-  if (unlikely(!result)) {
+  std::string decrypt_error;
+  if (unlikely(!registry.lookup(instance_name, &info, &decrypt_error))) {
+    if (current) {
+      remove_model_instance(instance_name);
+    }
     return nullptr;
   }
-
-  std::string api_key = info.api_key;
-  std::string config = info.config;
-  try {
-    if (!info.encrypted_api_key.empty()) {
-      api_key = pg_llm_decrypt_text(info.encrypted_api_key);
-    }
-    if (!info.encrypted_config.empty()) {
-      config = pg_llm_decrypt_text(info.encrypted_config);
-    }
-  } catch (const std::exception& e) {
+  if (!decrypt_error.empty()) {
     PG_LLM_LOG_ERROR("failed to decrypt model config for %s: %s",
                      instance_name.c_str(),
-                     e.what());
+                     decrypt_error.c_str());
     return nullptr;
   }
 
+  if (current) {
+    // Keep the instance, and its warm connections, when its row is unchanged
+    std::string digest = source_digest(info.local_model, info.model_type, info.api_key, info.config);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto source = sources_.find(instance_name);
+    if (source != sources_.end() && source->second.digest == digest) {
+      source->second.generation = generation;
+      return current;
+    }
+  }
+
   auto& manager = pg_llm::ModelManager::get_instance();
   manager.register_model(info.model_type, [model_type = info.model_type]() {
     return std::make_unique<pg_llm::LLMInterface>(model_type);
   });
-  result = manager.create_model_instance(info.local_model,
-                                         info.model_type,
-                                         instance_name,
-                                         api_key,
-                                         config);
+  bool result = manager.create_model_instance(info.local_model,
+                                              info.model_type,
+                                              instance_name,
+                                              info.api_key,
+                                              info.config,
+                                              generation);
   if (result) {
-    return get_model(instance_name);
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = model_instances_.find(instance_name);
+    return it != model_instances_.end() ? it->second : nullptr;
   }
 
   return nullptr;
@@ -96,55 +175,299 @@ std::shared_ptr<LLMInterface> ModelManager::get_model(const std::string& instanc
 std::vector<ModelResponse> ModelManager::parallel_inference(
   const std::string& prompt,
   const std::vector<std::string>& model_names) {
+  std::vector<ChatMessage> messages = {{"user", prompt}};
+  return parallel_inference(messages, model_names);
+}
 
-  std::vector<std::future<ModelResponse>> futures;
+std::vector<ModelResponse> ModelManager::parallel_inference(
+  const std::vector<ChatMessage>& messages,
+  const std::vector<std::string>& model_names) {
+  auto candidates = parallel_inference(messages, model_names, ParallelOptions{});
   std::vector<ModelResponse> responses;
+  responses.reserve(candidates.size());
+  for (auto& candidate : candidates) {
+    responses.push_back(std::move(candidate.response));
+  }
+  return responses;
+}
+
+namespace {
 
-  // Launch parallel inference tasks
+// Upper bound for one wait on the sockets between bookkeeping passes
+constexpr int kPollIntervalMs = 100;
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point since) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+bool transfer_succeeded(const HttpTransfer& transfer) {
+  return transfer.result == CURLE_OK && transfer.http_code == 200;
+}
+
+}  // namespace
+
+std::vector<ParallelCandidate> ModelManager::parallel_inference(
+  const std::vector<ChatMessage>& messages,
+  const std::vector<std::string>& model_names,
+  const ParallelOptions& options) {
+
+  // One requested candidate with its optional hedge. Member order matters:
+  // transfers must be released before their models.
+  struct Slot {
+    std::shared_ptr<LLMInterface> model;
+    std::shared_ptr<LLMInterface> hedge_model;
+    std::string hedge_instance;
+    std::unique_ptr<HttpTransfer> transfer;
+    std::unique_ptr<HttpTransfer> hedge_transfer;
+    std::optional<Clock::time_point> hedge_at;
+    ModelResponse hedge_response;
+    ParallelCandidate candidate;
+  };
+
+  auto& engine = HttpEngine::get_instance();
+  auto started = Clock::now();
+  std::vector<Slot> slots;
+  slots.reserve(model_names.size());
+
+  // Queue every request on the shared engine; unavailable models and mock
+  // models without "mock_delay_ms" answer immediately.
   for (const auto& model_name : model_names) {
     auto model = get_model(model_name);
     if (!model) continue;
 
-    futures.push_back(std::async(std::launch::async,
-    [model, prompt]() {
-      return model->chat_completion(prompt);
+    Slot slot;
+    slot.model = model;
+    slot.candidate.instance_name = model_name;
+    slot.candidate.answered_by = model_name;
+    slot.transfer = model->begin_chat_completion(messages, &slot.candidate.response);
+    if (!slot.transfer) {
+      slot.candidate.finished = true;
+    } else {
+      engine.add(slot.transfer.get());
+      Json::Value config = model->get_config();
+      std::string hedge_instance = config.get("hedge_instance", "").asString();
+      if (options.hedge && !hedge_instance.empty() && hedge_instance != model_name) {
+        // Without enough shared history fall back to the configured delay
+        double delay_ms = CircuitBreaker::get_instance()
+                            .latency_p95(model->get_database_id(), model->get_instance_name())
+                            .value_or(config.get("hedge_after_ms", 0).asDouble());
+        slot.hedge_model = delay_ms > 0.0 ? get_model(hedge_instance) : nullptr;
+        if (slot.hedge_model) {
+          slot.hedge_instance = hedge_instance;
+          slot.hedge_at = started + std::chrono::duration_cast<Clock::duration>(
+                                      std::chrono::duration<double, std::milli>(delay_ms));
+        }
+      }
     }
-                                ));
+    slots.push_back(std::move(slot));
   }
 
-  // Collect results
-  for (auto& future : futures) {
-    responses.push_back(future.get());
+  auto accepted = [&]() {
+    if (!options.accept) {
+      return false;
+    }
+    for (const auto& slot : slots) {
+      if (slot.candidate.finished &&
+          options.accept(slot.candidate.answered_by, slot.candidate.response)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  auto pending = [&]() {
+    return std::any_of(slots.begin(), slots.end(),
+                       [](const Slot& slot) { return !slot.candidate.finished; });
+  };
+
+  while (pending() && !accepted()) {
+    if (HttpEngine::interrupt_pending()) {
+      // Abort the outstanding transfers before the error unwinds this frame
+      for (auto& slot : slots) {
+        slot.transfer.reset();
+        slot.hedge_transfer.reset();
+      }
+    }
+    CHECK_FOR_INTERRUPTS();
+
+    // Wake up in time for the next hedge
+    int timeout_ms = kPollIntervalMs;
+    for (const auto& slot : slots) {
+      if (!slot.candidate.finished && slot.hedge_at.has_value() && !slot.candidate.hedged) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(*slot.hedge_at - Clock::now());
+        timeout_ms = std::clamp(static_cast<int>(wait.count()), 0, timeout_ms);
+      }
+    }
+    engine.run_once(timeout_ms);
+
+    for (auto& slot : slots) {
+      if (slot.candidate.finished) {
+        continue;
+      }
+      ParallelCandidate& candidate = slot.candidate;
+      HttpTransfer* primary = slot.transfer.get();
+      HttpTransfer* hedge = slot.hedge_transfer.get();
+      bool primary_ok = primary && primary->done && transfer_succeeded(*primary);
+      bool hedge_ok = hedge && hedge->done && transfer_succeeded(*hedge);
+
+      // The first successful leg wins; a failed leg only counts once the
+      // other one has failed too
+      if (primary && primary->done && (primary_ok || ((!hedge || hedge->done) && !hedge_ok))) {
+        candidate.response = slot.model->finish_chat_completion(*primary);
+        candidate.latency_ms = elapsed_ms(started);
+        candidate.finished = true;
+      } else if (hedge && hedge->done && (hedge_ok || (primary && primary->done))) {
+        candidate.response = slot.hedge_model->finish_chat_completion(*hedge);
+        candidate.answered_by = slot.hedge_instance;
+        candidate.latency_ms = elapsed_ms(started);
+        candidate.finished = true;
+      }
+      if (candidate.finished) {
+        slot.transfer.reset();
+        slot.hedge_transfer.reset();
+        continue;
+      }
+
+      if (slot.hedge_at.has_value() && !candidate.hedged && Clock::now() >= *slot.hedge_at) {
+        candidate.hedged = true;
+        slot.hedge_transfer = slot.hedge_model->begin_chat_completion(messages, &slot.hedge_response);
+        if (slot.hedge_transfer) {
+          engine.add(slot.hedge_transfer.get());
+        } else if (slot.hedge_response.error.empty()) {
+          // The hedge instance answered without a request
+          candidate.response = slot.hedge_response;
+          candidate.answered_by = slot.hedge_instance;
+          candidate.latency_ms = elapsed_ms(started);
+          candidate.finished = true;
+          slot.transfer.reset();
+        }
+      }
+    }
   }
 
-  return responses;
+  // Whatever is still running lost the race; destroying it cancels it
+  std::vector<ParallelCandidate> candidates;
+  candidates.reserve(slots.size());
+  for (auto& slot : slots) {
+    slot.transfer.reset();
+    slot.hedge_transfer.reset();
+    if (!slot.candidate.finished) {
+      slot.candidate.response = ModelResponse{"", 0.0, slot.model->get_model_name()};
+      slot.candidate.latency_ms = elapsed_ms(started);
+    }
+    candidates.push_back(std::move(slot.candidate));
+  }
+  return candidates;
 }
 
-std::vector<ModelResponse> ModelManager::parallel_inference(
-  const std::vector<ChatMessage>& messages,
-  const std::vector<std::string>& model_names) {
+std::vector<BatchResult> ModelManager::batch_inference(
+  const std::string& instance_name,
+  const std::vector<std::vector<ChatMessage>>& requests,
+  size_t max_concurrency) {
+  std::vector<BatchResult> results(requests.size());
+  auto model = get_model(instance_name);
+  if (!model) {
+    for (auto& result : results) {
+      result.error = "Model instance not found: " + instance_name;
+    }
+    return results;
+  }
 
-  std::vector<std::future<ModelResponse>> futures;
-  std::vector<ModelResponse> responses;
+  struct InFlight {
+    size_t index;
+    int attempt;
+    std::unique_ptr<HttpTransfer> transfer;
+  };
+  // A failed request waiting to be sent again
+  struct Retry {
+    size_t index;
+    int attempt;
+    Clock::time_point at;
+  };
 
-  // Launch parallel inference tasks
-  for (const auto& model_name : model_names) {
-    auto model = get_model(model_name);
-    if (!model) continue;
+  auto& engine = HttpEngine::get_instance();
+  std::vector<InFlight> in_flight;
+  std::vector<Retry> retries;
+  max_concurrency = std::max<size_t>(1, max_concurrency);
+  size_t next = 0;
 
-    futures.push_back(std::async(std::launch::async,
-      [model, messages]() {
-        return model->chat_completion(messages);
+  // Send attempt number `attempt` of a request
+  auto start = [&](size_t index, int attempt) {
+    ModelResponse immediate;
+    auto transfer = model->begin_chat_completion(requests[index], &immediate);
+    if (!transfer) {
+      // Only mock models answer without a transfer; anything else failed
+      results[index].response = immediate;
+      results[index].error = immediate.error;
+      return;
+    }
+    engine.add(transfer.get());
+    in_flight.push_back(InFlight{index, attempt, std::move(transfer)});
+  };
+
+  while (next < requests.size() || !in_flight.empty() || !retries.empty()) {
+    // Keep the window full, due retries first
+    auto now = Clock::now();
+    for (auto it = retries.begin(); it != retries.end() && in_flight.size() < max_concurrency;) {
+      if (it->at <= now) {
+        start(it->index, it->attempt);
+        it = retries.erase(it);
+      } else {
+        ++it;
       }
-    ));
-  }
+    }
+    while (next < requests.size() && in_flight.size() < max_concurrency) {
+      start(next++, 1);
+    }
 
-  // Collect results
-  for (auto& future : futures) {
-    responses.push_back(future.get());
+    if (in_flight.empty() && retries.empty()) {
+      continue;
+    }
+
+    if (HttpEngine::interrupt_pending()) {
+      // Abort the outstanding transfers before the error unwinds this frame
+      for (const auto& call : in_flight) {
+        results[call.index].error = "canceled";
+      }
+      for (const auto& retry : retries) {
+        results[retry.index].error = "canceled";
+      }
+      in_flight.clear();
+      retries.clear();
+    }
+    CHECK_FOR_INTERRUPTS();
+
+    // Wake up in time for the next retry
+    long timeout_ms = kPollIntervalMs;
+    for (const auto& retry : retries) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(retry.at - Clock::now());
+      timeout_ms = std::clamp<long>(wait.count(), 0, timeout_ms);
+    }
+    if (in_flight.empty()) {
+      engine.sleep(timeout_ms);
+      continue;
+    }
+    engine.run_once(static_cast<int>(timeout_ms));
+
+    auto finished = std::stable_partition(in_flight.begin(), in_flight.end(),
+                                          [](const InFlight& call) {
+                                            return !call.transfer->done;
+                                          });
+    for (auto it = finished; it != in_flight.end(); ++it) {
+      long delay_ms = model->retry_delay_ms(*it->transfer, it->attempt);
+      if (delay_ms >= 0) {
+        retries.push_back(Retry{it->index, it->attempt + 1, Clock::now() + std::chrono::milliseconds(delay_ms)});
+        continue;
+      }
+      BatchResult& result = results[it->index];
+      result.response = model->finish_chat_completion(*it->transfer);
+      result.error = result.response.error;
+    }
+    in_flight.erase(finished, in_flight.end());
   }
 
-  return responses;
+  return results;
 }
 
 ModelResponse ModelManager::get_best_response(
@@ -0,0 +1,404 @@
+#include "models/rate_limiter.h"
+
+extern "C" {
+#include "postgres.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+}
+
+#include <algorithm>
+#include <cmath>
+
+#include "models/http_engine.h"
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_shmem.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm rate limiter";
+
+// Instances that can be limited at once, and waiters queued per instance.
+// Waiters beyond the queue size retry until a position frees up.
+constexpr int kMaxSlots = 128;
+constexpr int kQueueSize = 256;
+
+// A slot with nothing in flight or queued that was not touched for this
+// long goes to another instance once the table is full
+constexpr int64 kIdleSlotUsecs = 10 * 60 * USECS_PER_SEC;
+
+// Upper bound for one sleep, so deadlines and interrupts are noticed
+constexpr long kPollIntervalMs = 100;
+
+// Rough characters per token for request size estimates
+constexpr int64_t kCharsPerToken = 4;
+
+struct RateLimitSlot {
+  slock_t mutex;
+  bool used;
+  Oid database_id;
+  uint8 key[PG_LLM_SLOT_KEY_SIZE];  // pg_llm_slot_key()
+  TimestampTz last_used;
+  double requests_per_second;       // Limits last seen for this instance
+  double tokens_per_minute;
+  double request_credits;
+  double token_credits;             // May go negative after settle()
+  TimestampTz refilled_at;
+  int32 in_flight;
+  uint64 next_ticket;
+  uint64 queue_head;                // Monotonic ring positions
+  uint64 queue_tail;
+  uint64 queue[kQueueSize];         // Tickets in arrival order, 0 = abandoned
+  ConditionVariable changed;        // Broadcast whenever capacity frees up
+};
+
+using RateLimitShared = PgLlmSlotTable<RateLimitSlot, kMaxSlots>;
+
+RateLimitShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<RateLimitShared*>(ptr);
+  if (found) {
+    return;
+  }
+  shared->init();
+  for (auto& slot : shared->slots) {
+    ConditionVariableInit(&slot.changed);
+  }
+}
+
+// Callers hold slot->mutex for every helper below
+
+bool reclaimable(const RateLimitSlot& slot, TimestampTz now) {
+  return slot.in_flight == 0 && slot.queue_head == slot.queue_tail &&
+         now - slot.last_used >= kIdleSlotUsecs;
+}
+
+void refill(RateLimitSlot* slot, const RateLimits& limits, TimestampTz now) {
+  double elapsed = std::max<double>(0.0, now - slot->refilled_at) / USECS_PER_SEC;
+  slot->requests_per_second = limits.requests_per_second;
+  slot->tokens_per_minute = limits.tokens_per_minute;
+  if (limits.requests_per_second > 0.0) {
+    // Allow a burst of one second worth of requests
+    double burst = std::max(1.0, limits.requests_per_second);
+    slot->request_credits = std::min(burst, slot->request_credits + elapsed * limits.requests_per_second);
+  }
+  if (limits.tokens_per_minute > 0.0) {
+    slot->token_credits = std::min(limits.tokens_per_minute,
+                                   slot->token_credits + elapsed * limits.tokens_per_minute / 60.0);
+  }
+  slot->refilled_at = now;
+}
+
+void compact_queue(RateLimitSlot* slot) {
+  while (slot->queue_head < slot->queue_tail && slot->queue[slot->queue_head % kQueueSize] == 0) {
+    slot->queue_head++;
+  }
+}
+
+bool enqueue(RateLimitSlot* slot, uint64 ticket) {
+  if (slot->queue_tail - slot->queue_head >= kQueueSize) {
+    return false;
+  }
+  slot->queue[slot->queue_tail % kQueueSize] = ticket;
+  slot->queue_tail++;
+  return true;
+}
+
+void dequeue(RateLimitSlot* slot, uint64 ticket) {
+  for (uint64 pos = slot->queue_head; pos < slot->queue_tail; ++pos) {
+    if (slot->queue[pos % kQueueSize] == ticket) {
+      slot->queue[pos % kQueueSize] = 0;
+      break;
+    }
+  }
+  compact_queue(slot);
+}
+
+bool first_in_line(RateLimitSlot* slot, uint64 ticket, bool queued) {
+  compact_queue(slot);
+  if (slot->queue_head == slot->queue_tail) {
+    return true;
+  }
+  return queued && slot->queue[slot->queue_head % kQueueSize] == ticket;
+}
+
+void xact_callback(XactEvent event, void* arg) {
+  if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT) {
+    RateLimiter::get_instance().release_held(0);
+  }
+}
+
+void subxact_callback(SubXactEvent event, SubTransactionId my_subid, SubTransactionId parent_subid, void* arg) {
+  if (event == SUBXACT_EVENT_ABORT_SUB) {
+    RateLimiter::get_instance().release_held(my_subid);
+  }
+}
+
+void exit_callback(int code, Datum arg) {
+  RateLimiter::get_instance().release_held(0);
+}
+
+}  // namespace
+
+RateLimits RateLimits::from_config(const Json::Value& config) {
+  RateLimits limits;
+  if (!config.isObject()) {
+    return limits;
+  }
+  limits.requests_per_second = config.get("rate_limit_rps", 0.0).asDouble();
+  limits.tokens_per_minute = config.get("rate_limit_tpm", 0.0).asDouble();
+  limits.max_concurrency = config.get("max_concurrency", 0).asInt();
+  limits.fail_fast = config.get("rate_limit_fail_fast", false).asBool();
+  return limits;
+}
+
+RateLimiter& RateLimiter::get_instance() {
+  static RateLimiter instance;
+  return instance;
+}
+
+void RateLimiter::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(RateLimitShared), init_shared);
+}
+
+bool RateLimiter::available() const {
+  return shared != nullptr;
+}
+
+void RateLimiter::register_callbacks() {
+  if (callbacks_registered_) {
+    return;
+  }
+  RegisterXactCallback(xact_callback, nullptr);
+  RegisterSubXactCallback(subxact_callback, nullptr);
+  before_shmem_exit(exit_callback, 0);
+  callbacks_registered_ = true;
+}
+
+int RateLimiter::find_slot(uint32_t database_id, const std::string& instance_name, bool create) {
+  auto reset = [](RateLimitSlot& slot, TimestampTz now) {
+    // Start with full buckets; refill() trims them to the real limits
+    slot.requests_per_second = 0.0;
+    slot.tokens_per_minute = 0.0;
+    slot.request_credits = HUGE_VAL;
+    slot.token_credits = HUGE_VAL;
+    slot.refilled_at = now;
+    slot.in_flight = 0;
+    slot.next_ticket = 0;
+    slot.queue_head = 0;
+    slot.queue_tail = 0;
+  };
+  return shared->find(&slot_index_, database_id, instance_name, create, reclaimable, reset);
+}
+
+RatePermit RateLimiter::acquire(uint32_t database_id,
+                                const std::string& instance_name,
+                                const RateLimits& limits,
+                                int64_t estimated_tokens) {
+  int index = available() ? find_slot(database_id, instance_name, true) : -1;
+  if (index < 0) {
+    if (available()) {
+      PG_LLM_LOG_WARNING("rate limiter has no free slot for instance %s; not limiting it",
+                         instance_name.c_str());
+    }
+    return ++next_permit_;
+  }
+  register_callbacks();
+
+  RateLimitSlot* slot = &shared->slots[index];
+  long max_wait = limits.fail_fast ? 0 : pg_llm_rate_limit_max_wait;
+  // Waiting past the caller's deadline would only produce a timed-out transfer
+  long deadline_ms = HttpEngine::get_instance().deadline_remaining_ms();
+  if (deadline_ms >= 0 && (max_wait < 0 || deadline_ms < max_wait)) {
+    max_wait = deadline_ms;
+  }
+  // A single request larger than the whole budget would never fit
+  double cost = limits.tokens_per_minute > 0.0
+    ? std::min<double>(estimated_tokens, limits.tokens_per_minute)
+    : 0.0;
+  TimestampTz start = GetCurrentTimestamp();
+  uint64 ticket = 0;
+  bool queued = false;
+
+  for (;;) {
+    TimestampTz now = GetCurrentTimestamp();
+    long wait_ms = kPollIntervalMs;
+    bool granted = false;
+
+    SpinLockAcquire(&slot->mutex);
+    slot->last_used = now;
+    refill(slot, limits, now);
+    if (ticket == 0) {
+      ticket = ++slot->next_ticket;
+    }
+    if (!queued) {
+      queued = enqueue(slot, ticket);
+    }
+    bool concurrency_ok = limits.max_concurrency <= 0 || slot->in_flight < limits.max_concurrency;
+    bool requests_ok = limits.requests_per_second <= 0.0 || slot->request_credits >= 1.0;
+    bool tokens_ok = limits.tokens_per_minute <= 0.0 || slot->token_credits >= cost;
+    if (first_in_line(slot, ticket, queued)) {
+      if (concurrency_ok && requests_ok && tokens_ok) {
+        if (limits.requests_per_second > 0.0) {
+          slot->request_credits -= 1.0;
+        }
+        if (limits.tokens_per_minute > 0.0) {
+          slot->token_credits -= cost;
+        }
+        slot->in_flight++;
+        granted = true;
+      } else {
+        // Sleep until the bucket that holds us back has refilled
+        if (!requests_ok) {
+          double seconds = (1.0 - slot->request_credits) / limits.requests_per_second;
+          wait_ms = std::min(wait_ms, static_cast<long>(std::ceil(seconds * 1000.0)));
+        }
+        if (!tokens_ok) {
+          double seconds = (cost - slot->token_credits) * 60.0 / limits.tokens_per_minute;
+          wait_ms = std::min(wait_ms, static_cast<long>(std::ceil(seconds * 1000.0)));
+        }
+      }
+    }
+    if (queued && (granted || max_wait == 0)) {
+      dequeue(slot, ticket);
+      queued = false;
+    }
+    SpinLockRelease(&slot->mutex);
+
+    waiting_slot_ = queued ? index : -1;
+    waiting_ticket_ = queued ? ticket : 0;
+    if (granted) {
+      ConditionVariableCancelSleep();
+      // The next waiter may fit as well
+      ConditionVariableBroadcast(&slot->changed);
+      RatePermit permit = ++next_permit_;
+      held_.push_back(HeldPermit{permit, index, GetCurrentSubTransactionId()});
+      return permit;
+    }
+
+    long waited = TimestampDifferenceMilliseconds(start, now);
+    if (max_wait >= 0 && waited >= max_wait) {
+      if (queued) {
+        SpinLockAcquire(&slot->mutex);
+        dequeue(slot, ticket);
+        SpinLockRelease(&slot->mutex);
+        waiting_slot_ = -1;
+        waiting_ticket_ = 0;
+      }
+      ConditionVariableCancelSleep();
+      ConditionVariableBroadcast(&slot->changed);
+      // Rejections without a wait are reported by the caller; the pg_llm
+      // workers retry them every few milliseconds
+      if (max_wait > 0) {
+        PG_LLM_LOG_WARNING("rate limit for instance %s exceeded after waiting %ld ms",
+                           instance_name.c_str(),
+                           waited);
+      }
+      return 0;
+    }
+    if (max_wait >= 0) {
+      wait_ms = std::min(wait_ms, max_wait - waited);
+    }
+    wait_ms = std::max(wait_ms, 1L);
+
+    auto& engine = HttpEngine::get_instance();
+    if (engine.active_count() > 0) {
+      // Requests this backend already started may hold the capacity we are
+      // waiting for, and only we can drive them to completion
+      CHECK_FOR_INTERRUPTS();
+      engine.run_once(static_cast<int>(wait_ms));
+    } else {
+      ConditionVariableTimedSleep(&slot->changed, wait_ms, PG_WAIT_EXTENSION);
+    }
+  }
+}
+
+void RateLimiter::release(RatePermit permit) {
+  auto it = std::find_if(held_.begin(), held_.end(), [permit](const HeldPermit& held) {
+    return held.id == permit;
+  });
+  if (it == held_.end()) {
+    return;
+  }
+  RateLimitSlot* slot = &shared->slots[it->slot];
+  held_.erase(it);
+
+  SpinLockAcquire(&slot->mutex);
+  if (slot->in_flight > 0) {
+    slot->in_flight--;
+  }
+  SpinLockRelease(&slot->mutex);
+  ConditionVariableBroadcast(&slot->changed);
+}
+
+void RateLimiter::settle(uint32_t database_id,
+                         const std::string& instance_name,
+                         int64_t estimated_tokens,
+                         int64_t actual_tokens) {
+  if (!available() || actual_tokens <= 0) {
+    return;
+  }
+  int index = find_slot(database_id, instance_name, false);
+  if (index < 0) {
+    return;
+  }
+
+  RateLimitSlot* slot = &shared->slots[index];
+  SpinLockAcquire(&slot->mutex);
+  if (slot->tokens_per_minute > 0.0) {
+    double charged = std::min<double>(estimated_tokens, slot->tokens_per_minute);
+    slot->token_credits += charged - static_cast<double>(actual_tokens);
+  }
+  SpinLockRelease(&slot->mutex);
+}
+
+int32_t RateLimiter::in_flight(uint32_t database_id, const std::string& instance_name) {
+  if (!available()) {
+    return 0;
+  }
+  int index = find_slot(database_id, instance_name, false);
+  if (index < 0) {
+    return 0;
+  }
+  RateLimitSlot* slot = &shared->slots[index];
+  SpinLockAcquire(&slot->mutex);
+  int32 count = slot->in_flight;
+  SpinLockRelease(&slot->mutex);
+  return count;
+}
+
+int64_t RateLimiter::estimate_tokens(const std::string& request_body, int64_t max_output_tokens) {
+  return static_cast<int64_t>(request_body.size()) / kCharsPerToken + std::max<int64_t>(0, max_output_tokens);
+}
+
+void RateLimiter::release_held(uint32_t subxact_id) {
+  if (waiting_slot_ >= 0) {
+    RateLimitSlot* slot = &shared->slots[waiting_slot_];
+    SpinLockAcquire(&slot->mutex);
+    dequeue(slot, waiting_ticket_);
+    SpinLockRelease(&slot->mutex);
+    ConditionVariableBroadcast(&slot->changed);
+    waiting_slot_ = -1;
+    waiting_ticket_ = 0;
+  }
+
+  std::vector<RatePermit> abandoned;
+  for (const auto& held : held_) {
+    if (subxact_id == 0 || held.subxact_id >= subxact_id) {
+      abandoned.push_back(held.id);
+    }
+  }
+  for (RatePermit permit : abandoned) {
+    release(permit);
+  }
+}
+
+} // namespace pg_llm
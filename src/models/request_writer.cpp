@@ -0,0 +1,149 @@
+#include "models/request_writer.h"
+
+#include <charconv>
+
+#include "models/llm_interface.h"
+
+namespace pg_llm {
+
+namespace {
+
+// Bytes of framing per message: {"role":"","content":""},
+constexpr size_t kMessageOverhead = 32;
+
+void append_number(std::string* out, double value) {
+  char buffer[32];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  out->append(buffer, result.ptr);
+}
+
+}  // namespace
+
+void append_json_string(std::string* out, std::string_view value) {
+  static const char kHex[] = "0123456789abcdef";
+
+  out->push_back('"');
+  size_t run = 0;
+  for (size_t i = 0; i < value.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(value[i]);
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    out->append(value.data() + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      case '\b':
+        out->append("\\b");
+        break;
+      case '\f':
+        out->append("\\f");
+        break;
+      default:
+        out->append("\\u00");
+        out->push_back(kHex[c >> 4]);
+        out->push_back(kHex[c & 0xF]);
+        break;
+    }
+  }
+  out->append(value.data() + run, value.size() - run);
+  out->push_back('"');
+}
+
+std::string build_embedding_request(const std::string& model,
+                                    const std::vector<std::string>& inputs,
+                                    size_t begin,
+                                    size_t end,
+                                    int dimensions) {
+  size_t size = model.size() + 64;
+  for (size_t i = begin; i < end; ++i) {
+    size += inputs[i].size() + 3;
+  }
+
+  std::string body;
+  body.reserve(size);
+  body += "{\"model\":";
+  append_json_string(&body, model);
+  body += ",\"encoding_format\":\"float\"";
+  if (dimensions > 0) {
+    body += ",\"dimensions\":" + std::to_string(dimensions);
+  }
+  body += ",\"input\":[";
+  for (size_t i = begin; i < end; ++i) {
+    if (i > begin) {
+      body += ',';
+    }
+    append_json_string(&body, inputs[i]);
+  }
+  body += "]}";
+  return body;
+}
+
+RequestDialect ChatRequestWriter::dialect_from_name(const std::string& name) {
+  return name == "openai" ? RequestDialect::kOpenAI : RequestDialect::kDashScope;
+}
+
+void ChatRequestWriter::configure(const std::string& model_name,
+                                  RequestDialect dialect,
+                                  double temperature,
+                                  double top_p,
+                                  int logprobs) {
+  prefix_ = "{\"model\":";
+  append_json_string(&prefix_, model_name);
+  prefix_ += ",\"messages\":[";
+
+  std::string sampling;
+  if (dialect == RequestDialect::kOpenAI) {
+    sampling = ",\"temperature\":";
+    append_number(&sampling, temperature);
+    sampling += ",\"top_p\":";
+    append_number(&sampling, top_p);
+  } else {
+    sampling = ",\"parameters\":{\"temperature\":";
+    append_number(&sampling, temperature);
+    sampling += ",\"top_p\":";
+    append_number(&sampling, top_p);
+    sampling += ",\"logprobs\":" + std::to_string(logprobs) + "}";
+  }
+
+  suffix_ = "],\"stream\":false" + sampling + "}";
+  // Ask for a trailing usage event so streamed replies get a confidence too
+  stream_suffix_ = "],\"stream\":true,\"stream_options\":{\"include_usage\":true}" + sampling + "}";
+}
+
+std::string ChatRequestWriter::write(const std::vector<ChatMessage>& messages, bool stream) const {
+  const std::string& suffix = stream ? stream_suffix_ : suffix_;
+  size_t size = prefix_.size() + suffix.size();
+  for (const auto& message : messages) {
+    size += message.role.size() + message.content.size() + kMessageOverhead;
+  }
+
+  std::string body;
+  body.reserve(size);
+  body += prefix_;
+  for (size_t i = 0; i < messages.size(); ++i) {
+    body += i == 0 ? "{\"role\":" : ",{\"role\":";
+    append_json_string(&body, messages[i].role);
+    body += ",\"content\":";
+    append_json_string(&body, messages[i].content);
+    body += '}';
+  }
+  body += suffix;
+  return body;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,634 @@
+#include "models/response_parser.h"
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+
+namespace pg_llm {
+
+namespace {
+
+// Consumed bytes are only dropped once there are at least this many
+constexpr size_t kCompactThreshold = 4096;
+
+// Nesting deeper than any chat completion payload; guards the recursion
+constexpr int kMaxDepth = 64;
+
+// Bound on data[].index so a bogus reply cannot force a huge allocation
+constexpr size_t kMaxEmbeddings = 1 << 20;
+
+// Cursor over a JSON document with the primitives both scanners share
+class JsonCursor {
+public:
+  explicit JsonCursor(std::string_view input) : in_(input) {}
+
+  const std::string& error() const { return error_; }
+
+protected:
+  bool fail(const char* message) {
+    if (error_.empty()) {
+      error_ = std::string(message) + " at offset " + std::to_string(pos_);
+    }
+    return false;
+  }
+
+  void skip_whitespace() {
+    while (pos_ < in_.size() &&
+           (in_[pos_] == ' ' || in_[pos_] == '\t' || in_[pos_] == '\n' || in_[pos_] == '\r')) {
+      ++pos_;
+    }
+  }
+
+  bool consume(char expected) {
+    skip_whitespace();
+    if (pos_ < in_.size() && in_[pos_] == expected) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  char peek() {
+    skip_whitespace();
+    return pos_ < in_.size() ? in_[pos_] : '\0';
+  }
+
+  bool finish() {
+    skip_whitespace();
+    if (pos_ != in_.size()) {
+      return fail("trailing characters after JSON value");
+    }
+    return true;
+  }
+
+  bool literal(const char* word) {
+    std::string_view expected(word);
+    if (in_.substr(pos_, expected.size()) != expected) {
+      return fail("invalid literal");
+    }
+    pos_ += expected.size();
+    return true;
+  }
+
+  // Characters of a number starting at the cursor
+  bool number(std::string_view* text) {
+    size_t start = pos_;
+    if (pos_ < in_.size() && in_[pos_] == '-') {
+      ++pos_;
+    }
+    size_t digits = pos_;
+    while (pos_ < in_.size() && ((in_[pos_] >= '0' && in_[pos_] <= '9') || in_[pos_] == '.' ||
+                                 in_[pos_] == 'e' || in_[pos_] == 'E' || in_[pos_] == '+' ||
+                                 in_[pos_] == '-')) {
+      ++pos_;
+    }
+    if (pos_ == digits) {
+      return fail("unexpected character");
+    }
+    *text = in_.substr(start, pos_ - start);
+    return true;
+  }
+
+  // Step over any value without materializing it
+  bool skip_value(int depth) {
+    if (depth > kMaxDepth) {
+      return fail("JSON nested too deeply");
+    }
+    char c = peek();
+    if (c == '{' || c == '[') {
+      char close = c == '{' ? '}' : ']';
+      ++pos_;
+      if (consume(close)) {
+        return true;
+      }
+      do {
+        if (c == '{') {
+          if (peek() != '"' || !string(nullptr)) {
+            return fail("expected object key");
+          }
+          if (!consume(':')) {
+            return fail("expected ':' after object key");
+          }
+        }
+        if (!skip_value(depth + 1)) {
+          return false;
+        }
+      } while (consume(','));
+      if (!consume(close)) {
+        return fail(c == '{' ? "expected ',' or '}' in object" : "expected ',' or ']' in array");
+      }
+      return true;
+    }
+    switch (c) {
+      case '"':
+        return string(nullptr);
+      case 't':
+        return literal("true");
+      case 'f':
+        return literal("false");
+      case 'n':
+        return literal("null");
+      case '\0':
+        return fail("unexpected end of JSON");
+      default: {
+        std::string_view ignored;
+        return number(&ignored);
+      }
+    }
+  }
+
+  static void append_utf8(std::string* out, uint32_t code_point) {
+    if (code_point < 0x80) {
+      out->push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      out->push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else if (code_point < 0x10000) {
+      out->push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else {
+      out->push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+      out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    }
+  }
+
+  bool hex4(uint32_t* code_unit) {
+    if (pos_ + 4 > in_.size()) {
+      return fail("truncated \\u escape");
+    }
+    uint32_t result = 0;
+    for (int i = 0; i < 4; ++i) {
+      char c = in_[pos_++];
+      result <<= 4;
+      if (c >= '0' && c <= '9') {
+        result |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        result |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        result |= c - 'A' + 10;
+      } else {
+        return fail("invalid \\u escape");
+      }
+    }
+    *code_unit = result;
+    return true;
+  }
+
+  // Scan a string starting at the opening quote; decode it into out unless
+  // out is null. Unescaped runs are copied in one piece.
+  bool string(std::string* out) {
+    ++pos_;  // '"'
+    size_t run = pos_;
+    while (pos_ < in_.size()) {
+      char c = in_[pos_];
+      if (c == '"') {
+        if (out) {
+          out->append(in_.data() + run, pos_ - run);
+        }
+        ++pos_;
+        return true;
+      }
+      if (c != '\\') {
+        ++pos_;
+        continue;
+      }
+
+      if (out) {
+        out->append(in_.data() + run, pos_ - run);
+      }
+      if (++pos_ >= in_.size()) {
+        break;
+      }
+      char escape = in_[pos_++];
+      char decoded = 0;
+      switch (escape) {
+        case '"':
+        case '\\':
+        case '/':
+          decoded = escape;
+          break;
+        case 'b':
+          decoded = '\b';
+          break;
+        case 'f':
+          decoded = '\f';
+          break;
+        case 'n':
+          decoded = '\n';
+          break;
+        case 'r':
+          decoded = '\r';
+          break;
+        case 't':
+          decoded = '\t';
+          break;
+        case 'u': {
+          uint32_t code_point = 0;
+          if (!hex4(&code_point)) {
+            return false;
+          }
+          // Join surrogate pairs; a lone surrogate becomes U+FFFD
+          if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+            uint32_t low = 0;
+            if (in_.substr(pos_, 2) == "\\u") {
+              pos_ += 2;
+              if (!hex4(&low)) {
+                return false;
+              }
+            }
+            code_point = (low >= 0xDC00 && low <= 0xDFFF)
+              ? 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00)
+              : 0xFFFD;
+          } else if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+            code_point = 0xFFFD;
+          }
+          if (out) {
+            append_utf8(out, code_point);
+          }
+          run = pos_;
+          continue;
+        }
+        default:
+          return fail("invalid escape in string");
+      }
+      if (out) {
+        out->push_back(decoded);
+      }
+      run = pos_;
+    }
+    return fail("unterminated string");
+  }
+
+  std::string_view in_;
+  size_t pos_ = 0;
+  std::string error_;
+};
+
+// Where in a chat payload a value sits, as far as ChatPayload cares
+enum class Target { kNone, kRoot, kChoices, kFirstChoice, kMessage, kContent, kUsage, kUsageField };
+
+class ChatScanner : public JsonCursor {
+public:
+  ChatScanner(std::string_view input, ChatPayload* payload) : JsonCursor(input), payload_(payload) {}
+
+  bool parse() {
+    return value(Target::kRoot, 0) && finish();
+  }
+
+private:
+  bool value(Target target, int depth) {
+    if (target == Target::kNone) {
+      return skip_value(depth);
+    }
+    if (depth > kMaxDepth) {
+      return fail("JSON nested too deeply");
+    }
+    switch (peek()) {
+      case '{':
+        return object(target, depth);
+      case '[':
+        return array(target, depth);
+      case '"': {
+        if (target != Target::kContent) {
+          return string(nullptr);
+        }
+        std::string decoded;
+        if (!string(&decoded)) {
+          return false;
+        }
+        payload_->content = std::move(decoded);
+        return true;
+      }
+      default:
+        if (target == Target::kUsageField && peek() != 'n' && peek() != 't' && peek() != 'f') {
+          std::string_view text;
+          if (!number(&text)) {
+            return false;
+          }
+          std::string copy(text);
+          char* end = nullptr;
+          double parsed = std::strtod(copy.c_str(), &end);
+          if (end != copy.c_str() + copy.size()) {
+            return fail("invalid number");
+          }
+          *usage_field_ = parsed;
+          return true;
+        }
+        return skip_value(depth);
+    }
+  }
+
+  Target member_target(Target parent, std::string_view key) {
+    switch (parent) {
+      case Target::kRoot:
+        if (key == "choices") {
+          return Target::kChoices;
+        }
+        if (key == "usage") {
+          return Target::kUsage;
+        }
+        break;
+      case Target::kFirstChoice:
+        if (key == "message" || key == "delta") {
+          return Target::kMessage;
+        }
+        break;
+      case Target::kMessage:
+        if (key == "content") {
+          return Target::kContent;
+        }
+        break;
+      case Target::kUsage:
+        if (key == "total_tokens") {
+          usage_field_ = &payload_->total_tokens;
+        } else if (key == "output_tokens") {
+          usage_field_ = &payload_->output_tokens;
+          payload_->has_output_tokens = true;
+        } else if (key == "completion_tokens") {
+          usage_field_ = &payload_->completion_tokens;
+        } else {
+          break;
+        }
+        return Target::kUsageField;
+      default:
+        break;
+    }
+    return Target::kNone;
+  }
+
+  bool object(Target target, int depth) {
+    ++pos_;  // '{'
+    if (target == Target::kUsage) {
+      payload_->has_usage = true;
+    }
+    if (consume('}')) {
+      return true;
+    }
+    std::string key;
+    do {
+      if (peek() != '"') {
+        return fail("expected object key");
+      }
+      key.clear();
+      if (!string(&key)) {
+        return false;
+      }
+      if (!consume(':')) {
+        return fail("expected ':' after object key");
+      }
+      if (!value(member_target(target, key), depth + 1)) {
+        return false;
+      }
+    } while (consume(','));
+    if (!consume('}')) {
+      return fail("expected ',' or '}' in object");
+    }
+    return true;
+  }
+
+  bool array(Target target, int depth) {
+    ++pos_;  // '['
+    if (consume(']')) {
+      return true;
+    }
+    size_t index = 0;
+    do {
+      Target element = Target::kNone;
+      if (target == Target::kChoices && index == 0) {
+        payload_->has_choices = true;
+        element = Target::kFirstChoice;
+      }
+      if (!value(element, depth + 1)) {
+        return false;
+      }
+      ++index;
+    } while (consume(','));
+    if (!consume(']')) {
+      return fail("expected ',' or ']' in array");
+    }
+    return true;
+  }
+
+  ChatPayload* payload_;
+  double* usage_field_ = nullptr;  // Usage counter the next number belongs to
+};
+
+// Reads data[].embedding (and data[].index) of an embeddings response
+class EmbeddingScanner : public JsonCursor {
+public:
+  EmbeddingScanner(std::string_view input, std::vector<std::vector<float>>* embeddings)
+    : JsonCursor(input), embeddings_(embeddings) {}
+
+  bool parse() {
+    if (peek() != '{') {
+      return fail("expected object");
+    }
+    ++pos_;
+    bool found = false;
+    if (!consume('}')) {
+      std::string key;
+      do {
+        if (peek() != '"') {
+          return fail("expected object key");
+        }
+        key.clear();
+        if (!string(&key)) {
+          return false;
+        }
+        if (!consume(':')) {
+          return fail("expected ':' after object key");
+        }
+        if (key == "data") {
+          found = true;
+          if (!data()) {
+            return false;
+          }
+        } else if (!skip_value(1)) {
+          return false;
+        }
+      } while (consume(','));
+      if (!consume('}')) {
+        return fail("expected ',' or '}' in object");
+      }
+    }
+    if (!found) {
+      return fail("missing data array");
+    }
+    return finish();
+  }
+
+private:
+  bool data() {
+    if (peek() != '[') {
+      return fail("data is not an array");
+    }
+    ++pos_;
+    if (consume(']')) {
+      return true;
+    }
+    size_t position = 0;
+    do {
+      if (!item(position++)) {
+        return false;
+      }
+    } while (consume(','));
+    if (!consume(']')) {
+      return fail("expected ',' or ']' in array");
+    }
+    return true;
+  }
+
+  // One data element; placed by its "index", or by position without one
+  bool item(size_t position) {
+    if (peek() != '{') {
+      return fail("expected embedding object");
+    }
+    ++pos_;
+    std::vector<float> values;
+    size_t index = position;
+    if (!consume('}')) {
+      std::string key;
+      do {
+        if (peek() != '"') {
+          return fail("expected object key");
+        }
+        key.clear();
+        if (!string(&key)) {
+          return false;
+        }
+        if (!consume(':')) {
+          return fail("expected ':' after object key");
+        }
+        if (key == "embedding") {
+          if (!vector(&values)) {
+            return false;
+          }
+        } else if (key == "index" && peek() != 'n') {
+          std::string_view text;
+          if (!number(&text)) {
+            return false;
+          }
+          auto result = std::from_chars(text.data(), text.data() + text.size(), index);
+          if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+            return fail("invalid embedding index");
+          }
+        } else if (!skip_value(2)) {
+          return false;
+        }
+      } while (consume(','));
+      if (!consume('}')) {
+        return fail("expected ',' or '}' in object");
+      }
+    }
+    if (index >= kMaxEmbeddings) {
+      return fail("embedding index out of range");
+    }
+    if (embeddings_->size() <= index) {
+      embeddings_->resize(index + 1);
+    }
+    (*embeddings_)[index] = std::move(values);
+    return true;
+  }
+
+  bool vector(std::vector<float>* values) {
+    if (peek() != '[') {
+      return fail("embedding is not an array");
+    }
+    ++pos_;
+    if (consume(']')) {
+      return true;
+    }
+    do {
+      skip_whitespace();
+      std::string_view text;
+      if (!number(&text)) {
+        return false;
+      }
+      float value = 0.0f;
+      auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+      if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+        return fail("invalid number in embedding");
+      }
+      values->push_back(value);
+    } while (consume(','));
+    if (!consume(']')) {
+      return fail("expected ',' or ']' in embedding");
+    }
+    return true;
+  }
+
+  std::vector<std::vector<float>>* embeddings_;
+};
+
+}  // namespace
+
+void LineBuffer::append(const char* data, size_t size) {
+  if (start_ == data_.size()) {
+    data_.clear();
+    start_ = 0;
+    scanned_ = 0;
+  } else if (start_ >= kCompactThreshold && start_ * 2 >= data_.size()) {
+    data_.erase(0, start_);
+    scanned_ -= start_;
+    start_ = 0;
+  }
+  data_.append(data, size);
+}
+
+bool LineBuffer::next_line(std::string_view* line) {
+  size_t newline = data_.find('\n', scanned_);
+  if (newline == std::string::npos) {
+    scanned_ = data_.size();
+    return false;
+  }
+
+  size_t end = newline;
+  if (end > start_ && data_[end - 1] == '\r') {
+    --end;
+  }
+  *line = std::string_view(data_.data() + start_, end - start_);
+  start_ = newline + 1;
+  scanned_ = start_;
+  return true;
+}
+
+std::string_view LineBuffer::remainder() const {
+  return std::string_view(data_.data() + start_, data_.size() - start_);
+}
+
+void LineBuffer::clear() {
+  data_.clear();
+  start_ = 0;
+  scanned_ = 0;
+}
+
+bool parse_chat_payload(std::string_view json, ChatPayload* payload, std::string* error) {
+  *payload = ChatPayload();
+  ChatScanner scanner(json, payload);
+  if (scanner.parse()) {
+    return true;
+  }
+  if (error) {
+    *error = scanner.error();
+  }
+  return false;
+}
+
+bool parse_embedding_payload(std::string_view json,
+                             std::vector<std::vector<float>>* embeddings,
+                             std::string* error) {
+  embeddings->clear();
+  EmbeddingScanner scanner(json, embeddings);
+  if (scanner.parse()) {
+    return true;
+  }
+  if (error) {
+    *error = scanner.error();
+  }
+  return false;
+}
+
+} // namespace pg_llm
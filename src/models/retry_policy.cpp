@@ -0,0 +1,138 @@
+#include "models/retry_policy.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+#include "utils/pg_llm_log.h"
+
+namespace pg_llm {
+
+namespace {
+
+// Upper bounds for the retry settings
+constexpr int kMaxAttempts = 10;
+constexpr int kMaxDelayMs = 300000;
+
+constexpr uint32_t class_bit(FailureClass failure) {
+  return 1u << static_cast<int>(failure);
+}
+
+constexpr uint32_t kTransientClasses = class_bit(FailureClass::kConnect) | class_bit(FailureClass::kTimeout) |
+                                       class_bit(FailureClass::kRateLimited) | class_bit(FailureClass::kServer);
+
+std::mt19937_64& jitter_engine() {
+  static std::mt19937_64 engine{std::random_device{}()};
+  return engine;
+}
+
+}  // namespace
+
+RetryPolicy RetryPolicy::from_config(const Json::Value& config) {
+  RetryPolicy result;
+  result.retry_on = kTransientClasses;
+  if (!config.isObject()) {
+    return result;
+  }
+  result.max_attempts = std::clamp(config.get("retry_max_attempts", result.max_attempts).asInt(), 1, kMaxAttempts);
+  result.base_delay_ms = std::clamp(config.get("retry_base_delay_ms", result.base_delay_ms).asInt(), 0, kMaxDelayMs);
+  result.max_delay_ms = std::clamp(config.get("retry_max_delay_ms", result.max_delay_ms).asInt(), 0, kMaxDelayMs);
+  result.budget_ratio = std::clamp(config.get("retry_budget_ratio", result.budget_ratio).asDouble(), 0.0, 1.0);
+
+  const Json::Value& retry_on = config["retry_on"];
+  if (retry_on.isArray()) {
+    result.retry_on = 0;
+    for (const auto& entry : retry_on) {
+      std::string name = entry.asString();
+      bool known = false;
+      for (auto failure : {FailureClass::kConnect,
+                           FailureClass::kTimeout,
+                           FailureClass::kRateLimited,
+                           FailureClass::kServer}) {
+        if (name == class_name(failure)) {
+          result.retry_on |= class_bit(failure);
+          known = true;
+        }
+      }
+      if (!known) {
+        PG_LLM_LOG_WARNING("ignoring unknown retry_on class \"%s\"", name.c_str());
+      }
+    }
+  }
+  return result;
+}
+
+FailureClass RetryPolicy::classify(CURLcode result, long http_code) {
+  switch (result) {
+    case CURLE_OK:
+      break;
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return FailureClass::kConnect;
+    case CURLE_OPERATION_TIMEDOUT:
+      return FailureClass::kTimeout;
+    default:
+      return FailureClass::kPermanent;
+  }
+  if (http_code >= 200 && http_code < 300) {
+    return FailureClass::kNone;
+  }
+  switch (http_code) {
+    case 408:
+      return FailureClass::kTimeout;
+    case 429:
+      return FailureClass::kRateLimited;
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+      return FailureClass::kServer;
+    default:
+      return FailureClass::kPermanent;
+  }
+}
+
+const char* RetryPolicy::class_name(FailureClass failure) {
+  switch (failure) {
+    case FailureClass::kNone:
+      return "none";
+    case FailureClass::kConnect:
+      return "connect";
+    case FailureClass::kTimeout:
+      return "timeout";
+    case FailureClass::kRateLimited:
+      return "rate_limited";
+    case FailureClass::kServer:
+      return "server";
+    case FailureClass::kPermanent:
+    default:
+      return "permanent";
+  }
+}
+
+bool RetryPolicy::retryable(FailureClass failure, int attempt) const {
+  return attempt < max_attempts && (retry_on & class_bit(failure)) != 0;
+}
+
+long RetryPolicy::backoff_ms(int retry, long retry_after_ms) const {
+  if (retry_after_ms > max_delay_ms) {
+    return -1;
+  }
+  // Doubling stops at the cap; the shift is bounded by kMaxAttempts
+  long ceiling = std::min<long>(max_delay_ms, static_cast<long>(base_delay_ms) << std::clamp(retry - 1, 0, 20));
+  long delay = 0;
+  if (ceiling > 0) {
+    delay = std::uniform_int_distribution<long>(0, ceiling)(jitter_engine());
+  }
+  return std::max(delay, retry_after_ms);
+}
+
+} // namespace pg_llm
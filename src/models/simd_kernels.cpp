@@ -0,0 +1,156 @@
+#include "models/simd_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PG_LLM_SIMD_AVX2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define PG_LLM_SIMD_NEON 1
+#endif
+
+namespace pg_llm {
+
+namespace {
+
+float sum_squares_scalar(const float* values, size_t count) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < count; ++i) {
+    sum += values[i] * values[i];
+  }
+  return sum;
+}
+
+void scale_scalar(float* values, size_t count, float factor) {
+  for (size_t i = 0; i < count; ++i) {
+    values[i] *= factor;
+  }
+}
+
+void axpy_i8_scalar(float* out, const int8_t* row, size_t count, float factor) {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] += factor * static_cast<float>(row[i]);
+  }
+}
+
+int32_t dot_i8_scalar(const int8_t* a, const int8_t* b, size_t count) {
+  int32_t sum = 0;
+  for (size_t i = 0; i < count; ++i) {
+    sum += static_cast<int32_t>(a[i]) * static_cast<int32_t>(b[i]);
+  }
+  return sum;
+}
+
+#if PG_LLM_SIMD_AVX2
+__attribute__((target("avx2,fma"))) float sum_squares_avx2(const float* values, size_t count) {
+  __m256 acc = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 v = _mm256_loadu_ps(values + i);
+    acc = _mm256_fmadd_ps(v, v, acc);
+  }
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  half = _mm_hadd_ps(half, half);
+  half = _mm_hadd_ps(half, half);
+  return _mm_cvtss_f32(half) + sum_squares_scalar(values + i, count - i);
+}
+
+__attribute__((target("avx2,fma"))) void scale_avx2(float* values, size_t count, float factor) {
+  __m256 f = _mm256_set1_ps(factor);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(values + i, _mm256_mul_ps(_mm256_loadu_ps(values + i), f));
+  }
+  scale_scalar(values + i, count - i, factor);
+}
+
+__attribute__((target("avx2,fma"))) void axpy_i8_avx2(float* out, const int8_t* row, size_t count, float factor) {
+  __m256 f = _mm256_set1_ps(factor);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + i));
+    __m256 widened = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(widened, f, _mm256_loadu_ps(out + i)));
+  }
+  axpy_i8_scalar(out + i, row + i, count - i, factor);
+}
+
+__attribute__((target("avx2,fma"))) int32_t dot_i8_avx2(const int8_t* a, const int8_t* b, size_t count) {
+  // maddubs multiplies unsigned by signed bytes: move a's sign onto b.
+  // Pairs sum to at most 2 * 127 * 127, which fits in int16.
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  for (size_t i = 0; i < count; i += 32) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    __m256i pairs = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+  }
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum = _mm_hadd_epi32(sum, sum);
+  sum = _mm_hadd_epi32(sum, sum);
+  return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+#if PG_LLM_SIMD_NEON
+float sum_squares_neon(const float* values, size_t count) {
+  float32x4_t acc = vdupq_n_f32(0.0f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t v = vld1q_f32(values + i);
+    acc = vmlaq_f32(acc, v, v);
+  }
+  return vaddvq_f32(acc) + sum_squares_scalar(values + i, count - i);
+}
+
+void scale_neon(float* values, size_t count, float factor) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    vst1q_f32(values + i, vmulq_n_f32(vld1q_f32(values + i), factor));
+  }
+  scale_scalar(values + i, count - i, factor);
+}
+
+void axpy_i8_neon(float* out, const int8_t* row, size_t count, float factor) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    int16x8_t wide = vmovl_s8(vld1_s8(row + i));
+    float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(wide)));
+    float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(wide)));
+    vst1q_f32(out + i, vmlaq_n_f32(vld1q_f32(out + i), lo, factor));
+    vst1q_f32(out + i + 4, vmlaq_n_f32(vld1q_f32(out + i + 4), hi, factor));
+  }
+  axpy_i8_scalar(out + i, row + i, count - i, factor);
+}
+
+int32_t dot_i8_neon(const int8_t* a, const int8_t* b, size_t count) {
+  int32x4_t acc = vdupq_n_s32(0);
+  for (size_t i = 0; i < count; i += 16) {
+    int8x16_t va = vld1q_s8(a + i);
+    int8x16_t vb = vld1q_s8(b + i);
+    acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+    acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+  }
+  return vaddvq_s32(acc);
+}
+#endif
+
+SimdKernels select_kernels() {
+#if PG_LLM_SIMD_AVX2
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return SimdKernels{"avx2", sum_squares_avx2, scale_avx2, axpy_i8_avx2, dot_i8_avx2};
+  }
+#elif PG_LLM_SIMD_NEON
+  return SimdKernels{"neon", sum_squares_neon, scale_neon, axpy_i8_neon, dot_i8_neon};
+#endif
+  return SimdKernels{"scalar", sum_squares_scalar, scale_scalar, axpy_i8_scalar, dot_i8_scalar};
+}
+
+}  // namespace
+
+const SimdKernels& simd_kernels() {
+  static const SimdKernels selected = select_kernels();
+  return selected;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,397 @@
+#include "models/tokenizer.h"
+
+extern "C" {
+#include "postgres.h"
+#include "storage/fd.h"
+}
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+#include <json/json.h>
+
+namespace pg_llm {
+
+namespace {
+
+constexpr size_t kMaxFileSize = 64 * 1024 * 1024;
+constexpr size_t kBytesPerToken = 4;
+
+// Models loaded by this backend, by resolved path
+std::unordered_map<std::string, std::shared_ptr<const Tokenizer>>& loaded_tokenizers() {
+  static std::unordered_map<std::string, std::shared_ptr<const Tokenizer>> tokenizers;
+  return tokenizers;
+}
+
+// Inverse of GPT-2's bytes_to_unicode: printable Latin-1 bytes stand for
+// themselves, the other 68 bytes were shifted to U+0100..U+0143
+const std::array<int16_t, 324>& unicode_to_byte() {
+  static const std::array<int16_t, 324> table = [] {
+    std::array<int16_t, 324> map;
+    map.fill(-1);
+    int shifted = 0;
+    for (int b = 0; b < 256; ++b) {
+      bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+      map[printable ? b : 256 + shifted++] = static_cast<int16_t>(b);
+    }
+    return map;
+  }();
+  return table;
+}
+
+// Turn a merges-file token back into the bytes it stands for
+bool decode_token(const std::string& token, std::string* bytes) {
+  const auto& table = unicode_to_byte();
+  bytes->clear();
+  for (size_t i = 0; i < token.size();) {
+    auto lead = static_cast<unsigned char>(token[i]);
+    uint32_t code;
+    if (lead < 0x80) {
+      code = lead;
+      i += 1;
+    } else if ((lead & 0xE0) == 0xC0 && i + 1 < token.size()) {
+      code = ((lead & 0x1Fu) << 6) | (static_cast<unsigned char>(token[i + 1]) & 0x3Fu);
+      i += 2;
+    } else {
+      return false;
+    }
+    if (code >= table.size() || table[code] < 0) {
+      return false;
+    }
+    bytes->push_back(static_cast<char>(table[code]));
+  }
+  return !bytes->empty();
+}
+
+bool is_space(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+bool is_digit(unsigned char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Non-ASCII bytes count as letters, which keeps UTF-8 sequences together
+bool is_letter(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+size_t contraction_length(std::string_view text, size_t pos) {
+  std::string_view rest = text.substr(pos);
+  for (std::string_view suffix : {"'re", "'ve", "'ll"}) {
+    if (rest.substr(0, 3) == suffix) {
+      return 3;
+    }
+  }
+  if (rest.size() >= 2 && (rest[1] == 's' || rest[1] == 't' || rest[1] == 'm' || rest[1] == 'd')) {
+    return 2;
+  }
+  return 0;
+}
+
+// Split text like the GPT-2 pattern
+//   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+template <typename Emit>
+void split_pieces(std::string_view text, Emit&& emit) {
+  size_t i = 0;
+  size_t n = text.size();
+  while (i < n) {
+    auto c = static_cast<unsigned char>(text[i]);
+    if (c == '\'') {
+      size_t length = contraction_length(text, i);
+      if (length > 0) {
+        emit(text.substr(i, length));
+        i += length;
+        continue;
+      }
+    }
+
+    size_t start = i;
+    if (is_space(c)) {
+      size_t end = i;
+      while (end < n && is_space(static_cast<unsigned char>(text[end]))) {
+        ++end;
+      }
+      if (end == n) {
+        emit(text.substr(i, end - i));
+        break;
+      }
+      // The last whitespace byte before a word belongs to the word when it
+      // is a plain space, and stands alone otherwise
+      if (end - i > 1) {
+        emit(text.substr(i, end - 1 - i));
+      }
+      start = i = end - 1;
+      if (text[i] != ' ') {
+        emit(text.substr(i, 1));
+        ++i;
+        continue;
+      }
+      ++i;
+      c = static_cast<unsigned char>(text[i]);
+    }
+
+    if (is_letter(c)) {
+      while (i < n && is_letter(static_cast<unsigned char>(text[i]))) {
+        ++i;
+      }
+    } else if (is_digit(c)) {
+      while (i < n && is_digit(static_cast<unsigned char>(text[i]))) {
+        ++i;
+      }
+    } else {
+      while (i < n) {
+        auto b = static_cast<unsigned char>(text[i]);
+        if (is_space(b) || is_letter(b) || is_digit(b)) {
+          break;
+        }
+        ++i;
+      }
+    }
+    emit(text.substr(start, i - start));
+  }
+}
+
+bool read_file(const std::string& path, int fd, size_t size, std::string* content, std::string* error) {
+  content->resize(size);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t got = read(fd, content->data() + done, size - done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      *error = "could not read \"" + path + "\": " + (got < 0 ? strerror(errno) : "unexpected end of file");
+      return false;
+    }
+    done += static_cast<size_t>(got);
+  }
+  return true;
+}
+
+std::string file_identity(const std::string& path, const struct stat& st) {
+  return path + ":" + std::to_string(static_cast<long long>(st.st_size)) + ":" +
+         std::to_string(static_cast<long long>(st.st_mtime));
+}
+
+}  // namespace
+
+std::shared_ptr<const Tokenizer> Tokenizer::open(const std::string& path, std::string* error) {
+  // Backends run in the data directory, so relative paths resolve there
+  std::vector<char> resolved(path.begin(), path.end());
+  resolved.push_back('\0');
+  canonicalize_path(resolved.data());
+  if (!path_is_relative_and_below_cwd(resolved.data())) {
+    *error = "tokenizer_path must be a relative path inside the data directory";
+    return nullptr;
+  }
+  std::string relative(resolved.data());
+
+  int fd = OpenTransientFile(relative.c_str(), O_RDONLY | PG_BINARY);
+  if (fd < 0) {
+    *error = "could not open \"" + relative + "\": " + strerror(errno);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = "could not stat \"" + relative + "\": " + strerror(errno);
+    CloseTransientFile(fd);
+    return nullptr;
+  }
+
+  auto& tokenizers = loaded_tokenizers();
+  std::string identity = file_identity(relative, st);
+  auto cached = tokenizers.find(relative);
+  if (cached != tokenizers.end() && cached->second->identity() == identity) {
+    CloseTransientFile(fd);
+    return cached->second;
+  }
+
+  size_t file_size = static_cast<size_t>(st.st_size);
+  if (file_size > kMaxFileSize) {
+    *error = "\"" + relative + "\" is too large for a tokenizer file";
+    CloseTransientFile(fd);
+    return nullptr;
+  }
+  std::string content;
+  bool read_ok = read_file(relative, fd, file_size, &content, error);
+  CloseTransientFile(fd);
+  if (!read_ok) {
+    return nullptr;
+  }
+
+  std::shared_ptr<Tokenizer> tokenizer(new Tokenizer());
+  tokenizer->identity_ = identity;
+  for (int b = 0; b < 256; ++b) {
+    tokenizer->symbol(std::string(1, static_cast<char>(b)));
+  }
+
+  size_t first = content.find_first_not_of(" \t\r\n");
+  if (first != std::string::npos && content[first] == '{') {
+    // tokenizer.json: merges are "left right" strings or [left, right] pairs
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    Json::Value root;
+    std::string errors;
+    if (!reader->parse(content.data(), content.data() + content.size(), &root, &errors)) {
+      *error = "\"" + relative + "\" is not valid JSON: " + errors;
+      return nullptr;
+    }
+    const Json::Value& merges = root["model"]["merges"];
+    if (!merges.isArray()) {
+      *error = "\"" + relative + "\" has no model.merges array";
+      return nullptr;
+    }
+    for (const auto& merge : merges) {
+      if (merge.isString()) {
+        std::string line = merge.asString();
+        size_t space = line.find(' ');
+        if (space != std::string::npos) {
+          tokenizer->add_merge(line.substr(0, space), line.substr(space + 1));
+        }
+      } else if (merge.isArray() && merge.size() == 2) {
+        tokenizer->add_merge(merge[0].asString(), merge[1].asString());
+      }
+    }
+  } else {
+    // merges.txt
+    size_t offset = 0;
+    while (offset < content.size()) {
+      size_t end = content.find('\n', offset);
+      if (end == std::string::npos) {
+        end = content.size();
+      }
+      std::string line = content.substr(offset, end - offset);
+      offset = end + 1;
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line.empty() || line.rfind("#version", 0) == 0) {
+        continue;
+      }
+      size_t space = line.find(' ');
+      if (space != std::string::npos) {
+        tokenizer->add_merge(line.substr(0, space), line.substr(space + 1));
+      }
+    }
+  }
+
+  if (tokenizer->merges_.empty()) {
+    *error = "\"" + relative + "\" contains no byte-level BPE merges";
+    return nullptr;
+  }
+  tokenizers[relative] = tokenizer;
+  return tokenizer;
+}
+
+uint32_t Tokenizer::symbol(const std::string& bytes) {
+  auto inserted = symbols_.emplace(bytes, static_cast<uint32_t>(symbols_.size()));
+  return inserted.first->second;
+}
+
+bool Tokenizer::add_merge(const std::string& left, const std::string& right) {
+  std::string left_bytes;
+  std::string right_bytes;
+  if (!decode_token(left, &left_bytes) || !decode_token(right, &right_bytes)) {
+    return false;
+  }
+  uint64_t key = (static_cast<uint64_t>(symbol(left_bytes)) << 32) | symbol(right_bytes);
+  // Earlier lines win; the rank is the merge's position in the file
+  uint32_t merged = symbol(left_bytes + right_bytes);
+  return merges_.emplace(key, Merge{static_cast<uint32_t>(merges_.size()), merged}).second;
+}
+
+size_t Tokenizer::count(std::string_view text) const {
+  // Prompts repeat the same words; merge each distinct piece once
+  std::unordered_map<std::string_view, size_t> seen;
+  size_t total = 0;
+  split_pieces(text, [&](std::string_view piece) {
+    auto it = seen.find(piece);
+    if (it == seen.end()) {
+      it = seen.emplace(piece, count_piece(piece)).first;
+    }
+    total += it->second;
+  });
+  return total;
+}
+
+size_t Tokenizer::count_piece(std::string_view piece) const {
+  if (piece.size() < 2) {
+    return piece.size();
+  }
+
+  // Symbols form a linked list; the lowest-ranked adjacent pair is merged
+  // first and ties go to the leftmost pair, as in the reference BPE
+  struct Node {
+    uint32_t token;
+    int prev;
+    int next;
+    bool alive;
+  };
+  int n = static_cast<int>(piece.size());
+  std::vector<Node> nodes(n);
+  for (int i = 0; i < n; ++i) {
+    nodes[i] = Node{static_cast<unsigned char>(piece[i]), i - 1, i + 1 < n ? i + 1 : -1, true};
+  }
+
+  // (rank, position, left, right); entries go stale when a neighbour merges
+  using Candidate = std::tuple<uint32_t, int, uint32_t, uint32_t>;
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>> queue;
+  auto push = [&](int pos) {
+    int next = nodes[pos].next;
+    if (next < 0) {
+      return;
+    }
+    uint64_t key = (static_cast<uint64_t>(nodes[pos].token) << 32) | nodes[next].token;
+    auto it = merges_.find(key);
+    if (it != merges_.end()) {
+      queue.emplace(it->second.rank, pos, nodes[pos].token, nodes[next].token);
+    }
+  };
+  for (int i = 0; i + 1 < n; ++i) {
+    push(i);
+  }
+
+  size_t symbols = piece.size();
+  while (!queue.empty()) {
+    auto [rank, pos, left, right] = queue.top();
+    queue.pop();
+    Node& node = nodes[pos];
+    if (!node.alive || node.token != left || node.next < 0 || nodes[node.next].token != right) {
+      continue;
+    }
+    uint64_t key = (static_cast<uint64_t>(left) << 32) | right;
+    Node& victim = nodes[node.next];
+    victim.alive = false;
+    node.token = merges_.at(key).token;
+    node.next = victim.next;
+    if (node.next >= 0) {
+      nodes[node.next].prev = pos;
+    }
+    --symbols;
+    push(pos);
+    if (node.prev >= 0) {
+      push(node.prev);
+    }
+  }
+  return symbols;
+}
+
+size_t estimate_token_count(std::string_view text) {
+  size_t total = 0;
+  split_pieces(text, [&](std::string_view piece) {
+    size_t length = piece.size() > 1 && piece[0] == ' ' ? piece.size() - 1 : piece.size();
+    total += (length + kBytesPerToken - 1) / kBytesPerToken;
+  });
+  return total;
+}
+
+} // namespace pg_llm
@@ -0,0 +1,619 @@
+#include "models/worker_pool.h"
+
+extern "C" {
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+
+PGDLLEXPORT void pg_llm_worker_main(Datum main_arg);
+}
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+
+#include "models/http_engine.h"
+#include "utils/pg_llm_log.h"
+#include "utils/pg_llm_shmem.h"
+#include "utils/pg_llm_support.h"
+
+namespace pg_llm {
+
+namespace {
+
+constexpr const char* kSharedName = "pg_llm worker pool";
+
+// Upper bound of pg_llm.workers
+constexpr int kMaxWorkers = 32;
+
+// Requests waiting for a worker; beyond it backends run their own
+constexpr uint32 kQueueCapacity = 1024;
+
+// Requests one worker drives at once
+constexpr size_t kMaxJobsPerWorker = 64;
+
+// Ring of the reply queue; longer replies are streamed through it
+constexpr Size kReplyQueueSize = 64 * 1024;
+
+// Instances a worker keeps built; the cache starts over beyond it
+constexpr size_t kMaxWorkerModels = 256;
+
+// Upper bound for one wait, so abandoned requests are noticed
+constexpr long kPollIntervalMs = 100;
+
+// Pause before a request the rate limiter turned away is tried again
+constexpr long kRateLimitRetryMs = 20;
+
+// Seconds before the postmaster restarts a worker that exited
+constexpr int kRestartSeconds = 5;
+
+using Clock = std::chrono::steady_clock;
+
+struct WorkerSlot {
+  Latch* latch;                // Null while the worker is not running
+  pg_atomic_uint32 in_flight;  // Requests the worker holds
+};
+
+struct WorkerPoolShared {
+  slock_t mutex;  // Guards the queue and the latches
+  uint32 head;    // Ring position of the oldest queued request
+  uint32 count;
+  dsm_handle queue[kQueueCapacity];
+  WorkerSlot workers[kMaxWorkers];
+  pg_atomic_uint64 submitted;
+  pg_atomic_uint64 completed;
+  pg_atomic_uint64 abandoned;
+  pg_atomic_uint64 rejected;
+};
+
+// Start of every request segment; the request queue follows it and the
+// reply queue follows that
+struct RequestSegment {
+  Size request_queue_size;
+};
+
+WorkerPoolShared* shared = nullptr;
+
+void init_shared(void* ptr, bool found) {
+  shared = static_cast<WorkerPoolShared*>(ptr);
+  if (found) {
+    return;
+  }
+  SpinLockInit(&shared->mutex);
+  shared->head = 0;
+  shared->count = 0;
+  for (auto& worker : shared->workers) {
+    worker.latch = nullptr;
+    pg_atomic_init_u32(&worker.in_flight, 0);
+  }
+  pg_atomic_init_u64(&shared->submitted, 0);
+  pg_atomic_init_u64(&shared->completed, 0);
+  pg_atomic_init_u64(&shared->abandoned, 0);
+  pg_atomic_init_u64(&shared->rejected, 0);
+}
+
+void detach_worker(int code, Datum arg) {
+  int index = DatumGetInt32(arg);
+  SpinLockAcquire(&shared->mutex);
+  shared->workers[index].latch = nullptr;
+  SpinLockRelease(&shared->mutex);
+  pg_atomic_write_u32(&shared->workers[index].in_flight, 0);
+}
+
+bool any_worker_running() {
+  bool running = false;
+  SpinLockAcquire(&shared->mutex);
+  for (const auto& worker : shared->workers) {
+    running = running || worker.latch != nullptr;
+  }
+  SpinLockRelease(&shared->mutex);
+  return running;
+}
+
+// With nowait a full queue returns SHM_MQ_WOULD_BLOCK; call again with the
+// same message to send the rest
+shm_mq_result send_message(shm_mq_handle* queue, const std::string& message, bool nowait) {
+#if PG_VERSION_NUM >= 150000
+  return shm_mq_send(queue, message.size(), message.data(), nowait, true);
+#else
+  return shm_mq_send(queue, message.size(), message.data(), nowait);
+#endif
+}
+
+shm_mq* request_queue(dsm_segment* segment) {
+  return reinterpret_cast<shm_mq*>(static_cast<char*>(dsm_segment_address(segment)) +
+                                   MAXALIGN(sizeof(RequestSegment)));
+}
+
+shm_mq* reply_queue(dsm_segment* segment) {
+  auto* header = static_cast<RequestSegment*>(dsm_segment_address(segment));
+  return reinterpret_cast<shm_mq*>(reinterpret_cast<char*>(request_queue(segment)) +
+                                   header->request_queue_size);
+}
+
+Json::Value response_json(const ModelResponse& response) {
+  Json::Value reply(Json::objectValue);
+  reply["response"] = response.response;
+  reply["confidence_score"] = response.confidence_score;
+  reply["model_name"] = response.model_name;
+  reply["error"] = response.error;
+  return reply;
+}
+
+std::string definition_digest(const ModelDefinition& definition) {
+  std::string source(1, definition.local_model ? '1' : '0');
+  source += std::to_string(definition.database_id);
+  source += ':';
+  for (const std::string* field :
+       {&definition.instance_name, &definition.model_type, &definition.api_key, &definition.config}) {
+    source += std::to_string(field->size());
+    source += ':';
+    source += *field;
+  }
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(source.data()),
+         source.size(),
+         reinterpret_cast<unsigned char*>(&digest[0]));
+  return digest;
+}
+
+}  // namespace
+
+// One request held by a worker
+struct WorkerPool::Job {
+  dsm_segment* segment = nullptr;
+  shm_mq_handle* requests = nullptr;  // Detached once the requester gives up
+  shm_mq_handle* replies = nullptr;
+  std::shared_ptr<LLMInterface> model;
+  std::vector<ChatMessage> messages;
+  std::unique_ptr<HttpTransfer> transfer;
+  int attempt = 0;
+  std::optional<Clock::time_point> deadline;
+  std::optional<Clock::time_point> retry_at;
+  std::optional<Clock::time_point> throttled_since;  // First rate-limit rejection
+  std::string unsent_reply;  // Reply the requester has not drained yet
+  bool replying = false;
+  bool finished = false;
+};
+
+WorkerPool& WorkerPool::get_instance() {
+  static WorkerPool instance;
+  return instance;
+}
+
+void WorkerPool::request_shmem() {
+  pg_llm_shmem_register(kSharedName, sizeof(WorkerPoolShared), init_shared);
+}
+
+void WorkerPool::register_workers() {
+  if (!process_shared_preload_libraries_in_progress) {
+    return;
+  }
+  for (int i = 0; i < std::min(pg_llm_workers, kMaxWorkers); ++i) {
+    BackgroundWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = kRestartSeconds;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_llm");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_llm_worker_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_llm worker %d", i);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_llm worker");
+    worker.bgw_main_arg = Int32GetDatum(i);
+    RegisterBackgroundWorker(&worker);
+  }
+}
+
+bool WorkerPool::enabled() const {
+  return shared != nullptr && pg_llm_workers > 0 && !is_worker_;
+}
+
+bool WorkerPool::chat(const ModelDefinition& model,
+                      const std::vector<ChatMessage>& messages,
+                      long deadline_ms,
+                      ModelResponse* response) {
+  if (!enabled()) {
+    return false;
+  }
+
+  Json::Value request(Json::objectValue);
+  request["instance_name"] = model.instance_name;
+  request["database_id"] = model.database_id;
+  request["model_type"] = model.model_type;
+  request["local_model"] = model.local_model;
+  request["api_key"] = model.api_key;
+  request["config"] = model.config;
+  request["deadline_ms"] = Json::Int64(deadline_ms);
+  Json::Value& items = request["messages"];
+  items = Json::Value(Json::arrayValue);
+  for (const auto& message : messages) {
+    Json::Value item(Json::objectValue);
+    item["role"] = message.role;
+    item["content"] = message.content;
+    items.append(item);
+  }
+  std::string payload = pg_llm_write_json(request);
+
+  // The request is written before any worker attaches, so its queue must
+  // hold it whole
+  Size request_queue_size =
+    MAXALIGN(shm_mq_minimum_size + MAXALIGN(sizeof(Size)) + MAXALIGN(payload.size()));
+  Size header_size = MAXALIGN(sizeof(RequestSegment));
+  dsm_segment* segment = dsm_create(header_size + request_queue_size + kReplyQueueSize, 0);
+  static_cast<RequestSegment*>(dsm_segment_address(segment))->request_queue_size = request_queue_size;
+  shm_mq* requests = shm_mq_create(request_queue(segment), request_queue_size);
+  shm_mq_set_sender(requests, MyProc);
+  shm_mq* replies = shm_mq_create(reply_queue(segment), kReplyQueueSize);
+  shm_mq_set_receiver(replies, MyProc);
+  shm_mq_handle* request_handle = shm_mq_attach(requests, segment, nullptr);
+  shm_mq_handle* reply_handle = shm_mq_attach(replies, segment, nullptr);
+  if (send_message(request_handle, payload, false) != SHM_MQ_SUCCESS) {
+    dsm_detach(segment);
+    return false;
+  }
+
+  // Queue it and wake the least busy worker
+  Latch* latch = nullptr;
+  uint32 least_busy = 0;
+  SpinLockAcquire(&shared->mutex);
+  for (auto& worker : shared->workers) {
+    uint32 in_flight = pg_atomic_read_u32(&worker.in_flight);
+    if (worker.latch != nullptr && (latch == nullptr || in_flight < least_busy)) {
+      latch = worker.latch;
+      least_busy = in_flight;
+    }
+  }
+  bool queued = latch != nullptr && shared->count < kQueueCapacity;
+  if (queued) {
+    shared->queue[(shared->head + shared->count) % kQueueCapacity] = dsm_segment_handle(segment);
+    shared->count += 1;
+  }
+  SpinLockRelease(&shared->mutex);
+  if (!queued) {
+    pg_atomic_fetch_add_u64(&shared->rejected, 1);
+    dsm_detach(segment);
+    return false;
+  }
+  pg_atomic_fetch_add_u64(&shared->submitted, 1);
+  SetLatch(latch);
+
+  // Sleeps on the latch until the reply, the deadline or a cancel, which
+  // raises here; the segment is detached on abort, which tells the worker
+  // to drop the request
+  auto started = Clock::now();
+  Size length = 0;
+  void* data = nullptr;
+  shm_mq_result result;
+  for (;;) {
+    result = shm_mq_receive(reply_handle, &length, &data, true);
+    if (result != SHM_MQ_WOULD_BLOCK) {
+      break;
+    }
+    // Every worker exited before taking the request: run it here
+    if (shm_mq_get_sender(replies) == nullptr && !any_worker_running()) {
+      dsm_detach(segment);
+      return false;
+    }
+    long wait_ms = kPollIntervalMs;
+    if (deadline_ms >= 0) {
+      long left = deadline_ms -
+        static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - started).count());
+      if (left <= 0) {
+        break;
+      }
+      wait_ms = std::min(wait_ms, left);
+    }
+    int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, wait_ms, PG_WAIT_EXTENSION);
+    if (rc & WL_LATCH_SET) {
+      ResetLatch(MyLatch);
+    }
+    CHECK_FOR_INTERRUPTS();
+  }
+  if (result == SHM_MQ_WOULD_BLOCK) {
+    *response = ModelResponse{"", 0.0, "", curl_easy_strerror(CURLE_OPERATION_TIMEDOUT)};
+  } else if (result == SHM_MQ_SUCCESS) {
+    Json::Value reply = pg_llm_parse_json(std::string(static_cast<const char*>(data), length));
+    response->response = reply.get("response", "").asString();
+    response->confidence_score = reply.get("confidence_score", 0.0).asDouble();
+    response->model_name = reply.get("model_name", "").asString();
+    response->error = reply.get("error", "").asString();
+  } else {
+    *response = ModelResponse{"", 0.0, "", "pg_llm worker exited before replying"};
+  }
+  dsm_detach(segment);
+  return true;
+}
+
+WorkerPoolStats WorkerPool::stats() {
+  WorkerPoolStats stats;
+  stats.enabled = shared != nullptr && pg_llm_workers > 0;
+  if (shared == nullptr) {
+    return stats;
+  }
+  SpinLockAcquire(&shared->mutex);
+  stats.queued = shared->count;
+  for (auto& worker : shared->workers) {
+    if (worker.latch != nullptr) {
+      stats.workers += 1;
+      stats.in_flight += pg_atomic_read_u32(&worker.in_flight);
+    }
+  }
+  SpinLockRelease(&shared->mutex);
+  stats.submitted = pg_atomic_read_u64(&shared->submitted);
+  stats.completed = pg_atomic_read_u64(&shared->completed);
+  stats.abandoned = pg_atomic_read_u64(&shared->abandoned);
+  stats.rejected = pg_atomic_read_u64(&shared->rejected);
+  return stats;
+}
+
+std::shared_ptr<LLMInterface> WorkerPool::model_for(const ModelDefinition& definition) {
+  std::string digest = definition_digest(definition);
+  auto it = models_.find(digest);
+  if (it != models_.end()) {
+    return it->second;
+  }
+  if (models_.size() >= kMaxWorkerModels) {
+    models_.clear();
+  }
+  auto model = std::make_shared<LLMInterface>(definition.model_type);
+  model->set_instance_name(definition.instance_name, definition.database_id);
+  model->set_rate_limit_wait(false);
+  if (!model->initialize(definition.local_model, definition.api_key, definition.config)) {
+    return nullptr;
+  }
+  model->preconnect();
+  models_[digest] = model;
+  return model;
+}
+
+void WorkerPool::start_job(uint32_t handle, std::vector<std::unique_ptr<Job>>* jobs) {
+  auto job = std::make_unique<Job>();
+  // Null when the requester already gave up and the segment is gone
+  job->segment = dsm_attach(handle);
+  if (job->segment == nullptr) {
+    pg_atomic_fetch_add_u64(&shared->abandoned, 1);
+    return;
+  }
+  shm_mq* requests = request_queue(job->segment);
+  shm_mq* replies = reply_queue(job->segment);
+  shm_mq_set_receiver(requests, MyProc);
+  shm_mq_set_sender(replies, MyProc);
+  job->requests = shm_mq_attach(requests, job->segment, nullptr);
+  job->replies = shm_mq_attach(replies, job->segment, nullptr);
+
+  Size length = 0;
+  void* data = nullptr;
+  if (shm_mq_receive(job->requests, &length, &data, true) != SHM_MQ_SUCCESS) {
+    pg_atomic_fetch_add_u64(&shared->abandoned, 1);
+    dsm_detach(job->segment);
+    return;
+  }
+  begin_job(job.get(), std::string(static_cast<const char*>(data), length));
+  // Unfinished: sending, waiting to retry or replying
+  if (!job->finished) {
+    jobs->push_back(std::move(job));
+  }
+}
+
+void WorkerPool::begin_job(Job* job, const std::string& payload) {
+  Json::Value request;
+  Json::Reader reader;
+  if (!reader.parse(payload, request)) {
+    reply(job, ModelResponse{"", 0.0, "", "malformed worker request"});
+    return;
+  }
+
+  ModelDefinition definition;
+  definition.instance_name = request["instance_name"].asString();
+  definition.database_id = request["database_id"].asUInt();
+  definition.model_type = request["model_type"].asString();
+  definition.local_model = request["local_model"].asBool();
+  definition.api_key = request["api_key"].asString();
+  definition.config = request["config"].asString();
+  for (const auto& item : request["messages"]) {
+    job->messages.push_back(ChatMessage{item["role"].asString(), item["content"].asString()});
+  }
+  long deadline_ms = static_cast<long>(request.get("deadline_ms", -1).asInt64());
+  if (deadline_ms >= 0) {
+    job->deadline = Clock::now() + std::chrono::milliseconds(deadline_ms);
+  }
+
+  job->model = model_for(definition);
+  if (!job->model) {
+    reply(job, ModelResponse{"", 0.0, "", "Model not initialized"});
+    return;
+  }
+  if (deadline_ms == 0) {
+    reply(job, ModelResponse{"", 0.0, job->model->get_model_name(), curl_easy_strerror(CURLE_OPERATION_TIMEDOUT)});
+    return;
+  }
+  send_transfer(job);
+}
+
+bool WorkerPool::send_transfer(Job* job) {
+  job->attempt += 1;
+  ModelResponse immediate;
+  job->transfer = job->model->begin_chat_completion(job->messages, &immediate);
+  if (!job->transfer) {
+    // Try again shortly rather than sleeping in the rate limiter, for as
+    // long as a backend would have waited for capacity
+    if (job->model->rate_limit_deferred()) {
+      auto now = Clock::now();
+      if (!job->throttled_since) {
+        job->throttled_since = now;
+      }
+      auto retry_at = now + std::chrono::milliseconds(kRateLimitRetryMs);
+      bool waited_out = pg_llm_rate_limit_max_wait >= 0 &&
+        now - *job->throttled_since >= std::chrono::milliseconds(pg_llm_rate_limit_max_wait);
+      if (!waited_out && (!job->deadline || retry_at < *job->deadline)) {
+        // Nothing was sent, so the retry policy does not count it
+        job->attempt -= 1;
+        job->retry_at = retry_at;
+        return true;
+      }
+      PG_LLM_LOG_WARNING("rate limit for instance %s exceeded after waiting %ld ms",
+                         job->model->get_instance_name().c_str(),
+                         static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                           now - *job->throttled_since).count()));
+    }
+    reply(job, immediate);
+    return false;
+  }
+  job->throttled_since.reset();
+  // The requester's deadline travels with the request
+  if (job->deadline) {
+    long remaining_ms = std::max<long>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(*job->deadline - Clock::now()).count(), 1);
+    if (job->transfer->timeout_ms <= 0 || remaining_ms < job->transfer->timeout_ms) {
+      job->transfer->timeout_ms = remaining_ms;
+    }
+  }
+  HttpEngine::get_instance().add(job->transfer.get());
+  return true;
+}
+
+void WorkerPool::reply(Job* job, const ModelResponse& response) {
+  job->transfer.reset();
+  job->unsent_reply = pg_llm_write_json(response_json(response));
+  job->replying = true;
+  flush_reply(job);
+}
+
+void WorkerPool::flush_reply(Job* job) {
+  // A reply longer than the free queue space goes out as the requester
+  // drains it, without holding up the other jobs
+  shm_mq_result result = send_message(job->replies, job->unsent_reply, true);
+  if (result == SHM_MQ_WOULD_BLOCK) {
+    return;
+  }
+  if (result == SHM_MQ_SUCCESS) {
+    pg_atomic_fetch_add_u64(&shared->completed, 1);
+  } else {
+    pg_atomic_fetch_add_u64(&shared->abandoned, 1);
+  }
+  job->unsent_reply.clear();
+  dsm_detach(job->segment);
+  job->segment = nullptr;
+  job->finished = true;
+}
+
+void WorkerPool::run(int index) {
+  is_worker_ = true;
+  index_ = index;
+  if (shared == nullptr || index < 0 || index >= kMaxWorkers) {
+    PG_LLM_LOG_WARNING("pg_llm worker %d has no shared queue; exiting", index);
+    return;
+  }
+  SpinLockAcquire(&shared->mutex);
+  shared->workers[index].latch = MyLatch;
+  SpinLockRelease(&shared->mutex);
+  before_shmem_exit(detach_worker, Int32GetDatum(index));
+  PG_LLM_LOG_INFO("pg_llm worker %d started", index);
+
+  auto& engine = HttpEngine::get_instance();
+  std::vector<std::unique_ptr<Job>> jobs;
+  while (true) {
+    CHECK_FOR_INTERRUPTS();
+    // pg_llm.* settings changed by a reload apply to the requests sent next
+    if (ConfigReloadPending) {
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    // Take queued requests while there is room
+    while (jobs.size() < kMaxJobsPerWorker) {
+      std::optional<dsm_handle> handle;
+      SpinLockAcquire(&shared->mutex);
+      if (shared->count > 0) {
+        handle = shared->queue[shared->head];
+        shared->head = (shared->head + 1) % kQueueCapacity;
+        shared->count -= 1;
+      }
+      SpinLockRelease(&shared->mutex);
+      if (!handle) {
+        break;
+      }
+      start_job(*handle, &jobs);
+    }
+
+    auto now = Clock::now();
+    long wait_ms = kPollIntervalMs;
+    for (auto& job : jobs) {
+      // The requester detaches its end when it is canceled or gone
+      Size length = 0;
+      void* data = nullptr;
+      if (shm_mq_receive(job->requests, &length, &data, true) == SHM_MQ_DETACHED) {
+        job->transfer.reset();
+        dsm_detach(job->segment);
+        job->segment = nullptr;
+        job->finished = true;
+        pg_atomic_fetch_add_u64(&shared->abandoned, 1);
+        continue;
+      }
+      // The requester read part of the reply, which set our latch
+      if (job->replying) {
+        flush_reply(job.get());
+        continue;
+      }
+
+      if (job->transfer && job->transfer->done) {
+        long delay_ms = job->model->retry_delay_ms(*job->transfer, job->attempt);
+        if (delay_ms >= 0 && job->deadline && now + std::chrono::milliseconds(delay_ms) >= *job->deadline) {
+          delay_ms = -1;
+        }
+        if (delay_ms < 0) {
+          reply(job.get(), job->model->finish_chat_completion(*job->transfer));
+          continue;
+        }
+        // Give back the rate-limit permit and the handle while waiting
+        job->transfer.reset();
+        job->retry_at = now + std::chrono::milliseconds(delay_ms);
+      }
+      if (!job->transfer && job->retry_at) {
+        if (now >= *job->retry_at) {
+          job->retry_at.reset();
+          send_transfer(job.get());
+        } else {
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*job->retry_at - now).count();
+          wait_ms = std::clamp<long>(left, 0, wait_ms);
+        }
+      }
+    }
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const std::unique_ptr<Job>& job) {
+      return job->finished;
+    }), jobs.end());
+    pg_atomic_write_u32(&shared->workers[index].in_flight, static_cast<uint32>(jobs.size()));
+
+    // Socket activity, a new request (the latch) or the next retry
+    if (engine.active_count() > 0) {
+      engine.run_once(static_cast<int>(wait_ms));
+    } else {
+      int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, wait_ms, PG_WAIT_EXTENSION);
+      if (rc & WL_LATCH_SET) {
+        ResetLatch(MyLatch);
+      }
+    }
+  }
+}
+
+} // namespace pg_llm
+
+void pg_llm_worker_main(Datum main_arg) {
+  pqsignal(SIGTERM, die);
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  BackgroundWorkerUnblockSignals();
+  pg_llm::WorkerPool::get_instance().run(DatumGetInt32(main_arg));
+}
@@ -1,9 +1,12 @@
 extern "C" {
 #include "postgres.h"  // clang-format off
 #include "catalog/pg_type.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "fmgr.h"
 #include "funcapi.h"
+#include "libpq/libpq.h"
+#include "tcop/tcopprot.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/jsonb.h"
@@ -44,6 +47,20 @@ PG_FUNCTION_INFO_V1(pg_llm_search_knowledge);
 PG_FUNCTION_INFO_V1(pg_llm_record_feedback);
 PG_FUNCTION_INFO_V1(pg_llm_get_audit_log);
 PG_FUNCTION_INFO_V1(pg_llm_get_trace);
+PG_FUNCTION_INFO_V1(pg_llm_cache_stats);
+PG_FUNCTION_INFO_V1(pg_llm_cache_reset);
+PG_FUNCTION_INFO_V1(pg_llm_chat_batch);
+PG_FUNCTION_INFO_V1(pg_llm_model_health);
+PG_FUNCTION_INFO_V1(pg_llm_embed_batch);
+PG_FUNCTION_INFO_V1(pg_llm_count_tokens);
+PG_FUNCTION_INFO_V1(pg_llm_models_changed);
+PG_FUNCTION_INFO_V1(pg_llm_worker_stats);
+PG_FUNCTION_INFO_V1(pg_llm_submit);
+PG_FUNCTION_INFO_V1(pg_llm_poll);
+PG_FUNCTION_INFO_V1(pg_llm_await);
+PG_FUNCTION_INFO_V1(pg_llm_map);
+PG_FUNCTION_INFO_V1(pg_llm_cancel_job);
+PG_FUNCTION_INFO_V1(pg_llm_resume_job);
 
 Datum pg_llm_add_model(PG_FUNCTION_ARGS);
 Datum pg_llm_remove_model(PG_FUNCTION_ARGS);
@@ -74,17 +91,44 @@ Datum pg_llm_search_knowledge(PG_FUNCTION_ARGS);
 Datum pg_llm_record_feedback(PG_FUNCTION_ARGS);
 Datum pg_llm_get_audit_log(PG_FUNCTION_ARGS);
 Datum pg_llm_get_trace(PG_FUNCTION_ARGS);
+Datum pg_llm_cache_stats(PG_FUNCTION_ARGS);
+Datum pg_llm_cache_reset(PG_FUNCTION_ARGS);
+Datum pg_llm_chat_batch(PG_FUNCTION_ARGS);
+Datum pg_llm_model_health(PG_FUNCTION_ARGS);
+Datum pg_llm_embed_batch(PG_FUNCTION_ARGS);
+Datum pg_llm_count_tokens(PG_FUNCTION_ARGS);
+Datum pg_llm_models_changed(PG_FUNCTION_ARGS);
+Datum pg_llm_worker_stats(PG_FUNCTION_ARGS);
+Datum pg_llm_submit(PG_FUNCTION_ARGS);
+Datum pg_llm_poll(PG_FUNCTION_ARGS);
+Datum pg_llm_await(PG_FUNCTION_ARGS);
+Datum pg_llm_map(PG_FUNCTION_ARGS);
+Datum pg_llm_cancel_job(PG_FUNCTION_ARGS);
+Datum pg_llm_resume_job(PG_FUNCTION_ARGS);
 
 void _PG_init(void);
 void _PG_fini(void);
 }  // extern "C"
 
+#include "cache/embedding_cache.h"
+#include "cache/response_cache.h"
+#include "cache/semantic_cache.h"
+#include "catalog/async_requests.h"
+#include "catalog/deferred_logs.h"
+#include "catalog/map_jobs.h"
+#include "catalog/model_registry.h"
 #include "catalog/pg_llm_models.h"
+#include "models/circuit_breaker.h"
+#include "models/context_packer.h"
 #include "models/llm_interface.h"
+#include "models/local_embedder.h"
 #include "models/model_manager.h"
+#include "models/simd_kernels.h"
+#include "models/worker_pool.h"
 #include "text2sql/pg_vector.h"
 #include "text2sql/text2sql.h"
 #include "utils/pg_llm_log.h"
+#include "utils/pg_llm_shmem.h"
 #include "utils/pg_llm_support.h"
 
 #include <algorithm>
@@ -98,9 +142,12 @@ void _PG_fini(void);
 namespace {
 
 using pg_llm::ChatMessage;
+using pg_llm::EmbeddingCache;
 using pg_llm::LLMInterface;
 using pg_llm::ModelManager;
 using pg_llm::ModelResponse;
+using pg_llm::ResponseCache;
+using pg_llm::SemanticCache;
 using pg_llm::StreamResponse;
 
 struct ChatExecutionResult {
@@ -109,6 +156,10 @@ struct ChatExecutionResult {
   std::string selected_model_name;
   std::string response;
   double confidence_score = 0.0;
+  std::string error;                   // Set when the selected instance failed
+  std::vector<ChatMessage> messages;   // Request sent, replayed to the fallback
+  bool cache_hit = false;
+  std::optional<double> cache_similarity;
   bool fallback_used = false;
   std::string fallback_instance;
   Json::Value candidates = Json::arrayValue;
@@ -116,10 +167,20 @@ struct ChatExecutionResult {
 };
 
 struct StreamSrfState {
-  std::vector<pg_llm::StreamChunk> chunks;
+  std::shared_ptr<LLMInterface> model;         // Keeps the model alive while streaming
+  std::unique_ptr<pg_llm::ChatStream> stream;  // Live request, pumped once per row
+  std::string event_type;
   std::string request_id;
-  std::string model_name;
-  double confidence_score = 0.0;
+  std::string instance_name;
+  std::string prompt;
+  std::optional<std::string> session_id;
+  int chunk_count = 0;
+};
+
+struct BatchItem {
+  pg_llm::BatchResult result;
+  std::string request_id;
+  bool cache_hit = false;
 };
 
 struct SessionMessageRow {
@@ -195,14 +256,25 @@ Datum uuid_text_datum(const std::string& value) {
   return CStringGetTextDatum(value.c_str());
 }
 
-std::vector<float> deterministic_embedding(const std::string& text, int dimensions = 64) {
-  std::vector<float> embedding(dimensions, 0.0f);
-  std::hash<std::string> hasher;
-  for (int i = 0; i < dimensions; ++i) {
-    size_t hashed = hasher(text + ":" + std::to_string(i));
-    embedding[i] = static_cast<float>((hashed % 2000) - 1000) / 1000.0f;
+// Knowledge base embeddings, served from the shared embedding cache when the
+// same chunk or question was embedded before
+std::vector<std::vector<float>> knowledge_embeddings(const std::vector<std::string>& texts) {
+  pg_llm::EmbeddingScope scope{pg_llm::kLocalEmbedderKey, 64, false};
+  auto results = EmbeddingCache::get_instance().get_or_embed(
+    scope, texts, [](const std::vector<std::string>& pending) {
+      std::vector<pg_llm::EmbeddingResult> computed(pending.size());
+      for (size_t i = 0; i < pending.size(); ++i) {
+        computed[i].embedding = pg_llm::local_embedding(pending[i], 64);
+      }
+      return computed;
+    });
+
+  std::vector<std::vector<float>> embeddings;
+  embeddings.reserve(results.size());
+  for (auto& result : results) {
+    embeddings.push_back(std::move(result.embedding));
   }
-  return embedding;
+  return embeddings;
 }
 
 Json::Value redact_metadata(const Json::Value& input) {
@@ -229,6 +301,11 @@ void insert_trace_log(const std::string& request_id,
   if (!pg_llm_trace_enabled) {
     return;
   }
+  if (pg_llm::DeferredLogs::active()) {
+    pg_llm::DeferredLogs::get_instance().add(
+      pg_llm::TraceRecord{request_id, stage, pg_llm_write_json(redact_metadata(details))});
+    return;
+  }
 
   SPI_connect();
   const char* sql =
@@ -255,6 +332,16 @@ void insert_audit_log(const std::string& request_id,
   if (!pg_llm_audit_enabled || pg_llm_audit_sample_rate <= 0.0) {
     return;
   }
+  if (pg_llm::DeferredLogs::active()) {
+    pg_llm::DeferredLogs::get_instance().add(pg_llm::AuditRecord{request_id,
+                                                                 event_type,
+                                                                 instance_name,
+                                                                 session_id,
+                                                                 success,
+                                                                 confidence_score,
+                                                                 pg_llm_write_json(redact_metadata(metadata))});
+    return;
+  }
 
   SPI_connect();
   const char* sql =
@@ -276,9 +363,91 @@ void insert_audit_log(const std::string& request_id,
   SPI_finish();
 }
 
+Datum text_array_datum(const std::vector<std::string>& values) {
+  std::vector<Datum> elements;
+  elements.reserve(values.size());
+  for (const auto& value : values) {
+    elements.push_back(text_datum(value));
+  }
+  return PointerGetDatum(
+    construct_array(elements.data(), static_cast<int>(elements.size()), TEXTOID, -1, false, 'i'));
+}
+
+// Batch counterpart of insert_audit_log/insert_trace_log: one INSERT per log
+// table for the whole batch instead of one SPI round trip per item
+void insert_batch_logs(const std::string& event_type,
+                       const std::string& instance_name,
+                       const std::vector<std::string>& request_ids,
+                       const std::vector<bool>& successes,
+                       const std::vector<double>& confidence_scores,
+                       const std::vector<Json::Value>& audit_metadata,
+                       const std::vector<Json::Value>& trace_details) {
+  bool audit = pg_llm_audit_enabled && pg_llm_audit_sample_rate > 0.0;
+  if (request_ids.empty() || (!audit && !pg_llm_trace_enabled)) {
+    return;
+  }
+  if (pg_llm::DeferredLogs::active()) {
+    for (size_t i = 0; i < request_ids.size(); ++i) {
+      if (audit) {
+        insert_audit_log(request_ids[i], event_type, instance_name, "", successes[i],
+                         confidence_scores[i], audit_metadata[i]);
+      }
+      insert_trace_log(request_ids[i], event_type, trace_details[i]);
+    }
+    return;
+  }
+
+  SPI_connect();
+  Datum ids = text_array_datum(request_ids);
+  if (audit) {
+    std::vector<Datum> success_datums;
+    std::vector<Datum> score_datums;
+    std::vector<std::string> metadata;
+    for (size_t i = 0; i < request_ids.size(); ++i) {
+      success_datums.push_back(BoolGetDatum(successes[i]));
+      score_datums.push_back(Float8GetDatum(confidence_scores[i]));
+      metadata.push_back(pg_llm_write_json(redact_metadata(audit_metadata[i])));
+    }
+    int count = static_cast<int>(request_ids.size());
+    const char* sql =
+      "INSERT INTO _pg_llm_catalog.pg_llm_audit_log "
+      "(request_id, event_type, instance_name, session_id, success, confidence_score, metadata) "
+      "SELECT r::uuid, $2, $3, '', s, c, m::jsonb "
+      "FROM unnest($1::text[], $4::boolean[], $5::float8[], $6::text[]) AS t(r, s, c, m)";
+    Oid argtypes[6] = {TEXTARRAYOID, TEXTOID, TEXTOID, BOOLARRAYOID, FLOAT8ARRAYOID, TEXTARRAYOID};
+    Datum values[6] = {
+      ids,
+      text_datum(event_type),
+      text_datum(instance_name),
+      PointerGetDatum(construct_array(success_datums.data(), count, BOOLOID, 1, true, 'c')),
+      PointerGetDatum(construct_array(score_datums.data(), count, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd')),
+      text_array_datum(metadata)};
+    char nulls[6] = {' ', ' ', ' ', ' ', ' ', ' '};
+    int ret = SPI_execute_with_args(sql, 6, argtypes, values, nulls, false, 0);
+    ensure_spi_result(ret, SPI_OK_INSERT, "failed to persist audit log");
+  }
+
+  if (pg_llm_trace_enabled) {
+    std::vector<std::string> details;
+    for (const auto& item : trace_details) {
+      details.push_back(pg_llm_write_json(redact_metadata(item)));
+    }
+    const char* sql =
+      "INSERT INTO _pg_llm_catalog.pg_llm_trace_log (request_id, stage, details) "
+      "SELECT r::uuid, $2, d::jsonb FROM unnest($1::text[], $3::text[]) AS t(r, d)";
+    Oid argtypes[3] = {TEXTARRAYOID, TEXTOID, TEXTARRAYOID};
+    Datum values[3] = {ids, text_datum(event_type), text_array_datum(details)};
+    char nulls[3] = {' ', ' ', ' '};
+    int ret = SPI_execute_with_args(sql, 3, argtypes, values, nulls, false, 0);
+    ensure_spi_result(ret, SPI_OK_INSERT, "failed to persist trace log");
+  }
+  SPI_finish();
+}
+
 PgLlmModelInfo get_model_info_or_error(const std::string& instance_name) {
   PgLlmModelInfo info;
-  if (!pg_llm_model_get_info(instance_name, &info)) {
+  std::string decrypt_error;  // Only the unencrypted columns are needed here
+  if (!pg_llm::ModelRegistry::get_instance().lookup(instance_name, &info, &decrypt_error)) {
     ereport(ERROR,
             (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
              errmsg("Model instance not found: %s", instance_name.c_str())));
@@ -505,19 +674,80 @@ void cleanup_sessions_internal(int timeout_seconds) {
   SPI_finish();
 }
 
-std::string build_rag_context(const std::string& query, int limit);
+std::vector<KnowledgeSearchRow> search_knowledge_internal(const std::string& query, int limit);
+
+// Threshold a reply from this instance must reach: options, then the
+// instance setting, then the GUC default
+double effective_confidence_threshold(const PgLlmModelInfo& info, const Json::Value& options) {
+  if (options.isObject() && options.isMember("confidence_threshold")) {
+    return options["confidence_threshold"].asDouble();
+  }
+  return info.confidence_threshold > 0.0 ? info.confidence_threshold : pg_llm_default_confidence_threshold;
+}
+
+// The "deadline_ms" option bounds the upstream calls of one request,
+// retries and hedges included; zero or absent leaves only the timeouts
+long deadline_ms_option(const Json::Value& options) {
+  return options.isObject() ? options.get("deadline_ms", 0).asInt() : 0;
+}
+
+// Pack knowledge chunks and session history around a chat prompt within
+// "max_input_tokens" (option, then instance config). Knowledge fills
+// first, best match first, skipping chunks that repeat a packed one;
+// history then fills from the newest message back and stops at the first
+// one that does not fit. The prompt itself is never cut. Replaces *messages
+// (the history) with the request and returns the packing plan.
+Json::Value pack_chat_context(const LLMInterface& model,
+                              const Json::Value& options,
+                              const std::string& prompt,
+                              const std::vector<KnowledgeSearchRow>& knowledge,
+                              size_t knowledge_limit,
+                              std::vector<ChatMessage>* messages) {
+  int budget = options.isObject()
+    ? options.get("max_input_tokens", model.max_input_tokens()).asInt()
+    : model.max_input_tokens();
+  pg_llm::ContextPacker packer([&model](std::string_view text) { return model.count_tokens(text); },
+                               budget > 0 ? static_cast<size_t>(budget) : 0);
+  packer.add_section({"knowledge", 0, "\n\nKnowledge Context:\n", knowledge_limit});
+  packer.add_section({"history", 1, "", SIZE_MAX, SIZE_MAX, false, true});
+  packer.reserve_tokens(model.count_tokens(std::vector<ChatMessage>{{"user", prompt}}));
+  if (packer.over_budget()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+             errmsg("prompt needs %zu tokens, over the max_input_tokens budget of %d",
+                    packer.used_tokens(),
+                    budget)));
+  }
+
+  for (const auto& row : knowledge) {
+    std::string label = row.source_name + ":" + std::to_string(row.chunk_index);
+    packer.add("knowledge", label, "[" + label + "] " + row.content + "\n", row.similarity);
+  }
+  std::vector<size_t> history_items;
+  for (size_t i = 0; i < messages->size(); ++i) {
+    const auto& message = (*messages)[i];
+    size_t framing = model.count_tokens(std::vector<ChatMessage>{{message.role, ""}});
+    history_items.push_back(
+      packer.add("history", "message " + std::to_string(i + 1), message.content, static_cast<double>(i), framing));
+  }
+  packer.pack();
+
+  std::vector<ChatMessage> request;
+  for (size_t i = 0; i < history_items.size(); ++i) {
+    if (packer.packed(history_items[i])) {
+      request.push_back(std::move((*messages)[i]));
+    }
+  }
+  request.push_back(ChatMessage{"user", prompt + packer.render("knowledge")});
+  *messages = std::move(request);
+  return packer.plan();
+}
 
 ChatExecutionResult maybe_apply_fallback(const ChatExecutionResult& input,
                                          const Json::Value& options,
                                          const std::string& event_type) {
   PgLlmModelInfo selected_info = get_model_info_or_error(input.selected_instance);
-  double threshold = selected_info.confidence_threshold > 0.0
-    ? selected_info.confidence_threshold
-    : pg_llm_default_confidence_threshold;
-
-  if (options.isObject() && options.isMember("confidence_threshold")) {
-    threshold = options["confidence_threshold"].asDouble();
-  }
+  double threshold = effective_confidence_threshold(selected_info, options);
 
   std::string fallback_instance = selected_info.fallback_instance;
   if (fallback_instance.empty() && pg_llm_default_local_fallback != nullptr) {
@@ -527,13 +757,37 @@ ChatExecutionResult maybe_apply_fallback(const ChatExecutionResult& input,
     fallback_instance = options["fallback_instance"].asString();
   }
 
-  if (input.confidence_score >= threshold || fallback_instance.empty() ||
-      fallback_instance == input.selected_instance) {
+  // A failed request has no answer to return, whatever the threshold
+  bool failed = !input.error.empty();
+  if (!failed && input.confidence_score >= threshold) {
+    return input;
+  }
+  if (fallback_instance.empty() || fallback_instance == input.selected_instance) {
+    if (failed) {
+      ereport(ERROR,
+              (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+               errmsg("request to instance \"%s\" failed: %s",
+                      input.selected_instance.c_str(),
+                      input.error.c_str())));
+    }
     return input;
   }
 
   auto fallback_model = get_model_or_error(fallback_instance);
-  auto fallback_response = fallback_model->chat_completion(input.response);
+  auto fallback_response = fallback_model->chat_completion(input.messages);
+  if (!fallback_response.error.empty()) {
+    if (!failed) {
+      return input;
+    }
+    ereport(ERROR,
+            (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+             errmsg("request to instance \"%s\" failed: %s",
+                    input.selected_instance.c_str(),
+                    input.error.c_str()),
+             errdetail("Fallback instance \"%s\" failed too: %s",
+                       fallback_instance.c_str(),
+                       fallback_response.error.c_str())));
+  }
   ChatExecutionResult result = input;
   result.fallback_used = true;
   result.fallback_instance = fallback_instance;
@@ -541,22 +795,85 @@ ChatExecutionResult maybe_apply_fallback(const ChatExecutionResult& input,
   result.selected_model_name = fallback_response.model_name;
   result.response = fallback_response.response;
   result.confidence_score = fallback_response.confidence_score;
+  result.error.clear();
 
   Json::Value trace(Json::objectValue);
   trace["event_type"] = event_type;
-  trace["reason"] = "confidence_below_threshold";
+  trace["reason"] = failed ? "request_failed" : "confidence_below_threshold";
+  if (failed) {
+    trace["error"] = input.error;
+  }
   trace["threshold"] = threshold;
   trace["fallback_instance"] = fallback_instance;
   result.trace_events.append(trace);
   return result;
 }
 
+struct CacheOutcome {
+  bool hit = false;
+  std::optional<double> similarity;  // Nearest semantic match, 1.0 for exact hits
+};
+
+// Serve a chat request from the shared exact-match cache, then from the
+// semantic cache, unless the caller opted out with "cache": false
+ModelResponse cached_chat_completion(const std::string& instance_name,
+                                     LLMInterface& model,
+                                     const std::vector<ChatMessage>& messages,
+                                     const Json::Value& options,
+                                     CacheOutcome* outcome) {
+  bool use_cache = !(options.isObject() && !options.get("cache", true).asBool());
+  auto& cache = ResponseCache::get_instance();
+  bool use_exact = use_cache && cache.enabled();
+
+  std::string key;
+  if (use_exact) {
+    key = ResponseCache::make_key(instance_name, model, messages);
+    if (auto cached = cache.lookup(key)) {
+      outcome->hit = true;
+      outcome->similarity = 1.0;
+      return *cached;
+    }
+  }
+
+  // Paraphrase matching only applies to standalone prompts; the meaning of
+  // a turn inside a conversation depends on its history
+  double threshold = use_cache && messages.size() == 1 ? SemanticCache::threshold(model, options) : 0.0;
+  std::vector<float> embedding;
+  if (threshold > 0.0) {
+    embedding = model.get_embedding(messages.back().content);
+    auto probe = SemanticCache::lookup(instance_name, model, embedding, threshold);
+    if (probe.similarity >= 0.0) {
+      outcome->similarity = probe.similarity;
+    }
+    if (probe.response.has_value()) {
+      outcome->hit = true;
+      if (use_exact) {
+        cache.store(key, *probe.response);
+      }
+      return *probe.response;
+    }
+  }
+
+  auto response = model.chat_completion(messages);
+  // Failed requests carry an error and must not be replayed
+  if (response.error.empty() && !response.response.empty()) {
+    if (use_exact) {
+      cache.store(key, response);
+    }
+    if (threshold > 0.0) {
+      SemanticCache::store(instance_name, model, messages.back().content, embedding, response);
+    }
+  }
+  return response;
+}
+
 ChatExecutionResult execute_single_chat_internal(const std::string& instance_name,
                                                  const std::string& prompt,
                                                  const Json::Value& options,
                                                  const std::optional<std::string>& session_id,
                                                  bool streaming) {
   auto model = get_model_or_error(instance_name);
+  pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
   std::string request_id = pg_llm_generate_uuid();
 
   std::vector<ChatMessage> messages;
@@ -564,37 +881,46 @@ ChatExecutionResult execute_single_chat_internal(const std::string& instance_nam
     messages = load_session_messages(*session_id);
   }
 
-  std::string effective_prompt = prompt;
-  if (options.get("enable_rag", false).asBool()) {
-    std::string rag_context = build_rag_context(prompt, options.get("knowledge_limit", 3).asInt());
-    if (!rag_context.empty()) {
-      effective_prompt += "\n\nKnowledge Context:\n" + rag_context;
-    }
+  // Over-fetch knowledge so chunks dropped as duplicates can be replaced
+  std::vector<KnowledgeSearchRow> knowledge;
+  int knowledge_limit = std::max(options.get("knowledge_limit", 3).asInt(), 0);
+  if (options.get("enable_rag", false).asBool() && knowledge_limit > 0) {
+    knowledge = search_knowledge_internal(prompt, knowledge_limit * 2);
   }
-  messages.push_back(ChatMessage{"user", effective_prompt});
+  Json::Value context_plan =
+    pack_chat_context(*model, options, prompt, knowledge, static_cast<size_t>(knowledge_limit), &messages);
 
   ModelResponse response;
+  CacheOutcome cache_outcome;
   if (streaming) {
     auto stream_response = model->stream_chat_completion(messages);
     response = ModelResponse{stream_response.response,
                              stream_response.confidence_score,
-                             stream_response.model_name};
+                             stream_response.model_name,
+                             stream_response.error};
   } else {
-    response = model->chat_completion(messages);
+    response = cached_chat_completion(instance_name, *model, messages, options, &cache_outcome);
   }
 
   ChatExecutionResult result;
   result.request_id = request_id;
+  result.cache_hit = cache_outcome.hit;
+  result.cache_similarity = cache_outcome.similarity;
   result.selected_instance = instance_name;
   result.selected_model_name = response.model_name;
   result.response = response.response;
   result.confidence_score = response.confidence_score;
+  result.error = response.error;
+  result.messages = messages;
 
   Json::Value candidate(Json::objectValue);
   candidate["instance_name"] = instance_name;
   candidate["model_name"] = response.model_name;
   candidate["response"] = response.response;
   candidate["confidence_score"] = response.confidence_score;
+  if (!response.error.empty()) {
+    candidate["error"] = response.error;
+  }
   result.candidates.append(candidate);
 
   Json::Value trace(Json::objectValue);
@@ -602,9 +928,17 @@ ChatExecutionResult execute_single_chat_internal(const std::string& instance_nam
   trace["instance_name"] = instance_name;
   trace["confidence_score"] = response.confidence_score;
   trace["streaming"] = streaming;
+  trace["cache_hit"] = cache_outcome.hit;
+  if (!response.error.empty()) {
+    trace["error"] = response.error;
+  }
+  if (cache_outcome.similarity.has_value()) {
+    trace["cache_similarity"] = *cache_outcome.similarity;
+  }
   if (options.get("enable_rag", false).asBool()) {
     trace["rag_enabled"] = true;
   }
+  trace["context_plan"] = context_plan;
   result.trace_events.append(trace);
 
   result = maybe_apply_fallback(result, options, session_id.has_value() ? "multi_turn_chat" : "chat");
@@ -637,8 +971,48 @@ ChatExecutionResult execute_parallel_chat_internal(const std::string& prompt,
                                                    const std::vector<std::string>& model_names,
                                                    const Json::Value& options) {
   auto& manager = ModelManager::get_instance();
-  auto responses = manager.parallel_inference(prompt, model_names);
-  if (responses.empty()) {
+  pg_llm::ParallelOptions parallel_options;
+  std::string mode = options.isObject() ? options.get("mode", "best").asString() : "best";
+  if (mode == "first_acceptable") {
+    // Resolved once per answering instance (hedges included); an instance
+    // missing from the catalog gets the default threshold
+    auto thresholds = std::make_shared<std::map<std::string, double>>();
+    parallel_options.accept = [thresholds, &options](const std::string& instance_name,
+                                                     const ModelResponse& response) {
+      auto it = thresholds->find(instance_name);
+      if (it == thresholds->end()) {
+        PgLlmModelInfo info;
+        std::string decrypt_error;
+        pg_llm::ModelRegistry::get_instance().lookup(instance_name, &info, &decrypt_error);
+        it = thresholds->emplace(instance_name, effective_confidence_threshold(info, options)).first;
+      }
+      return !response.response.empty() && response.confidence_score >= it->second;
+    };
+  } else if (mode != "best") {
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("invalid parallel chat mode \"%s\"", mode.c_str()),
+             errhint("Use \"best\" or \"first_acceptable\".")));
+  }
+  parallel_options.hedge = options.isObject() && options.get("hedge", false).asBool();
+
+  std::vector<ChatMessage> messages = {{"user", prompt}};
+  pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
+  auto candidates = manager.parallel_inference(messages, model_names, parallel_options);
+  const pg_llm::ParallelCandidate* best = nullptr;
+  for (const auto& candidate : candidates) {
+    if (!candidate.finished) {
+      continue;
+    }
+    // Any answer beats a failure
+    bool failed = !candidate.response.error.empty();
+    bool best_failed = best != nullptr && !best->response.error.empty();
+    if (best == nullptr || (best_failed && !failed) ||
+        (best_failed == failed && candidate.response.confidence_score > best->response.confidence_score)) {
+      best = &candidate;
+    }
+  }
+  if (best == nullptr) {
     ereport(ERROR,
             (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
              errmsg("No model responses available for parallel chat")));
@@ -646,33 +1020,45 @@ ChatExecutionResult execute_parallel_chat_internal(const std::string& prompt,
 
   ChatExecutionResult result;
   result.request_id = pg_llm_generate_uuid();
-  ModelResponse best = responses.front();
-  std::string best_instance = model_names.front();
-  for (size_t i = 0; i < responses.size(); ++i) {
-    const auto& response = responses[i];
-    Json::Value candidate(Json::objectValue);
-    candidate["instance_name"] = i < model_names.size() ? model_names[i] : response.model_name;
-    candidate["model_name"] = response.model_name;
-    candidate["response"] = response.response;
-    candidate["confidence_score"] = response.confidence_score;
-    result.candidates.append(candidate);
-
-    if (response.confidence_score > best.confidence_score) {
-      best = response;
-      best_instance = i < model_names.size() ? model_names[i] : response.model_name;
+  int canceled = 0;
+  for (const auto& candidate : candidates) {
+    Json::Value item(Json::objectValue);
+    item["instance_name"] = candidate.instance_name;
+    item["model_name"] = candidate.response.model_name;
+    item["response"] = candidate.response.response;
+    item["confidence_score"] = candidate.response.confidence_score;
+    item["latency_ms"] = candidate.latency_ms;
+    if (!candidate.response.error.empty()) {
+      item["error"] = candidate.response.error;
+    }
+    if (candidate.hedged) {
+      item["hedged"] = true;
+      item["answered_by"] = candidate.answered_by;
     }
+    if (!candidate.finished) {
+      item["canceled"] = true;
+      ++canceled;
+    }
+    result.candidates.append(item);
   }
+  const ModelResponse& best_response = best->response;
+  const std::string& best_instance = best->answered_by;
 
   result.selected_instance = best_instance;
-  result.selected_model_name = best.model_name;
-  result.response = best.response;
-  result.confidence_score = best.confidence_score;
+  result.selected_model_name = best_response.model_name;
+  result.response = best_response.response;
+  result.confidence_score = best_response.confidence_score;
+  result.error = best_response.error;
+  result.messages = messages;
 
   Json::Value trace(Json::objectValue);
   trace["prompt"] = prompt;
-  trace["candidate_count"] = static_cast<int>(responses.size());
+  trace["mode"] = mode;
+  trace["hedge"] = parallel_options.hedge;
+  trace["candidate_count"] = static_cast<int>(candidates.size());
+  trace["canceled_count"] = canceled;
   trace["selected_instance"] = best_instance;
-  trace["confidence_score"] = best.confidence_score;
+  trace["confidence_score"] = best_response.confidence_score;
   result.trace_events.append(trace);
   result = maybe_apply_fallback(result, options, "parallel_chat");
 
@@ -718,6 +1104,9 @@ pg_llm::text2sql::Text2SQLConfig parse_text2sql_config(bool use_vector_search,
     if (options.isMember("sample_data_limit")) {
       config.sample_data_limit = options["sample_data_limit"].asInt();
     }
+    if (options.isMember("max_tokens")) {
+      config.max_tokens = options["max_tokens"].asInt();
+    }
   }
   return config;
 }
@@ -810,6 +1199,7 @@ Json::Value build_text2sql_json_internal(const std::string& instance_name,
                                          bool use_vector_search,
                                          const Json::Value& options) {
   auto model = get_model_or_error(instance_name);
+  pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
   pg_llm::text2sql::Text2SQLConfig config = parse_text2sql_config(use_vector_search, options);
   pg_llm::text2sql::Text2SQL text2sql(model, config);
 
@@ -857,7 +1247,9 @@ Json::Value build_text2sql_json_internal(const std::string& instance_name,
                    true,
                    1.0,
                    audit);
-  insert_trace_log(result["request_id"].asString(), "text2sql", result);
+  Json::Value trace = result;
+  trace["context_plan"] = text2sql.context_plan();
+  insert_trace_log(result["request_id"].asString(), "text2sql", trace);
   return result;
 }
 
@@ -866,6 +1258,7 @@ Json::Value build_report_json_internal(const std::string& instance_name,
                                        const Json::Value& options) {
   Json::Value execution = build_sql_result_json(sql);
   auto model = get_model_or_error(instance_name);
+  pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
 
   Json::Value report(Json::objectValue);
   report["request_id"] = pg_llm_generate_uuid();
@@ -881,6 +1274,13 @@ Json::Value build_report_json_internal(const std::string& instance_name,
   narrative_prompt << "Summarize this SQL result for a PostgreSQL report: "
                    << pg_llm_write_json(execution);
   auto narrative = model->chat_completion(narrative_prompt.str());
+  if (!narrative.error.empty()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+             errmsg("request to instance \"%s\" failed: %s",
+                    instance_name.c_str(),
+                    narrative.error.c_str())));
+  }
   report["narrative"] = narrative.response;
   report["recommendations"] = Json::arrayValue;
   report["recommendations"].append("Review the generated narrative before sharing externally.");
@@ -929,8 +1329,47 @@ Json::Value build_report_json_internal(const std::string& instance_name,
   return report;
 }
 
+Json::Value build_chat_json_internal(const std::string& instance_name,
+                                     const std::string& prompt,
+                                     const Json::Value& options) {
+  auto result = execute_single_chat_internal(instance_name, prompt, options, std::nullopt, false);
+
+  Json::Value output(Json::objectValue);
+  output["request_id"] = result.request_id;
+  output["instance_name"] = result.selected_instance;
+  output["model_name"] = result.selected_model_name;
+  output["response"] = result.response;
+  output["confidence_score"] = result.confidence_score;
+  output["cache_hit"] = result.cache_hit;
+  output["cache_similarity"] = result.cache_similarity.has_value()
+    ? Json::Value(*result.cache_similarity)
+    : Json::Value(Json::nullValue);
+  output["fallback_used"] = result.fallback_used;
+  output["fallback_instance"] = result.fallback_instance;
+  output["candidates"] = result.candidates;
+  return output;
+}
+
+// Requests of pg_llm_submit; input is the prompt, or the SQL of a report
+void register_async_handlers() {
+  auto& requests = pg_llm::AsyncRequests::get_instance();
+  requests.register_handler("chat", build_chat_json_internal);
+  requests.register_handler("report", build_report_json_internal);
+  requests.register_handler("text2sql",
+    [](const std::string& instance_name, const std::string& prompt, const Json::Value& options) {
+      std::optional<std::string> schema_info;
+      if (options.isMember("schema_info")) {
+        schema_info = options["schema_info"].isString()
+          ? options["schema_info"].asString()
+          : pg_llm_write_json(options["schema_info"]);
+      }
+      bool use_vector_search = options.get("use_vector_search", true).asBool();
+      return build_text2sql_json_internal(instance_name, prompt, schema_info, use_vector_search, options);
+    });
+}
+
 std::vector<KnowledgeSearchRow> search_knowledge_internal(const std::string& query, int limit) {
-  std::vector<float> embedding = deterministic_embedding(query, 64);
+  std::vector<float> embedding = std::move(knowledge_embeddings({query})[0]);
   SPI_connect();
   Datum embedding_datum = std_vector_to_vector(embedding);
   const char* sql =
@@ -966,16 +1405,6 @@ std::vector<KnowledgeSearchRow> search_knowledge_internal(const std::string& que
   return rows;
 }
 
-std::string build_rag_context(const std::string& query, int limit) {
-  auto rows = search_knowledge_internal(query, limit);
-  std::stringstream buffer;
-  for (const auto& row : rows) {
-    buffer << "[" << row.source_name << ":" << row.chunk_index << "] "
-           << row.content << "\n";
-  }
-  return buffer.str();
-}
-
 int64 insert_knowledge_document(const std::string& source_name,
                                 const std::string& content,
                                 const std::string& metadata_json) {
@@ -999,6 +1428,7 @@ int64 insert_knowledge_document(const std::string& source_name,
 void insert_knowledge_chunk(int64 document_id,
                             int chunk_index,
                             const std::string& content,
+                            const std::vector<float>& embedding,
                             const std::string& metadata_json) {
   SPI_connect();
   const char* sql =
@@ -1010,7 +1440,7 @@ void insert_knowledge_chunk(int64 document_id,
     Int64GetDatum(document_id),
     Int32GetDatum(chunk_index),
     text_datum(content),
-    std_vector_to_vector(deterministic_embedding(content, 64)),
+    std_vector_to_vector(embedding),
     text_datum(metadata_json)};
   char nulls[5] = {' ', ' ', ' ', ' ', ' '};
   int ret = SPI_execute_with_args(sql, 5, argtypes, values, nulls, false, 0);
@@ -1055,11 +1485,120 @@ std::vector<std::string> array_to_strings(ArrayType* array) {
   return values;
 }
 
+// Releases a streaming session together with its SRF context, which also
+// covers queries that stop early (LIMIT) or fail while the stream is open.
+void release_stream_state(void* arg) {
+  auto* funcctx = static_cast<FuncCallContext*>(arg);
+  delete static_cast<StreamSrfState*>(funcctx->user_fctx);
+  funcctx->user_fctx = nullptr;
+}
+
+// Frees the batch results with the SRF context, like release_stream_state
+void release_batch_items(void* arg) {
+  auto* funcctx = static_cast<FuncCallContext*>(arg);
+  delete static_cast<std::vector<BatchItem>*>(funcctx->user_fctx);
+  funcctx->user_fctx = nullptr;
+}
+
+// Must be called with multi_call_memory_ctx as the current context
+void init_stream_srf(FuncCallContext* funcctx, StreamSrfState* state) {
+  funcctx->user_fctx = state;
+  auto* callback = static_cast<MemoryContextCallback*>(palloc0(sizeof(MemoryContextCallback)));
+  callback->func = release_stream_state;
+  callback->arg = funcctx;
+  MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx, callback);
+
+  TupleDesc tupdesc = CreateTemplateTupleDesc(6);
+  TupleDescInitEntry(tupdesc, 1, "seq_no", INT4OID, -1, 0);
+  TupleDescInitEntry(tupdesc, 2, "chunk", TEXTOID, -1, 0);
+  TupleDescInitEntry(tupdesc, 3, "is_final", BOOLOID, -1, 0);
+  TupleDescInitEntry(tupdesc, 4, "model_name", TEXTOID, -1, 0);
+  TupleDescInitEntry(tupdesc, 5, "confidence_score", FLOAT8OID, -1, 0);
+  TupleDescInitEntry(tupdesc, 6, "request_id", UUIDOID, -1, 0);
+  funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+}
+
+// Record the completed reply once the provider has closed the stream
+void finish_stream_srf(StreamSrfState* state) {
+  const std::string& response = state->stream->response();
+  if (state->session_id.has_value()) {
+    append_session_message(*state->session_id, state->request_id, "user", state->prompt);
+    append_session_message(*state->session_id, state->request_id, "assistant", response);
+  }
+
+  Json::Value audit(Json::objectValue);
+  audit["prompt"] = state->prompt;
+  audit["response"] = response;
+  audit["streaming"] = true;
+  audit["chunk_count"] = state->chunk_count;
+  insert_audit_log(state->request_id,
+                   state->event_type,
+                   state->instance_name,
+                   state->session_id.value_or(""),
+                   true,
+                   state->stream->confidence_score(),
+                   audit);
+}
+
+// One row per call: blocks only until the provider sends the next delta
+Datum next_stream_row(PG_FUNCTION_ARGS, FuncCallContext* funcctx) {
+  auto* state = static_cast<StreamSrfState*>(funcctx->user_fctx);
+
+  // Rows returned earlier sit in the protocol buffer; push them to the
+  // client before waiting on the network for the next chunk.
+  if (funcctx->call_cntr > 0 && whereToSendOutput == DestRemote) {
+    pq_flush();
+  }
+
+  pg_llm::StreamChunk chunk;
+  if (state != nullptr && state->stream->next(&chunk)) {
+    if (chunk.is_final) {
+      const std::string& error = state->stream->error();
+      if (!error.empty()) {
+        ereport(ERROR,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                 errmsg("request to instance \"%s\" failed: %s",
+                        state->instance_name.c_str(),
+                        error.c_str())));
+      }
+      finish_stream_srf(state);
+    } else {
+      state->chunk_count++;
+    }
+
+    Datum values[6];
+    bool nulls[6] = {false, false, false, false, false, false};
+    values[0] = Int32GetDatum(chunk.seq_no);
+    values[1] = CStringGetTextDatum(chunk.chunk.c_str());
+    values[2] = BoolGetDatum(chunk.is_final);
+    values[3] = CStringGetTextDatum(state->stream->model_name().c_str());
+    values[4] = Float8GetDatum(state->stream->confidence_score());
+    values[5] = pg_llm_uuid_in_datum(state->request_id);
+    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+  }
+
+  funcctx->user_fctx = nullptr;
+  delete state;
+  SRF_RETURN_DONE(funcctx);
+}
+
 }  // namespace
 
 void _PG_init(void) {
   pg_llm_define_core_gucs();
-  PG_LLM_LOG_INFO("pg_llm extension loaded");
+  pg_llm_shmem_init();
+  ResponseCache::request_shmem();
+  EmbeddingCache::request_shmem();
+  pg_llm::RateLimiter::request_shmem();
+  pg_llm::CircuitBreaker::request_shmem();
+  pg_llm::ModelRegistry::request_shmem();
+  pg_llm::WorkerPool::request_shmem();
+  pg_llm::DeferredLogs::request_shmem();
+  pg_llm::DeferredLogs::get_instance().register_callbacks();
+  pg_llm::WorkerPool::register_workers();
+  register_async_handlers();
+  PG_LLM_LOG_INFO("pg_llm extension loaded (SIMD kernels: %s)", pg_llm::simd_kernels().name);
 }
 
 void _PG_fini(void) {
@@ -1114,6 +1653,18 @@ Datum pg_llm_remove_model(PG_FUNCTION_ARGS) {
   PG_RETURN_BOOL(success);
 }
 
+// Statement trigger on pg_llm_models: retires the shared model registry
+// once the changing transaction commits
+Datum pg_llm_models_changed(PG_FUNCTION_ARGS) {
+  if (!CALLED_AS_TRIGGER(fcinfo)) {
+    ereport(ERROR,
+            (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+             errmsg("pg_llm_models_changed: not called by trigger manager")));
+  }
+  pg_llm::ModelRegistry::get_instance().invalidate();
+  return PointerGetDatum(NULL);
+}
+
 Datum pg_llm_chat(PG_FUNCTION_ARGS) {
   std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
   std::string prompt = text_to_std_string(PG_GETARG_TEXT_PP(1));
@@ -1219,7 +1770,15 @@ Datum pg_llm_get_embedding(PG_FUNCTION_ARGS) {
   std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
   std::string input_text = text_to_std_string(PG_GETARG_TEXT_PP(1));
   auto model = get_model_or_error(instance_name);
-  PG_RETURN_DATUM(std_vector_to_vector(model->get_embedding(input_text)));
+  auto results = model->embed({input_text});
+  if (!results[0].error.empty()) {
+    ereport(ERROR,
+            (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+             errmsg("failed to embed text with instance \"%s\": %s",
+                    instance_name.c_str(),
+                    results[0].error.c_str())));
+  }
+  PG_RETURN_DATUM(std_vector_to_vector(results[0].embedding));
 }
 
 Datum pg_llm_text2sql(PG_FUNCTION_ARGS) {
@@ -1327,18 +1886,7 @@ Datum pg_llm_chat_json(PG_FUNCTION_ARGS) {
   std::string prompt = text_to_std_string(PG_GETARG_TEXT_PP(1));
   Jsonb* options_jsonb = PG_ARGISNULL(2) ? nullptr : PG_GETARG_JSONB_P(2);
   Json::Value options = jsonb_to_value(options_jsonb);
-  auto result = execute_single_chat_internal(instance_name, prompt, options, std::nullopt, false);
-
-  Json::Value output(Json::objectValue);
-  output["request_id"] = result.request_id;
-  output["instance_name"] = result.selected_instance;
-  output["model_name"] = result.selected_model_name;
-  output["response"] = result.response;
-  output["confidence_score"] = result.confidence_score;
-  output["fallback_used"] = result.fallback_used;
-  output["fallback_instance"] = result.fallback_instance;
-  output["candidates"] = result.candidates;
-  PG_RETURN_DATUM(json_to_jsonb_datum(output));
+  PG_RETURN_DATUM(json_to_jsonb_datum(build_chat_json_internal(instance_name, prompt, options)));
 }
 
 Datum pg_llm_parallel_chat_json(PG_FUNCTION_ARGS) {
@@ -1475,8 +2023,10 @@ Datum pg_llm_add_knowledge(PG_FUNCTION_ARGS) {
 
   int64 document_id = insert_knowledge_document(source_name, content, pg_llm_write_json(metadata));
   auto chunks = split_content(content, std::max(chunk_size, 32));
+  auto embeddings = knowledge_embeddings(chunks);
+  std::string metadata_json = pg_llm_write_json(metadata);
   for (size_t i = 0; i < chunks.size(); ++i) {
-    insert_knowledge_chunk(document_id, static_cast<int>(i), chunks[i], pg_llm_write_json(metadata));
+    insert_knowledge_chunk(document_id, static_cast<int>(i), chunks[i], embeddings[i], metadata_json);
   }
   PG_RETURN_INT64(document_id);
 }
@@ -1637,112 +2187,481 @@ Datum pg_llm_get_trace(PG_FUNCTION_ARGS) {
 }
 
 Datum pg_llm_chat_stream(PG_FUNCTION_ARGS) {
-  std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
-  std::string prompt = text_to_std_string(PG_GETARG_TEXT_PP(1));
-  Json::Value options = PG_ARGISNULL(2)
-    ? Json::Value(Json::objectValue)
-    : jsonb_to_value(PG_GETARG_JSONB_P(2));
+  FuncCallContext* funcctx;
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    Json::Value options = PG_ARGISNULL(2)
+      ? Json::Value(Json::objectValue)
+      : jsonb_to_value(PG_GETARG_JSONB_P(2));
+    auto* state = new StreamSrfState();
+    state->event_type = "chat_stream";
+    state->instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
+    state->prompt = text_to_std_string(PG_GETARG_TEXT_PP(1));
+    state->request_id = pg_llm_generate_uuid();
+    init_stream_srf(funcctx, state);
+
+    state->model = get_model_or_error(state->instance_name);
+    {
+      // Caps the whole stream, not just the first chunk
+      pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
+      state->stream = state->model->open_chat_stream({ChatMessage{"user", state->prompt}});
+    }
+    insert_trace_log(state->request_id, "chat_stream", options);
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  return next_stream_row(fcinfo, funcctx);
+}
 
+Datum pg_llm_multi_turn_chat_stream(PG_FUNCTION_ARGS) {
   FuncCallContext* funcctx;
   if (SRF_IS_FIRSTCALL()) {
     funcctx = SRF_FIRSTCALL_INIT();
     MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-    auto model = get_model_or_error(instance_name);
-    auto response = model->stream_chat_completion(prompt);
+    Json::Value options = PG_ARGISNULL(3)
+      ? Json::Value(Json::objectValue)
+      : jsonb_to_value(PG_GETARG_JSONB_P(3));
     auto* state = new StreamSrfState();
-    state->chunks = response.chunks;
+    state->event_type = "multi_turn_chat_stream";
+    state->instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
+    state->session_id = text_to_std_string(PG_GETARG_TEXT_PP(1));
+    state->prompt = text_to_std_string(PG_GETARG_TEXT_PP(2));
     state->request_id = pg_llm_generate_uuid();
-    state->model_name = response.model_name;
-    state->confidence_score = response.confidence_score;
-    funcctx->user_fctx = state;
-    funcctx->max_calls = response.chunks.size();
+    init_stream_srf(funcctx, state);
+
+    state->model = get_model_or_error(state->instance_name);
+    auto messages = load_session_messages(*state->session_id);
+    Json::Value context_plan = pack_chat_context(*state->model, options, state->prompt, {}, 0, &messages);
+    {
+      pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
+      state->stream = state->model->open_chat_stream(messages);
+    }
+    Json::Value trace = options;
+    if (trace.isObject()) {
+      trace["context_plan"] = context_plan;
+    }
+    insert_trace_log(state->request_id, "multi_turn_chat_stream", trace);
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  return next_stream_row(fcinfo, funcctx);
+}
+
+Datum pg_llm_cache_stats(PG_FUNCTION_ARGS) {
+  auto stats = ResponseCache::get_instance().stats();
+  uint64_t lookups = stats.hits + stats.misses;
+
+  Json::Value result(Json::objectValue);
+  result["enabled"] = stats.enabled;
+  result["entries"] = Json::UInt64(stats.entries);
+  result["bytes_used"] = Json::UInt64(stats.bytes_used);
+  result["max_bytes"] = Json::UInt64(stats.max_bytes);
+  result["hits"] = Json::UInt64(stats.hits);
+  result["misses"] = Json::UInt64(stats.misses);
+  result["inserts"] = Json::UInt64(stats.inserts);
+  result["evictions"] = Json::UInt64(stats.evictions);
+  result["hit_ratio"] = lookups > 0 ? static_cast<double>(stats.hits) / lookups : 0.0;
+
+  auto embedding_stats = EmbeddingCache::get_instance().stats();
+  uint64_t embedding_lookups = embedding_stats.hits + embedding_stats.table_hits + embedding_stats.misses;
+  Json::Value embeddings(Json::objectValue);
+  embeddings["enabled"] = embedding_stats.enabled;
+  embeddings["entries"] = Json::UInt64(embedding_stats.entries);
+  embeddings["bytes_used"] = Json::UInt64(embedding_stats.bytes_used);
+  embeddings["max_bytes"] = Json::UInt64(embedding_stats.max_bytes);
+  embeddings["hits"] = Json::UInt64(embedding_stats.hits);
+  embeddings["table_hits"] = Json::UInt64(embedding_stats.table_hits);
+  embeddings["misses"] = Json::UInt64(embedding_stats.misses);
+  embeddings["inserts"] = Json::UInt64(embedding_stats.inserts);
+  embeddings["evictions"] = Json::UInt64(embedding_stats.evictions);
+  embeddings["hit_ratio"] = embedding_lookups > 0
+    ? static_cast<double>(embedding_stats.hits + embedding_stats.table_hits) / embedding_lookups
+    : 0.0;
+  result["embedding_cache"] = embeddings;
+
+  auto registry_stats = pg_llm::ModelRegistry::get_instance().stats();
+  Json::Value registry(Json::objectValue);
+  registry["enabled"] = registry_stats.enabled;
+  registry["generation"] = Json::UInt64(registry_stats.generation);
+  registry["entries"] = Json::UInt64(registry_stats.entries);
+  registry["hits"] = Json::UInt64(registry_stats.hits);
+  registry["misses"] = Json::UInt64(registry_stats.misses);
+  result["model_registry"] = registry;
+  PG_RETURN_DATUM(json_to_jsonb_datum(result));
+}
+
+Datum pg_llm_worker_stats(PG_FUNCTION_ARGS) {
+  auto stats = pg_llm::WorkerPool::get_instance().stats();
+  Json::Value result(Json::objectValue);
+  result["enabled"] = stats.enabled;
+  result["workers"] = stats.workers;
+  result["queued"] = Json::UInt64(stats.queued);
+  result["in_flight"] = Json::UInt64(stats.in_flight);
+  result["submitted"] = Json::UInt64(stats.submitted);
+  result["completed"] = Json::UInt64(stats.completed);
+  result["abandoned"] = Json::UInt64(stats.abandoned);
+  result["rejected"] = Json::UInt64(stats.rejected);
+  PG_RETURN_DATUM(json_to_jsonb_datum(result));
+}
+
+Datum pg_llm_submit(PG_FUNCTION_ARGS) {
+  std::string kind = text_to_std_string(PG_GETARG_TEXT_PP(0));
+  std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(1));
+  std::string input = text_to_std_string(PG_GETARG_TEXT_PP(2));
+  Jsonb* options_jsonb = PG_ARGISNULL(3) ? nullptr : PG_GETARG_JSONB_P(3);
+  Json::Value options = jsonb_to_value(options_jsonb);
+  // Fail now rather than in the worker
+  get_model_info_or_error(instance_name);
+  std::string request_id =
+    pg_llm::AsyncRequests::get_instance().submit(kind, instance_name, input, options);
+  PG_RETURN_DATUM(pg_llm_uuid_in_datum(request_id));
+}
+
+Datum pg_llm_poll(PG_FUNCTION_ARGS) {
+  std::string request_id = pg_llm_uuid_out_string(PG_GETARG_DATUM(0));
+  PG_RETURN_DATUM(json_to_jsonb_datum(pg_llm::AsyncRequests::get_instance().poll(request_id)));
+}
+
+Datum pg_llm_await(PG_FUNCTION_ARGS) {
+  std::string request_id = pg_llm_uuid_out_string(PG_GETARG_DATUM(0));
+  int timeout_ms = PG_ARGISNULL(1) ? 30000 : PG_GETARG_INT32(1);
+  PG_RETURN_DATUM(json_to_jsonb_datum(
+    pg_llm::AsyncRequests::get_instance().await(request_id, timeout_ms)));
+}
+
+Datum pg_llm_map(PG_FUNCTION_ARGS) {
+  std::string source_query = text_to_std_string(PG_GETARG_TEXT_PP(0));
+  std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(1));
+  std::string prompt_template = text_to_std_string(PG_GETARG_TEXT_PP(2));
+  std::string target_table = text_to_std_string(PG_GETARG_TEXT_PP(3));
+  Jsonb* options_jsonb = PG_ARGISNULL(4) ? nullptr : PG_GETARG_JSONB_P(4);
+  Json::Value options = jsonb_to_value(options_jsonb);
+  get_model_info_or_error(instance_name);
+  std::string job_id = pg_llm::MapJobs::get_instance().submit(
+    source_query, instance_name, prompt_template, target_table, options);
+  PG_RETURN_DATUM(pg_llm_uuid_in_datum(job_id));
+}
+
+Datum pg_llm_cancel_job(PG_FUNCTION_ARGS) {
+  std::string job_id = pg_llm_uuid_out_string(PG_GETARG_DATUM(0));
+  PG_RETURN_BOOL(pg_llm::MapJobs::get_instance().cancel(job_id));
+}
+
+Datum pg_llm_resume_job(PG_FUNCTION_ARGS) {
+  std::string job_id = pg_llm_uuid_out_string(PG_GETARG_DATUM(0));
+  PG_RETURN_BOOL(pg_llm::MapJobs::get_instance().resume(job_id));
+}
+
+Datum pg_llm_cache_reset(PG_FUNCTION_ARGS) {
+  uint64_t removed = ResponseCache::get_instance().reset();
+  removed += SemanticCache::reset();
+  removed += EmbeddingCache::get_instance().reset();
+  PG_RETURN_INT64(static_cast<int64>(removed));
+}
+
+Datum pg_llm_chat_batch(PG_FUNCTION_ARGS) {
+  // Default and upper bound for requests in flight at once
+  constexpr int kDefaultBatchConcurrency = 8;
+  constexpr int kMaxBatchConcurrency = 64;
+
+  FuncCallContext* funcctx;
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    if (PG_ARGISNULL(0)) {
+      ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("instance_name must not be null")));
+    }
+    std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
+    Json::Value options = PG_ARGISNULL(2)
+      ? Json::Value(Json::objectValue)
+      : jsonb_to_value(PG_GETARG_JSONB_P(2));
+    int max_concurrency = std::clamp(options.get("max_concurrency", kDefaultBatchConcurrency).asInt(),
+                                     1,
+                                     kMaxBatchConcurrency);
+
+    // Keep NULL elements so output positions match the input array
+    std::vector<std::optional<std::string>> prompts;
+    if (!PG_ARGISNULL(1)) {
+      ArrayType* array = PG_GETARG_ARRAYTYPE_P(1);
+      Datum* elements = nullptr;
+      bool* element_nulls = nullptr;
+      int count = 0;
+      deconstruct_array(array, TEXTOID, -1, false, 'i', &elements, &element_nulls, &count);
+      for (int i = 0; i < count; ++i) {
+        if (element_nulls[i]) {
+          prompts.emplace_back(std::nullopt);
+        } else {
+          prompts.emplace_back(text_to_std_string(DatumGetTextPP(elements[i])));
+        }
+      }
+    }
+
+    auto* items = new std::vector<BatchItem>(prompts.size());
+    funcctx->user_fctx = items;
+    auto* callback = static_cast<MemoryContextCallback*>(palloc0(sizeof(MemoryContextCallback)));
+    callback->func = release_batch_items;
+    callback->arg = funcctx;
+    MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx, callback);
+    auto model = prompts.empty() ? nullptr : get_model_or_error(instance_name);
+    auto& cache = ResponseCache::get_instance();
+    bool use_cache = cache.enabled() && options.get("cache", true).asBool();
+
+    // Serve what the cache already knows, send the rest upstream together
+    std::vector<std::vector<ChatMessage>> requests;
+    std::vector<size_t> request_positions;
+    std::vector<std::string> cache_keys(prompts.size());
+    for (size_t i = 0; i < prompts.size(); ++i) {
+      BatchItem& item = (*items)[i];
+      item.request_id = pg_llm_generate_uuid();
+      if (!prompts[i].has_value()) {
+        item.result.error = "prompt is null";
+        continue;
+      }
+      std::vector<ChatMessage> messages = {{"user", *prompts[i]}};
+      if (use_cache) {
+        cache_keys[i] = ResponseCache::make_key(instance_name, *model, messages);
+        if (auto cached = cache.lookup(cache_keys[i])) {
+          item.result.response = *cached;
+          item.cache_hit = true;
+          continue;
+        }
+      }
+      requests.push_back(std::move(messages));
+      request_positions.push_back(i);
+    }
+
+    pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
+    auto results = ModelManager::get_instance().batch_inference(instance_name, requests, max_concurrency);
+    for (size_t i = 0; i < results.size(); ++i) {
+      size_t position = request_positions[i];
+      BatchItem& item = (*items)[position];
+      item.result = std::move(results[i]);
+      if (use_cache && item.result.error.empty() && item.result.response.error.empty() &&
+          !item.result.response.response.empty()) {
+        cache.store(cache_keys[position], item.result.response);
+      }
+    }
+
+    std::string batch_id = pg_llm_generate_uuid();
+    std::vector<std::string> request_ids;
+    std::vector<bool> successes;
+    std::vector<double> confidence_scores;
+    std::vector<Json::Value> audit_metadata;
+    std::vector<Json::Value> trace_details;
+    for (size_t i = 0; i < items->size(); ++i) {
+      const BatchItem& item = (*items)[i];
+      Json::Value audit(Json::objectValue);
+      audit["batch_id"] = batch_id;
+      audit["batch_index"] = static_cast<int>(i + 1);
+      audit["prompt"] = prompts[i].value_or("");
+      audit["response"] = item.result.response.response;
+      if (!item.result.error.empty()) {
+        audit["error"] = item.result.error;
+      }
+      Json::Value trace(Json::objectValue);
+      trace["batch_id"] = batch_id;
+      trace["batch_index"] = static_cast<int>(i + 1);
+      trace["batch_size"] = static_cast<int>(items->size());
+      trace["instance_name"] = instance_name;
+      trace["max_concurrency"] = max_concurrency;
+      trace["cache_hit"] = item.cache_hit;
+      request_ids.push_back(item.request_id);
+      successes.push_back(item.result.error.empty());
+      confidence_scores.push_back(item.result.response.confidence_score);
+      audit_metadata.push_back(std::move(audit));
+      trace_details.push_back(std::move(trace));
+    }
+    insert_batch_logs("chat_batch", instance_name, request_ids, successes, confidence_scores,
+                      audit_metadata, trace_details);
+
+    funcctx->max_calls = items->size();
     TupleDesc tupdesc = CreateTemplateTupleDesc(6);
-    TupleDescInitEntry(tupdesc, 1, "seq_no", INT4OID, -1, 0);
-    TupleDescInitEntry(tupdesc, 2, "chunk", TEXTOID, -1, 0);
-    TupleDescInitEntry(tupdesc, 3, "is_final", BOOLOID, -1, 0);
-    TupleDescInitEntry(tupdesc, 4, "model_name", TEXTOID, -1, 0);
-    TupleDescInitEntry(tupdesc, 5, "confidence_score", FLOAT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 1, "idx", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 2, "response", TEXTOID, -1, 0);
+    TupleDescInitEntry(tupdesc, 3, "confidence_score", FLOAT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 4, "cache_hit", BOOLOID, -1, 0);
+    TupleDescInitEntry(tupdesc, 5, "error", TEXTOID, -1, 0);
     TupleDescInitEntry(tupdesc, 6, "request_id", UUIDOID, -1, 0);
     funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-
-    Json::Value audit(Json::objectValue);
-    audit["prompt"] = prompt;
-    audit["streaming"] = true;
-    audit["chunk_count"] = static_cast<int>(response.chunks.size());
-    insert_audit_log(state->request_id, "chat_stream", instance_name, "", true, response.confidence_score, audit);
-    insert_trace_log(state->request_id, "chat_stream", options);
     MemoryContextSwitchTo(oldcontext);
   }
 
   funcctx = SRF_PERCALL_SETUP();
-  auto* state = static_cast<StreamSrfState*>(funcctx->user_fctx);
+  auto* items = static_cast<std::vector<BatchItem>*>(funcctx->user_fctx);
   if (funcctx->call_cntr < funcctx->max_calls) {
-    const auto& chunk = state->chunks[funcctx->call_cntr];
+    const BatchItem& item = (*items)[funcctx->call_cntr];
+    bool failed = !item.result.error.empty();
     Datum values[6];
-    bool nulls[6] = {false, false, false, false, false, false};
-    values[0] = Int32GetDatum(chunk.seq_no);
-    values[1] = CStringGetTextDatum(chunk.chunk.c_str());
-    values[2] = BoolGetDatum(chunk.is_final);
-    values[3] = CStringGetTextDatum(state->model_name.c_str());
-    values[4] = Float8GetDatum(state->confidence_score);
-    values[5] = pg_llm_uuid_in_datum(state->request_id);
+    bool nulls[6] = {false, failed, failed, false, !failed, false};
+    values[0] = Int32GetDatum(static_cast<int32>(funcctx->call_cntr + 1));
+    values[1] = failed ? (Datum) 0 : CStringGetTextDatum(item.result.response.response.c_str());
+    values[2] = Float8GetDatum(item.result.response.confidence_score);
+    values[3] = BoolGetDatum(item.cache_hit);
+    values[4] = failed ? CStringGetTextDatum(item.result.error.c_str()) : (Datum) 0;
+    values[5] = pg_llm_uuid_in_datum(item.request_id);
     HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
     SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
   }
 
-  delete state;
   SRF_RETURN_DONE(funcctx);
 }
 
-Datum pg_llm_multi_turn_chat_stream(PG_FUNCTION_ARGS) {
-  std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
-  std::string session_id = text_to_std_string(PG_GETARG_TEXT_PP(1));
-  std::string prompt = text_to_std_string(PG_GETARG_TEXT_PP(2));
-  Json::Value options = PG_ARGISNULL(3)
-    ? Json::Value(Json::objectValue)
-    : jsonb_to_value(PG_GETARG_JSONB_P(3));
+Datum pg_llm_model_health(PG_FUNCTION_ARGS) {
+  constexpr int kColumns = 12;
 
   FuncCallContext* funcctx;
   if (SRF_IS_FIRSTCALL()) {
     funcctx = SRF_FIRSTCALL_INIT();
     MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-    auto model = get_model_or_error(instance_name);
-    auto response = model->stream_chat_completion(load_session_messages(session_id));
-    auto* state = new StreamSrfState();
-    state->chunks = response.chunks;
-    state->request_id = pg_llm_generate_uuid();
-    state->model_name = response.model_name;
-    state->confidence_score = response.confidence_score;
-    funcctx->user_fctx = state;
-    funcctx->max_calls = response.chunks.size();
-    TupleDesc tupdesc = CreateTemplateTupleDesc(6);
-    TupleDescInitEntry(tupdesc, 1, "seq_no", INT4OID, -1, 0);
-    TupleDescInitEntry(tupdesc, 2, "chunk", TEXTOID, -1, 0);
-    TupleDescInitEntry(tupdesc, 3, "is_final", BOOLOID, -1, 0);
-    TupleDescInitEntry(tupdesc, 4, "model_name", TEXTOID, -1, 0);
-    TupleDescInitEntry(tupdesc, 5, "confidence_score", FLOAT8OID, -1, 0);
-    TupleDescInitEntry(tupdesc, 6, "request_id", UUIDOID, -1, 0);
+    TupleDesc tupdesc = CreateTemplateTupleDesc(kColumns);
+    TupleDescInitEntry(tupdesc, 1, "instance_name", TEXTOID, -1, 0);
+    TupleDescInitEntry(tupdesc, 2, "state", TEXTOID, -1, 0);
+    TupleDescInitEntry(tupdesc, 3, "window_requests", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 4, "window_failures", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 5, "error_rate", FLOAT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 6, "avg_latency_ms", FLOAT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 7, "in_flight", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 8, "total_requests", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 9, "total_failures", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 10, "rejected", INT8OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 11, "opened_at", TIMESTAMPTZOID, -1, 0);
+    TupleDescInitEntry(tupdesc, 12, "last_failure_at", TIMESTAMPTZOID, -1, 0);
     funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-    insert_trace_log(state->request_id, "multi_turn_chat_stream", options);
+
+    // The snapshot is small; form every tuple now so nothing outlives the
+    // multi-call context if the caller stops early
+    auto& breaker = pg_llm::CircuitBreaker::get_instance();
+    if (!breaker.available()) {
+      ereport(NOTICE,
+              (errmsg("pg_llm model health is only tracked with pg_llm in shared_preload_libraries")));
+    }
+    // Instances of the catalog, so dropped ones are not listed
+    auto health = breaker.snapshot(pg_llm_get_all_instancenames());
+    auto* tuples = static_cast<HeapTuple*>(palloc0(sizeof(HeapTuple) * (health.size() + 1)));
+    for (size_t i = 0; i < health.size(); ++i) {
+      const auto& item = health[i];
+      Datum values[kColumns];
+      bool nulls[kColumns] = {false};
+      values[0] = text_datum(item.instance_name);
+      values[1] = text_datum(item.state);
+      values[2] = Int32GetDatum(static_cast<int32>(item.window_requests));
+      values[3] = Int32GetDatum(static_cast<int32>(item.window_failures));
+      values[4] = Float8GetDatum(item.window_requests > 0
+                                   ? static_cast<double>(item.window_failures) / item.window_requests
+                                   : 0.0);
+      values[5] = Float8GetDatum(item.latency_ms);
+      values[6] = Int32GetDatum(item.in_flight);
+      values[7] = Int64GetDatum(static_cast<int64>(item.total_requests));
+      values[8] = Int64GetDatum(static_cast<int64>(item.total_failures));
+      values[9] = Int64GetDatum(static_cast<int64>(item.rejected));
+      values[10] = TimestampTzGetDatum(item.opened_at);
+      nulls[10] = item.opened_at == 0;
+      values[11] = TimestampTzGetDatum(item.last_failure_at);
+      nulls[11] = item.last_failure_at == 0;
+      tuples[i] = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    }
+    funcctx->user_fctx = tuples;
+    funcctx->max_calls = health.size();
     MemoryContextSwitchTo(oldcontext);
   }
 
   funcctx = SRF_PERCALL_SETUP();
-  auto* state = static_cast<StreamSrfState*>(funcctx->user_fctx);
   if (funcctx->call_cntr < funcctx->max_calls) {
-    const auto& chunk = state->chunks[funcctx->call_cntr];
-    Datum values[6];
-    bool nulls[6] = {false, false, false, false, false, false};
-    values[0] = Int32GetDatum(chunk.seq_no);
-    values[1] = CStringGetTextDatum(chunk.chunk.c_str());
-    values[2] = BoolGetDatum(chunk.is_final);
-    values[3] = CStringGetTextDatum(state->model_name.c_str());
-    values[4] = Float8GetDatum(state->confidence_score);
-    values[5] = pg_llm_uuid_in_datum(state->request_id);
-    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    auto* tuples = static_cast<HeapTuple*>(funcctx->user_fctx);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuples[funcctx->call_cntr]));
   }
+  SRF_RETURN_DONE(funcctx);
+}
 
-  delete state;
+Datum pg_llm_embed_batch(PG_FUNCTION_ARGS) {
+  constexpr int kColumns = 3;
+
+  FuncCallContext* funcctx;
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    if (PG_ARGISNULL(0)) {
+      ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("instance_name must not be null")));
+    }
+    std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
+    Json::Value options = PG_ARGISNULL(2)
+      ? Json::Value(Json::objectValue)
+      : jsonb_to_value(PG_GETARG_JSONB_P(2));
+
+    // NULL elements keep their position and come back as errors
+    int count = 0;
+    std::vector<std::string> texts;
+    std::vector<int> text_index;
+    std::vector<bool> is_null;
+    if (!PG_ARGISNULL(1)) {
+      ArrayType* array = PG_GETARG_ARRAYTYPE_P(1);
+      Datum* elements = nullptr;
+      bool* element_nulls = nullptr;
+      deconstruct_array(array, TEXTOID, -1, false, 'i', &elements, &element_nulls, &count);
+      for (int i = 0; i < count; ++i) {
+        is_null.push_back(element_nulls[i]);
+        text_index.push_back(static_cast<int>(texts.size()));
+        if (!element_nulls[i]) {
+          texts.push_back(text_to_std_string(DatumGetTextPP(elements[i])));
+        }
+      }
+    }
+
+    std::vector<pg_llm::EmbeddingResult> results;
+    if (!texts.empty()) {
+      auto model = get_model_or_error(instance_name);
+      pg_llm::ScopedDeadline deadline(deadline_ms_option(options));
+      results = model->embed(texts, options.get("cache", true).asBool());
+    }
+
+    TupleDesc tupdesc = CreateTemplateTupleDesc(kColumns);
+    TupleDescInitEntry(tupdesc, 1, "idx", INT4OID, -1, 0);
+    TupleDescInitEntry(tupdesc, 2, "embedding", get_vector_type_oid(), -1, 0);
+    TupleDescInitEntry(tupdesc, 3, "error", TEXTOID, -1, 0);
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    // Form every tuple now so nothing outlives the multi-call context if
+    // the caller stops early
+    auto* tuples = static_cast<HeapTuple*>(palloc0(sizeof(HeapTuple) * (count + 1)));
+    for (int i = 0; i < count; ++i) {
+      Datum values[kColumns];
+      bool nulls[kColumns] = {false, true, true};
+      values[0] = Int32GetDatum(i + 1);
+      if (is_null[i]) {
+        values[2] = text_datum("text is null");
+        nulls[2] = false;
+      } else {
+        const auto& result = results[text_index[i]];
+        if (result.error.empty()) {
+          values[1] = std_vector_to_vector(result.embedding);
+          nulls[1] = false;
+        } else {
+          values[2] = text_datum(result.error);
+          nulls[2] = false;
+        }
+      }
+      tuples[i] = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+    }
+    funcctx->user_fctx = tuples;
+    funcctx->max_calls = count;
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    auto* tuples = static_cast<HeapTuple*>(funcctx->user_fctx);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuples[funcctx->call_cntr]));
+  }
   SRF_RETURN_DONE(funcctx);
 }
+
+Datum pg_llm_count_tokens(PG_FUNCTION_ARGS) {
+  std::string instance_name = text_to_std_string(PG_GETARG_TEXT_PP(0));
+  text* input = PG_GETARG_TEXT_PP(1);
+  auto model = get_model_or_error(instance_name);
+  size_t tokens = model->count_tokens(std::string_view(VARDATA_ANY(input), VARSIZE_ANY_EXHDR(input)));
+  PG_RETURN_INT32(static_cast<int32>(std::min<size_t>(tokens, PG_INT32_MAX)));
+}
@@ -40,3 +40,12 @@ Datum std_vector_to_vector(const std::vector<float>& vec) {
   // Return the new vector
   PG_RETURN_POINTER(result);
 }
+
+std::vector<float> vector_to_std_vector(Datum datum) {
+  Vector *vector = (Vector *) PG_DETOAST_DATUM(datum);
+  std::vector<float> result(VECTOR_DATA(vector), VECTOR_DATA(vector) + VECTOR_DIM(vector));
+  if ((Pointer) vector != DatumGetPointer(datum)) {
+    pfree(vector);
+  }
+  return result;
+}
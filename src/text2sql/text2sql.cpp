@@ -8,12 +8,24 @@ extern "C" {
 #include "utils/lsyscache.h"
 }
 
+#include <cstdint>
 #include <thread>
 #include <future>
 
+#include "models/context_packer.h"
+
 namespace pg_llm {
 namespace text2sql {
 
+namespace {
+
+// Largest share of the prompt budget each kind of optional context may take
+constexpr double kSimilarQueriesShare = 0.15;
+constexpr double kVectorHitsShare = 0.25;
+constexpr double kSampleRowsShare = 0.25;
+
+}  // namespace
+
 Text2SQL::Text2SQL(std::shared_ptr<LLMInterface> model, const Text2SQLConfig& config)
   : model_(model), config_(config) {}
 
@@ -469,54 +481,98 @@ std::string Text2SQL::build_prompt(const std::string& query,
                        "15. Support DDL statements (CREATE, ALTER, DROP, etc.)\n"
                        "16. Support transaction control (BEGIN, COMMIT, ROLLBACK)\n\n";
 
-    // Add database schema information
-    prompt += "DATABASE SCHEMA:\n";
-    for (const auto& table : schema) {
-        prompt += "Table: " + table.name + "\n";
+    // Query context and requirements
+    std::string requirements = "\nQUERY REQUIREMENTS:\n";
+    requirements += "1. Current Natural Language Query: " + query + "\n";
+    requirements += "2. Required Output Format: PostgreSQL SQL query in a SINGLE LINE ending with semicolon\n";
+    requirements += "3. Need to refer to schema information and similar queries information";
+
+    // Pack the optional context into max_tokens, most useful first: table
+    // columns, similar queries, vector search hits, then sample rows. Every
+    // item ends in a newline, so the counts of the parts add up.
+    const std::string schema_heading = "DATABASE SCHEMA:\n";
+    size_t budget = config_.max_tokens > 0 ? static_cast<size_t>(config_.max_tokens) : 0;
+    auto share = [&](double fraction) {
+        return budget == 0 ? SIZE_MAX : static_cast<size_t>(fraction * static_cast<double>(budget));
+    };
+    ContextPacker packer([this](std::string_view text) { return model_->count_tokens(text); }, budget);
+    packer.add_section({"schema", 0, "", SIZE_MAX, SIZE_MAX, false, false});
+    packer.add_section({"similar_queries", 1, "\nSIMILAR QUERIES:\n", SIZE_MAX, share(kSimilarQueriesShare)});
+    packer.add_section({"vector_hits", 2, "\nRELEVANT DATA CONTEXT:\n", SIZE_MAX, share(kVectorHitsShare)});
+    packer.add_section({"sample_rows", 3, "", SIZE_MAX, share(kSampleRowsShare), false, false});
+    packer.reserve(prompt);
+    packer.reserve(schema_heading);
+    packer.reserve(requirements);
+
+    // Tables arrive most relevant first
+    std::vector<size_t> table_items;
+    for (size_t i = 0; i < schema.size(); ++i) {
+        const auto& table = schema[i];
+        std::string section = "Table: " + table.name + "\n";
         if (!table.description.empty()) {
-            prompt += "Description: " + table.description + "\n";
+            section += "Description: " + table.description + "\n";
         }
-        prompt += "Columns (ONLY use these columns in your query):\n";
+        section += "Columns (ONLY use these columns in your query):\n";
         for (const auto& column : table.columns) {
-            prompt += "  " + column.first + " (" + column.second + ")\n";
+            section += "  " + column.first + " (" + column.second + ")\n";
         }
-        
-        // Add sample data for better context
-        std::string sample_data = get_table_sample_data(table.name);
-        if (!sample_data.empty()) {
-            prompt += "Sample Data:\n" + sample_data + "\n";
+        table_items.push_back(packer.add("schema", table.name, std::move(section), -static_cast<double>(i)));
+    }
+    for (size_t i = 0; i < similar_results.size(); ++i) {
+        packer.add("similar_queries", similar_results[i], "- " + similar_results[i] + "\n", -static_cast<double>(i));
+    }
+    for (const auto& result : search_results) {
+        std::string entry = "Table: " + result.table_name + "\n";
+        entry += "Column: " + result.column_name + "\n";
+        entry += "Row ID: " + std::to_string(result.row_id) + "\n";
+        entry += "Similarity Score: " + std::to_string(result.similarity) + "\n";
+        if (!result.metadata.empty()) {
+            entry += "Metadata: " + result.metadata + "\n";
         }
+        entry += "---\n";
+        packer.add("vector_hits",
+                   result.table_name + "." + result.column_name + ":" + std::to_string(result.row_id),
+                   std::move(entry),
+                   result.similarity);
+    }
+    packer.pack();
+    if (!table_items.empty() && !packer.packed(table_items[0])) {
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("Text2SQL prompt needs %zu tokens for its first table, over the max_tokens budget of %d",
+                        packer.used_tokens() + packer.tokens(table_items[0]),
+                        config_.max_tokens)));
     }
 
-    // Add vector search schema results for context
-    if (!search_results.empty()) {
-        prompt += "\nRELEVANT DATA CONTEXT:\n";
-        for (const auto& result : search_results) {
-            prompt += "Table: " + result.table_name + "\n";
-            prompt += "Column: " + result.column_name + "\n";
-            prompt += "Row ID: " + std::to_string(result.row_id) + "\n";
-            prompt += "Similarity Score: " + std::to_string(result.similarity) + "\n";
-            if (!result.metadata.empty()) {
-                prompt += "Metadata: " + result.metadata + "\n";
-            }
-            prompt += "---\n";
+    // Sample rows are only fetched for tables that made it in
+    std::vector<size_t> sample_items(schema.size(), SIZE_MAX);
+    for (size_t i = 0; i < schema.size(); ++i) {
+        if (!packer.packed(table_items[i])) {
+            continue;
+        }
+        std::string sample_data = get_table_sample_data(schema[i].name);
+        if (!sample_data.empty()) {
+            sample_items[i] = packer.add("sample_rows",
+                                         schema[i].name,
+                                         "Sample Data:\n" + sample_data + "\n",
+                                         -static_cast<double>(i));
         }
     }
+    packer.pack();
+    context_plan_ = packer.plan();
 
-    // Add similar queries for context
-    if (!similar_results.empty()) {
-        prompt += "\nSIMILAR QUERIES:\n";
-        for (const auto& similar_query : similar_results) {
-            prompt += "- " + similar_query + "\n";
+    prompt += schema_heading;
+    for (size_t i = 0; i < schema.size(); ++i) {
+        if (packer.packed(table_items[i])) {
+            prompt += packer.text(table_items[i]);
+        }
+        if (sample_items[i] != SIZE_MAX && packer.packed(sample_items[i])) {
+            prompt += packer.text(sample_items[i]);
         }
-        prompt += "\n";
     }
-
-    // Add query context and requirements
-    prompt += "\nQUERY REQUIREMENTS:\n";
-    prompt += "1. Current Natural Language Query: " + query + "\n";
-    prompt += "2. Required Output Format: PostgreSQL SQL query in a SINGLE LINE ending with semicolon\n";
-    prompt += "3. Need to refer to schema information and similar queries information";
+    prompt += packer.render("vector_hits");
+    prompt += packer.render("similar_queries");
+    prompt += requirements;
     return prompt;
 }
 
@@ -825,6 +881,13 @@ std::string Text2SQL::generate_statement(const std::string& query,
                                          const std::vector<std::string>& similar_results) {
     std::string prompt = build_prompt(query, schema, search_results, similar_results);
     auto response = model_->chat_completion(prompt);
+    if (!response.error.empty()) {
+        ereport(ERROR,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                 errmsg("request to instance \"%s\" failed: %s",
+                        model_->get_instance_name().c_str(),
+                        response.error.c_str())));
+    }
     return extract_sql(response.response);
 }
 
@@ -0,0 +1,181 @@
+#include "utils/pg_llm_shmem.h"
+
+extern "C" {
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+}
+
+#include <openssl/sha.h>
+
+#include "utils/pg_llm_log.h"
+
+static_assert(PG_LLM_SLOT_KEY_SIZE == SHA256_DIGEST_LENGTH, "slot keys are SHA-256 digests");
+
+namespace {
+
+constexpr const char* kTrancheName = "pg_llm";
+constexpr const char* kSharedStateName = "pg_llm shared state";
+constexpr int kMaxRegistrations = 16;
+
+struct PgLlmSharedState {
+  LWLock* lock;        // Guards area creation and shared hash creation
+  int tranche_id;      // Used by the DSA area and every shared hash table
+  bool area_created;
+  dsa_handle area_handle;
+};
+
+struct ShmemRegistration {
+  const char* name;
+  Size size;
+  PgLlmShmemInitCallback init;
+};
+
+ShmemRegistration registrations[kMaxRegistrations];
+int registration_count = 0;
+bool preloaded = false;
+
+PgLlmSharedState* shared_state = nullptr;
+dsa_area* shared_area = nullptr;
+
+#if PG_VERSION_NUM >= 150000
+shmem_request_hook_type prev_shmem_request_hook = nullptr;
+#endif
+shmem_startup_hook_type prev_shmem_startup_hook = nullptr;
+
+void request_shared_memory() {
+  RequestAddinShmemSpace(MAXALIGN(sizeof(PgLlmSharedState)));
+  for (int i = 0; i < registration_count; ++i) {
+    RequestAddinShmemSpace(MAXALIGN(registrations[i].size));
+  }
+  RequestNamedLWLockTranche(kTrancheName, 1);
+}
+
+#if PG_VERSION_NUM >= 150000
+void pg_llm_shmem_request() {
+  if (prev_shmem_request_hook) {
+    prev_shmem_request_hook();
+  }
+  request_shared_memory();
+}
+#endif
+
+void pg_llm_shmem_startup() {
+  if (prev_shmem_startup_hook) {
+    prev_shmem_startup_hook();
+  }
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  bool found = false;
+  shared_state = static_cast<PgLlmSharedState*>(
+    ShmemInitStruct(kSharedStateName, sizeof(PgLlmSharedState), &found));
+  if (!found) {
+    shared_state->lock = &(GetNamedLWLockTranche(kTrancheName))->lock;
+    shared_state->tranche_id = LWLockNewTrancheId();
+    shared_state->area_created = false;
+  }
+  for (int i = 0; i < registration_count; ++i) {
+    bool module_found = false;
+    void* ptr = ShmemInitStruct(registrations[i].name, registrations[i].size, &module_found);
+    registrations[i].init(ptr, module_found);
+  }
+  LWLockRelease(AddinShmemInitLock);
+
+  LWLockRegisterTranche(shared_state->tranche_id, kTrancheName);
+}
+
+}  // namespace
+
+void pg_llm_shmem_init(void) {
+  if (!process_shared_preload_libraries_in_progress) {
+    PG_LLM_LOG_INFO("pg_llm not in shared_preload_libraries; shared caches are disabled");
+    return;
+  }
+  preloaded = true;
+
+#if PG_VERSION_NUM >= 150000
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = pg_llm_shmem_request;
+#else
+  request_shared_memory();
+#endif
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = pg_llm_shmem_startup;
+}
+
+void pg_llm_shmem_register(const char* name, Size size, PgLlmShmemInitCallback init) {
+  if (!process_shared_preload_libraries_in_progress) {
+    return;
+  }
+  if (registration_count >= kMaxRegistrations) {
+    PG_LLM_LOG_FATAL("too many pg_llm shared memory registrations");
+  }
+  registrations[registration_count++] = ShmemRegistration{name, size, init};
+#if PG_VERSION_NUM < 150000
+  // Without a request hook space must be reserved right away; when called
+  // after pg_llm_shmem_init the base request has already been made.
+  if (preloaded) {
+    RequestAddinShmemSpace(MAXALIGN(size));
+  }
+#endif
+}
+
+bool pg_llm_shmem_available(void) {
+  return shared_state != nullptr;
+}
+
+dsa_area* pg_llm_shared_area(void) {
+  if (shared_area != nullptr || shared_state == nullptr) {
+    return shared_area;
+  }
+
+  // The mapping must survive the current query's memory context
+  MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+  if (!shared_state->area_created) {
+    shared_area = dsa_create(shared_state->tranche_id);
+    dsa_pin(shared_area);
+    shared_state->area_handle = dsa_get_handle(shared_area);
+    shared_state->area_created = true;
+  } else {
+    shared_area = dsa_attach(shared_state->area_handle);
+  }
+  dsa_pin_mapping(shared_area);
+  LWLockRelease(shared_state->lock);
+  MemoryContextSwitchTo(oldcontext);
+  return shared_area;
+}
+
+dshash_table* pg_llm_shared_hash(const dshash_parameters* params, dshash_table_handle* handle) {
+  dsa_area* area = pg_llm_shared_area();
+  if (area == nullptr) {
+    return nullptr;
+  }
+
+  dshash_parameters local_params = *params;
+  local_params.tranche_id = shared_state->tranche_id;
+
+  MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+  LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+  dshash_table* table = nullptr;
+  if (!DsaPointerIsValid(*handle)) {
+    table = dshash_create(area, &local_params, nullptr);
+    *handle = dshash_get_hash_table_handle(table);
+  } else {
+    table = dshash_attach(area, &local_params, *handle, nullptr);
+  }
+  LWLockRelease(shared_state->lock);
+  MemoryContextSwitchTo(oldcontext);
+  return table;
+}
+
+std::string pg_llm_slot_key(uint32 database_id, const std::string& instance_name) {
+  std::string material = std::to_string(database_id) + "\n" + instance_name;
+  std::string digest(SHA256_DIGEST_LENGTH, '\0');
+  SHA256(reinterpret_cast<const unsigned char*>(material.data()),
+         material.size(),
+         reinterpret_cast<unsigned char*>(&digest[0]));
+  return digest;
+}
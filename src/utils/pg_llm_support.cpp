@@ -23,6 +23,18 @@ bool pg_llm_redact_sensitive = true;
 double pg_llm_audit_sample_rate = 1.0;
 double pg_llm_default_confidence_threshold = 0.60;
 char* pg_llm_default_local_fallback = nullptr;
+bool pg_llm_response_cache_enabled = true;
+int pg_llm_response_cache_ttl = 3600;
+int pg_llm_response_cache_max_memory = 65536;
+int pg_llm_semantic_cache_max_entries = 100000;
+bool pg_llm_embedding_cache_enabled = true;
+int pg_llm_embedding_cache_max_memory = 65536;
+int pg_llm_rate_limit_max_wait = 30000;
+int pg_llm_request_timeout = 120000;
+int pg_llm_max_response_size = 16384;
+int pg_llm_workers = 0;
+int pg_llm_async_workers = 2;
+int pg_llm_async_result_ttl = 86400;
 
 void pg_llm_define_core_gucs(void) {
   DefineCustomStringVariable("pg_llm.master_key",
@@ -105,6 +117,158 @@ void pg_llm_define_core_gucs(void) {
                              nullptr,
                              nullptr,
                              nullptr);
+
+  DefineCustomBoolVariable("pg_llm.response_cache_enabled",
+                           "Serve identical chat requests from the shared response cache.",
+                           "Requires pg_llm in shared_preload_libraries.",
+                           &pg_llm_response_cache_enabled,
+                           true,
+                           PGC_SUSET,
+                           0,
+                           nullptr,
+                           nullptr,
+                           nullptr);
+
+  DefineCustomIntVariable("pg_llm.response_cache_ttl",
+                          "Lifetime of shared response cache entries.",
+                          "Zero keeps entries until they are evicted.",
+                          &pg_llm_response_cache_ttl,
+                          3600,
+                          0,
+                          INT_MAX,
+                          PGC_SUSET,
+                          GUC_UNIT_S,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.response_cache_max_memory",
+                          "Memory cap of the shared response cache.",
+                          "Least recently used entries are evicted above this size.",
+                          &pg_llm_response_cache_max_memory,
+                          65536,
+                          0,
+                          MAX_KILOBYTES,
+                          PGC_SIGHUP,
+                          GUC_UNIT_KB,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.semantic_cache_max_entries",
+                          "Largest number of semantic cache entries kept.",
+                          "The oldest entries are deleted above it; zero disables the limit.",
+                          &pg_llm_semantic_cache_max_entries,
+                          100000,
+                          0,
+                          INT_MAX,
+                          PGC_SUSET,
+                          0,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomBoolVariable("pg_llm.embedding_cache_enabled",
+                           "Reuse embeddings of previously embedded texts.",
+                           "Covers the shared memory tier and the catalog table tier.",
+                           &pg_llm_embedding_cache_enabled,
+                           true,
+                           PGC_SUSET,
+                           0,
+                           nullptr,
+                           nullptr,
+                           nullptr);
+
+  DefineCustomIntVariable("pg_llm.embedding_cache_max_memory",
+                          "Memory cap of the shared embedding cache.",
+                          "Least recently used entries are evicted above this size.",
+                          &pg_llm_embedding_cache_max_memory,
+                          65536,
+                          0,
+                          MAX_KILOBYTES,
+                          PGC_SIGHUP,
+                          GUC_UNIT_KB,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.rate_limit_max_wait",
+                          "Longest wait for a rate-limited model instance.",
+                          "Zero fails immediately when the limit is reached; -1 waits indefinitely.",
+                          &pg_llm_rate_limit_max_wait,
+                          30000,
+                          -1,
+                          INT_MAX,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.request_timeout",
+                          "Longest a single model API request may take.",
+                          "Applies to instances without a timeout_ms setting; zero disables the limit.",
+                          &pg_llm_request_timeout,
+                          120000,
+                          0,
+                          INT_MAX,
+                          PGC_USERSET,
+                          GUC_UNIT_MS,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.max_response_size",
+                          "Largest model API response body accepted.",
+                          "Larger responses fail the request; zero disables the limit.",
+                          &pg_llm_max_response_size,
+                          16384,
+                          0,
+                          MAX_KILOBYTES,
+                          PGC_USERSET,
+                          GUC_UNIT_KB,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.workers",
+                          "Background workers that perform chat requests for every backend.",
+                          "Zero runs requests in the calling backend. Requires pg_llm in shared_preload_libraries.",
+                          &pg_llm_workers,
+                          0,
+                          0,
+                          32,
+                          PGC_POSTMASTER,
+                          0,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.async_workers",
+                          "Background workers per database that run submitted requests.",
+                          "Workers are started on demand when a submitting transaction commits.",
+                          &pg_llm_async_workers,
+                          2,
+                          1,
+                          64,
+                          PGC_SIGHUP,
+                          0,
+                          nullptr,
+                          nullptr,
+                          nullptr);
+
+  DefineCustomIntVariable("pg_llm.async_result_ttl",
+                          "How long submitted requests and their results are kept.",
+                          "Counted from submission, and again from when the request finished.",
+                          &pg_llm_async_result_ttl,
+                          86400,
+                          1,
+                          INT_MAX,
+                          PGC_USERSET,
+                          GUC_UNIT_S,
+                          nullptr,
+                          nullptr,
+                          nullptr);
 }
 
 std::string pg_llm_generate_uuid() {
@@ -12,4 +12,27 @@ SELECT to_regclass('_pg_llm_catalog.pg_llm_trace_log') IS NOT NULL;
 SELECT to_regprocedure('pg_llm_chat_json(text,text,jsonb)') IS NOT NULL;
 SELECT to_regprocedure('pg_llm_get_trace(uuid)') IS NOT NULL;
 
+ALTER EXTENSION pg_llm UPDATE TO '1.2';
+
+SELECT extversion = '1.2'
+FROM pg_extension
+WHERE extname = 'pg_llm';
+
+SELECT to_regprocedure('pg_llm_cache_stats()') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_cache_reset()') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_chat_batch(text,text[],jsonb)') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_model_health()') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_embed_batch(text,text[],jsonb)') IS NOT NULL;
+SELECT to_regclass('_pg_llm_catalog.pg_llm_embedding_cache') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_count_tokens(text,text)') IS NOT NULL;
+SELECT to_regprocedure('_pg_llm_catalog.pg_llm_models_changed()') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_worker_stats()') IS NOT NULL;
+SELECT to_regclass('_pg_llm_catalog.pg_llm_async_requests') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_submit(text,text,text,jsonb)') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_await(uuid,integer)') IS NOT NULL;
+SELECT to_regclass('pg_llm_jobs') IS NOT NULL;
+SELECT to_regprocedure('pg_llm_map(text,text,text,text,jsonb)') IS NOT NULL;
+SELECT proparallel = 'r' FROM pg_proc WHERE oid = 'pg_llm_chat(text,text)'::regprocedure;
+SELECT proparallel = 's' FROM pg_proc WHERE oid = 'pg_llm_chat_parallel_safe(text,text)'::regprocedure;
+
 DROP EXTENSION pg_llm CASCADE;
@@ -82,11 +82,73 @@ SELECT
   (pg_llm_chat_json('mock_primary', 'hello', '{}'::jsonb)->>'response') = 'local fallback reply',
   (pg_llm_chat_json('mock_primary', 'hello', '{}'::jsonb)->>'fallback_used')::boolean;
 
+-- Connection failures are reported as warnings whose text depends on libcurl
+SET client_min_messages = error;
+SELECT pg_llm_add_model(
+  true,
+  'openai',
+  'unreachable_local',
+  '',
+  '{"model_name": "unreachable", "api_endpoint": "http://127.0.0.1:9/v1/chat/completions",
+    "fallback_instance": "mock_local", "connect_timeout_ms": 1000,
+    "retry_max_attempts": 2, "retry_base_delay_ms": 1}'
+);
+SELECT reply->>'response' = 'local fallback reply', (reply->>'fallback_used')::boolean
+FROM (
+  SELECT pg_llm_chat_json('unreachable_local', 'retry probe', '{"cache": false}'::jsonb) AS reply
+) AS probe;
+RESET client_min_messages;
+SELECT count(*) = 1
+FROM _pg_llm_catalog.pg_llm_trace_log
+WHERE details->>'reason' = 'request_failed' AND details->>'fallback_instance' = 'mock_local';
+SELECT count(*) = 1, bool_and(state = 'closed'), bool_and(total_failures >= 1 AND window_failures >= 1),
+       bool_and(last_failure_at IS NOT NULL)
+FROM pg_llm_model_health() WHERE instance_name = 'unreachable_local';
+
+SELECT current_setting('pg_llm.rate_limit_max_wait') = '30s';
+SELECT current_setting('pg_llm.request_timeout') = '2min';
+SELECT current_setting('pg_llm.max_response_size') = '16MB';
+SELECT pg_llm_chat_json('mock_local', 'deadline probe', '{"deadline_ms": 1000, "cache": false}'::jsonb)->>'response' = 'local fallback reply';
+
+SELECT
+  (pg_llm_chat_json('mock_local', 'cached hello', '{}'::jsonb)->>'response') =
+  (pg_llm_chat_json('mock_local', 'cached hello', '{"cache": false}'::jsonb)->>'response');
+SELECT pg_llm_cache_stats() ? 'hit_ratio';
+
+SELECT pg_llm_chat_json('mock_local', 'semantic probe', '{"semantic_cache_threshold": 0.99}'::jsonb) ? 'cache_hit';
+SELECT
+  (reply->>'cache_hit')::boolean,
+  (reply->>'cache_similarity')::float8 > 0.99,
+  reply->>'response' = 'local fallback reply'
+FROM (
+  SELECT pg_llm_chat_json('mock_local', 'semantic probe', '{"semantic_cache_threshold": 0.99}'::jsonb) AS reply
+) AS probe;
+SELECT pg_llm_chat('mock_local', 'reset probe') = 'local fallback reply';
+SELECT (pg_llm_cache_stats()->>'entries')::bigint > 0;
+SELECT pg_llm_cache_reset() > 0;
+SELECT (pg_llm_cache_stats()->>'entries')::bigint = 0;
+SELECT NOT (pg_llm_chat_json('mock_local', 'semantic probe', '{"semantic_cache_threshold": 0.99}'::jsonb)->>'cache_hit')::boolean;
+SELECT pg_llm_add_model(false, 'mock', 'mock_semantic', '',
+                        '{"provider": "mock", "mock_response": "first definition", "mock_confidence": 0.9}');
+SELECT pg_llm_chat_json('mock_semantic', 'redefined probe', '{"semantic_cache_threshold": 0.99}'::jsonb)->>'response' = 'first definition';
+SELECT pg_llm_add_model(false, 'mock', 'mock_semantic', '',
+                        '{"provider": "mock", "mock_response": "second definition", "mock_confidence": 0.9}');
+SELECT pg_llm_chat_json('mock_semantic', 'redefined probe', '{"semantic_cache_threshold": 0.99}'::jsonb)->>'response' = 'second definition';
+SET pg_llm.semantic_cache_max_entries = 1;
+SELECT pg_llm_chat_json('mock_semantic', 'capped probe', '{"semantic_cache_threshold": 0.99}'::jsonb) ? 'response';
+SELECT count(*) = 1 FROM _pg_llm_catalog.pg_llm_semantic_cache;
+RESET pg_llm.semantic_cache_max_entries;
+
 SELECT
   count(*) > 1,
   bool_or(is_final)
 FROM pg_llm_chat_stream('mock_local', 'hello stream', '{}'::jsonb);
 
+SELECT
+  string_agg(chunk, '' ORDER BY seq_no) = 'local fallback reply',
+  bool_and(chunk = '') FILTER (WHERE is_final)
+FROM pg_llm_chat_stream('mock_local', 'hello stream', '{}'::jsonb);
+
 SELECT
   pg_llm_parallel_chat(
     'parallel test',
@@ -100,6 +162,78 @@ SELECT
     '{}'::jsonb
   )->>'response') = 'parallel winner';
 
+SELECT
+  (reply->>'response') = 'parallel winner',
+  jsonb_array_length(reply->'candidates') = 2
+FROM (
+  SELECT pg_llm_parallel_chat_json(
+    'parallel test',
+    ARRAY['mock_primary', 'mock_parallel'],
+    '{"mode": "first_acceptable", "hedge": true, "confidence_threshold": 0.9}'::jsonb
+  ) AS reply
+) AS t;
+
+SELECT pg_llm_add_model(false, 'mock', 'mock_slow', '',
+                        '{"provider": "mock", "mock_response": "slow reply", "mock_delay_ms": 5000,
+                          "hedge_instance": "mock_parallel", "hedge_after_ms": 50}');
+SELECT
+  (reply->>'response') = 'parallel winner',
+  (reply->'candidates'->0->>'hedged')::boolean,
+  (reply->'candidates'->0->>'answered_by') = 'mock_parallel',
+  (reply->'candidates'->0->>'latency_ms')::float8 < 5000
+FROM (
+  SELECT pg_llm_parallel_chat_json('hedge probe', ARRAY['mock_slow'], '{"hedge": true}'::jsonb) AS reply
+) AS t;
+
+SELECT pg_llm_add_model(false, 'mock', 'mock_swap', '', '{"provider": "mock", "mock_response": "before swap"}');
+SELECT pg_llm_chat('mock_swap', 'swap probe') = 'before swap';
+SELECT pg_llm_add_model(false, 'mock', 'mock_swap', '', '{"provider": "mock", "mock_response": "after swap"}');
+SELECT
+  pg_llm_chat('mock_swap', 'swap probe') = 'after swap',
+  jsonb_array_length(
+    pg_llm_parallel_chat_json('swap probe', ARRAY['mock_swap', 'mock_swap'], '{}'::jsonb)->'candidates'
+  ) = 2;
+SELECT pg_llm_cache_stats()->'model_registry' ? 'generation';
+SELECT count(*) = 1 FROM pg_trigger WHERE tgname = 'pg_llm_models_changed';
+
+SELECT count(*) = 3, count(error) = 1, array_agg(idx ORDER BY idx) = ARRAY[1, 2, 3]
+FROM pg_llm_chat_batch('mock_local', ARRAY['batch a', NULL, 'batch b'], '{"max_concurrency": 2}'::jsonb);
+SELECT error = 'prompt is null' AND response IS NULL
+FROM pg_llm_chat_batch('mock_local', ARRAY['batch a', NULL]) WHERE idx = 2;
+
+SELECT count(*) = 3, count(embedding) = 2, bool_and(error IS NULL) FILTER (WHERE idx <> 2)
+FROM pg_llm_embed_batch('mock_local', ARRAY['embed a', NULL, 'embed b']);
+SELECT embedding = pg_llm_get_embedding('mock_local', 'embed a')
+FROM pg_llm_embed_batch('mock_local', ARRAY['embed a']) WHERE idx = 1;
+SELECT count(*) = 2, count(DISTINCT embedding::text) = 1
+FROM pg_llm_embed_batch('mock_local', ARRAY['embed twice', 'embed twice']);
+SELECT embedding = pg_llm_get_embedding('mock_local', 'embed twice')
+FROM pg_llm_embed_batch('mock_local', ARRAY['embed twice'], '{"cache": false}'::jsonb);
+SELECT pg_llm_cache_stats()->'embedding_cache' ? 'table_hits';
+SELECT abs(vector_norm(pg_llm_get_embedding('mock_local', 'unit length check')) - 1) < 1e-5;
+SELECT (q <=> pg_llm_get_embedding('mock_local', 'how many orders shipped last week?')) <
+       (q <=> pg_llm_get_embedding('mock_local', 'explain MVCC in PostgreSQL'))
+FROM (SELECT pg_llm_get_embedding('mock_local', 'How many orders shipped last week') AS q) AS probe;
+
+SELECT pg_llm_add_model(
+  false,
+  'mock',
+  'mock_onnxless',
+  '',
+  '{"provider": "mock", "model_name": "mock-onnxless",
+    "embedding_provider": "local_onnxless", "embedding_model_path": "../outside.pgemb"}'
+);
+SELECT embedding IS NULL AND error LIKE '%inside the data directory%'
+FROM pg_llm_embed_batch('mock_onnxless', ARRAY['path check']);
+
+SELECT pg_llm_count_tokens('mock_local', '') = 0;
+SELECT pg_llm_count_tokens('mock_local', repeat('select ', 100)) > pg_llm_count_tokens('mock_local', 'select');
+SELECT pg_llm_chat_json('mock_local', 'budget probe', '{"max_input_tokens": 64, "cache": false}'::jsonb)->>'response' = 'local fallback reply';
+SELECT (details->'context_plan'->>'budget')::int = 64
+FROM _pg_llm_catalog.pg_llm_trace_log
+WHERE details->>'prompt' = 'budget probe' AND details ? 'context_plan'
+ORDER BY id DESC LIMIT 1;
+
 SELECT pg_llm_create_session(4) AS session_id \gset
 SELECT length(:'session_id') = 36;
 SELECT pg_llm_multi_turn_chat('mock_primary', :'session_id', 'first question') = 'local fallback reply';
@@ -110,6 +244,7 @@ SELECT
   count(*) > 0,
   bool_or(is_final)
 FROM pg_llm_multi_turn_chat_stream('mock_local', :'session_id', 'stream turn', '{}'::jsonb);
+SELECT count(*) = 4 FROM pg_llm_get_session_messages(:'session_id');
 SELECT pg_llm_delete_session(:'session_id');
 
 CREATE TABLE pg_llm_demo (label text, value integer);
@@ -154,5 +289,77 @@ SELECT pg_llm_record_feedback(:'request_id'::uuid, 5, 'useful', '{"tag":"positiv
 SELECT count(*) > 0 FROM pg_llm_get_audit_log('{"limit":100}'::jsonb);
 SELECT jsonb_array_length((pg_llm_get_trace((SELECT request_id FROM pg_llm_get_audit_log('{"limit":1}'::jsonb) LIMIT 1))->'events')) >= 0;
 
-DROP TABLE pg_llm_demo;
+SELECT count(*) = 4 FROM pg_proc
+WHERE proname IN ('pg_llm_chat_parallel_safe', 'pg_llm_get_embedding_parallel_safe',
+                  'pg_llm_embed_batch', 'pg_llm_count_tokens')
+  AND proparallel = 's';
+SELECT count(*) = 2 FROM pg_proc
+WHERE proname IN ('pg_llm_chat', 'pg_llm_get_embedding') AND proparallel = 'r';
+CREATE TABLE pg_llm_parallel_input AS
+SELECT g AS id, 'parallel row ' || g AS body FROM generate_series(1, 200) AS g;
+ANALYZE pg_llm_parallel_input;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT count(pg_llm_get_embedding_parallel_safe('mock_local', body)) = 200 FROM pg_llm_parallel_input;
+EXPLAIN (COSTS OFF)
+SELECT count(*) FROM pg_llm_parallel_input WHERE pg_llm_chat_parallel_safe('mock_local', body) IS NOT NULL;
+SELECT count(*) = 200 FROM pg_llm_parallel_input WHERE pg_llm_chat_parallel_safe('mock_local', body) IS NOT NULL;
+SELECT count(*) = 200 FROM _pg_llm_catalog.pg_llm_audit_log
+WHERE event_type = 'chat' AND metadata->>'prompt' LIKE 'parallel row %';
+-- Rows deferred inside a rolled back savepoint are not written at commit
+BEGIN;
+SAVEPOINT before_parallel;
+SELECT count(*) = 200 FROM pg_llm_parallel_input WHERE pg_llm_chat_parallel_safe('mock_local', 'undone ' || body) IS NOT NULL;
+ROLLBACK TO SAVEPOINT before_parallel;
+COMMIT;
+SELECT count(*) = 0 FROM _pg_llm_catalog.pg_llm_audit_log WHERE metadata->>'prompt' LIKE 'undone %';
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+SELECT current_setting('pg_llm.workers') = '0', pg_llm_worker_stats() ? 'rejected';
+-- Async and map workers only see server and database settings
+SELECT current_database() AS test_db \gset
+ALTER DATABASE :"test_db" SET pg_llm.master_key = 'unit-test-master-key';
+SELECT pg_llm_submit('chat', 'mock_primary', 'async hello') AS async_id \gset
+SELECT (pg_llm_poll(:'async_id'::uuid)->>'kind') = 'chat';
+SELECT state->>'status' = 'succeeded', state->'result'->>'response' = 'local fallback reply'
+FROM (SELECT pg_llm_await(:'async_id'::uuid, 10000) AS state) AS probe;
+CREATE TABLE pg_llm_map_source AS SELECT g AS id, 'item ' || g AS name FROM generate_series(1, 5) AS g;
+SELECT pg_llm_map('SELECT id, name FROM pg_llm_map_source', 'mock_primary', 'Describe {{name}}',
+                  'pg_llm_map_target', '{"batch_size": 2}'::jsonb) AS map_job \gset
+SELECT to_regclass('pg_llm_map_target') IS NOT NULL;
+DO $$
+BEGIN
+  FOR i IN 1..200 LOOP
+    EXIT WHEN NOT EXISTS (SELECT 1 FROM pg_llm_jobs WHERE status IN ('queued', 'running'));
+    PERFORM pg_sleep(0.05);
+  END LOOP;
+END
+$$;
+SELECT status = 'succeeded', rows_total = 5, rows_done = 5, rows_skipped = 0, batches = 3
+FROM pg_llm_jobs WHERE job_id = :'map_job';
+SELECT count(*) = 5 FROM pg_llm_map_target;
+SELECT pg_llm_map('SELECT NULL::integer AS id, ''orphan'' AS name', 'mock_primary', 'Describe {{name}}',
+                  'pg_llm_map_target') AS null_job \gset
+SELECT pg_llm_map('SELECT 7 AS id, ''twin'' AS name UNION ALL SELECT 7, ''twin''', 'mock_primary',
+                  'Describe {{name}}', 'pg_llm_map_target') AS twin_job \gset
+DO $$
+BEGIN
+  FOR i IN 1..200 LOOP
+    EXIT WHEN NOT EXISTS (SELECT 1 FROM pg_llm_jobs WHERE status IN ('queued', 'running'));
+    PERFORM pg_sleep(0.05);
+  END LOOP;
+END
+$$;
+SELECT status = 'succeeded', rows_total = 0, rows_skipped = 1 FROM pg_llm_jobs WHERE job_id = :'null_job';
+SELECT status = 'failed', error LIKE '%not unique%', rows_done = 0 FROM pg_llm_jobs WHERE job_id = :'twin_job';
+SELECT count(*) = 0 FROM _pg_llm_catalog.pg_llm_map_rows;
+
+DROP TABLE pg_llm_demo, pg_llm_parallel_input;
+DROP TABLE pg_llm_map_source, pg_llm_map_target;
+ALTER DATABASE :"test_db" RESET pg_llm.master_key;
 DROP EXTENSION pg_llm CASCADE;